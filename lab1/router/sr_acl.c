@@ -0,0 +1,596 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_acl.c
+ *
+ * Description:
+ *
+ * Tuple space search over the rules of an ACL, see sr_acl.h.  Every
+ * field a rule can look at sits in one 16 byte key, and what a rule
+ * looks at is a mask over that key: masking a packet's key and probing
+ * the table of the tuple (the mask) finds the first rule of that tuple
+ * matching the packet.  Tuples are kept in the order of the first rule
+ * they hold, so the search stops at the first tuple that starts after
+ * the best match so far.
+ *
+ * The classifier is read only once compiled.  Hits are counted in one
+ * row per thread, so counting needs no locked instruction; threads past
+ * SR_ACL_MAX_THREADS share the last row and add atomically.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_acl.h"
+
+#define SR_ACL_NONE     0xffffffff
+#define SR_ACL_LINE_MAX 1024
+
+/* Host order fields; l4 is set when the packet carries its ports */
+union sr_acl_key
+{
+    struct {
+        uint32_t src, dst;
+        uint16_t sport, dport;
+        uint8_t proto, iface, l4, pad;
+    } f;
+    uint64_t w[2];
+};
+
+struct sr_acl_rule
+{
+    enum sr_acl_action action;
+    unsigned int line;
+    char* text;
+};
+
+/* Open addressed, rule SR_ACL_NONE when free */
+struct sr_acl_entry
+{
+    uint64_t w[2];
+    uint32_t rule;
+};
+
+struct sr_acl_tuple
+{
+    union sr_acl_key mask;
+    uint32_t min_rule;          /* first rule in the tuple */
+    uint32_t n;
+    uint32_t size_mask;
+    struct sr_acl_entry* slots;
+};
+
+struct sr_acl
+{
+    struct sr_acl_rule* rules;
+    unsigned int nrules;
+    struct sr_acl_tuple* tuples;
+    unsigned int ntuples;
+    unsigned int nentries;
+    char ifaces[SR_ACL_MAX_IFACES][sr_IFACE_NAMELEN];
+    unsigned int nifaces;       /* interface i is key value i + 1 */
+    uint64_t* hits;             /* SR_ACL_MAX_THREADS rows of stride */
+    unsigned int stride;        /* nrules, then packets no rule matched */
+};
+
+/* An entry waiting for its tuple's table to be sized */
+struct sr_acl_pending
+{
+    union sr_acl_key key;
+    uint32_t tuple;
+    uint32_t rule;
+};
+
+/* A rule as parsed, before port ranges are split */
+struct sr_acl_spec
+{
+    union sr_acl_key key, mask;
+    unsigned int sport_lo, sport_hi, dport_lo, dport_hi;
+};
+
+struct sr_acl_build
+{
+    struct sr_acl* acl;
+    struct sr_acl_pending* pending;
+    unsigned int npending, max_pending;
+    unsigned int max_tuples;
+    const char* err;
+};
+
+static int sr_acl_nthreads;
+static __thread int sr_acl_thread = -1;
+
+static const char* sr_acl_actions[] = { "permit", "deny", "reject" };
+
+static uint32_t sr_acl_hash(uint64_t a, uint64_t b)
+{
+    uint64_t h = (a ^ b * 0x9e3779b97f4a7c15ULL) * 0xff51afd7ed558ccdULL;
+    return h >> 32;
+}
+
+static uint32_t sr_acl_prefix_mask(unsigned int len)
+{
+    return len ? ~0U << (32 - len) : 0;
+}
+
+static unsigned int sr_acl_iface(struct sr_acl* acl, const char* name)
+{
+    unsigned int i;
+
+    for (i = 0; i < acl->nifaces; i++)
+        if (strncmp(acl->ifaces[i], name, sr_IFACE_NAMELEN) == 0)
+            return i + 1;
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Compiling
+ *---------------------------------------------------------------------*/
+
+static int sr_acl_number(struct sr_acl_build* b, const char* s,
+                         unsigned long max, unsigned int* out)
+{
+    char* end;
+    unsigned long v = strtoul(s, &end, 10);
+
+    if (*s == '\0' || *end != '\0' || v > max) {
+        b->err = "bad number";
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int sr_acl_prefix(struct sr_acl_build* b, char* s, uint32_t* addr,
+                         uint32_t* mask)
+{
+    char* slash = strchr(s, '/');
+    unsigned int len = 32;
+    struct in_addr a;
+
+    if (slash) {
+        *slash = '\0';
+        if (sr_acl_number(b, slash + 1, 32, &len) < 0)
+            return -1;
+    }
+    if (inet_pton(AF_INET, s, &a) != 1) {
+        b->err = "bad address";
+        return -1;
+    }
+    *mask = sr_acl_prefix_mask(len);
+    *addr = ntohl(a.s_addr) & *mask;
+    return 0;
+}
+
+static int sr_acl_range(struct sr_acl_build* b, char* s, unsigned int* lo,
+                        unsigned int* hi)
+{
+    char* dash = strchr(s, '-');
+
+    if (dash)
+        *dash = '\0';
+    if (sr_acl_number(b, s, 65535, lo) < 0)
+        return -1;
+    if (!dash) {
+        *hi = *lo;
+        return 0;
+    }
+    if (sr_acl_number(b, dash + 1, 65535, hi) < 0)
+        return -1;
+    if (*hi < *lo) {
+        b->err = "empty port range";
+        return -1;
+    }
+    return 0;
+}
+
+/* Splits [lo, hi] into aligned blocks, as values and prefix lengths.
+   At most 30 of them. */
+static unsigned int sr_acl_split(unsigned int lo, unsigned int hi,
+                                 uint16_t* val, uint8_t* len)
+{
+    unsigned int n = 0, size;
+
+    while (lo <= hi) {
+        size = lo ? lo & -lo : 65536;
+        while (lo + size - 1 > hi)
+            size >>= 1;
+        val[n] = lo;
+        len[n] = 16 - __builtin_ctz(size);
+        n++;
+        lo += size;
+    }
+    return n;
+}
+
+static int sr_acl_add_entry(struct sr_acl_build* b, const union sr_acl_key* key,
+                            const union sr_acl_key* mask, uint32_t rule)
+{
+    struct sr_acl* acl = b->acl;
+    struct sr_acl_pending* p;
+    unsigned int t;
+
+    for (t = 0; t < acl->ntuples; t++)
+        if (acl->tuples[t].mask.w[0] == mask->w[0] &&
+            acl->tuples[t].mask.w[1] == mask->w[1])
+            break;
+    if (t == acl->ntuples) {
+        if (t == b->max_tuples) {
+            struct sr_acl_tuple* tuples;
+            b->max_tuples = b->max_tuples ? 2 * b->max_tuples : 16;
+            tuples = realloc(acl->tuples, b->max_tuples * sizeof(*tuples));
+            if (!tuples) {
+                b->err = "out of memory";
+                return -1;
+            }
+            acl->tuples = tuples;
+        }
+        memset(&acl->tuples[t], 0, sizeof(acl->tuples[t]));
+        acl->tuples[t].mask = *mask;
+        acl->tuples[t].min_rule = rule;
+        acl->ntuples++;
+    }
+
+    if (b->npending == SR_ACL_MAX_ENTRIES) {
+        b->err = "too many entries";
+        return -1;
+    }
+    if (b->npending == b->max_pending) {
+        b->max_pending = b->max_pending ? 2 * b->max_pending : 256;
+        p = realloc(b->pending, b->max_pending * sizeof(*p));
+        if (!p) {
+            b->err = "out of memory";
+            return -1;
+        }
+        b->pending = p;
+    }
+    p = &b->pending[b->npending++];
+    p->key.w[0] = key->w[0] & mask->w[0];
+    p->key.w[1] = key->w[1] & mask->w[1];
+    p->tuple = t;
+    p->rule = rule;
+    acl->tuples[t].n++;
+    return 0;
+}
+
+/* One entry per pair of port prefixes the rule's ranges split into */
+static int sr_acl_expand(struct sr_acl_build* b, struct sr_acl_spec* s,
+                         uint32_t rule)
+{
+    uint16_t sval[32], dval[32];
+    uint8_t slen[32], dlen[32];
+    unsigned int ns, nd, i, j;
+
+    ns = sr_acl_split(s->sport_lo, s->sport_hi, sval, slen);
+    nd = sr_acl_split(s->dport_lo, s->dport_hi, dval, dlen);
+    for (i = 0; i < ns; i++) {
+        for (j = 0; j < nd; j++) {
+            s->key.f.sport = sval[i];
+            s->mask.f.sport = sr_acl_prefix_mask(slen[i]) >> 16;
+            s->key.f.dport = dval[j];
+            s->mask.f.dport = sr_acl_prefix_mask(dlen[j]) >> 16;
+            if (sr_acl_add_entry(b, &s->key, &s->mask, rule) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* Parses the fields of a rule after its action */
+static int sr_acl_parse(struct sr_acl_build* b, char* line,
+                        struct sr_acl_spec* s)
+{
+    struct sr_acl* acl = b->acl;
+    char *tok, *arg, *save = NULL;
+    unsigned int v, seen = 0, bit;
+    static const char* fields[] = { "iface", "proto", "src", "dst", "sport",
+                                    "dport" };
+
+    memset(s, 0, sizeof(*s));
+    s->sport_hi = s->dport_hi = 65535;
+    for (tok = strtok_r(line, " \t", &save); tok;
+         tok = strtok_r(NULL, " \t", &save)) {
+        for (bit = 0; bit < 6; bit++)
+            if (strcmp(tok, fields[bit]) == 0)
+                break;
+        if (bit == 6) {
+            b->err = "unknown field";
+            return -1;
+        }
+        if (seen & 1 << bit) {
+            b->err = "repeated field";
+            return -1;
+        }
+        seen |= 1 << bit;
+        if ((arg = strtok_r(NULL, " \t", &save)) == NULL) {
+            b->err = "missing value";
+            return -1;
+        }
+
+        switch (bit) {
+            case 0:
+                if (!(v = sr_acl_iface(acl, arg))) {
+                    if (acl->nifaces == SR_ACL_MAX_IFACES) {
+                        b->err = "too many interfaces";
+                        return -1;
+                    }
+                    strncpy(acl->ifaces[acl->nifaces], arg, sr_IFACE_NAMELEN - 1);
+                    v = ++acl->nifaces;
+                }
+                s->key.f.iface = v;
+                s->mask.f.iface = 0xff;
+                break;
+            case 1:
+                if (strcmp(arg, "tcp") == 0)
+                    v = ip_protocol_tcp;
+                else if (strcmp(arg, "udp") == 0)
+                    v = IPPROTO_UDP;
+                else if (strcmp(arg, "icmp") == 0)
+                    v = ip_protocol_icmp;
+                else if (sr_acl_number(b, arg, 0xff, &v) < 0)
+                    return -1;
+                s->key.f.proto = v;
+                s->mask.f.proto = 0xff;
+                break;
+            case 2:
+                if (sr_acl_prefix(b, arg, &s->key.f.src, &s->mask.f.src) < 0)
+                    return -1;
+                break;
+            case 3:
+                if (sr_acl_prefix(b, arg, &s->key.f.dst, &s->mask.f.dst) < 0)
+                    return -1;
+                break;
+            case 4:
+                if (sr_acl_range(b, arg, &s->sport_lo, &s->sport_hi) < 0)
+                    return -1;
+                break;
+            case 5:
+                if (sr_acl_range(b, arg, &s->dport_lo, &s->dport_hi) < 0)
+                    return -1;
+                break;
+        }
+    }
+
+    if (seen & (1 << 4 | 1 << 5)) {
+        if (s->mask.f.proto && s->key.f.proto != ip_protocol_tcp &&
+            s->key.f.proto != IPPROTO_UDP) {
+            b->err = "ports without tcp or udp";
+            return -1;
+        }
+        s->key.f.l4 = 1;
+        s->mask.f.l4 = 0xff;
+    }
+    return 0;
+}
+
+/* Sizes each tuple's table and fills it.  Pending entries are in rule
+   order, so an entry whose key is taken is shadowed and left out. */
+static int sr_acl_fill(struct sr_acl_build* b)
+{
+    struct sr_acl* acl = b->acl;
+    unsigned int t, i;
+
+    for (t = 0; t < acl->ntuples; t++) {
+        struct sr_acl_tuple* tp = &acl->tuples[t];
+        uint32_t size = 8;
+        while (size < 2 * tp->n)
+            size <<= 1;
+        if (!(tp->slots = malloc(size * sizeof(*tp->slots)))) {
+            b->err = "out of memory";
+            return -1;
+        }
+        memset(tp->slots, 0xff, size * sizeof(*tp->slots));
+        tp->size_mask = size - 1;
+        tp->n = 0;
+    }
+    for (i = 0; i < b->npending; i++) {
+        struct sr_acl_pending* p = &b->pending[i];
+        struct sr_acl_tuple* tp = &acl->tuples[p->tuple];
+        uint32_t h = sr_acl_hash(p->key.w[0], p->key.w[1]) & tp->size_mask;
+
+        while (tp->slots[h].rule != SR_ACL_NONE &&
+               (tp->slots[h].w[0] != p->key.w[0] ||
+                tp->slots[h].w[1] != p->key.w[1]))
+            h = (h + 1) & tp->size_mask;
+        if (tp->slots[h].rule != SR_ACL_NONE)
+            continue;
+        tp->slots[h].w[0] = p->key.w[0];
+        tp->slots[h].w[1] = p->key.w[1];
+        tp->slots[h].rule = p->rule;
+        tp->n++;
+        acl->nentries++;
+    }
+    return 0;
+}
+
+static int sr_acl_tuple_cmp(const void* a, const void* b)
+{
+    const struct sr_acl_tuple* x = a;
+    const struct sr_acl_tuple* y = b;
+    return x->min_rule < y->min_rule ? -1 : x->min_rule > y->min_rule;
+}
+
+static void sr_acl_dump(FILE* fp, void* arg)
+{
+    struct sr_acl* acl = arg;
+    unsigned int r, t;
+
+    fprintf(fp, "acl %u rules, %u entries in %u tuples\n", acl->nrules,
+            acl->nentries, acl->ntuples);
+    for (r = 0; r < acl->stride; r++) {
+        uint64_t hits = 0;
+        for (t = 0; t < SR_ACL_MAX_THREADS; t++)
+            hits += __atomic_load_n(&acl->hits[t * acl->stride + r],
+                                    __ATOMIC_RELAXED);
+        if (!hits)
+            continue;
+        if (r < acl->nrules)
+            fprintf(fp, "acl %12llu  %4u: %s\n", (unsigned long long)hits,
+                    acl->rules[r].line, acl->rules[r].text);
+        else
+            fprintf(fp, "acl %12llu  no rule, permit\n", (unsigned long long)hits);
+    }
+}
+
+struct sr_acl* sr_acl_load(const char* path)
+{
+    struct sr_acl_build b;
+    struct sr_acl_spec spec;
+    struct sr_acl* acl;
+    char line[SR_ACL_LINE_MAX], *p, *end;
+    unsigned int lineno = 0, a;
+    FILE* fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return NULL;
+    }
+    memset(&b, 0, sizeof(b));
+    b.acl = acl = calloc(1, sizeof(*acl));
+    if (!acl || !(acl->rules = calloc(SR_ACL_MAX_RULES, sizeof(*acl->rules)))) {
+        fprintf(stderr, "sr_acl: out of memory\n");
+        fclose(fp);
+        free(acl);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        p = line + strspn(line, " \t\r\n");
+        end = p + strlen(p);
+        while (end > p && strchr(" \t\r\n", end[-1]))
+            *--end = '\0';
+        if (*p == '\0')
+            continue;
+
+        if (acl->nrules == SR_ACL_MAX_RULES) {
+            b.err = "too many rules";
+            break;
+        }
+        acl->rules[acl->nrules].text = strdup(p);
+        acl->rules[acl->nrules].line = lineno;
+        end = p + strcspn(p, " \t");
+        for (a = 0; a <= SR_ACL_REJECT; a++)
+            if ((size_t)(end - p) == strlen(sr_acl_actions[a]) &&
+                strncmp(p, sr_acl_actions[a], end - p) == 0)
+                break;
+        if (a > SR_ACL_REJECT) {
+            b.err = "expected permit, deny or reject";
+            break;
+        }
+        acl->rules[acl->nrules].action = a;
+        if (sr_acl_parse(&b, end, &spec) < 0 ||
+            sr_acl_expand(&b, &spec, acl->nrules) < 0)
+            break;
+        acl->nrules++;
+    }
+    fclose(fp);
+
+    if (!b.err)
+        sr_acl_fill(&b);
+    free(b.pending);
+    if (b.err) {
+        fprintf(stderr, "sr_acl: %s:%u: %s\n", path, lineno, b.err);
+        if (acl->nrules < SR_ACL_MAX_RULES)
+            free(acl->rules[acl->nrules].text);
+        sr_acl_destroy(acl);
+        return NULL;
+    }
+
+    qsort(acl->tuples, acl->ntuples, sizeof(*acl->tuples), sr_acl_tuple_cmp);
+    acl->stride = acl->nrules + 1;
+    acl->hits = calloc(SR_ACL_MAX_THREADS * acl->stride, sizeof(uint64_t));
+    fprintf(stderr, "sr_acl: %u rules, %u entries in %u tuples\n", acl->nrules,
+            acl->nentries, acl->ntuples);
+    sr_stats_add_dumper(sr_acl_dump, acl);
+    return acl;
+}
+
+/*---------------------------------------------------------------------
+ * Matching
+ *---------------------------------------------------------------------*/
+
+static void sr_acl_count(struct sr_acl* acl, unsigned int r)
+{
+    uint64_t* c;
+
+    if (sr_acl_thread < 0)
+        sr_acl_thread = __atomic_fetch_add(&sr_acl_nthreads, 1, __ATOMIC_RELAXED);
+    if (sr_acl_thread >= SR_ACL_MAX_THREADS - 1) {
+        __atomic_fetch_add(&acl->hits[(SR_ACL_MAX_THREADS - 1) * acl->stride + r],
+                           1, __ATOMIC_RELAXED);
+        return;
+    }
+    c = &acl->hits[sr_acl_thread * acl->stride + r];
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+enum sr_acl_action sr_acl_check(struct sr_acl* acl, const uint8_t* ip_packet,
+                                unsigned int len, const char* iface)
+{
+    const sr_ip_hdr_t* ip_hdr = (const sr_ip_hdr_t*)ip_packet;
+    union sr_acl_key key;
+    uint32_t best = SR_ACL_NONE;
+    unsigned int t, hl;
+
+    if (!acl)
+        return SR_ACL_PERMIT;
+
+    key.w[0] = key.w[1] = 0;
+    key.f.src = ntohl(ip_hdr->ip_src);
+    key.f.dst = ntohl(ip_hdr->ip_dst);
+    key.f.proto = ip_hdr->ip_p;
+    key.f.iface = sr_acl_iface(acl, iface);
+    hl = ip_hdr->ip_hl * 4;
+    if ((ip_hdr->ip_p == ip_protocol_tcp || ip_hdr->ip_p == IPPROTO_UDP) &&
+        !(ntohs(ip_hdr->ip_off) & IP_OFFMASK) && len >= hl + 4) {
+        key.f.sport = ip_packet[hl] << 8 | ip_packet[hl + 1];
+        key.f.dport = ip_packet[hl + 2] << 8 | ip_packet[hl + 3];
+        key.f.l4 = 1;
+    }
+
+    for (t = 0; t < acl->ntuples && acl->tuples[t].min_rule < best; t++) {
+        const struct sr_acl_tuple* tp = &acl->tuples[t];
+        uint64_t w0 = key.w[0] & tp->mask.w[0];
+        uint64_t w1 = key.w[1] & tp->mask.w[1];
+        uint32_t h = sr_acl_hash(w0, w1) & tp->size_mask;
+
+        while (tp->slots[h].rule != SR_ACL_NONE) {
+            if (tp->slots[h].w[0] == w0 && tp->slots[h].w[1] == w1) {
+                if (tp->slots[h].rule < best)
+                    best = tp->slots[h].rule;
+                break;
+            }
+            h = (h + 1) & tp->size_mask;
+        }
+    }
+
+    if (best == SR_ACL_NONE) {
+        sr_acl_count(acl, acl->nrules);
+        return SR_ACL_PERMIT;
+    }
+    sr_acl_count(acl, best);
+    return acl->rules[best].action;
+}
+
+void sr_acl_destroy(struct sr_acl* acl)
+{
+    unsigned int i;
+
+    if (!acl)
+        return;
+    sr_stats_del_dumper(sr_acl_dump, acl);
+    for (i = 0; i < acl->nrules; i++)
+        free(acl->rules[i].text);
+    for (i = 0; i < acl->ntuples; i++)
+        free(acl->tuples[i].slots);
+    free(acl->rules);
+    free(acl->tuples);
+    free(acl->hits);
+    free(acl);
+}
@@ -0,0 +1,65 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_acl.h
+ *
+ * Description:
+ *
+ * Ingress packet filter (-A) for forwarded traffic.  A rule file is
+ * compiled once at startup into a tuple space classifier: rules are
+ * grouped by which fields they look at and how many bits of each
+ * (source and destination prefix length, port prefix length, protocol,
+ * interface), and each group is one hash table keyed by the masked
+ * header fields.  A packet costs one hash probe per group, however many
+ * rules there are, and groups whose best rule cannot beat a match
+ * already found are skipped.
+ *
+ * One rule per line, first matching rule wins, '#' starts a comment:
+ *
+ *   action  := "permit" | "deny" | "reject"
+ *   rule    := action { field }
+ *   field   := "iface" NAME | "proto" ( "tcp" | "udp" | "icmp" | N )
+ *            | "src" A.B.C.D[/LEN] | "dst" A.B.C.D[/LEN]
+ *            | "sport" N[-M] | "dport" N[-M]
+ *
+ * reject also sends an ICMP administratively prohibited back.  Port
+ * ranges are split into prefixes, so a rule may take several entries.
+ * A port field only matches TCP and UDP segments that carry their
+ * ports, not later fragments.  A packet no rule matches is permitted: a
+ * last line of "deny" turns that around.
+ *
+ * Every rule counts its hits, per thread; the counts are printed with
+ * the stats.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ACL_H
+#define SR_ACL_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_ACL_MAX_RULES     65536
+#define SR_ACL_MAX_ENTRIES   (1 << 20)  /* after port range expansion */
+#define SR_ACL_MAX_IFACES    16
+#define SR_ACL_MAX_THREADS   16         /* with their own hit counters */
+
+enum sr_acl_action { SR_ACL_PERMIT, SR_ACL_DENY, SR_ACL_REJECT };
+
+struct sr_acl;
+
+/* Compiles the rule file at path.  Returns NULL and names the offending
+   line on an error. */
+struct sr_acl* sr_acl_load(const char* path);
+
+/* What to do with an IP packet of len bytes received on iface.  A NULL
+   acl permits everything.  Thread safe. */
+enum sr_acl_action sr_acl_check(struct sr_acl* acl, const uint8_t* ip_packet,
+                                unsigned int len, const char* iface);
+
+void sr_acl_destroy(struct sr_acl* acl);
+
+#endif /* -- SR_ACL_H -- */
@@ -6,10 +6,14 @@
 #include <pthread.h>
 #include <sched.h>
 #include <string.h>
+#include <errno.h>
 #include "sr_arpcache.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_nbr.h"
+#include "sr_punt.h"
+#include "sr_stats.h"
 
 #define myDEBUG   1
 
@@ -43,44 +47,54 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
     go back to all the sender of packets that were waiting on a reply to this ARP request
     */
     time_t curtime = time(NULL);
-    /* char* eth_frame; */
-    /* loop through outstanding requests */
-    struct sr_arpreq *req;/* = malloc(sizeof(sr_arpreq));*/ 
-    for (req = sr->cache.requests; req != NULL; req = req->next) {
-        curtime = time(NULL);
+    /* loop through outstanding requests; a request may be destroyed on
+       the way, so step to the next one first */
+    struct sr_arpreq *req, *next;
+    for (req = sr->cache.requests; req != NULL; req = next) {
+        next = req->next;
 
-        if (difftime(curtime, req->sent) > 1) {
+        if (difftime(curtime, req->sent) >= 1) {
 
             if (req->times_sent < 5) {
-                
-                /* this request hasn't sent in the past second and isn't expired so resend it*/
-                struct sr_if* intf = sr->if_list; 
-                 /* Resend request (broadcast) !! */
-                for(intf; intf != NULL; intf = intf->next) {
-                    if(req->ip == intf->ip) {
-                        generate_arp_request(sr, req, intf);
-                        req->times_sent += 1; 
-                        req->sent = time(NULL); 
-                    }
+                /* this request hasn't sent in the past second and isn't
+                   expired so resend it out the interface its packets
+                   are waiting on (generate_arp_request() bumps
+                   times_sent and sent) */
+                struct sr_if* intf = req->packets ?
+                    sr_get_interface(sr, req->packets->iface) : NULL;
+                if (intf) {
+                    generate_arp_request(sr, req, intf);
+                }
+                else {
+                    req->times_sent += 1;
+                    req->sent = curtime;
                 }
-                /* increment times_sent after sending the request again, update sent time to now. */
             }
             else {
+                /* A gateway that goes down here has its packets forwarded
+                   again, toward a backup, and the request taken off the
+                   queue; whatever is still waiting on ip gets an error */
+                uint32_t ip = req->ip;
+                struct sr_packet *pac;
+                sr_stat_inc(SR_STAT_ARP_REQ_TIMEOUT);
+                sr_nbr_lost(sr, ip);
+                for (req = sr->cache.requests; req != NULL; req = req->next) {
+                    if (req->ip == ip) {
+                        break;
+                    }
+                }
+                if (req == NULL) {
+                    continue;
+                }
+
                 /* this request has already been sent 5 times
                 reply to all senders waiting on this reply with a DEST HOST UNREACHABLE
                 loop through the senders waiting on a reply from this ARP request */
-                struct sr_packet *pac;
-                
-                /* loop through all the packets tied to this request */
                 for (pac = req->packets; pac != NULL; pac = pac->next) {
+                    sr_stat_inc(SR_STAT_DROP_ARP_TIMEOUT);
                     /* send an ICMP packet DEST HOST UNREACHABLE type=3, code=1*/
-                    struct sr_if* intf = sr_get_interface(sr, pac->iface);
-                    struct sr_ip_hdr* ip_hdr = (sr_ip_hdr_t* )(pac->buf + sizeof(struct sr_ip_hdr));
-                    struct sr_arpentry* dest_entry = sr_arpcache_lookup(&(sr->cache), ip_hdr->ip_src); 
-
-                    handle_icmp_t3(sr, (sr_ethernet_hdr_t*)(pac->buf),
-                        (sr_ip_hdr_t*)(pac->buf + sizeof(sr_ethernet_hdr_t)),
-                        pac->len - sizeof(sr_ethernet_hdr_t), 3, 0);
+                    sr_punt(sr, SR_PUNT_ICMP_ERR, pac->buf, pac->len,
+                            NULL, 3, 1);
                 }
                 sr_arpreq_destroy(&sr->cache, req);
             }
@@ -213,11 +227,19 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
         prev = req;
     }
     
+    /* Refresh the entry ip already has, or take a free one: gateways
+       answer a hello every few hundred milliseconds */
     int i;
     for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
+        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip))
             break;
     }
+    if (i == SR_ARPCACHE_SZ) {
+        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+            if (!(cache->entries[i].valid))
+                break;
+        }
+    }
     
     if (i != SR_ARPCACHE_SZ) {
         memcpy(cache->entries[i].mac, mac, 6);
@@ -225,6 +247,9 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
         cache->entries[i].added = time(NULL);
         cache->entries[i].valid = 1;
     }
+    else {
+        sr_stat_inc(SR_STAT_ARP_CACHE_FULL);
+    }
     
     pthread_mutex_unlock(&(cache->lock));
     
@@ -294,45 +319,76 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     /* Invalidate all entries */
     memset(cache->entries, 0, sizeof(cache->entries));
     cache->requests = NULL;
+    cache->running = 0;
+    cache->stop = 0;
     
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
     pthread_mutexattr_settype(&(cache->attr), PTHREAD_MUTEX_RECURSIVE);
     int success = pthread_mutex_init(&(cache->lock), &(cache->attr));
+    pthread_cond_init(&(cache->wake), NULL);
     
     return success;
 }
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    pthread_cond_destroy(&(cache->wake));
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
+/* One pass of the cleanup thread: invalidates entries that were added more
+   than SR_ARPCACHE_TO seconds ago and resends or gives up on requests. */
+void sr_arpcache_sweep(struct sr_instance *sr) {
+    struct sr_arpcache *cache = &(sr->cache);
+
+    pthread_mutex_lock(&(cache->lock));
+
+    time_t curtime = time(NULL);
+
+    int i;
+    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+        if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
+            cache->entries[i].valid = 0;
+            sr_stat_inc(SR_STAT_ARP_CACHE_EXPIRED);
+        }
+    }
+
+    sr_arpcache_sweepreqs(sr);
+
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/* Thread which sweeps the cache once a second, until sr_arpcache_stop().
+   It waits on the cache's condition rather than sleeping so that a stop
+   need not wait out the second. */
 void *sr_arpcache_timeout(void *sr_ptr) {
     struct sr_instance *sr = sr_ptr;
     struct sr_arpcache *cache = &(sr->cache);
-    
-    while (1) {
-        sleep(1.0);
-        
-        pthread_mutex_lock(&(cache->lock));
-    
-        time_t curtime = time(NULL);
-        
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
-        }
-        
-        sr_arpcache_sweepreqs(sr);
+    struct timespec ts;
 
-        pthread_mutex_unlock(&(cache->lock));
+    pthread_mutex_lock(&(cache->lock));
+    while (!cache->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        while (!cache->stop &&
+               pthread_cond_timedwait(&(cache->wake), &(cache->lock), &ts) != ETIMEDOUT)
+            ;
+        if (!cache->stop)
+            sr_arpcache_sweep(sr);
     }
-    
+    pthread_mutex_unlock(&(cache->lock));
+
     return NULL;
 }
 
+void sr_arpcache_stop(struct sr_arpcache *cache) {
+    if (!cache->running)
+        return;
+    pthread_mutex_lock(&(cache->lock));
+    cache->stop = 1;
+    pthread_cond_signal(&(cache->wake));
+    pthread_mutex_unlock(&(cache->lock));
+    pthread_join(cache->thread, NULL);
+    cache->running = 0;
+}
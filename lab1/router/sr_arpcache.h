@@ -104,6 +104,10 @@ struct sr_arpcache {
     struct sr_arpreq *requests;
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
+    pthread_t thread;           /* sr_arpcache_timeout, if running */
+    pthread_cond_t wake;        /* signalled, under lock, to stop it */
+    int running;
+    int stop;
 };
 
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order. 
@@ -147,4 +151,14 @@ int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
 
+/* Stops and joins the thread running sr_arpcache_timeout, if any.  Once it
+   returns nothing sweeps the cache, sends ARP requests or punts on its own. */
+void  sr_arpcache_stop(struct sr_arpcache *cache);
+
+struct sr_instance;
+
+/* One pass of the cleanup thread, for routers sharing one timer thread
+   (sr_tenant.h) instead of running their own. */
+void  sr_arpcache_sweep(struct sr_instance *sr);
+
 #endif
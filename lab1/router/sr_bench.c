@@ -0,0 +1,913 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_bench.c
+ *
+ * Description:
+ *
+ * Stand-alone VNS compatible server used to benchmark sr on localhost.
+ * It speaks the server side of vnscommand.h (auth, open, VNS_RTABLE,
+ * VNSHWINFO, VNSPACKET), presents the lab1 topology to the router and
+ * then drives it with synthetic UDP traffic injected on the client
+ * interface.  Frames the router forwards back are matched by sequence
+ * number to report packets per second and per-packet latency.
+ *
+ *   client (10.0.1.100) -- eth3 [ sr ] eth1 -- server1 (192.168.2.2)
+ *                                      eth2 -- server2 (172.64.3.10)
+ *
+ * Start sr_bench first, then point sr at it:
+ *
+ *   ./sr_bench -n 100000 -s 64-1500 -d 192.168.2.2,172.64.3.10
+ *   ./sr -s localhost -p 8888
+ *
+ * -t hands the router another routing table, and -x silences one host
+ * for part of the run (it neither answers ARP nor takes frames) to time
+ * failover to a backup route:
+ *
+ *   ./sr_bench -t rtable.backup -x 10.0.1.100@1000-3000 -d rand -r 20000
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_protocol.h"
+#include "sha1.h"
+#include "vnscommand.h"
+
+#define DEFAULT_PORT     8888
+#define DEFAULT_COUNT    100000
+#define DEFAULT_AUTH_KEY "auth_key"
+#define AUTH_KEY_LEN     64
+#define SHA1_LEN         20
+#define SALT_LEN         16
+#define MAX_DESTS        64
+#define MAX_FRAME        1514
+#define MIN_FRAME        60
+#define IDLE_TIMEOUT_NS  2000000000ULL
+#define RTABLE_MAX       1024
+
+#define BENCH_MAGIC      0x53524231 /* "SRB1" */
+#define BENCH_SPORT      40000
+#define BENCH_DPORT      9
+
+/* ----------------------------------------------------------------------------
+ * Topology presented to the router.  Interface names and addresses match
+ * lab1/IP_CONFIG and the default rtable so sr can run unmodified.
+ * -------------------------------------------------------------------------- */
+
+struct bench_if
+{
+    const char* name;
+    const char* ip;
+    const char* mask;
+};
+
+static const struct bench_if bench_ifs[] = {
+    { "eth1", "192.168.2.1", "255.255.255.0" },
+    { "eth2", "172.64.3.1",  "255.255.255.0" },
+    { "eth3", "10.0.1.1",    "255.255.255.0" }
+};
+#define BENCH_NIFS   (sizeof(bench_ifs) / sizeof(bench_ifs[0]))
+#define INGRESS_IF   2 /* eth3 */
+#define CLIENT_IP    "10.0.1.100"
+
+static const char bench_rtable[] =
+    "0.0.0.0  10.0.1.100  0.0.0.0 eth3\n"
+    "192.168.2.2 192.168.2.2 255.255.255.255 eth1\n"
+    "172.64.3.10  172.64.3.10  255.255.255.255 eth2\n";
+
+/* Bench payload carried after the UDP header */
+struct bench_payload
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t tx_ns;
+} __attribute__ ((packed));
+
+struct bench_udp_hdr
+{
+    uint16_t sport;
+    uint16_t dport;
+    uint16_t len;
+    uint16_t sum;
+} __attribute__ ((packed));
+
+enum bench_arp_mode {
+    arp_mode_reply,   /* answer every ARP request from the router */
+    arp_mode_ignore,  /* never answer: exercises queueing and host unreachable */
+    arp_mode_warm     /* push gratuitous replies up front, then answer */
+};
+
+enum bench_dist {
+    dist_uniform,
+    dist_zipf,
+    dist_seq
+};
+
+struct bench
+{
+    int      fd;
+    pthread_mutex_t send_lock;
+
+    /* configuration */
+    unsigned int count;
+    unsigned int min_size;
+    unsigned int max_size;
+    uint32_t dests[MAX_DESTS];  /* network byte order, 0 == random address */
+    unsigned int ndests;
+    enum bench_dist dist;
+    double   zipf_cdf[MAX_DESTS];
+    enum bench_arp_mode arp_mode;
+    unsigned int rate;          /* packets per second, 0 == unpaced */
+    unsigned int window;        /* max packets in flight, 0 == unlimited */
+    char*    rtable;            /* routing table handed to sr */
+    uint32_t dead_ip;           /* host silenced by -x, network order */
+    uint64_t dead_from;         /* ns after start_ns */
+    uint64_t dead_to;
+    volatile uint64_t start_ns;
+
+    /* router side addresses */
+    uint32_t if_ip[BENCH_NIFS];
+    uint8_t  if_mac[BENCH_NIFS][ETHER_ADDR_LEN];
+    uint32_t client_ip;
+
+    /* results, written by the receive thread */
+    uint64_t* tx_ns;            /* send time per sequence number */
+    uint64_t* lat_ns;           /* latency samples */
+    uint32_t* flow_last;        /* last seq + 1 seen per (dst, sport) flow */
+    volatile unsigned int sent;
+    volatile unsigned int received;
+    volatile unsigned int dup;
+    volatile unsigned int reorder;
+    volatile unsigned int icmp;
+    volatile unsigned int arp_req;
+    volatile unsigned int other;
+    volatile unsigned int blackholed;
+    volatile uint64_t last_blackholed_ns;
+    volatile uint64_t last_rx_ns;
+    volatile int done;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Host MACs are derived from their IP so replies need no table */
+static void mac_for_ip(uint32_t ip_nbo, uint8_t* mac)
+{
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    memcpy(mac + 2, &ip_nbo, 4);
+}
+
+/* Same Internet checksum as sr_utils.c, duplicated to keep the tool
+ * independent of the router objects. */
+static uint16_t bench_cksum(const void* _data, int len)
+{
+    const uint8_t* data = _data;
+    uint32_t sum;
+
+    for (sum = 0; len >= 2; data += 2, len -= 2)
+        sum += data[0] << 8 | data[1];
+    if (len > 0)
+        sum += data[0] << 8;
+    while (sum > 0xffff)
+        sum = (sum >> 16) + (sum & 0xffff);
+    sum = htons(~sum);
+    return sum ? sum : 0xffff;
+}
+
+/*---------------------------------------------------------------------
+ * Socket helpers
+ *---------------------------------------------------------------------*/
+
+static int write_full(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = buf;
+    while (len > 0) {
+        ssize_t ret = write(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void* buf, size_t len)
+{
+    uint8_t* p = buf;
+    while (len > 0) {
+        ssize_t ret = read(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int bench_send(struct bench* b, const void* buf, size_t len)
+{
+    int ret;
+    pthread_mutex_lock(&b->send_lock);
+    ret = write_full(b->fd, buf, len);
+    pthread_mutex_unlock(&b->send_lock);
+    return ret;
+}
+
+/* Read one VNS command; returns a malloc'd buffer with host order header */
+static uint8_t* bench_read_cmd(struct bench* b, uint32_t* type, uint32_t* len)
+{
+    uint32_t hdr[2];
+    uint8_t* buf;
+
+    if (read_full(b->fd, hdr, sizeof(hdr)) < 0)
+        return NULL;
+    *len = ntohl(hdr[0]);
+    *type = ntohl(hdr[1]);
+    if (*len < sizeof(hdr) || *len > 10000) {
+        fprintf(stderr, "sr_bench: bad command length %u\n", *len);
+        return NULL;
+    }
+    buf = malloc(*len);
+    assert(buf);
+    memcpy(buf, hdr, sizeof(hdr));
+    if (read_full(b->fd, buf + sizeof(hdr), *len - sizeof(hdr)) < 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static int bench_send_frame(struct bench* b, const char* iface,
+                            const uint8_t* frame, unsigned int len)
+{
+    uint8_t msg[sizeof(c_packet_header) + MAX_FRAME];
+    c_packet_header* hdr = (c_packet_header*)msg;
+
+    assert(len <= MAX_FRAME);
+    hdr->mLen = htonl(sizeof(c_packet_header) + len);
+    hdr->mType = htonl(VNSPACKET);
+    memset(hdr->mInterfaceName, 0, sizeof(hdr->mInterfaceName));
+    strncpy(hdr->mInterfaceName, iface, sizeof(hdr->mInterfaceName));
+    memcpy(msg + sizeof(c_packet_header), frame, len);
+    return bench_send(b, msg, sizeof(c_packet_header) + len);
+}
+
+/*---------------------------------------------------------------------
+ * Session setup: the server half of sr_connect_to_server()
+ *---------------------------------------------------------------------*/
+
+static int bench_auth(struct bench* b, const char* key_file)
+{
+    uint8_t req[sizeof(c_auth_request) + SALT_LEN];
+    c_auth_request* ar = (c_auth_request*)req;
+    uint8_t status[sizeof(c_auth_status) + 64];
+    c_auth_status* as = (c_auth_status*)status;
+    char auth_key[AUTH_KEY_LEN + 1];
+    c_auth_reply* reply;
+    uint32_t type, len, name_len;
+    int i, have_key = 0, ok = 1;
+    FILE* fp;
+
+    ar->mLen = htonl(sizeof(req));
+    ar->mType = htonl(VNS_AUTH_REQUEST);
+    for (i = 0; i < SALT_LEN; i++)
+        ar->salt[i] = rand() & 0xff;
+    if (bench_send(b, req, sizeof(req)) < 0)
+        return -1;
+
+    reply = (c_auth_reply*)bench_read_cmd(b, &type, &len);
+    if (!reply || type != VNS_AUTH_REPLY) {
+        fprintf(stderr, "sr_bench: expected auth reply\n");
+        free(reply);
+        return -1;
+    }
+    name_len = ntohl(reply->usernameLen);
+    if (sizeof(c_auth_reply) + name_len + SHA1_LEN > len) {
+        fprintf(stderr, "sr_bench: truncated auth reply\n");
+        free(reply);
+        return -1;
+    }
+
+    /* Verify the salted SHA1 when we share the router's key */
+    if ((fp = fopen(key_file, "r")) != NULL) {
+        have_key = (fgets(auth_key, AUTH_KEY_LEN + 1, fp) == auth_key &&
+                    strlen(auth_key) == AUTH_KEY_LEN);
+        fclose(fp);
+    }
+    if (have_key) {
+        SHA1Context sha1;
+        SHA1Reset(&sha1);
+        SHA1Input(&sha1, ar->salt, SALT_LEN);
+        SHA1Input(&sha1, (unsigned char*)auth_key, AUTH_KEY_LEN);
+        if (!SHA1Result(&sha1))
+            return -1;
+        for (i = 0; i < 5; i++)
+            sha1.Message_Digest[i] = htonl(sha1.Message_Digest[i]);
+        ok = memcmp(reply->username + name_len, sha1.Message_Digest,
+                    SHA1_LEN) == 0;
+    }
+    printf("sr_bench: auth from %.*s %s\n", (int)name_len, reply->username,
+           have_key ? (ok ? "verified" : "REJECTED") : "accepted (no key)");
+    free(reply);
+
+    memset(status, 0, sizeof(status));
+    as->mType = htonl(VNS_AUTH_STATUS);
+    as->auth_ok = ok;
+    strcpy(as->msg, ok ? "sr_bench" : "bad credentials");
+    len = sizeof(c_auth_status) + strlen(as->msg) + 1;
+    as->mLen = htonl(len);
+    if (bench_send(b, status, len) < 0)
+        return -1;
+    return ok ? 0 : -1;
+}
+
+static int bench_open(struct bench* b)
+{
+    uint32_t type, len;
+    uint8_t* cmd = bench_read_cmd(b, &type, &len);
+
+    if (!cmd)
+        return -1;
+
+    if (type == VNS_OPEN_TEMPLATE) {
+        c_open_template* ot = (c_open_template*)cmd;
+        uint8_t msg[sizeof(c_rtable) + RTABLE_MAX];
+        c_rtable* rt = (c_rtable*)msg;
+
+        printf("sr_bench: template %.30s for %.32s\n", ot->templateName,
+               ot->mVirtualHostID);
+        memset(msg, 0, sizeof(msg));
+        len = sizeof(c_rtable) + strlen(b->rtable);
+        rt->mLen = htonl(len);
+        rt->mType = htonl(VNS_RTABLE);
+        strncpy(rt->mVirtualHostID, ot->mVirtualHostID, IDSIZE - 1);
+        memcpy(rt->rtable, b->rtable, strlen(b->rtable));
+        free(cmd);
+        return bench_send(b, msg, len);
+    }
+    if (type == VNSOPEN) {
+        c_open* op = (c_open*)cmd;
+        printf("sr_bench: open topo %u host %.32s\n", ntohs(op->topoID),
+               op->mVirtualHostID);
+        free(cmd);
+        return 0;
+    }
+    fprintf(stderr, "sr_bench: expected open, got %u\n", type);
+    free(cmd);
+    return -1;
+}
+
+static int bench_hwinfo(struct bench* b)
+{
+    c_hwinfo hw;
+    unsigned int i, n = 0;
+
+    memset(&hw, 0, sizeof(hw));
+    for (i = 0; i < BENCH_NIFS; i++) {
+        uint32_t mask = inet_addr(bench_ifs[i].mask);
+
+        hw.mHWInfo[n].mKey = htonl(HWINTERFACE);
+        strncpy(hw.mHWInfo[n++].value, bench_ifs[i].name, 31);
+        hw.mHWInfo[n].mKey = htonl(HWETHER);
+        memcpy(hw.mHWInfo[n++].value, b->if_mac[i], ETHER_ADDR_LEN);
+        hw.mHWInfo[n].mKey = htonl(HWETHIP);
+        memcpy(hw.mHWInfo[n++].value, &b->if_ip[i], 4);
+        hw.mHWInfo[n].mKey = htonl(HWMASK);
+        memcpy(hw.mHWInfo[n++].value, &mask, 4);
+    }
+    hw.mLen = htonl(2 * sizeof(uint32_t) + n * sizeof(c_hw_entry));
+    hw.mType = htonl(VNSHWINFO);
+    return bench_send(b, &hw, ntohl(hw.mLen));
+}
+
+/*---------------------------------------------------------------------
+ * Traffic
+ *---------------------------------------------------------------------*/
+
+static void bench_arp_reply(struct bench* b, const char* iface,
+                            const uint8_t* router_mac, uint32_t router_ip,
+                            uint32_t host_ip)
+{
+    uint8_t frame[MIN_FRAME];
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+    sr_arp_hdr_t* arp = (sr_arp_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    uint8_t host_mac[ETHER_ADDR_LEN];
+
+    mac_for_ip(host_ip, host_mac);
+    memset(frame, 0, sizeof(frame));
+    memcpy(eth->ether_dhost, router_mac, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, host_mac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_arp);
+
+    arp->ar_hrd = htons(arp_hrd_ethernet);
+    arp->ar_pro = htons(ethertype_ip);
+    arp->ar_hln = ETHER_ADDR_LEN;
+    arp->ar_pln = 4;
+    arp->ar_op = htons(arp_op_reply);
+    memcpy(arp->ar_sha, host_mac, ETHER_ADDR_LEN);
+    arp->ar_sip = host_ip;
+    memcpy(arp->ar_tha, router_mac, ETHER_ADDR_LEN);
+    arp->ar_tip = router_ip;
+
+    bench_send_frame(b, iface, frame, sizeof(frame));
+}
+
+/* Interface whose subnet holds ip, the ingress interface otherwise */
+static unsigned int bench_if_for(struct bench* b, uint32_t ip)
+{
+    unsigned int i;
+    for (i = 0; i < BENCH_NIFS; i++) {
+        uint32_t mask = inet_addr(bench_ifs[i].mask);
+        if ((ip & mask) == (b->if_ip[i] & mask))
+            return i;
+    }
+    return INGRESS_IF;
+}
+
+static unsigned int bench_pick_dest(struct bench* b, unsigned int seq)
+{
+    unsigned int i;
+    double r;
+
+    switch (b->dist) {
+        case dist_seq:
+            return seq % b->ndests;
+        case dist_zipf:
+            r = (double)rand() / ((double)RAND_MAX + 1.0);
+            for (i = 0; i < b->ndests - 1; i++)
+                if (r < b->zipf_cdf[i])
+                    break;
+            return i;
+        default:
+            return rand() % b->ndests;
+    }
+}
+
+static unsigned int bench_build(struct bench* b, uint8_t* frame, unsigned int seq)
+{
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+    sr_ip_hdr_t* ip = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    struct bench_udp_hdr* udp = (struct bench_udp_hdr*)(ip + 1);
+    struct bench_payload* pl = (struct bench_payload*)(udp + 1);
+    unsigned int len = b->min_size;
+    uint32_t dst = b->dests[bench_pick_dest(b, seq)];
+
+    if (b->max_size > b->min_size)
+        len += rand() % (b->max_size - b->min_size + 1);
+    if (dst == 0)
+        dst = htonl(0x0b000000 | (rand() & 0x00ffffff)); /* 11/8, default route */
+
+    memset(frame, 0, len);
+    memcpy(eth->ether_dhost, b->if_mac[INGRESS_IF], ETHER_ADDR_LEN);
+    mac_for_ip(b->client_ip, eth->ether_shost);
+    eth->ether_type = htons(ethertype_ip);
+
+    ip->ip_v = 4;
+    ip->ip_hl = 5;
+    ip->ip_len = htons(len - sizeof(sr_ethernet_hdr_t));
+    ip->ip_id = htons(seq & 0xffff);
+    ip->ip_ttl = 64;
+    ip->ip_p = 17;
+    ip->ip_src = b->client_ip;
+    ip->ip_dst = dst;
+    ip->ip_sum = bench_cksum(ip, sizeof(sr_ip_hdr_t));
+
+    /* vary the source port so flows spread across a multipath router */
+    udp->sport = htons(BENCH_SPORT + (seq & 0xff));
+    udp->dport = htons(BENCH_DPORT);
+    udp->len = htons(len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
+
+    pl->magic = htonl(BENCH_MAGIC);
+    pl->seq = seq;
+    pl->tx_ns = now_ns();
+    b->tx_ns[seq] = pl->tx_ns;
+    return len;
+}
+
+/* Is ip silenced by -x right now? */
+static int bench_is_dead(struct bench* b, uint32_t ip, uint64_t now)
+{
+    return b->dead_ip && ip == b->dead_ip && b->start_ns &&
+           now - b->start_ns >= b->dead_from && now - b->start_ns < b->dead_to;
+}
+
+static void bench_handle_frame(struct bench* b, const char* iface,
+                               uint8_t* frame, unsigned int len)
+{
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+    uint64_t now = now_ns();
+    uint8_t dead_mac[ETHER_ADDR_LEN];
+
+    b->last_rx_ns = now;
+    if (len < sizeof(sr_ethernet_hdr_t)) {
+        b->other++;
+        return;
+    }
+    mac_for_ip(b->dead_ip, dead_mac);
+    if (bench_is_dead(b, b->dead_ip, now) &&
+        memcmp(eth->ether_dhost, dead_mac, ETHER_ADDR_LEN) == 0) {
+        b->blackholed++;
+        b->last_blackholed_ns = now;
+        return;
+    }
+
+    if (ntohs(eth->ether_type) == ethertype_arp &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
+        sr_arp_hdr_t* arp = (sr_arp_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+        if (ntohs(arp->ar_op) == arp_op_request) {
+            b->arp_req++;
+            if (b->arp_mode != arp_mode_ignore && !bench_is_dead(b, arp->ar_tip, now))
+                bench_arp_reply(b, iface, arp->ar_sha, arp->ar_sip, arp->ar_tip);
+        } else {
+            b->other++;
+        }
+        return;
+    }
+
+    if (ntohs(eth->ether_type) == ethertype_ip &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+        sr_ip_hdr_t* ip = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+        unsigned int min_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) +
+                               sizeof(struct bench_udp_hdr) +
+                               sizeof(struct bench_payload);
+
+        if (ip->ip_p == ip_protocol_icmp) {
+            b->icmp++;
+            return;
+        }
+        if (ip->ip_p == 17 && len >= min_len) {
+            struct bench_payload* pl = (struct bench_payload*)
+                (frame + min_len - sizeof(struct bench_payload));
+            if (ntohl(pl->magic) == BENCH_MAGIC && pl->seq < b->count) {
+                if (b->tx_ns[pl->seq] == 0) {
+                    b->dup++;
+                    return;
+                }
+                {
+                    /* sport and the low byte of the destination name the flow */
+                    uint8_t* l4 = (uint8_t*)ip + ip->ip_hl * 4;
+                    unsigned int flow = (l4[1] << 8) | (ntohl(ip->ip_dst) & 0xff);
+                    if (b->flow_last[flow] > pl->seq)
+                        b->reorder++;
+                    else
+                        b->flow_last[flow] = pl->seq + 1;
+                }
+                b->lat_ns[b->received] = now - b->tx_ns[pl->seq];
+                b->tx_ns[pl->seq] = 0;
+                b->received++;
+                return;
+            }
+        }
+    }
+    b->other++;
+}
+
+static void* bench_rx_thread(void* arg)
+{
+    struct bench* b = arg;
+    uint32_t type, len;
+    uint8_t* cmd;
+
+    while (!b->done && (cmd = bench_read_cmd(b, &type, &len)) != NULL) {
+        if (type == VNSPACKET && len >= sizeof(c_packet_header)) {
+            c_packet_header* hdr = (c_packet_header*)cmd;
+            char iface[17];
+            memcpy(iface, hdr->mInterfaceName, 16);
+            iface[16] = '\0';
+            bench_handle_frame(b, iface, cmd + sizeof(c_packet_header),
+                               len - sizeof(c_packet_header));
+        }
+        free(cmd);
+    }
+    b->done = 1;
+    return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_report(struct bench* b, uint64_t start, uint64_t end)
+{
+    double secs = (end - start) / 1e9;
+    unsigned int n = b->received;
+
+    printf("\nsent %u  forwarded %u  lost %u  dup %u  reordered %u  icmp %u  arp-req %u  other %u\n",
+           b->sent, n, b->sent - n, b->dup, b->reorder, b->icmp, b->arp_req, b->other);
+    if (b->dead_ip && b->blackholed)
+        printf("blackholed at the silenced host %u, the last %.1f ms after it went quiet\n",
+               b->blackholed,
+               (b->last_blackholed_ns - b->start_ns - b->dead_from) / 1e6);
+    printf("elapsed %.3f s  tx %.0f pps  fwd %.0f pps\n", secs,
+           b->sent / secs, n / secs);
+    if (n == 0)
+        return;
+
+    qsort(b->lat_ns, n, sizeof(uint64_t), cmp_u64);
+    printf("latency us: min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           b->lat_ns[0] / 1e3, b->lat_ns[n / 2] / 1e3,
+           b->lat_ns[(uint64_t)n * 90 / 100] / 1e3,
+           b->lat_ns[(uint64_t)n * 99 / 100] / 1e3,
+           b->lat_ns[(uint64_t)n * 999 / 1000] / 1e3, b->lat_ns[n - 1] / 1e3);
+}
+
+static void bench_run(struct bench* b)
+{
+    uint8_t frame[MAX_FRAME];
+    pthread_t rx;
+    uint64_t start, next, gap;
+    unsigned int i, len;
+
+    if (b->arp_mode == arp_mode_warm) {
+        for (i = 0; i < b->ndests; i++) {
+            unsigned int k = bench_if_for(b, b->dests[i]);
+            if (b->dests[i])
+                bench_arp_reply(b, bench_ifs[k].name, b->if_mac[k],
+                                b->if_ip[k], b->dests[i]);
+        }
+        bench_arp_reply(b, bench_ifs[INGRESS_IF].name, b->if_mac[INGRESS_IF],
+                        b->if_ip[INGRESS_IF], b->client_ip);
+    }
+
+    pthread_create(&rx, NULL, bench_rx_thread, b);
+
+    /* give sr a moment to process hwinfo and print its tables */
+    usleep(200000);
+
+    gap = b->rate ? 1000000000ULL / b->rate : 0;
+    start = next = now_ns();
+    b->start_ns = start;
+    for (i = 0; i < b->count && !b->done; i++) {
+        if (gap) {
+            while (now_ns() < next)
+                ;
+            next += gap;
+        }
+        while (b->window && b->sent - b->received >= b->window &&
+               now_ns() - b->last_rx_ns < IDLE_TIMEOUT_NS && !b->done)
+            sched_yield();
+
+        len = bench_build(b, frame, i);
+        if (bench_send_frame(b, bench_ifs[INGRESS_IF].name, frame, len) < 0) {
+            perror("sr_bench: send");
+            break;
+        }
+        b->sent++;
+        if (b->last_rx_ns < start)
+            b->last_rx_ns = now_ns();
+    }
+
+    /* drain until everything came back or the router went quiet */
+    while (!b->done && b->received < b->sent &&
+           now_ns() - b->last_rx_ns < IDLE_TIMEOUT_NS)
+        usleep(1000);
+
+    bench_report(b, start, b->last_rx_ns > start ? b->last_rx_ns : now_ns());
+}
+
+/*---------------------------------------------------------------------
+ * Command line
+ *---------------------------------------------------------------------*/
+
+static void usage(char* argv0)
+{
+    printf("VNS compatible traffic generator for sr\n");
+    printf("Format: %s [-h] [-p port] [-n count] [-s size[-max]] \n", argv0);
+    printf("           [-d dest,dest,...|rand] [-z uniform|zipf|seq] \n");
+    printf("           [-a reply|ignore|warm] [-r pps] [-w window] [-k auth_key]\n");
+    printf("           [-t rtable] [-x host@from_ms-to_ms]\n");
+    printf("   defaults port=%d count=%d size=%d dests=192.168.2.2,172.64.3.10\n",
+           DEFAULT_PORT, DEFAULT_COUNT, MIN_FRAME);
+}
+
+static int parse_dests(struct bench* b, char* spec)
+{
+    char* tok;
+    double total = 0, acc = 0;
+    unsigned int i;
+
+    b->ndests = 0;
+    for (tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        struct in_addr a;
+        if (b->ndests == MAX_DESTS)
+            return -1;
+        if (strcmp(tok, "rand") == 0)
+            b->dests[b->ndests++] = 0;
+        else if (inet_aton(tok, &a))
+            b->dests[b->ndests++] = a.s_addr;
+        else
+            return -1;
+    }
+    if (b->ndests == 0)
+        return -1;
+
+    /* zipf(1) over destinations in the order given */
+    for (i = 0; i < b->ndests; i++)
+        total += 1.0 / (i + 1);
+    for (i = 0; i < b->ndests; i++) {
+        acc += 1.0 / (i + 1);
+        b->zipf_cdf[i] = acc / total;
+    }
+    return 0;
+}
+
+/* The rtable sent to sr instead of bench_rtable */
+static char* read_rtable(const char* path)
+{
+    static char buf[RTABLE_MAX];
+    FILE* fp = fopen(path, "r");
+    size_t n;
+
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+    n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    return buf;
+}
+
+static int parse_dead(struct bench* b, char* spec)
+{
+    char* at = strchr(spec, '@');
+    unsigned int from, to;
+    struct in_addr a;
+
+    if (!at)
+        return -1;
+    *at = '\0';
+    if (!inet_aton(spec, &a) || sscanf(at + 1, "%u-%u", &from, &to) != 2 || to <= from)
+        return -1;
+    b->dead_ip = a.s_addr;
+    b->dead_from = from * 1000000ULL;
+    b->dead_to = to * 1000000ULL;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    struct bench b;
+    struct sockaddr_in addr;
+    char dest_spec[] = "192.168.2.2,172.64.3.10";
+    char* dests = dest_spec;
+    char* key_file = DEFAULT_AUTH_KEY;
+    unsigned short port = DEFAULT_PORT;
+    unsigned int i;
+    int lfd, c, one = 1;
+
+    memset(&b, 0, sizeof(b));
+    b.rtable = (char*)bench_rtable;
+    b.count = DEFAULT_COUNT;
+    b.min_size = b.max_size = MIN_FRAME;
+    pthread_mutex_init(&b.send_lock, NULL);
+
+    while ((c = getopt(argc, argv, "hp:n:s:d:z:a:r:w:k:t:x:")) != EOF) {
+        switch (c) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'n':
+                b.count = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%u-%u", &b.min_size, &b.max_size) < 2)
+                    b.max_size = b.min_size;
+                break;
+            case 'd':
+                dests = optarg;
+                break;
+            case 'z':
+                b.dist = !strcmp(optarg, "zipf") ? dist_zipf :
+                         !strcmp(optarg, "seq") ? dist_seq : dist_uniform;
+                break;
+            case 'a':
+                b.arp_mode = !strcmp(optarg, "ignore") ? arp_mode_ignore :
+                             !strcmp(optarg, "warm") ? arp_mode_warm : arp_mode_reply;
+                break;
+            case 'r':
+                b.rate = atoi(optarg);
+                break;
+            case 'w':
+                b.window = atoi(optarg);
+                break;
+            case 'k':
+                key_file = optarg;
+                break;
+            case 't':
+                if ((b.rtable = read_rtable(optarg)) == NULL)
+                    exit(1);
+                break;
+            case 'x':
+                if (parse_dead(&b, optarg) < 0) {
+                    fprintf(stderr, "sr_bench: -x wants host@from_ms-to_ms\n");
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (parse_dests(&b, dests) < 0) {
+        fprintf(stderr, "sr_bench: bad destination list\n");
+        exit(1);
+    }
+    if (b.min_size < MIN_FRAME)
+        b.min_size = MIN_FRAME;
+    if (b.max_size > MAX_FRAME)
+        b.max_size = MAX_FRAME;
+    if (b.max_size < b.min_size)
+        b.max_size = b.min_size;
+    if (b.count == 0)
+        exit(0);
+
+    for (i = 0; i < BENCH_NIFS; i++) {
+        b.if_ip[i] = inet_addr(bench_ifs[i].ip);
+        b.if_mac[i][0] = 0x02;
+        b.if_mac[i][5] = i + 1;
+    }
+    b.client_ip = inet_addr(CLIENT_IP);
+    b.tx_ns = calloc(b.count, sizeof(uint64_t));
+    b.lat_ns = calloc(b.count, sizeof(uint64_t));
+    b.flow_last = calloc(1 << 16, sizeof(uint32_t));
+    assert(b.tx_ns && b.lat_ns);
+    srand(time(NULL));
+
+    if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0) {
+        perror("bind/listen");
+        exit(1);
+    }
+
+    printf("sr_bench: waiting for sr on localhost:%u\n", port);
+    if ((b.fd = accept(lfd, NULL, NULL)) < 0) {
+        perror("accept");
+        exit(1);
+    }
+    close(lfd);
+    setsockopt(b.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (bench_auth(&b, key_file) < 0 || bench_open(&b) < 0 || bench_hwinfo(&b) < 0) {
+        fprintf(stderr, "sr_bench: session setup failed\n");
+        exit(1);
+    }
+
+    bench_run(&b);
+
+    /* tell the router we are done; it exits its read loop on VNSCLOSE */
+    {
+        c_close cl;
+        memset(&cl, 0, sizeof(cl));
+        cl.mLen = htonl(sizeof(cl));
+        cl.mType = htonl(VNSCLOSE);
+        strcpy(cl.mErrorMessage, "sr_bench finished");
+        b.done = 1;
+        bench_send(&b, &cl, sizeof(cl));
+    }
+    shutdown(b.fd, SHUT_WR);
+    close(b.fd);
+    return 0;
+}
@@ -0,0 +1,556 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_capfilter.c
+ *
+ * Description:
+ *
+ * Capture filter compiler and interpreter.  The expression is parsed into
+ * a small tree of field tests joined by and/or/not, which is then emitted
+ * back to front as a branch program: each test gets the (already emitted)
+ * true and false continuations as its jump targets, so and/or/not cost no
+ * instructions of their own and every jump goes forward.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_capfilter.h"
+
+/* instruction opcodes */
+#define CF_RET  0   /* return k */
+#define CF_JEQ  1   /* (field & mask) == k ? jt : jf */
+
+/* fields an instruction can test */
+enum sr_cf_field {
+    CF_ETHERTYPE,
+    CF_IP_PROTO,
+    CF_IP_SRC,
+    CF_IP_DST,
+    CF_SPORT,
+    CF_DPORT,
+    CF_IFACE        /* k is an index into the filter's name table */
+};
+
+static const char* sr_cf_field_names[] =
+    { "ethertype", "ip proto", "ip src", "ip dst", "sport", "dport", "iface" };
+
+struct sr_cf_insn
+{
+    uint8_t  op;
+    uint8_t  field;
+    uint16_t jt, jf;
+    uint32_t k;
+    uint32_t mask;
+};
+
+struct sr_capfilter
+{
+    unsigned int ninsns;
+    unsigned int sample_n;
+    unsigned int sample_ctr;
+    unsigned int nifaces;
+    char ifaces[SR_CF_MAX_IFACES][sr_IFACE_NAMELEN];
+    struct sr_cf_insn code[SR_CF_MAX_INSNS];
+};
+
+/*---------------------------------------------------------------------------
+ * Parser
+ *---------------------------------------------------------------------------*/
+
+#define CF_LEAF 0
+#define CF_AND  1
+#define CF_OR   2
+#define CF_NOT  3
+
+#define CF_MAX_NODES (2 * SR_CF_MAX_INSNS)
+#define CF_MAX_TOKEN 64
+
+struct sr_cf_node
+{
+    int type;
+    struct sr_cf_node *l, *r;
+    uint8_t  field;
+    uint32_t k, mask;
+};
+
+struct sr_cf_parser
+{
+    const char* expr;
+    const char* pos;
+    const char* tok_start;
+    char tok[CF_MAX_TOKEN];
+    const char* err;
+    unsigned int nnodes;
+    struct sr_cf_node nodes[CF_MAX_NODES];
+    struct sr_capfilter* f;
+};
+
+static void cf_next(struct sr_cf_parser* p)
+{
+    unsigned int n = 0;
+
+    while (isspace((unsigned char)*p->pos))
+        p->pos++;
+    p->tok_start = p->pos;
+
+    if (*p->pos == '\0') {
+        p->tok[0] = '\0';
+        return;
+    }
+    if (strchr("()!", *p->pos)) {
+        p->tok[n++] = *p->pos++;
+    } else if ((p->pos[0] == '&' && p->pos[1] == '&') ||
+               (p->pos[0] == '|' && p->pos[1] == '|')) {
+        p->tok[n++] = *p->pos++;
+        p->tok[n++] = *p->pos++;
+    } else {
+        while (*p->pos && !isspace((unsigned char)*p->pos) &&
+               !strchr("()!&|", *p->pos)) {
+            if (n < CF_MAX_TOKEN - 1)
+                p->tok[n++] = *p->pos;
+            p->pos++;
+        }
+        if (n == 0) {
+            p->err = "unexpected character";
+            p->tok[n++] = *p->pos++;
+        }
+    }
+    p->tok[n] = '\0';
+}
+
+static int cf_is(struct sr_cf_parser* p, const char* a, const char* b)
+{
+    return strcmp(p->tok, a) == 0 || (b && strcmp(p->tok, b) == 0);
+}
+
+static struct sr_cf_node* cf_node(struct sr_cf_parser* p, int type,
+                                  struct sr_cf_node* l, struct sr_cf_node* r)
+{
+    struct sr_cf_node* n;
+
+    if (p->nnodes == CF_MAX_NODES) {
+        p->err = "expression too long";
+        return NULL;
+    }
+    n = &p->nodes[p->nnodes++];
+    memset(n, 0, sizeof(struct sr_cf_node));
+    n->type = type;
+    n->l = l;
+    n->r = r;
+    return n;
+}
+
+static struct sr_cf_node* cf_leaf(struct sr_cf_parser* p, int field,
+                                  uint32_t k, uint32_t mask)
+{
+    struct sr_cf_node* n = cf_node(p, CF_LEAF, NULL, NULL);
+    if (n) {
+        n->field = field;
+        n->k = k & mask;
+        n->mask = mask;
+    }
+    return n;
+}
+
+/* src/dst qualified address or port test; dir is 's', 'd' or 0 for either */
+static struct sr_cf_node* cf_dir(struct sr_cf_parser* p, int dir, int sfield,
+                                 int dfield, uint32_t k, uint32_t mask)
+{
+    if (dir == 's')
+        return cf_leaf(p, sfield, k, mask);
+    if (dir == 'd')
+        return cf_leaf(p, dfield, k, mask);
+    return cf_node(p, CF_OR, cf_leaf(p, sfield, k, mask),
+                   cf_leaf(p, dfield, k, mask));
+}
+
+static int cf_number(struct sr_cf_parser* p, const char* s, uint32_t max,
+                     uint32_t* out)
+{
+    char* end;
+    unsigned long v = strtoul(s, &end, 0);
+
+    if (*s == '\0' || *end != '\0' || v > max) {
+        p->err = "bad number";
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int cf_addr(struct sr_cf_parser* p, const char* s, uint32_t* out)
+{
+    struct in_addr a;
+
+    if (inet_pton(AF_INET, s, &a) != 1) {
+        p->err = "bad address";
+        return -1;
+    }
+    *out = ntohl(a.s_addr);
+    return 0;
+}
+
+static struct sr_cf_node* cf_expr(struct sr_cf_parser* p);
+
+static struct sr_cf_node* cf_prim(struct sr_cf_parser* p)
+{
+    int dir = 0;
+    uint32_t k, len;
+    char* slash;
+
+    if (cf_is(p, "arp", NULL)) {
+        cf_next(p);
+        return cf_leaf(p, CF_ETHERTYPE, ethertype_arp, 0xffff);
+    }
+    if (cf_is(p, "ip", NULL)) {
+        cf_next(p);
+        return cf_leaf(p, CF_ETHERTYPE, ethertype_ip, 0xffff);
+    }
+    /* ip proto loads fail on non-IP frames, no need to test the ethertype */
+    if (cf_is(p, "icmp", NULL)) {
+        cf_next(p);
+        return cf_leaf(p, CF_IP_PROTO, ip_protocol_icmp, 0xff);
+    }
+    if (cf_is(p, "tcp", NULL)) {
+        cf_next(p);
+        return cf_leaf(p, CF_IP_PROTO, IPPROTO_TCP, 0xff);
+    }
+    if (cf_is(p, "udp", NULL)) {
+        cf_next(p);
+        return cf_leaf(p, CF_IP_PROTO, IPPROTO_UDP, 0xff);
+    }
+    if (cf_is(p, "proto", NULL)) {
+        cf_next(p);
+        if (cf_number(p, p->tok, 0xff, &k) < 0)
+            return NULL;
+        cf_next(p);
+        return cf_leaf(p, CF_IP_PROTO, k, 0xff);
+    }
+    if (cf_is(p, "iface", NULL)) {
+        struct sr_capfilter* f = p->f;
+        cf_next(p);
+        if (p->tok[0] == '\0' || strlen(p->tok) >= sr_IFACE_NAMELEN) {
+            p->err = "bad interface name";
+            return NULL;
+        }
+        for (k = 0; k < f->nifaces; k++)
+            if (strcmp(f->ifaces[k], p->tok) == 0)
+                break;
+        if (k == f->nifaces) {
+            if (f->nifaces == SR_CF_MAX_IFACES) {
+                p->err = "too many interfaces";
+                return NULL;
+            }
+            strcpy(f->ifaces[f->nifaces++], p->tok);
+        }
+        cf_next(p);
+        return cf_leaf(p, CF_IFACE, k, 0xffffffff);
+    }
+
+    if (cf_is(p, "src", NULL) || cf_is(p, "dst", NULL)) {
+        dir = p->tok[0];
+        cf_next(p);
+    }
+    if (cf_is(p, "host", NULL)) {
+        cf_next(p);
+        if (cf_addr(p, p->tok, &k) < 0)
+            return NULL;
+        cf_next(p);
+        return cf_dir(p, dir, CF_IP_SRC, CF_IP_DST, k, 0xffffffff);
+    }
+    if (cf_is(p, "net", NULL)) {
+        cf_next(p);
+        if ((slash = strchr(p->tok, '/')) == NULL) {
+            p->err = "expected A.B.C.D/LEN";
+            return NULL;
+        }
+        *slash = '\0';
+        if (cf_addr(p, p->tok, &k) < 0 || cf_number(p, slash + 1, 32, &len) < 0)
+            return NULL;
+        cf_next(p);
+        return cf_dir(p, dir, CF_IP_SRC, CF_IP_DST, k,
+                      len ? 0xffffffff << (32 - len) : 0);
+    }
+    if (cf_is(p, "port", NULL)) {
+        cf_next(p);
+        if (cf_number(p, p->tok, 0xffff, &k) < 0)
+            return NULL;
+        cf_next(p);
+        return cf_dir(p, dir, CF_SPORT, CF_DPORT, k, 0xffff);
+    }
+
+    p->err = dir ? "expected host, net or port" : "expected a primitive";
+    return NULL;
+}
+
+static struct sr_cf_node* cf_factor(struct sr_cf_parser* p)
+{
+    struct sr_cf_node* n;
+
+    if (cf_is(p, "not", "!")) {
+        cf_next(p);
+        n = cf_factor(p);
+        return n ? cf_node(p, CF_NOT, n, NULL) : NULL;
+    }
+    if (cf_is(p, "(", NULL)) {
+        cf_next(p);
+        if ((n = cf_expr(p)) == NULL)
+            return NULL;
+        if (!cf_is(p, ")", NULL)) {
+            p->err = "expected )";
+            return NULL;
+        }
+        cf_next(p);
+        return n;
+    }
+    return cf_prim(p);
+}
+
+static struct sr_cf_node* cf_term(struct sr_cf_parser* p)
+{
+    struct sr_cf_node* n = cf_factor(p);
+
+    while (n && !p->err && cf_is(p, "and", "&&")) {
+        struct sr_cf_node* r;
+        cf_next(p);
+        if ((r = cf_factor(p)) == NULL)
+            return NULL;
+        n = cf_node(p, CF_AND, n, r);
+    }
+    return n;
+}
+
+static struct sr_cf_node* cf_expr(struct sr_cf_parser* p)
+{
+    struct sr_cf_node* n = cf_term(p);
+
+    while (n && !p->err && cf_is(p, "or", "||")) {
+        struct sr_cf_node* r;
+        cf_next(p);
+        if ((r = cf_term(p)) == NULL)
+            return NULL;
+        n = cf_node(p, CF_OR, n, r);
+    }
+    return n;
+}
+
+/*---------------------------------------------------------------------------
+ * Code generation
+ *
+ * Instructions are numbered in emission order starting at 1; the program
+ * is laid out in reverse so the last one emitted (the entry) is at pc 0.
+ *---------------------------------------------------------------------------*/
+
+static int cf_emit(struct sr_capfilter* f, int op, int field, uint32_t k,
+                   uint32_t mask, unsigned int jt, unsigned int jf)
+{
+    struct sr_cf_insn* in;
+
+    if (f->ninsns == SR_CF_MAX_INSNS)
+        return 0;
+    in = &f->code[f->ninsns++];
+    in->op = op;
+    in->field = field;
+    in->k = k;
+    in->mask = mask;
+    in->jt = jt;
+    in->jf = jf;
+    return f->ninsns;
+}
+
+static unsigned int cf_gen(struct sr_capfilter* f, struct sr_cf_node* n,
+                           unsigned int t, unsigned int e)
+{
+    unsigned int b;
+
+    switch (n->type) {
+        case CF_AND:
+            if ((b = cf_gen(f, n->r, t, e)) == 0)
+                return 0;
+            return cf_gen(f, n->l, b, e);
+        case CF_OR:
+            if ((b = cf_gen(f, n->r, t, e)) == 0)
+                return 0;
+            return cf_gen(f, n->l, t, b);
+        case CF_NOT:
+            return cf_gen(f, n->l, e, t);
+        default:
+            return cf_emit(f, CF_JEQ, n->field, n->k, n->mask, t, e);
+    }
+}
+
+/* Reverses the program and turns emission numbers into pcs. */
+static void cf_layout(struct sr_capfilter* f)
+{
+    unsigned int i, n = f->ninsns;
+
+    for (i = 0; i < n / 2; i++) {
+        struct sr_cf_insn tmp = f->code[i];
+        f->code[i] = f->code[n - 1 - i];
+        f->code[n - 1 - i] = tmp;
+    }
+    for (i = 0; i < n; i++) {
+        if (f->code[i].op == CF_RET)
+            continue;
+        f->code[i].jt = n - f->code[i].jt;
+        f->code[i].jf = n - f->code[i].jf;
+    }
+}
+
+struct sr_capfilter* sr_capfilter_compile(const char* expr, unsigned int sample_n)
+{
+    struct sr_cf_parser* p;
+    struct sr_cf_node* root = NULL;
+    struct sr_capfilter* f;
+    unsigned int accept, reject;
+
+    f = calloc(1, sizeof(struct sr_capfilter));
+    p = calloc(1, sizeof(struct sr_cf_parser));
+    if (!f || !p) {
+        free(f);
+        free(p);
+        return NULL;
+    }
+    f->sample_n = sample_n;
+    p->f = f;
+    p->expr = p->pos = expr ? expr : "";
+
+    cf_next(p);
+    if (p->tok[0] != '\0') {
+        root = cf_expr(p);
+        if (!p->err && p->tok[0] != '\0')
+            p->err = "unexpected token";
+    }
+    if (p->err) {
+        fprintf(stderr, "capture filter: %s at offset %d: %s\n",
+                p->err, (int)(p->tok_start - p->expr), p->expr);
+        free(p);
+        free(f);
+        return NULL;
+    }
+
+    accept = cf_emit(f, CF_RET, 0, 1, 0, 0, 0);
+    reject = cf_emit(f, CF_RET, 0, 0, 0, 0, 0);
+    if (root && cf_gen(f, root, accept, reject) == 0) {
+        fprintf(stderr, "capture filter: more than %d instructions: %s\n",
+                SR_CF_MAX_INSNS, p->expr);
+        free(p);
+        free(f);
+        return NULL;
+    }
+    if (!root)
+        f->ninsns = accept;
+    cf_layout(f);
+
+    free(p);
+    return f;
+}
+
+/*---------------------------------------------------------------------------
+ * Interpreter
+ *---------------------------------------------------------------------------*/
+
+/* Loads field from the frame; returns -1 if the frame does not have it. */
+static int cf_load(struct sr_capfilter* f, int field, uint32_t k,
+                   const uint8_t* frame, unsigned int len, const char* iface,
+                   uint32_t* v)
+{
+    const sr_ethernet_hdr_t* eth = (const sr_ethernet_hdr_t*)frame;
+    const sr_ip_hdr_t* ip = (const sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    const uint8_t* l4;
+
+    if (field == CF_IFACE) {
+        *v = iface && strncmp(iface, f->ifaces[k], sr_IFACE_NAMELEN) == 0 ?
+             k : ~k;
+        return 0;
+    }
+    if (len < sizeof(sr_ethernet_hdr_t))
+        return -1;
+    if (field == CF_ETHERTYPE) {
+        *v = ntohs(eth->ether_type);
+        return 0;
+    }
+
+    if (eth->ether_type != htons(ethertype_ip) ||
+        len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))
+        return -1;
+    switch (field) {
+        case CF_IP_PROTO:
+            *v = ip->ip_p;
+            return 0;
+        case CF_IP_SRC:
+            *v = ntohl(ip->ip_src);
+            return 0;
+        case CF_IP_DST:
+            *v = ntohl(ip->ip_dst);
+            return 0;
+    }
+
+    /* ports: first fragment of TCP or UDP only */
+    if ((ip->ip_p != IPPROTO_TCP && ip->ip_p != IPPROTO_UDP) ||
+        (ntohs(ip->ip_off) & IP_OFFMASK) != 0 ||
+        len < sizeof(sr_ethernet_hdr_t) + ip->ip_hl * 4 + 4)
+        return -1;
+    l4 = (const uint8_t*)ip + ip->ip_hl * 4;
+    *v = field == CF_SPORT ? (l4[0] << 8) | l4[1] : (l4[2] << 8) | l4[3];
+    return 0;
+}
+
+int sr_capfilter_match(struct sr_capfilter* f, const uint8_t* frame,
+                       unsigned int len, const char* iface)
+{
+    const struct sr_cf_insn* in;
+    unsigned int pc = 0;
+    uint32_t v;
+
+    if (!f)
+        return 1;
+
+    for (;;) {
+        in = &f->code[pc];
+        if (in->op == CF_RET)
+            break;
+        if (cf_load(f, in->field, in->k, frame, len, iface, &v) == 0 &&
+            (v & in->mask) == in->k)
+            pc = in->jt;
+        else
+            pc = in->jf;
+    }
+    if (!in->k)
+        return 0;
+
+    if (f->sample_n > 1 &&
+        __atomic_fetch_add(&f->sample_ctr, 1, __ATOMIC_RELAXED) % f->sample_n)
+        return 0;
+    return 1;
+}
+
+void sr_capfilter_print(struct sr_capfilter* f, FILE* fp)
+{
+    unsigned int i;
+
+    for (i = 0; i < f->ninsns; i++) {
+        const struct sr_cf_insn* in = &f->code[i];
+        if (in->op == CF_RET)
+            fprintf(fp, "(%03u) ret %s\n", i, in->k ? "accept" : "reject");
+        else if (in->field == CF_IFACE)
+            fprintf(fp, "(%03u) %-9s == %-10s jt %u jf %u\n", i,
+                    sr_cf_field_names[in->field], f->ifaces[in->k],
+                    in->jt, in->jf);
+        else
+            fprintf(fp, "(%03u) %-9s & 0x%08x == 0x%08x jt %u jf %u\n", i,
+                    sr_cf_field_names[in->field], in->mask, in->k,
+                    in->jt, in->jf);
+    }
+    if (f->sample_n > 1)
+        fprintf(fp, "sample 1 in %u\n", f->sample_n);
+}
+
+void sr_capfilter_destroy(struct sr_capfilter* f)
+{
+    free(f);
+}
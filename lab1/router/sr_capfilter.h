@@ -0,0 +1,61 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_capfilter.h
+ *
+ * Description:
+ *
+ * Capture filter for -l packet logging.  A tcpdump-like expression is
+ * compiled once at startup into a small branch program: every
+ * instruction tests one header field and jumps to one of two targets,
+ * ending in accept or reject.  Frames that fail the filter cost a handful
+ * of loads and compares before sr_log_packet() returns.
+ *
+ * Grammar (keywords are case sensitive, "&&", "||" and "!" also work):
+ *
+ *   expr    := term { "or" term }
+ *   term    := factor { "and" factor }
+ *   factor  := "not" factor | "(" expr ")" | prim
+ *   prim    := "arp" | "ip" | "icmp" | "tcp" | "udp" | "proto" N
+ *            | [ "src" | "dst" ] "host" A.B.C.D
+ *            | [ "src" | "dst" ] "net" A.B.C.D/LEN
+ *            | [ "src" | "dst" ] "port" N
+ *            | "iface" NAME
+ *
+ * A test on a field the frame does not have (a port on an ARP frame, an
+ * address on a truncated frame) is false.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_CAPFILTER_H
+#define SR_CAPFILTER_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <stdio.h>
+
+#define SR_CF_MAX_INSNS  256
+#define SR_CF_MAX_IFACES 8
+
+struct sr_capfilter;
+
+/* Compiles expr.  Returns NULL and prints the offending position on a
+   syntax error.  An empty expression accepts everything.  sample_n > 1
+   keeps only every n-th frame that passes the expression. */
+struct sr_capfilter* sr_capfilter_compile(const char* expr, unsigned int sample_n);
+
+/* Non-zero if the frame received or sent on iface should be logged.  A
+   NULL filter accepts everything. */
+int sr_capfilter_match(struct sr_capfilter* f, const uint8_t* frame,
+                       unsigned int len, const char* iface);
+
+/* Prints the compiled program, one instruction per line. */
+void sr_capfilter_print(struct sr_capfilter* f, FILE* fp);
+
+void sr_capfilter_destroy(struct sr_capfilter* f);
+
+#endif /* -- SR_CAPFILTER_H -- */
@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include "sr_dumper.h"
 
+#define SWAP32(x) ((((x) & 0xff) << 24) | (((x) & 0xff00) << 8) | \
+                   (((x) >> 8) & 0xff00) | (((x) >> 24) & 0xff))
+
 static void
 sf_write_header(FILE *fp, int linktype, int thiszone, int snaplen)
 {
@@ -69,3 +72,83 @@ sr_dump_close(FILE *fp)
   fclose(fp);
 }
 
+/*
+ * Open a dump file written by sr_dump_open() (or tcpdump) for reading.
+ */
+FILE *
+sr_dump_read_open(const char *fname, int *swapped, int *snaplen)
+{
+        struct pcap_file_header hdr;
+        FILE *fp;
+
+        if (fname[0] == '-' && fname[1] == '\0')
+                fp = stdin;
+        else if ((fp = fopen(fname, "r")) == NULL) {
+                fprintf(stderr, "sr_dump_read_open: can't open %s\n", fname);
+                return (NULL);
+        }
+
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+                fprintf(stderr, "sr_dump_read_open: short header in %s\n", fname);
+                fclose(fp);
+                return (NULL);
+        }
+        if (hdr.magic == TCPDUMP_MAGIC)
+                *swapped = 0;
+        else if (hdr.magic == SWAP32(TCPDUMP_MAGIC))
+                *swapped = 1;
+        else {
+                fprintf(stderr, "sr_dump_read_open: %s is not a pcap file\n",
+                    fname);
+                fclose(fp);
+                return (NULL);
+        }
+
+        hdr.linktype = *swapped ? SWAP32(hdr.linktype) : hdr.linktype;
+        if (hdr.linktype != LINKTYPE_ETHERNET) {
+                fprintf(stderr, "sr_dump_read_open: %s: linktype %u is not "
+                    "ethernet\n", fname, hdr.linktype);
+                fclose(fp);
+                return (NULL);
+        }
+        if (snaplen)
+                *snaplen = *swapped ? SWAP32(hdr.snaplen) : hdr.snaplen;
+
+        return fp;
+}
+
+/*
+ * Read the next packet record from a dump file.
+ */
+int
+sr_dump_read(FILE *fp, int swapped, struct pcap_pkthdr *h,
+             unsigned char *buf, unsigned int buflen)
+{
+        struct pcap_sf_pkthdr sf_hdr;
+        unsigned int keep;
+
+        if (fread(&sf_hdr, sizeof(sf_hdr), 1, fp) != 1)
+                return 0;
+        if (swapped) {
+                sf_hdr.ts.tv_sec  = SWAP32(sf_hdr.ts.tv_sec);
+                sf_hdr.ts.tv_usec = SWAP32(sf_hdr.ts.tv_usec);
+                sf_hdr.caplen     = SWAP32(sf_hdr.caplen);
+                sf_hdr.len        = SWAP32(sf_hdr.len);
+        }
+        if (sf_hdr.caplen > 0x40000)
+                return -1;
+
+        h->ts.tv_sec  = sf_hdr.ts.tv_sec;
+        h->ts.tv_usec = sf_hdr.ts.tv_usec;
+        h->len        = sf_hdr.len;
+        keep = min(sf_hdr.caplen, buflen);
+        h->caplen     = keep;
+
+        if (keep == 0 || fread(buf, keep, 1, fp) != 1)
+                return -1;
+        /* skip whatever did not fit into the caller's buffer */
+        if (sf_hdr.caplen > keep &&
+            fseek(fp, sf_hdr.caplen - keep, SEEK_CUR) != 0)
+                return -1;
+        return keep;
+}
@@ -77,3 +77,16 @@ void sr_dump(FILE *fp, const struct pcap_pkthdr *h, const unsigned char *sp);
  * Close the file
  */
 void sr_dump_close(FILE *fp);
+
+/**
+ * Open an existing dump file for reading and check its header.  Files
+ * written on a host of the other byte order are accepted.
+ */
+FILE* sr_dump_read_open(const char *fname, int *swapped, int *snaplen);
+
+/**
+ * Read the next packet into buf (at most buflen bytes are kept).  Returns
+ * the captured length, 0 at end of file and -1 on a corrupt record.
+ */
+int sr_dump_read(FILE *fp, int swapped, struct pcap_pkthdr *h,
+                 unsigned char *buf, unsigned int buflen);
@@ -0,0 +1,574 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_egress.c
+ *
+ * Description:
+ *
+ * Egress queues and the thread that drains them.  Each interface queue
+ * has a pool of limit frame slots, linked by index into one FIFO per flow
+ * bucket; busy buckets sit on the new or the old list, fq_codel style.
+ * One lock covers every queue: producers only copy a frame in, and the
+ * draining thread copies a frame out and drops the lock to write it.
+ *
+ * CoDel follows RFC 8289, per bucket, in sr_tsc() ticks.  A bucket
+ * holding no more than one frame's worth of bytes is never dropped from.
+ * ARP, hellos included, bypasses all of it in a bucket of its own that
+ * is served first: a gateway must not look dead because its interface
+ * is congested.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_log.h"
+#include "sr_egress.h"
+
+#define SR_EGRESS_NONE 0xffff
+#define SR_EGRESS_CTRL SR_EGRESS_BUCKETS  /* non-IP, strict priority */
+
+struct sr_egress_pkt
+{
+    uint64_t t_enq;             /* sr_tsc() */
+    uint16_t next;              /* in its bucket, or the free list */
+    uint16_t len;
+    uint8_t frame[SR_EGRESS_FRAME_MAX];
+};
+
+/* A flow bucket: its frames, DRR deficit and CoDel state */
+struct sr_egress_flow
+{
+    uint16_t head, tail;
+    uint16_t next;              /* on the new or old list */
+    uint16_t listed;
+    int deficit;
+    uint32_t bytes;
+    uint64_t first_above;       /* sojourn above target until then, 0 below */
+    uint64_t drop_next;
+    uint32_t count, lastcount;
+    int dropping;
+};
+
+struct sr_egress_list
+{
+    uint16_t head, tail;
+};
+
+struct sr_egress_q
+{
+    char name[sr_IFACE_NAMELEN];
+    struct sr_egress_pkt* pkts;
+    uint16_t free;
+    unsigned int backlog;       /* frames */
+    struct sr_egress_flow flow[SR_EGRESS_BUCKETS + 1];
+    struct sr_egress_list new_flows, old_flows;
+    uint64_t next_tx;           /* shaper: sr_tsc() the next frame may leave */
+
+    uint64_t enqueued, sent, codel_drops, codel_marks, overlimit_drops;
+    unsigned int max_backlog;
+    uint64_t sojourn[SR_HIST_BUCKETS];
+};
+
+struct sr_egress
+{
+    unsigned long limit, target_ms, interval_ms, quantum, rate_kbps, ecn;
+    uint64_t target, interval;  /* ticks */
+    double ticks_per_byte;      /* 0 unshaped */
+    uint64_t burst;             /* ticks of credit a shaped queue may bank */
+    double ticks_per_ns;
+
+    struct sr_instance* sr;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running, stop;
+    unsigned int nq;
+    struct sr_egress_q q[SR_EGRESS_MAX_IFS];
+};
+
+static const char* sr_egress_keys[] = { "limit", "target", "interval", "quantum", "rate",
+                                        "ecn" };
+
+static int sr_egress_parse(struct sr_egress* e, const char* spec)
+{
+    unsigned long* field[6];
+    const char* p;
+
+    field[0] = &e->limit;
+    field[1] = &e->target_ms;
+    field[2] = &e->interval_ms;
+    field[3] = &e->quantum;
+    field[4] = &e->rate_kbps;
+    field[5] = &e->ecn;
+
+    if (strcmp(spec, "on") == 0)
+        return 0;
+    for (p = spec; *p; ) {
+        const char* end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        const char* eq = memchr(p, '=', len);
+        char* q;
+        int k;
+
+        if (!eq)
+            return -1;
+        for (k = 0; k < 6; k++)
+            if (strlen(sr_egress_keys[k]) == (size_t)(eq - p) &&
+                strncmp(p, sr_egress_keys[k], eq - p) == 0)
+                break;
+        if (k == 6)
+            return -1;
+        *field[k] = strtoul(eq + 1, &q, 10);
+        if (q == eq + 1 || q != p + len)
+            return -1;
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    return 0;
+}
+
+struct sr_egress* sr_egress_create(const char* spec)
+{
+    struct sr_egress* e = calloc(1, sizeof(struct sr_egress));
+
+    if (!e)
+        return NULL;
+    if (sr_egress_parse(e, SR_EGRESS_DEFAULT) != 0 || sr_egress_parse(e, spec) != 0 ||
+        e->limit == 0 || e->limit >= SR_EGRESS_NONE || e->quantum == 0 ||
+        e->target_ms == 0 || e->interval_ms < e->target_ms || e->ecn > 1) {
+        fprintf(stderr, "bad egress queue spec '%s', expected on or "
+                "limit|target|interval|quantum|rate|ecn=N,...\n", spec);
+        free(e);
+        return NULL;
+    }
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    return e;
+}
+
+static void sr_egress_list_add(struct sr_egress_q* q, struct sr_egress_list* l,
+                               uint16_t fi)
+{
+    q->flow[fi].next = SR_EGRESS_NONE;
+    if (l->head == SR_EGRESS_NONE)
+        l->head = fi;
+    else
+        q->flow[l->tail].next = fi;
+    l->tail = fi;
+}
+
+static void sr_egress_list_pop(struct sr_egress_q* q, struct sr_egress_list* l)
+{
+    l->head = q->flow[l->head].next;
+}
+
+/* Takes the oldest frame off bucket f */
+static uint16_t sr_egress_pop(struct sr_egress_q* q, struct sr_egress_flow* f)
+{
+    uint16_t i = f->head;
+
+    if (i == SR_EGRESS_NONE)
+        return i;
+    f->head = q->pkts[i].next;
+    f->bytes -= q->pkts[i].len;
+    q->backlog--;
+    return i;
+}
+
+static void sr_egress_free(struct sr_egress_q* q, uint16_t i)
+{
+    q->pkts[i].next = q->free;
+    q->free = i;
+}
+
+static uint64_t sr_codel_control_law(struct sr_egress* e, uint64_t t, uint32_t count)
+{
+    return t + (uint64_t)(e->interval / sqrt(count));
+}
+
+/* RFC 8289 dodequeue(): should the frame just taken off f be dropped? */
+static int sr_codel_ok_to_drop(struct sr_egress* e, struct sr_egress_q* q,
+                               struct sr_egress_flow* f, uint16_t i, uint64_t now)
+{
+    if (i == SR_EGRESS_NONE) {
+        f->first_above = 0;
+        return 0;
+    }
+    if (now - q->pkts[i].t_enq < e->target || f->bytes <= e->quantum) {
+        f->first_above = 0;
+        return 0;
+    }
+    if (f->first_above == 0) {
+        f->first_above = now + e->interval;
+        return 0;
+    }
+    return now >= f->first_above;
+}
+
+static void sr_codel_drop(struct sr_egress_q* q, uint16_t i)
+{
+    sr_egress_free(q, i);
+    q->codel_drops++;
+    sr_stat_inc(SR_STAT_EGRESS_CODEL_DROP);
+}
+
+/* Marks the frame CE instead of dropping it, if ecn is on and it is an
+   ECN capable IP datagram; returns 0 if it must be dropped.  One already
+   marked counts as marked again. */
+static int sr_codel_mark(struct sr_egress* e, struct sr_egress_q* q, uint16_t i)
+{
+    uint8_t* frame = q->pkts[i].frame;
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    uint8_t* b = (uint8_t*)ip_hdr;
+
+    if (!e->ecn || q->pkts[i].len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) ||
+        ((sr_ethernet_hdr_t*)frame)->ether_type != htons(ethertype_ip) ||
+        (b[1] & IPTOS_ECN_MASK) == IPTOS_ECN_NOT_ECT)
+        return 0;
+    /* tos shares its checksum word with the version and header length */
+    if ((b[1] & IPTOS_ECN_MASK) != IPTOS_ECN_CE) {
+        ip_hdr->ip_sum = cksum_adjust(ip_hdr->ip_sum, htons(b[0] << 8 | b[1]),
+                                      htons(b[0] << 8 | b[1] | IPTOS_ECN_CE));
+        b[1] |= IPTOS_ECN_CE;
+    }
+    q->codel_marks++;
+    sr_stat_inc(SR_STAT_EGRESS_ECN_MARK);
+    return 1;
+}
+
+/* RFC 8289 dequeue() on one bucket.  A marked frame is sent, so it ends
+   this round of dropping: the next signal waits for the control law. */
+static uint16_t sr_codel_dequeue(struct sr_egress* e, struct sr_egress_q* q,
+                                 struct sr_egress_flow* f, uint64_t now)
+{
+    uint16_t i = sr_egress_pop(q, f);
+    int drop = sr_codel_ok_to_drop(e, q, f, i, now);
+
+    if (f->dropping) {
+        if (!drop)
+            f->dropping = 0;
+        while (f->dropping && now >= f->drop_next) {
+            if (sr_codel_mark(e, q, i)) {
+                f->count++;
+                f->drop_next = sr_codel_control_law(e, f->drop_next, f->count);
+                break;
+            }
+            sr_codel_drop(q, i);
+            f->count++;
+            i = sr_egress_pop(q, f);
+            if (!sr_codel_ok_to_drop(e, q, f, i, now))
+                f->dropping = 0;
+            else
+                f->drop_next = sr_codel_control_law(e, f->drop_next, f->count);
+        }
+    } else if (drop) {
+        uint32_t delta;
+
+        if (!sr_codel_mark(e, q, i)) {
+            sr_codel_drop(q, i);
+            i = sr_egress_pop(q, f);
+        }
+        f->count++;
+        f->dropping = 1;
+        /* back into dropping soon after leaving it: resume near the old
+           rate rather than from the start */
+        delta = f->count - f->lastcount;
+        f->count = delta > 1 && now - f->drop_next < 16 * e->interval ? delta : 1;
+        f->drop_next = sr_codel_control_law(e, now, f->count);
+        f->lastcount = f->count;
+    }
+    return i;
+}
+
+/* Next frame of q by DRR over its buckets, new ones first */
+static uint16_t sr_egress_dequeue(struct sr_egress* e, struct sr_egress_q* q,
+                                  uint64_t now)
+{
+    if (q->flow[SR_EGRESS_CTRL].head != SR_EGRESS_NONE)
+        return sr_egress_pop(q, &q->flow[SR_EGRESS_CTRL]);
+    while (1) {
+        struct sr_egress_list* l = q->new_flows.head != SR_EGRESS_NONE ?
+                                   &q->new_flows : &q->old_flows;
+        uint16_t fi = l->head, i;
+        struct sr_egress_flow* f;
+
+        if (fi == SR_EGRESS_NONE)
+            return SR_EGRESS_NONE;
+        f = &q->flow[fi];
+        if (f->deficit <= 0) {
+            f->deficit += e->quantum;
+            sr_egress_list_pop(q, l);
+            sr_egress_list_add(q, &q->old_flows, fi);
+            continue;
+        }
+        i = sr_codel_dequeue(e, q, f, now);
+        if (i == SR_EGRESS_NONE) {
+            /* an emptied new bucket waits its turn on the old list, so
+               a flow cannot stay new by sending one frame at a time */
+            sr_egress_list_pop(q, l);
+            if (l == &q->new_flows && q->old_flows.head != SR_EGRESS_NONE)
+                sr_egress_list_add(q, &q->old_flows, fi);
+            else
+                f->listed = 0;
+            continue;
+        }
+        f->deficit -= q->pkts[i].len;
+        return i;
+    }
+}
+
+/* Queue full: the bucket with the most bytes loses its oldest frame */
+static void sr_egress_overlimit(struct sr_egress_q* q)
+{
+    struct sr_egress_flow* fat = &q->flow[0];
+    unsigned int k;
+    uint16_t i;
+
+    for (k = 1; k < SR_EGRESS_BUCKETS; k++)
+        if (q->flow[k].bytes > fat->bytes)
+            fat = &q->flow[k];
+    if (fat->head == SR_EGRESS_NONE)
+        fat = &q->flow[SR_EGRESS_CTRL];
+    if ((i = sr_egress_pop(q, fat)) == SR_EGRESS_NONE)
+        return;
+    sr_egress_free(q, i);
+    q->overlimit_drops++;
+    sr_stat_inc(SR_STAT_EGRESS_OVERLIMIT);
+}
+
+int sr_egress_send(struct sr_egress* e, const uint8_t* frame, unsigned int len,
+                   const char* iface)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)frame;
+    iov.iov_len = len;
+    return sr_egress_sendv(e, &iov, 1, iface);
+}
+
+int sr_egress_sendv(struct sr_egress* e, const struct iovec* iov, int iovcnt,
+                    const char* iface)
+{
+    return sr_egress_sendv_flow(e, iov, iovcnt, iface,
+                                sr_flow_hash(iov[0].iov_base, iov[0].iov_len));
+}
+
+int sr_egress_sendv_flow(struct sr_egress* e, const struct iovec* iov, int iovcnt,
+                         const char* iface, uint32_t flow)
+{
+    const uint8_t* frame = iov[0].iov_base;
+    struct sr_egress_q* q = NULL;
+    struct sr_egress_flow* f;
+    uint16_t fi, i;
+    unsigned int k, len = 0, at;
+    int v;
+
+    for (v = 0; v < iovcnt; v++)
+        len += iov[v].iov_len;
+
+    for (k = 0; k < e->nq; k++)
+        if (strncmp(e->q[k].name, iface, sr_IFACE_NAMELEN) == 0)
+            q = &e->q[k];
+    if (!q || len > SR_EGRESS_FRAME_MAX) {
+        sr_log_err(SR_LOG_VNS, "egress: cannot queue %u bytes on %s\n", len, iface);
+        sr_stat_inc(SR_STAT_TX_ERRORS);
+        return -1;
+    }
+    /* bits 8-13: the FIB picks paths by the top bits and workers by the
+       low ones, and either would crowd one interface into few buckets */
+    if (((const sr_ethernet_hdr_t*)frame)->ether_type != htons(ethertype_ip))
+        fi = SR_EGRESS_CTRL;
+    else
+        fi = (flow >> 8) & (SR_EGRESS_BUCKETS - 1);
+    f = &q->flow[fi];
+
+    pthread_mutex_lock(&e->lock);
+    if (q->backlog >= e->limit)
+        sr_egress_overlimit(q);
+    i = q->free;
+    q->free = q->pkts[i].next;
+    q->pkts[i].t_enq = sr_tsc();
+    q->pkts[i].len = len;
+    q->pkts[i].next = SR_EGRESS_NONE;
+    for (at = 0, v = 0; v < iovcnt; at += iov[v].iov_len, v++)
+        memcpy(q->pkts[i].frame + at, iov[v].iov_base, iov[v].iov_len);
+
+    if (f->head == SR_EGRESS_NONE)
+        f->head = i;
+    else
+        q->pkts[f->tail].next = i;
+    f->tail = i;
+    f->bytes += len;
+    if (!f->listed && fi != SR_EGRESS_CTRL) {
+        f->listed = 1;
+        f->deficit = e->quantum;
+        sr_egress_list_add(q, &q->new_flows, fi);
+    }
+    q->enqueued++;
+    if (++q->backlog > q->max_backlog)
+        q->max_backlog = q->backlog;
+    pthread_cond_signal(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+}
+
+static void* sr_egress_main(void* arg)
+{
+    struct sr_egress* e = arg;
+    uint8_t frame[SR_EGRESS_FRAME_MAX];
+    unsigned int k;
+
+    pthread_mutex_lock(&e->lock);
+    while (1) {
+        uint64_t now = sr_tsc(), wait = 0;
+        int sent = 0;
+
+        for (k = 0; k < e->nq; k++) {
+            struct sr_egress_q* q = &e->q[k];
+            uint16_t i, len;
+            uint64_t sojourn;
+
+            if (!q->backlog)
+                continue;
+            if (e->ticks_per_byte && now < q->next_tx) {
+                if (!wait || q->next_tx - now < wait)
+                    wait = q->next_tx - now;
+                continue;
+            }
+            if ((i = sr_egress_dequeue(e, q, now)) == SR_EGRESS_NONE)
+                continue;
+
+            len = q->pkts[i].len;
+            memcpy(frame, q->pkts[i].frame, len);
+            sojourn = now - q->pkts[i].t_enq;
+            q->sojourn[sr_hist_bucket(sojourn)]++;
+            q->sent++;
+            sr_egress_free(q, i);
+            if (e->ticks_per_byte) {
+                /* a late wakeup may be made up for, SR_EGRESS_BURST
+                   frames' worth at most */
+                uint64_t floor = now - e->burst;
+                q->next_tx = (q->next_tx > floor ? q->next_tx : floor) +
+                             (uint64_t)(len * e->ticks_per_byte);
+            }
+
+            pthread_mutex_unlock(&e->lock);
+            sr_hist_add(SR_HIST_SOJOURN, sojourn);
+            sr_vns_send(e->sr, frame, len, q->name);
+            pthread_mutex_lock(&e->lock);
+            sent = 1;
+            now = sr_tsc();
+        }
+        if (sent)
+            continue;
+        if (e->stop)
+            break;
+        if (wait) {
+            struct timespec ts;
+            uint64_t ns = wait / e->ticks_per_ns;
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ns += ts.tv_nsec;
+            ts.tv_sec += ns / 1000000000ULL;
+            ts.tv_nsec = ns % 1000000000ULL;
+            pthread_cond_timedwait(&e->cond, &e->lock, &ts);
+        } else {
+            pthread_cond_wait(&e->cond, &e->lock);
+        }
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+static void sr_egress_dump(FILE* fp, void* arg)
+{
+    struct sr_egress* e = arg;
+    unsigned int k;
+
+    pthread_mutex_lock(&e->lock);
+    for (k = 0; k < e->nq; k++) {
+        struct sr_egress_q* q = &e->q[k];
+        fprintf(fp, "egress %-4s sent %llu  codel drop %llu  ecn mark %llu  "
+                "overlimit drop %llu  backlog %u (max %u)\n", q->name,
+                (unsigned long long)q->sent, (unsigned long long)q->codel_drops,
+                (unsigned long long)q->codel_marks,
+                (unsigned long long)q->overlimit_drops, q->backlog, q->max_backlog);
+    }
+    fprintf(fp, "%-8s %10s %9s %9s %9s %9s %9s %9s\n", "sojourn", "count",
+            "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (k = 0; k < e->nq; k++)
+        sr_hist_print(fp, e->q[k].name, e->q[k].sojourn, e->ticks_per_ns);
+    pthread_mutex_unlock(&e->lock);
+}
+
+int sr_egress_start(struct sr_egress* e, struct sr_instance* sr)
+{
+    struct sr_if* iface;
+    unsigned int k, i;
+
+    e->sr = sr;
+    e->ticks_per_ns = sr_stats_ticks_per_ns();
+    e->target = e->target_ms * 1000000ULL * e->ticks_per_ns;
+    e->interval = e->interval_ms * 1000000ULL * e->ticks_per_ns;
+    /* kbit/s is bits per ms: 8e6 / rate ns per byte */
+    e->ticks_per_byte = e->rate_kbps ? 8e6 / e->rate_kbps * e->ticks_per_ns : 0;
+    e->burst = SR_EGRESS_BURST * e->quantum * e->ticks_per_byte;
+
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        struct sr_egress_q* q = &e->q[e->nq];
+
+        if (e->nq == SR_EGRESS_MAX_IFS) {
+            fprintf(stderr, "sr_egress: more than %d interfaces\n", SR_EGRESS_MAX_IFS);
+            return -1;
+        }
+        strncpy(q->name, iface->name, sr_IFACE_NAMELEN);
+        if ((q->pkts = malloc(e->limit * sizeof(struct sr_egress_pkt))) == NULL)
+            return -1;
+        for (i = 0; i < e->limit; i++)
+            q->pkts[i].next = i + 1 < e->limit ? i + 1 : SR_EGRESS_NONE;
+        q->free = 0;
+        for (k = 0; k <= SR_EGRESS_BUCKETS; k++)
+            q->flow[k].head = SR_EGRESS_NONE;
+        q->new_flows.head = q->old_flows.head = SR_EGRESS_NONE;
+        e->nq++;
+    }
+
+    if (pthread_create(&e->thread, NULL, sr_egress_main, e) != 0) {
+        fprintf(stderr, "sr_egress: cannot start egress thread\n");
+        return -1;
+    }
+    e->running = 1;
+    sr_stats_add_dumper(sr_egress_dump, e);
+    return 0;
+}
+
+void sr_egress_destroy(struct sr_egress* e)
+{
+    unsigned int k;
+
+    if (!e)
+        return;
+    sr_stats_del_dumper(sr_egress_dump, e);
+    if (e->running) {
+        pthread_mutex_lock(&e->lock);
+        e->stop = 1;
+        pthread_cond_signal(&e->cond);
+        pthread_mutex_unlock(&e->lock);
+        pthread_join(e->thread, NULL);
+    }
+    for (k = 0; k < e->nq; k++)
+        free(e->q[k].pkts);
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->cond);
+    free(e);
+}
@@ -0,0 +1,91 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_egress.h
+ *
+ * Description:
+ *
+ * Egress queueing (-Q).  Without it sr_send_packet() writes every frame
+ * to the server at once, in whatever order the threads produce them, and
+ * any backlog piles up unmanaged in the socket.  With it each interface
+ * gets a queue in front of the wire and one thread drains them:
+ *
+ *   - frames are spread over SR_EGRESS_BUCKETS flow buckets by their
+ *     symmetric flow hash, and buckets take turns by deficit round robin
+ *     with a quantum of one full frame.  A bucket that just became busy
+ *     goes ahead of the ones with a standing backlog, so sparse flows
+ *     (DNS, interactive traffic) skip the queue built by bulk ones.  ARP
+ *     goes ahead of all of them, so hellos get through congestion;
+ *
+ *   - every bucket runs CoDel: once its frames have waited longer than
+ *     target for a whole interval, frames are dropped at the head at an
+ *     increasing rate until the sojourn time is back under target.
+ *     With ecn=1 an ECN capable IP frame (RFC 3168) is marked CE and
+ *     sent instead, so ECN transports slow down without losing it;
+ *
+ *   - when the interface queue holds limit frames, the next frame costs
+ *     the bucket with the most bytes its oldest frame.
+ *
+ * rate shapes each interface to that many kbit/s, which puts the
+ * bottleneck -- and the queue -- in the router where it can be managed.
+ * Unshaped, the queue forms only when the server socket pushes back,
+ * which with the kernel's send buffer is late: set rate a little under
+ * the real bottleneck to keep the backlog where CoDel can see it.
+ *
+ * Drops, marks and the sojourn time of every frame sent are in the stats
+ * segment (egress_*, histogram "sojourn"); per interface figures are
+ * printed with the counters.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_EGRESS_H
+#define SR_EGRESS_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <sys/uio.h>
+
+#define SR_EGRESS_DEFAULT    "limit=1000,target=5,interval=100,quantum=1514,rate=0,ecn=1"
+#define SR_EGRESS_BUCKETS    64
+#define SR_EGRESS_MAX_IFS    16
+#define SR_EGRESS_FRAME_MAX  1600
+#define SR_EGRESS_BURST      4      /* quanta a shaped interface may catch up */
+
+struct sr_instance;
+struct sr_egress;
+
+/* Parses spec, "on" or key=value pairs overriding SR_EGRESS_DEFAULT:
+   limit (frames per interface), target and interval (ms), quantum
+   (bytes), rate (kbit/s per interface, 0 unshaped) and ecn (1 marks
+   rather than drops what can be marked).  Returns NULL and
+   complains on a bad spec. */
+struct sr_egress* sr_egress_create(const char* spec);
+
+/* Sets up a queue per interface of sr and starts the thread draining
+   them into the server socket.  Returns 0 or -1. */
+int sr_egress_start(struct sr_egress* e, struct sr_instance* sr);
+
+/* Queues a frame for iface.  Returns 0, or -1 if it was dropped. */
+int sr_egress_send(struct sr_egress* e, const uint8_t* frame, unsigned int len,
+                   const char* iface);
+
+/* sr_egress_send() of a frame in iovcnt pieces, gathered into its slot.
+   The first must hold the Ethernet and IP headers. */
+int sr_egress_sendv(struct sr_egress* e, const struct iovec* iov, int iovcnt,
+                    const char* iface);
+
+/* sr_egress_sendv() into the bucket of flow, an sr_flow_hash() taken by
+   the caller.  For fragments the router makes: hashed one by one they
+   have no ports, and would be queued apart from, and reordered against,
+   the unfragmented packets of their flow. */
+int sr_egress_sendv_flow(struct sr_egress* e, const struct iovec* iov, int iovcnt,
+                         const char* iface, uint32_t flow);
+
+/* Stops the thread, drops what is still queued and frees e. */
+void sr_egress_destroy(struct sr_egress* e);
+
+#endif /* -- SR_EGRESS_H -- */
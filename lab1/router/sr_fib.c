@@ -0,0 +1,220 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.c
+ *
+ * Description:
+ *
+ * Building the forwarding table.  Buckets are handed out by cumulative
+ * weight, so each path owns one contiguous run of buckets within a
+ * bucket of its exact share.  Lookups use the top bits of the flow hash:
+ * -W picks workers by its low bits, and using the same bits would leave
+ * each worker seeing only some of the paths.
+ *
+ * A flow whose path is down probes the buckets again from a point set by
+ * the middle bits of its hash, so the stranded flows spread over the
+ * survivors by weight instead of all landing on the next path along.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_router.h"
+#include "sr_lpm.h"
+#include "sr_nbr.h"
+#include "sr_stats.h"
+#include "sr_fib.h"
+
+/* Prefix length of a contiguous mask (host order), or -1 */
+static int sr_fib_mask_len(uint32_t mask)
+{
+    int len = mask ? __builtin_popcount(mask) : 0;
+
+    if (len && mask != 0xffffffffU << (32 - len))
+        return -1;
+    return len;
+}
+
+static void sr_fib_spread(struct sr_fib_entry* e)
+{
+    unsigned int total = 0, cum, b, i;
+
+    for (i = 0; i < e->npaths; i++)
+        total += e->path[i].weight;
+    for (b = 0; b < SR_FIB_BUCKETS; b++) {
+        /* the path whose share covers the middle of bucket b */
+        unsigned long mid = ((unsigned long)(2 * b + 1) * total) / (2 * SR_FIB_BUCKETS);
+        for (i = 0, cum = e->path[0].weight; i + 1 < e->npaths && mid >= cum; )
+            cum += e->path[++i].weight;
+        e->bucket[b] = i;
+    }
+}
+
+/* Points each entry at its longest covering prefix */
+static void sr_fib_link_parents(struct sr_fib* fib)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < fib->nentries; i++) {
+        struct sr_fib_entry* e = &fib->entries[i];
+        for (j = 0; j < fib->nentries; j++) {
+            const struct sr_fib_entry* p = &fib->entries[j];
+            uint32_t mask = p->len ? 0xffffffffU << (32 - p->len) : 0;
+            if (p->len < e->len && (e->prefix & mask) == p->prefix &&
+                (!e->parent || p->len > e->parent->len))
+                e->parent = p;
+        }
+    }
+}
+
+/* Drops backups that share a neighbor with a primary path; an entry made
+   only of backups uses them as its primaries */
+static void sr_fib_check_backups(struct sr_fib_entry* e)
+{
+    unsigned int i, j, n = 0;
+
+    if (e->npaths == 0) {
+        for (i = 0; i < e->nbackups; i++) {
+            e->path[e->npaths] = e->backup[i];
+            e->path[e->npaths++].weight = 1;
+        }
+        e->nbackups = 0;
+        return;
+    }
+    for (i = 0; i < e->nbackups; i++) {
+        for (j = 0; j < e->npaths; j++)
+            if (e->backup[i].nbr && e->backup[i].nbr == e->path[j].nbr)
+                break;
+        if (j < e->npaths) {
+            struct in_addr a;
+            a.s_addr = e->backup[i].gw;
+            fprintf(stderr, "sr_fib: backup via %s is also a primary path, ignoring it\n",
+                    inet_ntoa(a));
+            continue;
+        }
+        e->backup[n++] = e->backup[i];
+    }
+    e->nbackups = n;
+}
+
+struct sr_fib* sr_fib_build(struct sr_instance* sr)
+{
+    struct sr_fib* fib;
+    struct sr_rt* rt;
+    unsigned int nroutes = 0, i;
+
+    for (rt = sr->routing_table; rt; rt = rt->next)
+        nroutes++;
+    if ((fib = calloc(1, sizeof(struct sr_fib))) == NULL ||
+        (fib->lpm = sr_lpm_create()) == NULL ||
+        (fib->entries = calloc(nroutes ? nroutes : 1,
+                               sizeof(struct sr_fib_entry))) == NULL) {
+        sr_fib_destroy(fib);
+        return NULL;
+    }
+
+    for (rt = sr->routing_table; rt; rt = rt->next) {
+        uint32_t mask = ntohl(rt->mask.s_addr);
+        uint32_t prefix = ntohl(rt->dest.s_addr) & mask;
+        int len = sr_fib_mask_len(mask);
+        struct sr_if* iface = sr_get_interface(sr, rt->interface);
+        struct sr_fib_entry* e;
+        struct sr_nexthop* nh;
+
+        if (len < 0 || !iface) {
+            fprintf(stderr, "sr_fib: skipping route to %s via %s: %s\n",
+                    inet_ntoa(rt->dest), rt->interface,
+                    len < 0 ? "non-contiguous mask" : "no such interface");
+            continue;
+        }
+        for (i = 0; i < fib->nentries; i++)
+            if (fib->entries[i].prefix == prefix && fib->entries[i].len == (unsigned)len)
+                break;
+        e = &fib->entries[i];
+        if (i == fib->nentries) {
+            fib->nentries++;
+            e->prefix = prefix;
+            e->len = len;
+        }
+        if (rt->weight ? e->npaths == SR_FIB_MAX_PATHS :
+                         e->nbackups == SR_FIB_MAX_BACKUPS) {
+            fprintf(stderr, "sr_fib: more than %d %s to %s/%d, ignoring the rest\n",
+                    rt->weight ? SR_FIB_MAX_PATHS : SR_FIB_MAX_BACKUPS,
+                    rt->weight ? "paths" : "backups", inet_ntoa(rt->dest), len);
+            continue;
+        }
+        nh = rt->weight ? &e->path[e->npaths++] : &e->backup[e->nbackups++];
+        nh->gw = rt->gw.s_addr;
+        nh->iface = iface;
+        nh->weight = rt->weight;
+        nh->nbr = NULL;
+        if (nh->gw && sr->nbrs &&
+            (nh->nbr = sr_nbr_get(sr->nbrs, nh->gw, iface)) == NULL)
+            fprintf(stderr, "sr_fib: more than %d gateways, %s is assumed up\n",
+                    SR_NBR_MAX, inet_ntoa(rt->gw));
+    }
+
+    sr_fib_link_parents(fib);
+    for (i = 0; i < fib->nentries; i++) {
+        sr_fib_check_backups(&fib->entries[i]);
+        sr_fib_spread(&fib->entries[i]);
+        if (sr_lpm_insert(fib->lpm, fib->entries[i].prefix, fib->entries[i].len,
+                          &fib->entries[i]) != 0) {
+            sr_fib_destroy(fib);
+            return NULL;
+        }
+    }
+    return fib;
+}
+
+/* The flow's own next hop is down: first live surviving path, backup or
+   covering route, or dead itself if there is none */
+static const struct sr_nexthop* sr_fib_alternate(const struct sr_fib_entry* e,
+                                                 uint32_t hash,
+                                                 const struct sr_nexthop* dead)
+{
+    unsigned int start = hash >> 13, i;
+
+    for (; e; e = e->parent) {
+        for (i = 0; i < SR_FIB_BUCKETS; i++) {
+            const struct sr_nexthop* nh =
+                &e->path[e->bucket[(start + i) & (SR_FIB_BUCKETS - 1)]];
+            if (sr_nbr_up(nh->nbr)) {
+                sr_stat_inc(SR_STAT_FIB_ALTERNATE);
+                return nh;
+            }
+        }
+        for (i = 0; i < e->nbackups; i++)
+            if (sr_nbr_up(e->backup[i].nbr)) {
+                sr_stat_inc(SR_STAT_FIB_ALTERNATE);
+                return &e->backup[i];
+            }
+    }
+    return dead;
+}
+
+const struct sr_nexthop* sr_fib_lookup(const struct sr_fib* fib, uint32_t dest,
+                                       uint32_t hash)
+{
+    const struct sr_fib_entry* e = sr_lpm_lookup(fib->lpm, dest);
+    const struct sr_nexthop* nh;
+
+    if (!e)
+        return NULL;
+    nh = &e->path[e->bucket[hash >> (32 - SR_FIB_BUCKET_BITS)]];
+    if (sr_nbr_up(nh->nbr))
+        return nh;
+    return sr_fib_alternate(e, hash, nh);
+}
+
+void sr_fib_destroy(struct sr_fib* fib)
+{
+    if (!fib)
+        return;
+    sr_lpm_destroy(fib->lpm, NULL);
+    free(fib->entries);
+    free(fib);
+}
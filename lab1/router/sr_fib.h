@@ -0,0 +1,92 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.h
+ *
+ * Description:
+ *
+ * Forwarding table compiled from the routing table by sr_init_interfaces()
+ * once the interfaces are known.  Routes with the same destination and
+ * mask are merged into one entry with up to SR_FIB_MAX_PATHS equal-cost
+ * next hops.  A packet's next hop is
+ * picked by its symmetric flow hash (sr_flow_hash), so every packet of a
+ * flow, in both directions, takes the same path while different flows
+ * spread over all of them.
+ *
+ * Each entry spreads SR_FIB_BUCKETS hash buckets over its paths in
+ * proportion to their weights (optional fifth rtable column, default 1);
+ * weights therefore resolve to 1/SR_FIB_BUCKETS of the traffic.
+ *
+ * Failover is precomputed too.  A route of weight 0 is a backup for its
+ * prefix, and every entry links to the entry of its longest covering
+ * prefix.  When the next hop a flow hashes to is down (sr_nbr.h), the
+ * flow moves to a surviving equal-cost path, then to the first live
+ * backup, then on up the covering prefixes; flows on live paths stay
+ * where they are.  A backup through a neighbor a primary path already
+ * uses would fail with it and is dropped when the FIB is built.  There
+ * is no topology here to prove an alternate loop-free: like any static
+ * route that is up to whoever writes the rtable.
+ *
+ * The FIB is read-only once built and shared by every forwarding thread.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_FIB_MAX_PATHS    8
+#define SR_FIB_MAX_BACKUPS  4
+#define SR_FIB_BUCKET_BITS  6
+#define SR_FIB_BUCKETS      (1 << SR_FIB_BUCKET_BITS)
+
+struct sr_instance;
+struct sr_if;
+struct sr_lpm;
+struct sr_nbr;
+
+struct sr_nexthop
+{
+    uint32_t gw;                /* network order, 0 for an on-link route */
+    struct sr_if* iface;
+    unsigned int weight;
+    struct sr_nbr* nbr;         /* liveness of gw, NULL when on-link */
+};
+
+struct sr_fib_entry
+{
+    uint32_t prefix;            /* host order */
+    unsigned int len;
+    unsigned int npaths;
+    struct sr_nexthop path[SR_FIB_MAX_PATHS];
+    uint8_t bucket[SR_FIB_BUCKETS];  /* path index per hash bucket */
+    unsigned int nbackups;
+    struct sr_nexthop backup[SR_FIB_MAX_BACKUPS];
+    const struct sr_fib_entry* parent;  /* longest covering prefix */
+};
+
+struct sr_fib
+{
+    struct sr_lpm* lpm;         /* prefix -> struct sr_fib_entry */
+    struct sr_fib_entry* entries;
+    unsigned int nentries;
+};
+
+/* Compiles sr->routing_table.  Routes through unknown interfaces and
+   non-contiguous masks are reported and skipped. */
+struct sr_fib* sr_fib_build(struct sr_instance* sr);
+
+/* Next hop for dest (host order) and a packet of flow hash, or NULL if
+   there is no route.  If no next hop for dest is up, the one the flow
+   hashes to is returned anyway and ARP has the last word. */
+const struct sr_nexthop* sr_fib_lookup(const struct sr_fib* fib, uint32_t dest,
+                                       uint32_t hash);
+
+void sr_fib_destroy(struct sr_fib* fib);
+
+#endif /* -- SR_FIB_H -- */
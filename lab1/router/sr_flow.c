@@ -0,0 +1,583 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flow.c
+ *
+ * Description:
+ *
+ * Flow table and IPFIX exporter, see sr_flow.h.  A flow hashes to one
+ * bucket of SR_FLOW_WAYS records and lives in any free way of it; a
+ * bucket is guarded by a spin lock held for a few compares, which only
+ * contends when two threads account the same bucket or the sweep passes
+ * by.  A full bucket gives up the way idle longest, and the flow in it
+ * waits on the pending list for the export thread.
+ *
+ * The export thread ticks the table clock every SR_FLOW_TICK_MS and
+ * sweeps the part of the table that brings it round once a second.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_flow.h"
+
+/* IPFIX information elements of a record, in order */
+#define SR_FLOW_TEMPLATE_ID  256
+#define SR_FLOW_REC_LEN      55
+
+/* flowEndReason */
+enum { SR_FLOW_END_IDLE = 1, SR_FLOW_END_ACTIVE = 2, SR_FLOW_END_FIN = 3,
+       SR_FLOW_END_FORCED = 4, SR_FLOW_END_EVICTED = 5 };
+
+static const uint16_t sr_flow_template[][2] = {
+    { 8, 4 },                   /* sourceIPv4Address */
+    { 12, 4 },                  /* destinationIPv4Address */
+    { 7, 2 },                   /* sourceTransportPort */
+    { 11, 2 },                  /* destinationTransportPort */
+    { 4, 1 },                   /* protocolIdentifier */
+    { 6, 1 },                   /* tcpControlBits */
+    { 10, 4 },                  /* ingressInterface */
+    { 2, 8 },                   /* packetDeltaCount */
+    { 1, 8 },                   /* octetDeltaCount */
+    { 152, 8 },                 /* flowStartMilliseconds */
+    { 153, 8 },                 /* flowEndMilliseconds */
+    { 34, 4 },                  /* samplingInterval */
+    { 136, 1 },                 /* flowEndReason */
+};
+#define SR_FLOW_FIELDS (sizeof(sr_flow_template) / sizeof(sr_flow_template[0]))
+
+union sr_flow_key
+{
+    struct {
+        uint32_t src, dst;      /* network order */
+        uint16_t sport, dport;  /* host order */
+        uint8_t proto, iface, pad[2];
+    } f;
+    uint64_t w[2];
+};
+
+struct sr_flow_rec
+{
+    union sr_flow_key key;
+    uint64_t pkts, bytes;
+    uint64_t first_ms, last_ms;
+    uint8_t tcp_flags;
+    uint8_t used;
+};
+
+struct sr_flow_bucket
+{
+    int lock;
+    struct sr_flow_rec way[SR_FLOW_WAYS];
+} __attribute__((aligned(64)));
+
+struct sr_flows
+{
+    struct sr_flow_bucket* buckets;
+    uint32_t nbuckets;          /* power of two */
+    uint64_t now_ms;            /* table clock, ticked by the thread */
+    char ifaces[SR_FLOW_MAX_IFACES][sr_IFACE_NAMELEN];
+    unsigned int nifaces;       /* interface i is ingressInterface i + 1 */
+
+    /* flows pushed out of full buckets */
+    pthread_mutex_t lock;
+    struct sr_flow_rec* pending;
+    unsigned int npending;
+    struct sr_flow_rec* spare;  /* the export thread's */
+
+    /* configuration */
+    unsigned long sample, idle_s, active_s, entries;
+    char path[256];
+    struct sockaddr_in collector;
+
+    /* export thread; everything below is its own */
+    FILE* fp;
+    int sock;
+    uint32_t sweep;             /* next bucket to sweep */
+    uint8_t msg[SR_FLOW_MSG_MAX];
+    unsigned int msg_len, msg_recs;
+    uint32_t seq;               /* records exported before this message */
+    uint64_t msg_ms;            /* when the open message was started */
+    uint64_t exported, messages;
+    int stop;
+    int running;
+    pthread_t thread;
+};
+
+static __thread uint32_t sr_flow_rng;
+
+static uint64_t sr_flow_clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sr_flow_lock(struct sr_flow_bucket* b)
+{
+    while (__atomic_exchange_n(&b->lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&b->lock, __ATOMIC_RELAXED))
+            ;
+}
+
+static void sr_flow_unlock(struct sr_flow_bucket* b)
+{
+    __atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+}
+
+/*---------------------------------------------------------------------
+ * Export
+ *---------------------------------------------------------------------*/
+
+static uint8_t* sr_flow_put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static uint8_t* sr_flow_put32(uint8_t* p, uint32_t v)
+{
+    p = sr_flow_put16(p, v >> 16);
+    return sr_flow_put16(p, v);
+}
+
+static uint8_t* sr_flow_put64(uint8_t* p, uint64_t v)
+{
+    p = sr_flow_put32(p, v >> 32);
+    return sr_flow_put32(p, v);
+}
+
+/* Message header, the template set and the data set header */
+static void sr_flow_msg_begin(struct sr_flows* f)
+{
+    uint8_t* p = f->msg + 16;
+    unsigned int i;
+
+    p = sr_flow_put16(p, 2);
+    p = sr_flow_put16(p, 4 + 4 + 4 * SR_FLOW_FIELDS);
+    p = sr_flow_put16(p, SR_FLOW_TEMPLATE_ID);
+    p = sr_flow_put16(p, SR_FLOW_FIELDS);
+    for (i = 0; i < SR_FLOW_FIELDS; i++) {
+        p = sr_flow_put16(p, sr_flow_template[i][0]);
+        p = sr_flow_put16(p, sr_flow_template[i][1]);
+    }
+    p = sr_flow_put16(p, SR_FLOW_TEMPLATE_ID);
+    p += 2;                     /* data set length, at flush */
+    f->msg_len = p - f->msg;
+    f->msg_recs = 0;
+    f->msg_ms = __atomic_load_n(&f->now_ms, __ATOMIC_RELAXED);
+}
+
+static void sr_flow_msg_flush(struct sr_flows* f)
+{
+    unsigned int set_off = 16 + 4 + 4 + 4 * SR_FLOW_FIELDS;
+    uint8_t* p = f->msg;
+
+    if (!f->msg_recs)
+        return;
+    p = sr_flow_put16(p, 10);
+    p = sr_flow_put16(p, f->msg_len);
+    p = sr_flow_put32(p, time(NULL));
+    p = sr_flow_put32(p, f->seq);
+    sr_flow_put32(p, 0);
+    sr_flow_put16(f->msg + set_off + 2, f->msg_len - set_off);
+
+    if (f->fp) {
+        if (fwrite(f->msg, f->msg_len, 1, f->fp) != 1)
+            sr_stat_add(SR_STAT_DROP_FLOW_EXPORT, f->msg_recs);
+        fflush(f->fp);
+    } else if (send(f->sock, f->msg, f->msg_len, 0) < 0) {
+        sr_stat_add(SR_STAT_DROP_FLOW_EXPORT, f->msg_recs);
+    }
+    f->seq += f->msg_recs;
+    f->messages++;
+    sr_flow_msg_begin(f);
+}
+
+static void sr_flow_export(struct sr_flows* f, const struct sr_flow_rec* r,
+                           uint8_t reason)
+{
+    uint8_t* p;
+
+    if (f->msg_len + SR_FLOW_REC_LEN > SR_FLOW_MSG_MAX)
+        sr_flow_msg_flush(f);
+    p = f->msg + f->msg_len;
+    p = sr_flow_put32(p, ntohl(r->key.f.src));
+    p = sr_flow_put32(p, ntohl(r->key.f.dst));
+    p = sr_flow_put16(p, r->key.f.sport);
+    p = sr_flow_put16(p, r->key.f.dport);
+    *p++ = r->key.f.proto;
+    *p++ = r->tcp_flags;
+    p = sr_flow_put32(p, r->key.f.iface);
+    p = sr_flow_put64(p, r->pkts);
+    p = sr_flow_put64(p, r->bytes);
+    p = sr_flow_put64(p, r->first_ms);
+    p = sr_flow_put64(p, r->last_ms);
+    p = sr_flow_put32(p, f->sample);
+    *p++ = reason;
+    f->msg_len = p - f->msg;
+    f->msg_recs++;
+    f->exported++;
+    sr_stat_inc(SR_STAT_FLOW_EXPORTED);
+}
+
+/* Why r should go now, or 0 */
+static uint8_t sr_flow_expired(struct sr_flows* f, const struct sr_flow_rec* r,
+                               uint64_t now)
+{
+    if (r->tcp_flags & (TCP_FIN | TCP_RST))
+        return SR_FLOW_END_FIN;
+    /* the clock is wall time, and may step back */
+    if (now < r->last_ms)
+        return 0;
+    if (now - r->last_ms >= f->idle_s * 1000)
+        return SR_FLOW_END_IDLE;
+    if (now - r->first_ms >= f->active_s * 1000)
+        return SR_FLOW_END_ACTIVE;
+    return 0;
+}
+
+/* Exports what is due in n buckets from f->sweep, or every flow if
+   force.  Records are copied out so the lock is not held while they
+   are encoded. */
+static void sr_flow_sweep(struct sr_flows* f, uint32_t n, int force)
+{
+    uint64_t now = __atomic_load_n(&f->now_ms, __ATOMIC_RELAXED);
+    struct sr_flow_rec out[SR_FLOW_WAYS];
+    uint8_t why[SR_FLOW_WAYS];
+    unsigned int w, k;
+
+    while (n--) {
+        struct sr_flow_bucket* b = &f->buckets[f->sweep];
+        f->sweep = (f->sweep + 1) & (f->nbuckets - 1);
+
+        k = 0;
+        sr_flow_lock(b);
+        for (w = 0; w < SR_FLOW_WAYS; w++) {
+            struct sr_flow_rec* r = &b->way[w];
+            if (!r->used)
+                continue;
+            why[k] = force ? SR_FLOW_END_FORCED : sr_flow_expired(f, r, now);
+            if (why[k]) {
+                out[k++] = *r;
+                r->used = 0;
+            }
+        }
+        sr_flow_unlock(b);
+        for (w = 0; w < k; w++)
+            sr_flow_export(f, &out[w], why[w]);
+    }
+}
+
+/* Swaps the pending list for the spare one and exports it */
+static void sr_flow_drain_pending(struct sr_flows* f)
+{
+    struct sr_flow_rec* out;
+    unsigned int n, i;
+
+    pthread_mutex_lock(&f->lock);
+    out = f->pending;
+    n = f->npending;
+    f->pending = f->spare;
+    f->spare = out;
+    f->npending = 0;
+    pthread_mutex_unlock(&f->lock);
+    for (i = 0; i < n; i++)
+        sr_flow_export(f, &out[i], SR_FLOW_END_EVICTED);
+}
+
+static void* sr_flow_main(void* arg)
+{
+    struct sr_flows* f = arg;
+    struct timespec tick;
+    uint32_t slice = f->nbuckets / (1000 / SR_FLOW_TICK_MS);
+
+    tick.tv_sec = 0;
+    tick.tv_nsec = SR_FLOW_TICK_MS * 1000000L;
+    if (!slice)
+        slice = 1;
+    while (!__atomic_load_n(&f->stop, __ATOMIC_RELAXED)) {
+        nanosleep(&tick, NULL);
+        __atomic_store_n(&f->now_ms, sr_flow_clock_ms(), __ATOMIC_RELAXED);
+        sr_flow_drain_pending(f);
+        sr_flow_sweep(f, slice, 0);
+        /* a record waits at most a second for its message to fill */
+        if (f->now_ms - f->msg_ms >= 1000)
+            sr_flow_msg_flush(f);
+    }
+    return NULL;
+}
+
+/*---------------------------------------------------------------------
+ * Setup
+ *---------------------------------------------------------------------*/
+
+static const char* sr_flow_keys[] = { "sample", "idle", "active", "entries",
+                                      "file", "udp" };
+
+static int sr_flow_parse(struct sr_flows* f, const char* spec)
+{
+    unsigned long* field[4];
+    const char* p;
+
+    field[0] = &f->sample;
+    field[1] = &f->idle_s;
+    field[2] = &f->active_s;
+    field[3] = &f->entries;
+
+    for (p = spec; *p; ) {
+        const char* end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        const char* eq = memchr(p, '=', len);
+        size_t vlen;
+        char val[256], *q;
+        int k;
+
+        if (!eq)
+            return -1;
+        for (k = 0; k < 6; k++)
+            if (strlen(sr_flow_keys[k]) == (size_t)(eq - p) &&
+                strncmp(p, sr_flow_keys[k], eq - p) == 0)
+                break;
+        vlen = p + len - (eq + 1);
+        if (k == 6 || vlen == 0 || vlen >= sizeof(val))
+            return -1;
+        memcpy(val, eq + 1, vlen);
+        val[vlen] = '\0';
+
+        if (k < 4) {
+            *field[k] = strtoul(val, &q, 10);
+            if (*q != '\0')
+                return -1;
+        } else if (k == 4) {
+            strcpy(f->path, val);
+        } else {
+            char* colon = strchr(val, ':');
+            if (!colon)
+                return -1;
+            *colon = '\0';
+            f->collector.sin_family = AF_INET;
+            f->collector.sin_port = htons(strtoul(colon + 1, &q, 10));
+            if (*q != '\0' || inet_pton(AF_INET, val, &f->collector.sin_addr) != 1)
+                return -1;
+        }
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    return 0;
+}
+
+static void sr_flow_dump(FILE* fp, void* arg)
+{
+    struct sr_flows* f = arg;
+    unsigned int i, w, active = 0;
+
+    for (i = 0; i < f->nbuckets; i++)
+        for (w = 0; w < SR_FLOW_WAYS; w++)
+            active += __atomic_load_n(&f->buckets[i].way[w].used, __ATOMIC_RELAXED);
+    fprintf(fp, "flows %u active of %lu, 1 in %lu sampled, %llu exported in "
+            "%llu messages to %s\n", active, f->entries, f->sample,
+            (unsigned long long)f->exported, (unsigned long long)f->messages,
+            f->path[0] ? f->path : inet_ntoa(f->collector.sin_addr));
+}
+
+struct sr_flows* sr_flows_create(const char* spec)
+{
+    struct sr_flows* f = calloc(1, sizeof(struct sr_flows));
+    void* mem;
+
+    if (!f)
+        return NULL;
+    f->sock = -1;
+    if (sr_flow_parse(f, SR_FLOW_DEFAULT) != 0 || sr_flow_parse(f, spec) != 0 ||
+        !f->path[0] == !f->collector.sin_family || f->sample == 0 ||
+        f->idle_s == 0 || f->active_s == 0 || f->entries < SR_FLOW_WAYS) {
+        fprintf(stderr, "bad flow export spec '%s', expected file=PATH or "
+                "udp=A.B.C.D:PORT and sample|idle|active|entries=N,...\n", spec);
+        free(f);
+        return NULL;
+    }
+
+    f->nbuckets = 1;
+    while (f->nbuckets * SR_FLOW_WAYS < f->entries)
+        f->nbuckets <<= 1;
+    f->entries = f->nbuckets * SR_FLOW_WAYS;
+    if (posix_memalign(&mem, 64, f->nbuckets * sizeof(struct sr_flow_bucket)) == 0)
+        f->buckets = mem;
+    f->pending = malloc(SR_FLOW_PENDING * sizeof(struct sr_flow_rec));
+    f->spare = malloc(SR_FLOW_PENDING * sizeof(struct sr_flow_rec));
+    if (!f->buckets || !f->pending || !f->spare) {
+        fprintf(stderr, "sr_flow: out of memory\n");
+        free(f->buckets);
+        free(f->pending);
+        free(f->spare);
+        free(f);
+        return NULL;
+    }
+    memset(f->buckets, 0, f->nbuckets * sizeof(struct sr_flow_bucket));
+
+    if (f->path[0]) {
+        if ((f->fp = fopen(f->path, "wb")) == NULL)
+            perror(f->path);
+    } else if ((f->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+               connect(f->sock, (struct sockaddr*)&f->collector,
+                       sizeof(f->collector)) != 0) {
+        perror("sr_flow: collector");
+        if (f->sock >= 0)
+            close(f->sock);
+        f->sock = -1;
+    }
+    if (!f->fp && f->sock < 0) {
+        free(f->pending);
+        free(f->spare);
+        free(f->buckets);
+        free(f);
+        return NULL;
+    }
+
+    pthread_mutex_init(&f->lock, NULL);
+    f->now_ms = sr_flow_clock_ms();
+    sr_flow_msg_begin(f);
+    if (pthread_create(&f->thread, NULL, sr_flow_main, f) != 0) {
+        fprintf(stderr, "sr_flow: cannot start export thread\n");
+        sr_flows_destroy(f);
+        return NULL;
+    }
+    f->running = 1;
+    sr_stats_add_dumper(sr_flow_dump, f);
+    return f;
+}
+
+void sr_flows_destroy(struct sr_flows* f)
+{
+    if (!f)
+        return;
+    sr_stats_del_dumper(sr_flow_dump, f);
+    if (f->running) {
+        __atomic_store_n(&f->stop, 1, __ATOMIC_RELAXED);
+        pthread_join(f->thread, NULL);
+    }
+    sr_flow_drain_pending(f);
+    f->sweep = 0;
+    sr_flow_sweep(f, f->nbuckets, 1);
+    sr_flow_msg_flush(f);
+    if (f->fp)
+        fclose(f->fp);
+    if (f->sock >= 0)
+        close(f->sock);
+    pthread_mutex_destroy(&f->lock);
+    free(f->pending);
+    free(f->spare);
+    free(f->buckets);
+    free(f);
+}
+
+/*---------------------------------------------------------------------
+ * Accounting
+ *---------------------------------------------------------------------*/
+
+static unsigned int sr_flow_iface(struct sr_flows* f, const char* name)
+{
+    unsigned int i, n = __atomic_load_n(&f->nifaces, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < n; i++)
+        if (strncmp(f->ifaces[i], name, sr_IFACE_NAMELEN) == 0)
+            return i + 1;
+
+    /* first packet from this interface */
+    pthread_mutex_lock(&f->lock);
+    for (i = 0; i < f->nifaces; i++)
+        if (strncmp(f->ifaces[i], name, sr_IFACE_NAMELEN) == 0)
+            break;
+    if (i == f->nifaces && i < SR_FLOW_MAX_IFACES) {
+        strncpy(f->ifaces[i], name, sr_IFACE_NAMELEN - 1);
+        __atomic_store_n(&f->nifaces, i + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return i < SR_FLOW_MAX_IFACES ? i + 1 : 0;
+}
+
+void sr_flow_account(struct sr_flows* f, const uint8_t* ip_packet,
+                     unsigned int len, const char* iface)
+{
+    const sr_ip_hdr_t* ip_hdr = (const sr_ip_hdr_t*)ip_packet;
+    struct sr_flow_bucket* b;
+    struct sr_flow_rec* r;
+    union sr_flow_key key;
+    unsigned int hl = ip_hdr->ip_hl * 4, w, victim = 0;
+    uint8_t flags = 0;
+    uint64_t h, now;
+
+    if (!f)
+        return;
+    if (f->sample > 1) {
+        uint32_t x = sr_flow_rng ? sr_flow_rng : (uint32_t)(uintptr_t)&key | 1;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        sr_flow_rng = x;
+        if (x % f->sample)
+            return;
+    }
+
+    key.w[0] = key.w[1] = 0;
+    key.f.src = ip_hdr->ip_src;
+    key.f.dst = ip_hdr->ip_dst;
+    key.f.proto = ip_hdr->ip_p;
+    key.f.iface = sr_flow_iface(f, iface);
+    if ((ip_hdr->ip_p == ip_protocol_tcp || ip_hdr->ip_p == IPPROTO_UDP) &&
+        !(ntohs(ip_hdr->ip_off) & IP_OFFMASK) && len >= hl + 4) {
+        key.f.sport = ip_packet[hl] << 8 | ip_packet[hl + 1];
+        key.f.dport = ip_packet[hl + 2] << 8 | ip_packet[hl + 3];
+        if (ip_hdr->ip_p == ip_protocol_tcp && len >= hl + sizeof(sr_tcp_hdr_t))
+            flags = ((const sr_tcp_hdr_t*)(ip_packet + hl))->tcp_flags;
+    }
+
+    h = (key.w[0] ^ key.w[1] * 0x9e3779b97f4a7c15ULL) * 0xff51afd7ed558ccdULL;
+    b = &f->buckets[(h >> 32) & (f->nbuckets - 1)];
+    now = __atomic_load_n(&f->now_ms, __ATOMIC_RELAXED);
+
+    sr_flow_lock(b);
+    for (w = 0; w < SR_FLOW_WAYS; w++) {
+        r = &b->way[w];
+        if (r->used && r->key.w[0] == key.w[0] && r->key.w[1] == key.w[1])
+            break;
+        /* a free way, or else the one idle longest */
+        if (!r->used)
+            victim = w;
+        else if (b->way[victim].used && r->last_ms < b->way[victim].last_ms)
+            victim = w;
+    }
+
+    if (w == SR_FLOW_WAYS) {
+        r = &b->way[victim];
+        if (r->used) {
+            pthread_mutex_lock(&f->lock);
+            if (f->npending < SR_FLOW_PENDING)
+                f->pending[f->npending++] = *r;
+            else
+                sr_stat_inc(SR_STAT_DROP_FLOW_EXPORT);
+            pthread_mutex_unlock(&f->lock);
+            sr_stat_inc(SR_STAT_FLOW_EVICTED);
+        }
+        r->key = key;
+        r->pkts = r->bytes = 0;
+        r->first_ms = now;
+        r->tcp_flags = 0;
+        r->used = 1;
+    }
+    r->pkts++;
+    r->bytes += len;
+    r->last_ms = now;
+    r->tcp_flags |= flags;
+    sr_flow_unlock(b);
+}
@@ -0,0 +1,60 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flow.h
+ *
+ * Description:
+ *
+ * Flow telemetry (-E).  Forwarded packets are accounted per flow --
+ * source and destination address and port, protocol and input interface
+ * -- in a fixed size set associative table: packets, bytes, the OR of
+ * TCP flags and the times of the first and last packet.  With sample=N
+ * only one packet in N, picked at random, is accounted.
+ *
+ * A flow is exported when it has been idle for idle seconds, has lasted
+ * active seconds, has seen a FIN or RST, or is pushed out of a full
+ * bucket by a new flow.  Records go out as IPFIX (RFC 7011) messages of
+ * at most SR_FLOW_MSG_MAX bytes, each carrying its template, to a file
+ * (an IPFIX file in the sense of RFC 5655) or a UDP collector.  Counts
+ * are as sampled; every record carries the sampling interval to scale
+ * them by.  The table never blocks a packet on export: one thread sweeps
+ * it and does all the encoding and I/O.
+ *
+ * spec is key=value pairs overriding SR_FLOW_DEFAULT, with exactly one
+ * of file=PATH or udp=A.B.C.D:PORT:
+ *
+ *   udp=127.0.0.1:4739,sample=100,idle=15,active=60,entries=65536
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FLOW_H
+#define SR_FLOW_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_FLOW_DEFAULT      "sample=1,idle=15,active=60,entries=65536"
+#define SR_FLOW_WAYS         4          /* flows per bucket */
+#define SR_FLOW_TICK_MS      100        /* clock and sweep granularity */
+#define SR_FLOW_MSG_MAX      1400       /* bytes, fits a UDP datagram */
+#define SR_FLOW_PENDING      4096       /* evicted flows awaiting export */
+#define SR_FLOW_MAX_IFACES   16
+
+struct sr_flows;
+
+/* Parses spec, opens the file or the collector socket and starts the
+   export thread.  Returns NULL and complains on a bad spec. */
+struct sr_flows* sr_flows_create(const char* spec);
+
+/* Accounts an IP packet of len bytes received on iface.  A NULL table
+   does nothing.  Thread safe. */
+void sr_flow_account(struct sr_flows* f, const uint8_t* ip_packet,
+                     unsigned int len, const char* iface);
+
+/* Stops the thread, exports every flow still in the table and frees f. */
+void sr_flows_destroy(struct sr_flows* f);
+
+#endif /* -- SR_FLOW_H -- */
@@ -0,0 +1,438 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_frag.c
+ *
+ * Description:
+ *
+ * IP fragmentation and reassembly, see sr_frag.h.  Fragments are cut on
+ * 8-byte boundaries as large as the MTU allows and handed to
+ * sr_send_packetv() as a header built on the stack and a pointer into
+ * the original datagram.  Reassembly takes one lock for the table; a
+ * datagram's payload is grown in place as fragments further into it
+ * arrive, so one that comes in order is copied once.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_punt.h"
+#include "sr_stats.h"
+#include "sr_utils.h"
+#include "sr_egress.h"
+#include "sr_frag.h"
+
+#define SR_IP_MAX       65535
+#define SR_IP_HL_MAX    60
+#define SR_REASM_BLOCKS (SR_IP_MAX / 8 + 1)
+
+/* -- fragmentation -- */
+
+int sr_frag_set_mtu(struct sr_instance* sr, const char* spec)
+{
+    char buf[256], *tok, *save = NULL, *eq, *end;
+    struct sr_if* iface;
+    unsigned long v;
+
+    if (strlen(spec) >= sizeof(buf)) {
+        fprintf(stderr, "sr_frag: MTU spec too long\n");
+        return -1;
+    }
+    strcpy(buf, spec);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        eq = strchr(tok, '=');
+        v = strtoul(eq ? eq + 1 : tok, &end, 10);
+        if (*end != '\0' || v < SR_IF_MTU_MIN || v > SR_IF_MTU) {
+            fprintf(stderr, "sr_frag: bad MTU '%s', %d to %d\n", tok,
+                    SR_IF_MTU_MIN, SR_IF_MTU);
+            return -1;
+        }
+        if (!eq) {
+            for (iface = sr->if_list; iface; iface = iface->next)
+                iface->mtu = v;
+            continue;
+        }
+        *eq = '\0';
+        if ((iface = sr_get_interface(sr, tok)) == NULL) {
+            fprintf(stderr, "sr_frag: no interface %s\n", tok);
+            return -1;
+        }
+        iface->mtu = v;
+    }
+    return 0;
+}
+
+/* Copies the options that go into every fragment, those with the copied
+   flag, from the len bytes at opts to out, padded to a word.  Returns
+   how many bytes that is. */
+static unsigned int sr_frag_copy_opts(const uint8_t* opts, unsigned int len,
+                                      uint8_t* out)
+{
+    unsigned int i = 0, n = 0, olen;
+
+    while (i < len && opts[i] != 0) {
+        if (opts[i] == 1) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || (olen = opts[i + 1]) < 2 || i + olen > len)
+            break;
+        if (opts[i] & 0x80) {
+            memcpy(out + n, opts + i, olen);
+            n += olen;
+        }
+        i += olen;
+    }
+    while (n & 3)
+        out[n++] = 0;
+    return n;
+}
+
+/* Sends one fragment.  Its egress bucket is the whole datagram's, flow,
+   so the fragments keep their place among the flow's other packets. */
+static int sr_frag_sendv(struct sr_instance* sr, const struct iovec* iov,
+                         struct sr_if* iface, uint32_t flow)
+{
+    if (sr->egress)
+        return sr_egress_sendv_flow(sr->egress, iov, 2, iface->name, flow);
+    return sr_send_packetv(sr, iov, 2, iface->name);
+}
+
+int sr_frag_send(struct sr_instance* sr, uint8_t* frame, unsigned int len,
+                 struct sr_if* iface)
+{
+    const sr_ip_hdr_t* ip_hdr = (const sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    uint8_t hdr[sizeof(sr_ethernet_hdr_t) + SR_IP_HL_MAX];
+    uint8_t opts[SR_IP_HL_MAX - sizeof(sr_ip_hdr_t)];
+    sr_ip_hdr_t* frag_hdr = (sr_ip_hdr_t*)(hdr + sizeof(sr_ethernet_hdr_t));
+    const uint8_t* payload;
+    struct iovec iov[2];
+    unsigned int hl, ip_len, opts_len, off, n;
+    uint16_t ip_off;
+    uint32_t flow;
+
+    if (len <= sizeof(sr_ethernet_hdr_t) + iface->mtu ||
+        ethertype(frame) != ethertype_ip)
+        return sr_send_packet(sr, frame, len, iface->name);
+
+    hl = ip_hdr->ip_hl * 4;
+    ip_len = ntohs(ip_hdr->ip_len);
+    ip_off = ntohs(ip_hdr->ip_off);
+    if (hl < sizeof(sr_ip_hdr_t) || ip_len < hl ||
+        ip_len > len - sizeof(sr_ethernet_hdr_t) ||
+        (ip_off & IP_OFFMASK) * 8 + ip_len - hl > SR_IP_MAX) {
+        sr_stat_inc(SR_STAT_DROP_IP_MALFORMED);
+        return -1;
+    }
+    /* only the padding is over */
+    if (ip_len <= iface->mtu)
+        return sr_send_packet(sr, frame, sizeof(sr_ethernet_hdr_t) + ip_len,
+                              iface->name);
+
+    if (ip_off & IP_DF) {
+        sr_stat_inc(SR_STAT_DROP_FRAG_DF);
+        sr_punt(sr, SR_PUNT_ICMP_ERR, frame, len, NULL, 3, 4);
+        return -1;
+    }
+
+    flow = sr_flow_hash(frame, len);
+    opts_len = sr_frag_copy_opts((const uint8_t*)(ip_hdr + 1),
+                                 hl - sizeof(sr_ip_hdr_t), opts);
+    payload = (const uint8_t*)ip_hdr + hl;
+    memcpy(hdr, frame, sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+
+    for (off = 0; off < ip_len - hl; off += n) {
+        unsigned int frag_hl = off ? sizeof(sr_ip_hdr_t) + opts_len : hl;
+        uint16_t mf = IP_MF;
+
+        n = (iface->mtu - frag_hl) & ~7U;
+        if (off + n >= ip_len - hl) {
+            n = ip_len - hl - off;
+            /* the last piece of a fragment is only last if it was */
+            mf = ip_off & IP_MF;
+        }
+        if (off)
+            memcpy(frag_hdr + 1, opts, opts_len);
+        else
+            memcpy(frag_hdr + 1, ip_hdr + 1, hl - sizeof(sr_ip_hdr_t));
+        frag_hdr->ip_hl = frag_hl / 4;
+        frag_hdr->ip_len = htons(frag_hl + n);
+        frag_hdr->ip_off = htons((ip_off & IP_RF) | mf |
+                                 ((ip_off & IP_OFFMASK) + off / 8));
+        frag_hdr->ip_sum = 0;
+        frag_hdr->ip_sum = cksum(frag_hdr, frag_hl);
+
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sizeof(sr_ethernet_hdr_t) + frag_hl;
+        iov[1].iov_base = (void*)(payload + off);
+        iov[1].iov_len = n;
+        if (sr_frag_sendv(sr, iov, iface, flow) != 0)
+            return -1;
+        sr_stat_inc(SR_STAT_FRAG_TX);
+    }
+    sr_stat_inc(SR_STAT_FRAG_OK);
+    return 0;
+}
+
+/* -- reassembly -- */
+
+struct sr_reasm_dgram
+{
+    struct sr_reasm_dgram* hnext;           /* hash chain */
+    struct sr_reasm_dgram *older, *newer;   /* age list */
+    uint32_t src, dst;                      /* network order */
+    uint16_t id;
+    uint8_t proto;
+    uint64_t t_first;                       /* sr_tsc() of the first fragment */
+    unsigned int total;                     /* payload bytes, 0 until the last fragment */
+    unsigned int high;                      /* end of the furthest fragment */
+    unsigned int have;                      /* payload bytes received */
+    unsigned int cap;                       /* bytes at data */
+    unsigned int hdr_len;                   /* 0 until the first fragment */
+    uint8_t hdr[sizeof(sr_ethernet_hdr_t) + SR_IP_HL_MAX];
+    uint8_t* data;
+    uint64_t blocks[(SR_REASM_BLOCKS + 63) / 64];
+};
+
+struct sr_reasm
+{
+    pthread_mutex_t lock;
+    struct sr_reasm_dgram* buckets[SR_REASM_BUCKETS];
+    struct sr_reasm_dgram *oldest, *newest;
+    size_t mem;
+    uint64_t timeout;                       /* sr_tsc() ticks */
+};
+
+struct sr_reasm* sr_reasm_create(void)
+{
+    struct sr_reasm* r = calloc(1, sizeof(*r));
+
+    if (!r) {
+        fprintf(stderr, "sr_reasm: out of memory\n");
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    r->timeout = SR_REASM_TIMEOUT * 1e9 * sr_stats_ticks_per_ns();
+    return r;
+}
+
+static unsigned int sr_reasm_hash(uint32_t src, uint32_t dst, uint16_t id,
+                                  uint8_t proto)
+{
+    uint32_t h = src ^ (dst * 0x9e3779b1) ^ ((uint32_t)id << 8 | proto);
+
+    h *= 0x85ebca6b;
+    h ^= h >> 16;
+    return h & (SR_REASM_BUCKETS - 1);
+}
+
+static void sr_reasm_free(struct sr_reasm* r, struct sr_reasm_dgram* d)
+{
+    struct sr_reasm_dgram** p = &r->buckets[sr_reasm_hash(d->src, d->dst, d->id,
+                                                          d->proto)];
+    while (*p != d)
+        p = &(*p)->hnext;
+    *p = d->hnext;
+
+    if (d->older)
+        d->older->newer = d->newer;
+    else
+        r->oldest = d->newer;
+    if (d->newer)
+        d->newer->older = d->older;
+    else
+        r->newest = d->older;
+
+    r->mem -= sizeof(*d) + d->cap;
+    free(d->data);
+    free(d);
+}
+
+/* Drops the oldest datagrams, but never keep, until bytes more fit under
+   the cap.  Returns -1 if they still do not. */
+static int sr_reasm_make_room(struct sr_reasm* r, size_t bytes,
+                              struct sr_reasm_dgram* keep)
+{
+    while (r->mem + bytes > SR_REASM_MEM && r->oldest && r->oldest != keep) {
+        sr_stat_inc(SR_STAT_DROP_REASM_MEM);
+        sr_reasm_free(r, r->oldest);
+    }
+    return r->mem + bytes > SR_REASM_MEM ? -1 : 0;
+}
+
+/* Grows d's payload buffer to hold at least need bytes */
+static int sr_reasm_grow(struct sr_reasm* r, struct sr_reasm_dgram* d,
+                         unsigned int need)
+{
+    unsigned int cap = d->cap ? d->cap : 2048;
+    uint8_t* data;
+
+    if (need <= d->cap)
+        return 0;
+    while (cap < need)
+        cap *= 2;
+    if (cap > SR_IP_MAX)
+        cap = SR_IP_MAX;
+    if (sr_reasm_make_room(r, cap - d->cap, d) != 0 ||
+        (data = realloc(d->data, cap)) == NULL)
+        return -1;
+    r->mem += cap - d->cap;
+    d->data = data;
+    d->cap = cap;
+    return 0;
+}
+
+/* Marks blocks [first, last) received; returns -1, marking none, if any
+   already were */
+static int sr_reasm_mark(struct sr_reasm_dgram* d, unsigned int first,
+                         unsigned int last)
+{
+    unsigned int b;
+
+    for (b = first; b < last; b++)
+        if (d->blocks[b / 64] >> (b % 64) & 1)
+            return -1;
+    for (b = first; b < last; b++)
+        d->blocks[b / 64] |= 1ULL << (b % 64);
+    return 0;
+}
+
+/* The datagram, once every byte of it is in */
+static uint8_t* sr_reasm_build(struct sr_reasm_dgram* d, unsigned int* out_len)
+{
+    unsigned int hl = d->hdr_len - sizeof(sr_ethernet_hdr_t);
+    sr_ip_hdr_t* ip_hdr;
+    uint8_t* frame;
+
+    if (hl + d->total > SR_IP_MAX) {
+        sr_stat_inc(SR_STAT_DROP_REASM_BAD);
+        return NULL;
+    }
+    if ((frame = malloc(d->hdr_len + d->total)) == NULL) {
+        sr_stat_inc(SR_STAT_DROP_REASM_MEM);
+        return NULL;
+    }
+    memcpy(frame, d->hdr, d->hdr_len);
+    memcpy(frame + d->hdr_len, d->data, d->total);
+
+    ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    ip_hdr->ip_len = htons(hl + d->total);
+    ip_hdr->ip_off &= ~htons(IP_MF | IP_OFFMASK);
+    ip_hdr->ip_sum = 0;
+    ip_hdr->ip_sum = cksum(ip_hdr, hl);
+
+    sr_stat_inc(SR_STAT_REASM_OK);
+    *out_len = d->hdr_len + d->total;
+    return frame;
+}
+
+uint8_t* sr_reasm_add(struct sr_reasm* r, const uint8_t* frame, unsigned int len,
+                      unsigned int* out_len)
+{
+    const sr_ip_hdr_t* ip_hdr = (const sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    struct sr_reasm_dgram* d;
+    unsigned int hl, ip_len, off, n, end, b;
+    uint16_t ip_off;
+    uint64_t now;
+    uint8_t* out = NULL;
+
+    hl = ip_hdr->ip_hl * 4;
+    ip_len = ntohs(ip_hdr->ip_len);
+    ip_off = ntohs(ip_hdr->ip_off);
+    off = (ip_off & IP_OFFMASK) * 8;
+    n = ip_len - hl;
+    end = off + n;
+    /* every fragment but the last holds whole blocks */
+    if (hl < sizeof(sr_ip_hdr_t) || ip_len <= hl ||
+        ip_len > len - sizeof(sr_ethernet_hdr_t) ||
+        end + sizeof(sr_ip_hdr_t) > SR_IP_MAX || ((ip_off & IP_MF) && (n & 7))) {
+        sr_stat_inc(SR_STAT_DROP_REASM_BAD);
+        return NULL;
+    }
+    b = sr_reasm_hash(ip_hdr->ip_src, ip_hdr->ip_dst, ip_hdr->ip_id, ip_hdr->ip_p);
+    now = sr_tsc();
+
+    pthread_mutex_lock(&r->lock);
+    while (r->oldest && now - r->oldest->t_first > r->timeout) {
+        sr_stat_inc(SR_STAT_DROP_REASM_TIMEOUT);
+        sr_reasm_free(r, r->oldest);
+    }
+
+    for (d = r->buckets[b]; d; d = d->hnext)
+        if (d->src == ip_hdr->ip_src && d->dst == ip_hdr->ip_dst &&
+            d->id == ip_hdr->ip_id && d->proto == ip_hdr->ip_p)
+            break;
+    if (!d) {
+        if (sr_reasm_make_room(r, sizeof(*d), NULL) != 0 ||
+            (d = calloc(1, sizeof(*d))) == NULL) {
+            sr_stat_inc(SR_STAT_DROP_REASM_MEM);
+            pthread_mutex_unlock(&r->lock);
+            return NULL;
+        }
+        d->src = ip_hdr->ip_src;
+        d->dst = ip_hdr->ip_dst;
+        d->id = ip_hdr->ip_id;
+        d->proto = ip_hdr->ip_p;
+        d->t_first = now;
+        d->hnext = r->buckets[b];
+        r->buckets[b] = d;
+        d->older = r->newest;
+        if (r->newest)
+            r->newest->newer = d;
+        else
+            r->oldest = d;
+        r->newest = d;
+        r->mem += sizeof(*d);
+    }
+
+    /* a second last fragment, a fragment past the end or an overlap
+       leaves the datagram in doubt: drop all of it */
+    if ((!(ip_off & IP_MF) && (d->total || end < d->high)) ||
+        (d->total && end > d->total) ||
+        sr_reasm_mark(d, off / 8, (end + 7) / 8) != 0) {
+        sr_stat_inc(SR_STAT_DROP_REASM_BAD);
+        sr_reasm_free(r, d);
+        pthread_mutex_unlock(&r->lock);
+        return NULL;
+    }
+    if (sr_reasm_grow(r, d, end) != 0) {
+        sr_stat_inc(SR_STAT_DROP_REASM_MEM);
+        sr_reasm_free(r, d);
+        pthread_mutex_unlock(&r->lock);
+        return NULL;
+    }
+    memcpy(d->data + off, (const uint8_t*)ip_hdr + hl, n);
+    d->have += n;
+    if (end > d->high)
+        d->high = end;
+    if (!(ip_off & IP_MF))
+        d->total = end;
+    if (off == 0) {
+        d->hdr_len = sizeof(sr_ethernet_hdr_t) + hl;
+        memcpy(d->hdr, frame, d->hdr_len);
+    }
+
+    /* blocks are never counted twice, so have reaching total is all of it */
+    if (d->total && d->have == d->total && d->hdr_len) {
+        out = sr_reasm_build(d, out_len);
+        sr_reasm_free(r, d);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return out;
+}
+
+void sr_reasm_destroy(struct sr_reasm* r)
+{
+    if (!r)
+        return;
+    while (r->oldest)
+        sr_reasm_free(r, r->oldest);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
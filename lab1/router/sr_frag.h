@@ -0,0 +1,72 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_frag.h
+ *
+ * Description:
+ *
+ * IP fragmentation and reassembly.
+ *
+ * Every interface has an MTU, SR_IF_MTU unless -M says otherwise:
+ *
+ *   1400                   every interface
+ *   eth1=1280,eth2=576     the interfaces named, the rest keep SR_IF_MTU
+ *
+ * A datagram longer than the MTU of the interface it leaves by is sent
+ * as fragments (RFC 791), or, with DF set, dropped with an ICMP
+ * fragmentation needed error carrying that MTU (RFC 1191).  A fragment
+ * is never copied: it goes out as a gather list of a new header on the
+ * stack and its slice of the original payload.  With -Q the fragments
+ * are queued in the egress bucket of the datagram they came from, so
+ * they stay in order with the rest of its flow.
+ *
+ * Fragments addressed to the router are reassembled before local
+ * delivery.  Datagrams under reassembly are found by (source,
+ * destination, id, protocol) in a hash table; each keeps the first
+ * fragment's header, its payload so far and a bitmap of the 8-byte
+ * blocks received.  Memory is capped: past SR_REASM_MEM the oldest
+ * datagrams are dropped to make room, as are those not complete within
+ * SR_REASM_TIMEOUT seconds.  Overlapping fragments drop the whole
+ * datagram (RFC 5722's rule, applied to IPv4 as Linux does).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FRAG_H
+#define SR_FRAG_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_REASM_MEM         (4 << 20)  /* bytes of datagrams in progress */
+#define SR_REASM_TIMEOUT     30         /* seconds to complete a datagram */
+#define SR_REASM_BUCKETS     1024
+
+struct sr_instance;
+struct sr_if;
+struct sr_reasm;
+
+/* Sets the interface MTUs from spec, see above.  Returns -1 and
+   complains on a bad spec or an unknown interface. */
+int sr_frag_set_mtu(struct sr_instance* sr, const char* spec);
+
+/* Sends the frame out iface, fragmenting an IP datagram over the
+   interface's MTU.  The frame is only read.  Returns what
+   sr_send_packet() does, or -1 if the datagram could not be sent. */
+int sr_frag_send(struct sr_instance* sr, uint8_t* frame, unsigned int len,
+                 struct sr_if* iface);
+
+struct sr_reasm* sr_reasm_create(void);
+
+/* Adds the fragment in frame, an Ethernet frame of len bytes.  Returns
+   NULL while the datagram is incomplete, or once it is, the whole
+   datagram as a new frame of *out_len bytes that the caller frees.
+   Thread safe. */
+uint8_t* sr_reasm_add(struct sr_reasm* r, const uint8_t* frame, unsigned int len,
+                      unsigned int* out_len);
+
+void sr_reasm_destroy(struct sr_reasm* r);
+
+#endif /* -- SR_FRAG_H -- */
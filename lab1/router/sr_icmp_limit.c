@@ -0,0 +1,191 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_icmp_limit.c
+ *
+ * Description:
+ *
+ * GCRA buckets for ICMP error generation.  A bucket allows a message at
+ * time now if its theoretical arrival time tat is at most burst - 1
+ * intervals ahead of now, and then moves tat one interval further.  The
+ * whole check runs under one lock: it is only reached on the slow path,
+ * when an error is about to be generated.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_icmp_limit.h"
+
+/* What a bucket allows; interval 0 means unlimited */
+struct sr_gcra
+{
+    uint64_t interval;          /* ns per message */
+    uint64_t tolerance;         /* (burst - 1) * interval */
+};
+
+enum { SR_ICMP_LIMIT_UNREACH, SR_ICMP_LIMIT_TIMEX, SR_ICMP_LIMIT_NTYPES };
+
+struct sr_icmp_limit_slot
+{
+    uint32_t prefix;            /* host order, masked */
+    uint32_t used;
+    uint64_t tat;
+};
+
+struct sr_icmp_limit
+{
+    pthread_mutex_t lock;
+    struct sr_gcra type[SR_ICMP_LIMIT_NTYPES];
+    uint64_t type_tat[SR_ICMP_LIMIT_NTYPES];
+    struct sr_gcra source;
+    uint32_t mask;              /* source prefix mask, host order */
+    struct sr_icmp_limit_slot slots[SR_ICMP_LIMIT_SLOTS];
+};
+
+static const char* sr_icmp_limit_keys[] = { "unreach", "timex", "source", "prefix" };
+
+static uint64_t sr_icmp_limit_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sr_gcra_set(struct sr_gcra* g, unsigned long rate, unsigned long burst)
+{
+    if (rate == 0) {
+        g->interval = g->tolerance = 0;
+        return;
+    }
+    g->interval = 1000000000ULL / rate;
+    g->tolerance = (burst ? burst - 1 : 0) * g->interval;
+}
+
+/* Would g allow a message now given tat?  If so, *next is the new tat */
+static int sr_gcra_check(const struct sr_gcra* g, uint64_t tat, uint64_t now,
+                         uint64_t* next)
+{
+    uint64_t base = tat > now ? tat : now;
+
+    if (!g->interval) {
+        *next = tat;
+        return 1;
+    }
+    if (base - now > g->tolerance)
+        return 0;
+    *next = base + g->interval;
+    return 1;
+}
+
+static uint32_t sr_icmp_limit_hash(uint32_t prefix)
+{
+    prefix *= 0x9e3779b1;
+    return prefix >> 22 & (SR_ICMP_LIMIT_SLOTS - 1);
+}
+
+struct sr_icmp_limit* sr_icmp_limit_create(const char* spec)
+{
+    struct sr_icmp_limit* l;
+    const char* p;
+
+    if (!spec)
+        spec = SR_ICMP_LIMIT_DEFAULT;
+    if ((l = calloc(1, sizeof(struct sr_icmp_limit))) == NULL)
+        return NULL;
+    pthread_mutex_init(&l->lock, NULL);
+    l->mask = 0xffffffff;
+
+    for (p = spec; *p; ) {
+        const char* end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        const char* eq = memchr(p, '=', len);
+        unsigned long rate, burst;
+        char* q;
+        int k;
+
+        if (!eq)
+            goto bad;
+        for (k = 0; k < 4; k++)
+            if (strlen(sr_icmp_limit_keys[k]) == (size_t)(eq - p) &&
+                strncmp(p, sr_icmp_limit_keys[k], eq - p) == 0)
+                break;
+        rate = strtoul(eq + 1, &q, 10);
+        if (k == 4 || q == eq + 1)
+            goto bad;
+        burst = rate;
+        if (*q == '/' && k != 3)
+            burst = strtoul(q + 1, &q, 10);
+        if (q != p + len)
+            goto bad;
+
+        if (k == 3) {
+            if (rate > 32)
+                goto bad;
+            l->mask = rate ? 0xffffffff << (32 - rate) : 0;
+        } else {
+            sr_gcra_set(k == 2 ? &l->source : &l->type[k], rate, burst);
+        }
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    return l;
+
+bad:
+    fprintf(stderr, "bad ICMP limit spec '%s', expected "
+            "unreach|timex|source=RATE[/BURST] or prefix=LEN,...\n", spec);
+    free(l);
+    return NULL;
+}
+
+int sr_icmp_limit_allow(struct sr_icmp_limit* l, uint8_t type, uint32_t src)
+{
+    struct sr_icmp_limit_slot* s;
+    uint64_t now, type_next, src_next, src_tat;
+    uint32_t prefix;
+    int t, ok;
+
+    if (!l)
+        return 1;
+
+    t = type == 11 ? SR_ICMP_LIMIT_TIMEX : SR_ICMP_LIMIT_UNREACH;
+    prefix = ntohl(src) & l->mask;
+    s = &l->slots[sr_icmp_limit_hash(prefix)];
+    now = sr_icmp_limit_now();
+
+    pthread_mutex_lock(&l->lock);
+    if (!sr_gcra_check(&l->type[t], l->type_tat[t], now, &type_next)) {
+        pthread_mutex_unlock(&l->lock);
+        sr_stat_inc(t == SR_ICMP_LIMIT_TIMEX ? SR_STAT_ICMP_TIMEX_RL :
+                                               SR_STAT_ICMP_UNREACH_RL);
+        return 0;
+    }
+    src_tat = s->used && s->prefix == prefix ? s->tat : 0;
+    ok = sr_gcra_check(&l->source, src_tat, now, &src_next);
+    if (ok) {
+        /* only a message that is sent uses up tokens */
+        l->type_tat[t] = type_next;
+        s->prefix = prefix;
+        s->used = 1;
+        s->tat = src_next;
+    }
+    pthread_mutex_unlock(&l->lock);
+
+    if (!ok)
+        sr_stat_inc(SR_STAT_ICMP_SOURCE_RL);
+    return ok;
+}
+
+void sr_icmp_limit_destroy(struct sr_icmp_limit* l)
+{
+    if (!l)
+        return;
+    pthread_mutex_destroy(&l->lock);
+    free(l);
+}
@@ -0,0 +1,53 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_icmp_limit.h
+ *
+ * Description:
+ *
+ * Rate limiting of the ICMP errors the router generates.  Before an error
+ * is built it must get a token from the bucket of its type (destination
+ * unreachable, time exceeded) and from the bucket of the source prefix
+ * of the datagram that caused it, so neither a flood from one network nor
+ * a looping route can keep the router busy generating ICMP.  Refused
+ * errors are counted by the bucket that refused them.
+ *
+ * Each bucket is kept as a GCRA "theoretical arrival time": one 64-bit
+ * timestamp that is equivalent to a token bucket of the given rate and
+ * burst.  Source prefixes share a fixed direct-mapped table, a prefix
+ * colliding with another just takes over its slot with a full bucket.
+ *
+ * The limits are a spec of KEY=RATE[/BURST] or prefix=LEN entries:
+ *
+ *   unreach=100/20,timex=100/20,source=10/10,prefix=24
+ *
+ * with RATE in messages per second; a rate of 0 removes that limit.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ICMP_LIMIT_H
+#define SR_ICMP_LIMIT_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_ICMP_LIMIT_DEFAULT  "unreach=1000/50,timex=1000/50,source=100/20,prefix=24"
+#define SR_ICMP_LIMIT_SLOTS    1024  /* source prefixes tracked, power of two */
+
+struct sr_icmp_limit;
+
+/* Creates a limiter from spec, or from SR_ICMP_LIMIT_DEFAULT if spec is
+   NULL.  Returns NULL and complains on a bad spec. */
+struct sr_icmp_limit* sr_icmp_limit_create(const char* spec);
+
+/* Takes a token for an ICMP error of type about a datagram from src
+   (network order).  Returns 1 if the error may be sent, 0 if it is
+   suppressed.  A NULL limiter allows everything.  Thread safe. */
+int sr_icmp_limit_allow(struct sr_icmp_limit* l, uint8_t type, uint32_t src);
+
+void sr_icmp_limit_destroy(struct sr_icmp_limit* l);
+
+#endif /* -- SR_ICMP_LIMIT_H -- */
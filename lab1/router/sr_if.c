@@ -77,6 +77,7 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
         assert(sr->if_list);
         sr->if_list->next = 0;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
+        sr->if_list->mtu = SR_IF_MTU;
         return;
     }
 
@@ -89,6 +90,7 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     assert(if_walker->next);
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
+    if_walker->mtu = SR_IF_MTU;
     if_walker->next = 0;
 } /* -- sr_add_interface -- */ 
 
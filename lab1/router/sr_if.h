@@ -28,6 +28,9 @@
 
 struct sr_instance;
 
+#define SR_IF_MTU      1500     /* default, and the most a VNS frame carries */
+#define SR_IF_MTU_MIN  68       /* RFC 791: the least any link must carry */
+
 /* ----------------------------------------------------------------------------
  * struct sr_if
  *
@@ -35,12 +38,24 @@ struct sr_instance;
  *
  * -------------------------------------------------------------------------- */
 
+/* ICMP error frame prebuilt for one interface by sr_init_interfaces();
+   only the addresses, type and code, the quoted datagram and the
+   checksums vary */
+struct sr_icmp_tmpl
+{
+  uint8_t frame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) +
+                sizeof(sr_icmp_t3_hdr_t)];
+  uint32_t ip_sum; /* unfolded sum of the IP header minus the addresses */
+};
+
 struct sr_if
 {
   char name[sr_IFACE_NAMELEN];
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  uint16_t mtu; /* largest datagram sent whole, -M */
+  struct sr_icmp_tmpl icmp_tmpl;
   struct sr_if* next;
 };
 
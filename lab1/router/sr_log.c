@@ -0,0 +1,330 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_log.c
+ *
+ * Description:
+ *
+ * Buffered asynchronous log sink.  A logging thread formats the message on
+ * its own stack, then copies it with a small header into a per-thread SPSC
+ * ring.  The writer thread turns records into lines and hands them to the
+ * kernel in large write()s, so no thread on the packet path touches stdio.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_ring.h"
+#include "sr_log.h"
+
+#define SR_LOG_OUTBUF   (64 << 10)
+#define SR_LOG_IDLE_US  1000
+
+uint8_t sr_log_levels[SR_LOG_NSUBSYS] =
+    { SR_LOG_DEFAULT_LEVEL, SR_LOG_DEFAULT_LEVEL, SR_LOG_DEFAULT_LEVEL,
+      SR_LOG_DEFAULT_LEVEL, SR_LOG_DEFAULT_LEVEL };
+
+static const char* sr_log_subsys_names[SR_LOG_NSUBSYS] =
+    { "vns", "router", "arp", "icmp", "rt" };
+static const char* sr_log_level_names[] =
+    { "off", "err", "warn", "info", "debug", "trace" };
+
+struct sr_log_rec
+{
+    uint32_t sec;
+    uint32_t usec;
+    uint8_t  sub;
+    uint8_t  lvl;
+    uint16_t len;               /* bytes of text following, no newline */
+};
+
+struct sr_log_producer
+{
+    struct sr_ring* ring;
+    uint64_t drops;
+} __attribute__ ((aligned (SR_CACHE_LINE)));
+
+static struct
+{
+    int running;
+    int stop;
+    pthread_t writer;
+    unsigned int nproducers;
+    uint64_t overflow_drops;
+    struct sr_log_producer producers[SR_LOG_PRODUCERS];
+} sink;
+
+static __thread struct sr_log_producer* tls_producer;
+static __thread int tls_claimed;
+
+static struct sr_log_producer* sr_log_claim(void)
+{
+    struct sr_log_producer* p;
+    struct sr_ring* ring;
+    unsigned int slot;
+
+    slot = __atomic_fetch_add(&sink.nproducers, 1, __ATOMIC_RELAXED);
+    if (slot >= SR_LOG_PRODUCERS || (ring = sr_ring_create(SR_LOG_RING_SZ)) == NULL)
+        return NULL;
+    p = &sink.producers[slot];
+    __atomic_store_n(&p->ring, ring, __ATOMIC_RELEASE);
+    return p;
+}
+
+/* Formats one record as a line; returns its length. */
+static int sr_log_format(char* out, size_t outlen, const struct sr_log_rec* r,
+                         const char* text)
+{
+    return snprintf(out, outlen, "%u.%06u %-6s %-5s %.*s\n", r->sec, r->usec,
+                    sr_log_subsys_names[r->sub], sr_log_level_names[r->lvl],
+                    (int)r->len, text);
+}
+
+static void sr_log_flush(char* buf, size_t* used)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < *used) {
+        if ((n = write(STDERR_FILENO, buf + off, *used - off)) <= 0)
+            break;
+        off += n;
+    }
+    *used = 0;
+}
+
+static unsigned int sr_log_drain(char* out, size_t* used)
+{
+    unsigned int i, n = 0, len;
+    struct sr_log_rec* r;
+
+    for (i = 0; i < SR_LOG_PRODUCERS; i++) {
+        struct sr_ring* ring = __atomic_load_n(&sink.producers[i].ring,
+                                               __ATOMIC_ACQUIRE);
+        if (!ring)
+            continue;
+        while ((r = sr_ring_peek(ring, &len)) != NULL) {
+            if (SR_LOG_OUTBUF - *used < SR_LOG_LINE_MAX + 64)
+                sr_log_flush(out, used);
+            *used += sr_log_format(out + *used, SR_LOG_OUTBUF - *used, r,
+                                   (const char*)(r + 1));
+            sr_ring_release(ring, len);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void* sr_log_writer(void* arg)
+{
+    static char out[SR_LOG_OUTBUF];
+    size_t used = 0;
+
+    while (1) {
+        int stop = __atomic_load_n(&sink.stop, __ATOMIC_ACQUIRE);
+
+        if (sr_log_drain(out, &used))
+            continue;
+        if (used)
+            sr_log_flush(out, &used);
+        if (stop)
+            break;
+        usleep(SR_LOG_IDLE_US);
+    }
+    return NULL;
+}
+
+static void sr_log_emit(int sub, int lvl, const char* text, unsigned int len)
+{
+    struct sr_log_rec* r;
+    struct timeval tv;
+
+    /* messages carry their own newline in this code base, drop it */
+    if (len && text[len - 1] == '\n')
+        len--;
+
+    gettimeofday(&tv, 0);
+
+    if (__atomic_load_n(&sink.running, __ATOMIC_ACQUIRE)) {
+        if (!tls_claimed) {
+            tls_producer = sr_log_claim();
+            tls_claimed = 1;
+        }
+        if (!tls_producer) {
+            __atomic_fetch_add(&sink.overflow_drops, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        r = sr_ring_reserve(tls_producer->ring, sizeof(struct sr_log_rec) + len);
+        if (!r) {
+            __atomic_store_n(&tls_producer->drops, tls_producer->drops + 1,
+                             __ATOMIC_RELAXED);
+            return;
+        }
+        r->sec = tv.tv_sec;
+        r->usec = tv.tv_usec;
+        r->sub = sub;
+        r->lvl = lvl;
+        r->len = len;
+        memcpy(r + 1, text, len);
+        sr_ring_commit(tls_producer->ring, sizeof(struct sr_log_rec) + len);
+    } else {
+        struct sr_log_rec rec;
+        char line[SR_LOG_LINE_MAX + 64];
+        rec.sec = tv.tv_sec;
+        rec.usec = tv.tv_usec;
+        rec.sub = sub;
+        rec.lvl = lvl;
+        rec.len = len;
+        sr_log_format(line, sizeof(line), &rec, text);
+        fputs(line, stderr);
+    }
+}
+
+void sr_log_write(int sub, int lvl, const char* fmt, ...)
+{
+    char text[SR_LOG_LINE_MAX];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if (n >= (int)sizeof(text))
+        n = sizeof(text) - 1;
+    sr_log_emit(sub, lvl, text, n);
+}
+
+void sr_log_write_frame(int sub, int lvl, const char* what,
+                        const uint8_t* buf, unsigned int len)
+{
+    const sr_ethernet_hdr_t* eth = (const sr_ethernet_hdr_t*)buf;
+    char text[SR_LOG_LINE_MAX];
+    char a[INET_ADDRSTRLEN], b[INET_ADDRSTRLEN];
+    const uint8_t *s, *d;
+    int n;
+
+    if (len < sizeof(sr_ethernet_hdr_t)) {
+        sr_log_write(sub, lvl, "%s: runt frame, %u bytes", what, len);
+        return;
+    }
+    s = eth->ether_shost;
+    d = eth->ether_dhost;
+    n = snprintf(text, sizeof(text),
+                 "%s: %02x:%02x:%02x:%02x:%02x:%02x > %02x:%02x:%02x:%02x:%02x:%02x len %u",
+                 what, s[0], s[1], s[2], s[3], s[4], s[5],
+                 d[0], d[1], d[2], d[3], d[4], d[5], len);
+
+    if (eth->ether_type == htons(ethertype_ip) &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+        const sr_ip_hdr_t* ip = (const sr_ip_hdr_t*)(eth + 1);
+        inet_ntop(AF_INET, &ip->ip_src, a, sizeof(a));
+        inet_ntop(AF_INET, &ip->ip_dst, b, sizeof(b));
+        n += snprintf(text + n, sizeof(text) - n,
+                      " ip %s > %s proto %u ttl %u id %u len %u", a, b,
+                      ip->ip_p, ip->ip_ttl, ntohs(ip->ip_id), ntohs(ip->ip_len));
+    } else if (eth->ether_type == htons(ethertype_arp) &&
+               len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
+        const sr_arp_hdr_t* arp = (const sr_arp_hdr_t*)(eth + 1);
+        inet_ntop(AF_INET, &arp->ar_sip, a, sizeof(a));
+        inet_ntop(AF_INET, &arp->ar_tip, b, sizeof(b));
+        n += snprintf(text + n, sizeof(text) - n, " arp %s %s > %s",
+                      ntohs(arp->ar_op) == arp_op_request ? "request" : "reply",
+                      a, b);
+    } else {
+        n += snprintf(text + n, sizeof(text) - n, " type 0x%04x",
+                      ntohs(eth->ether_type));
+    }
+    if (n >= (int)sizeof(text))
+        n = sizeof(text) - 1;
+    sr_log_emit(sub, lvl, text, n);
+}
+
+static int sr_log_parse_level(const char* s, size_t len)
+{
+    int i;
+    for (i = SR_LOG_OFF; i <= SR_LOG_TRACE; i++)
+        if (strlen(sr_log_level_names[i]) == len &&
+            strncmp(s, sr_log_level_names[i], len) == 0)
+            return i;
+    return -1;
+}
+
+int sr_log_config(const char* spec)
+{
+    const char* p = spec;
+
+    while (*p) {
+        const char* end = strchr(p, ',');
+        const char* eq;
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        int sub, lvl;
+
+        eq = memchr(p, '=', len);
+        if (!eq) {
+            if ((lvl = sr_log_parse_level(p, len)) < 0)
+                goto bad;
+            for (sub = 0; sub < SR_LOG_NSUBSYS; sub++)
+                sr_log_levels[sub] = lvl;
+        } else {
+            for (sub = 0; sub < SR_LOG_NSUBSYS; sub++)
+                if (strlen(sr_log_subsys_names[sub]) == (size_t)(eq - p) &&
+                    strncmp(p, sr_log_subsys_names[sub], eq - p) == 0)
+                    break;
+            lvl = sr_log_parse_level(eq + 1, len - (eq + 1 - p));
+            if (sub == SR_LOG_NSUBSYS || lvl < 0)
+                goto bad;
+            sr_log_levels[sub] = lvl;
+        }
+        if (lvl > SR_LOG_MAX_LEVEL)
+            fprintf(stderr, "log level %s is compiled out (SR_LOG_MAX_LEVEL %s)\n",
+                    sr_log_level_names[lvl], sr_log_level_names[SR_LOG_MAX_LEVEL]);
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "bad log spec '%s', expected LEVEL or SUBSYS=LEVEL,...\n", spec);
+    return -1;
+}
+
+int sr_log_init(void)
+{
+    if (sink.running)
+        return 0;
+    sink.stop = 0;
+    if (pthread_create(&sink.writer, NULL, sr_log_writer, NULL) != 0) {
+        perror("sr_log: pthread_create");
+        return -1;
+    }
+    __atomic_store_n(&sink.running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void sr_log_shutdown(void)
+{
+    uint64_t drops;
+    unsigned int i;
+
+    if (!sink.running)
+        return;
+    __atomic_store_n(&sink.running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&sink.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(sink.writer, NULL);
+
+    drops = sink.overflow_drops;
+    for (i = 0; i < SR_LOG_PRODUCERS; i++)
+        drops += sink.producers[i].drops;
+    if (drops)
+        fprintf(stderr, "sr_log: %llu messages dropped on full ring\n",
+                (unsigned long long)drops);
+}
@@ -0,0 +1,94 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_log.h
+ *
+ * Description:
+ *
+ * Level based logging for the router.  Each subsystem has its own runtime
+ * level (set with -L), and SR_LOG_MAX_LEVEL removes everything above it
+ * at compile time:
+ *
+ *   sr_log_debug(SR_LOG_ROUTER, "ip packet for others\n");
+ *
+ * expands to a compare against a constant and a byte load, or to nothing
+ * when the level is compiled out; the arguments are not evaluated unless
+ * the message is enabled.  Enabled messages are formatted by the calling
+ * thread into its own ring and written to stderr by a background thread
+ * once sr_log_init() has been called (synchronously before that).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_LOG_H
+#define SR_LOG_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include "sr_workers.h"
+
+/* levels */
+#define SR_LOG_OFF    0
+#define SR_LOG_ERR    1
+#define SR_LOG_WARN   2
+#define SR_LOG_INFO   3
+#define SR_LOG_DEBUG  4
+#define SR_LOG_TRACE  5
+
+/* subsystems */
+#define SR_LOG_VNS     0   /* server connection, frame rx/tx */
+#define SR_LOG_ROUTER  1   /* sr_handlepacket and forwarding */
+#define SR_LOG_ARP     2   /* ARP cache and requests */
+#define SR_LOG_ICMP    3   /* ICMP generation */
+#define SR_LOG_RT      4   /* routing table */
+#define SR_LOG_NSUBSYS 5
+
+#ifndef SR_LOG_MAX_LEVEL
+#ifdef _DEBUG_
+#define SR_LOG_MAX_LEVEL SR_LOG_TRACE
+#else
+#define SR_LOG_MAX_LEVEL SR_LOG_INFO
+#endif
+#endif
+
+#define SR_LOG_DEFAULT_LEVEL SR_LOG_WARN
+#define SR_LOG_LINE_MAX      512
+#define SR_LOG_RING_SZ       (256 << 10)  /* bytes per logging thread */
+#define SR_LOG_PRODUCERS     SR_THREADS_MAX
+
+extern uint8_t sr_log_levels[SR_LOG_NSUBSYS];
+
+#define sr_log_enabled(sub, lvl) \
+    ((lvl) <= SR_LOG_MAX_LEVEL && (lvl) <= sr_log_levels[sub])
+
+#define sr_log(sub, lvl, fmt, args...) \
+    do { if (sr_log_enabled(sub, lvl)) sr_log_write(sub, lvl, fmt, ## args); } while (0)
+
+#define sr_log_err(sub, fmt, args...)   sr_log(sub, SR_LOG_ERR, fmt, ## args)
+#define sr_log_warn(sub, fmt, args...)  sr_log(sub, SR_LOG_WARN, fmt, ## args)
+#define sr_log_info(sub, fmt, args...)  sr_log(sub, SR_LOG_INFO, fmt, ## args)
+#define sr_log_debug(sub, fmt, args...) sr_log(sub, SR_LOG_DEBUG, fmt, ## args)
+#define sr_log_trace(sub, fmt, args...) sr_log(sub, SR_LOG_TRACE, fmt, ## args)
+
+/* One line decode of an ethernet frame (addresses, protocol, lengths),
+   the cheap replacement for print_hdrs() on the packet path. */
+#define sr_log_frame(sub, lvl, what, buf, len) \
+    do { if (sr_log_enabled(sub, lvl)) sr_log_write_frame(sub, lvl, what, buf, len); } while (0)
+
+void sr_log_write(int sub, int lvl, const char* fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+void sr_log_write_frame(int sub, int lvl, const char* what,
+                        const uint8_t* buf, unsigned int len);
+
+/* Parses a -L spec: "LEVEL" sets every subsystem, "SUB=LEVEL[,...]" sets
+   individual ones, e.g. "info,arp=trace".  Returns -1 on a bad spec. */
+int sr_log_config(const char* spec);
+
+/* Starts / stops the background writer.  Shutdown drains what is queued. */
+int  sr_log_init(void);
+void sr_log_shutdown(void);
+
+#endif /* -- SR_LOG_H -- */
@@ -0,0 +1,132 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_lpm.c
+ *
+ * Description:
+ *
+ * Stride-8 multibit trie with controlled prefix expansion.  A prefix of
+ * length len lives at level (len - 1) / 8 and fills the 2^(8 - len % 8)
+ * slots it covers there, unless a slot already holds a longer prefix.
+ * Anything at a deeper level is longer than anything above it, so a
+ * lookup just remembers the last value it passed on the way down.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_lpm.h"
+
+struct sr_lpm_node;
+
+struct sr_lpm_slot
+{
+    void* val;
+    unsigned int len;               /* of the prefix val belongs to */
+    struct sr_lpm_node* child;
+};
+
+struct sr_lpm_node
+{
+    struct sr_lpm_slot slot[256];
+};
+
+struct sr_lpm
+{
+    struct sr_lpm_node root;
+    void** vals;                    /* each distinct value once, for destroy */
+    unsigned int nvals, cap;
+};
+
+struct sr_lpm* sr_lpm_create(void)
+{
+    return calloc(1, sizeof(struct sr_lpm));
+}
+
+static int sr_lpm_remember(struct sr_lpm* t, void* val)
+{
+    unsigned int i;
+
+    for (i = 0; i < t->nvals; i++)
+        if (t->vals[i] == val)
+            return 0;
+    if (t->nvals == t->cap) {
+        unsigned int cap = t->cap ? 2 * t->cap : 16;
+        void** v = realloc(t->vals, cap * sizeof(void*));
+        if (!v)
+            return -1;
+        t->vals = v;
+        t->cap = cap;
+    }
+    t->vals[t->nvals++] = val;
+    return 0;
+}
+
+int sr_lpm_insert(struct sr_lpm* t, uint32_t prefix, unsigned int len, void* val)
+{
+    struct sr_lpm_node* node = &t->root;
+    unsigned int level, last, first, n, i;
+
+    if (len > 32 || sr_lpm_remember(t, val) != 0)
+        return -1;
+    if (len < 32)
+        prefix &= ~(0xffffffffU >> len);
+
+    last = len ? (len - 1) / 8 : 0;
+    for (level = 0; level < last; level++) {
+        struct sr_lpm_slot* s = &node->slot[prefix >> (24 - 8 * level) & 0xff];
+        if (!s->child && (s->child = calloc(1, sizeof(struct sr_lpm_node))) == NULL)
+            return -1;
+        node = s->child;
+    }
+
+    first = prefix >> (24 - 8 * last) & 0xff;
+    n = 1U << (8 * (last + 1) - len);
+    for (i = first; i < first + n; i++) {
+        struct sr_lpm_slot* s = &node->slot[i];
+        if (!s->val || s->len <= len) {
+            s->val = val;
+            s->len = len;
+        }
+    }
+    return 0;
+}
+
+void* sr_lpm_lookup(const struct sr_lpm* t, uint32_t addr)
+{
+    const struct sr_lpm_node* node = &t->root;
+    void* best = NULL;
+    int shift;
+
+    for (shift = 24; node && shift >= 0; shift -= 8) {
+        const struct sr_lpm_slot* s = &node->slot[addr >> shift & 0xff];
+        if (s->val)
+            best = s->val;
+        node = s->child;
+    }
+    return best;
+}
+
+static void sr_lpm_free_node(struct sr_lpm_node* node)
+{
+    unsigned int i;
+
+    for (i = 0; i < 256; i++)
+        if (node->slot[i].child) {
+            sr_lpm_free_node(node->slot[i].child);
+            free(node->slot[i].child);
+        }
+}
+
+void sr_lpm_destroy(struct sr_lpm* t, void (*free_val)(void*))
+{
+    unsigned int i;
+
+    if (!t)
+        return;
+    sr_lpm_free_node(&t->root);
+    if (free_val)
+        for (i = 0; i < t->nvals; i++)
+            free_val(t->vals[i]);
+    free(t->vals);
+    free(t);
+}
@@ -0,0 +1,41 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_lpm.h
+ *
+ * Description:
+ *
+ * Longest prefix match over IPv4 addresses.  A multibit trie with a
+ * stride of 8: each level is indexed by one byte of the address, and a
+ * prefix is expanded over the slots of its last level it covers, so a
+ * lookup is at most four array indexes.  Values are opaque pointers.
+ *
+ * The table is built once and then only read: lookups take no lock and
+ * may run on any number of threads.  To change it, build a new one.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_LPM_H
+#define SR_LPM_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+struct sr_lpm;
+
+struct sr_lpm* sr_lpm_create(void);
+
+/* Maps prefix/len (host order) to val, replacing an earlier value for the
+   same prefix.  Returns 0, or -1 if out of memory or len > 32. */
+int sr_lpm_insert(struct sr_lpm* t, uint32_t prefix, unsigned int len, void* val);
+
+/* Value of the longest prefix containing addr (host order), or NULL. */
+void* sr_lpm_lookup(const struct sr_lpm* t, uint32_t addr);
+
+/* Frees the table; free_val, if given, is called once per inserted value. */
+void sr_lpm_destroy(struct sr_lpm* t, void (*free_val)(void*));
+
+#endif /* -- SR_LPM_H -- */
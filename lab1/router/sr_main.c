@@ -23,6 +23,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <signal.h>
 #include <sys/types.h>
 
 #ifdef _LINUX_
@@ -30,8 +31,23 @@
 #endif /* _LINUX_ */
 
 #include "sr_dumper.h"
+#include "sr_pcaplog.h"
+#include "sr_capfilter.h"
+#include "sr_log.h"
+#include "sr_stats.h"
+#include "sr_workers.h"
+#include "sr_punt.h"
+#include "sr_icmp_limit.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_nbr.h"
+#include "sr_egress.h"
+#include "sr_acl.h"
+#include "sr_police.h"
+#include "sr_flow.h"
+#include "sr_frag.h"
+#include "sr_tenant.h"
 
 extern char* optarg;
 
@@ -65,11 +81,25 @@ int main(int argc, char **argv)
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    char *capfilter = 0;
+    char *statsfile = 0;
+    char *cpus = 0;
+    char *icmp_limit = 0;
+    char *egress = 0;
+    char *acl = 0;
+    char *police = 0;
+    char *flows = 0;
+    char *mtu = 0;
+    char *tenants = 0;
+    unsigned int nworkers = 0;
+    unsigned int punt_depth = SR_PUNT_DEPTH;
+    unsigned int hello_ms = SR_NBR_HELLO_MS;
+    unsigned int sample = 1;
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:F:N:L:S:W:C:P:R:H:Q:A:B:E:M:V:")) != EOF)
     {
         switch (c)
         {
@@ -101,12 +131,153 @@ int main(int argc, char **argv)
             case 'T':
                 template = optarg;
                 break;
+            case 'F':
+                capfilter = optarg;
+                break;
+            case 'N':
+                sample = atoi((char *) optarg);
+                break;
+            case 'L':
+                if(sr_log_config(optarg) != 0)
+                { exit(1); }
+                break;
+            case 'S':
+                statsfile = optarg;
+                break;
+            case 'W':
+                nworkers = atoi((char *) optarg);
+                break;
+            case 'C':
+                cpus = optarg;
+                break;
+            case 'P':
+                punt_depth = atoi((char *) optarg);
+                break;
+            case 'R':
+                icmp_limit = optarg;
+                break;
+            case 'H':
+                hello_ms = atoi((char *) optarg);
+                break;
+            case 'Q':
+                egress = optarg;
+                break;
+            case 'A':
+                acl = optarg;
+                break;
+            case 'B':
+                police = optarg;
+                break;
+            case 'E':
+                flows = optarg;
+                break;
+            case 'M':
+                mtu = optarg;
+                break;
+            case 'V':
+                tenants = optarg;
+                break;
         } /* switch */
     } /* -- while -- */
 
+    /* -- SIGUSR1 prints counters and stage latencies; must precede any
+          thread creation so every thread inherits the blocked mask -- */
+    sr_stats_dump_on_signal(SIGUSR1);
+
+    /* -- from here on per-packet messages go through the async sink -- */
+    sr_log_init();
+
+    /* -- counters, exported to sr_stat if -S was given -- */
+    if(sr_stats_init(statsfile) != 0)
+    { exit(1); }
+
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
 
+    /* -- every router in the tenant file in this one process, sharing
+          the event loop, a timer thread and the workers -- */
+    if(tenants)
+    {
+        struct sr_tenant_conf conf;
+        struct sr_tenants* t;
+
+        if(logfile || egress || acl || police || flows)
+        {
+            fprintf(stderr,"sr: -l, -Q, -A, -B and -E are per router, "
+                    "not supported with -V\n");
+            exit(1);
+        }
+        if(! user )
+        { sr_set_user(&sr); }
+        else
+        { strncpy(sr.user, user, 32); }
+
+        memset(&conf, 0, sizeof(conf));
+        conf.user = sr.user;
+        conf.server = server;
+        conf.port = port;
+        conf.icmp_limit = icmp_limit;
+        conf.mtu = mtu;
+        conf.hello_ms = hello_ms;
+        conf.nworkers = nworkers;
+        conf.cpus = cpus;
+
+        t = sr_tenants_start(tenants, &conf);
+        if(!t)
+        { exit(1); }
+        sr_tenants_report(t, stdout);
+
+        sr_tenants_run(t);
+
+        sr_tenants_destroy(t);
+#ifdef _DEBUG_
+        sr_stats_dump(stderr);
+#endif
+        sr_log_shutdown();
+        return 0;
+    }
+
+    /* -- token buckets in front of ICMP error generation -- */
+    sr.icmp_limit = sr_icmp_limit_create(icmp_limit);
+    if(!sr.icmp_limit)
+    { exit(1); }
+
+    /* -- ingress filter, compiled before any packet is seen -- */
+    if(acl)
+    {
+        sr.acl = sr_acl_load(acl);
+        if(!sr.acl)
+        { exit(1); }
+    }
+
+    /* -- per prefix policers, after the stats so they can time -- */
+    if(police)
+    {
+        sr.police = sr_police_load(police);
+        if(!sr.police)
+        { exit(1); }
+    }
+
+    /* -- per flow accounting, exported as IPFIX -- */
+    if(flows)
+    {
+        sr.flows = sr_flows_create(flows);
+        if(!sr.flows)
+        { exit(1); }
+    }
+
+    /* -- interface MTUs, set once the interfaces are known -- */
+    sr.mtu_spec = mtu;
+
+    /* -- per-interface DRR/CoDel queues in front of the wire, started
+          once the interfaces are known -- */
+    if(egress)
+    {
+        sr.egress = sr_egress_create(egress);
+        if(!sr.egress)
+        { exit(1); }
+    }
+
     /* -- set up routing table from file -- */
     if(template == NULL) {
         sr.template[0] = '\0';
@@ -126,13 +297,23 @@ int main(int argc, char **argv)
     /* -- set up file pointer for logging of raw packets -- */
     if(logfile != 0)
     {
-        sr.logfile = sr_dump_open(logfile,0,PACKET_DUMP_SIZE);
+        sr.logfile = sr_pcaplog_open(logfile,PACKET_DUMP_SIZE,
+                                     SR_PCAPLOG_RING_SZ);
         if(!sr.logfile)
         {
             fprintf(stderr,"Error opening up dump file %s\n",
                     logfile);
             exit(1);
         }
+        if(capfilter || sample > 1)
+        {
+            sr.capfilter = sr_capfilter_compile(capfilter, sample);
+            if(!sr.capfilter)
+            { exit(1); }
+#ifdef _DEBUG_
+            sr_capfilter_print(sr.capfilter, stderr);
+#endif
+        }
     }
 
     Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
@@ -159,6 +340,31 @@ int main(int argc, char **argv)
     /* call router init (for arp subsystem etc.) */
     sr_init(&sr);
 
+    /* -- traffic for the router itself and ICMP errors go to the
+          control-plane thread; -P 0 handles them inline -- */
+    if(punt_depth)
+    {
+        sr.punt = sr_punt_start(&sr, punt_depth);
+        if(!sr.punt)
+        { return 1; }
+    }
+
+    /* -- ARP hellos to every gateway so a dead one fails over to its
+          backup; -H 0 turns them off -- */
+    if(hello_ms)
+    {
+        if(sr_nbr_start(&sr, hello_ms) != 0)
+        { return 1; }
+    }
+
+    /* -- hand frames to flow-hashed worker threads instead of inline -- */
+    if(nworkers)
+    {
+        sr.workers = sr_workers_start(nworkers, cpus);
+        if(!sr.workers)
+        { return 1; }
+    }
+
     /* -- whizbang main loop ;-) */
     while( sr_read_from_server(&sr) == 1);
 
@@ -178,7 +384,19 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-l log file] [-F capture filter] [-N sample 1 in N] \n");
+    printf("           [-L log levels, e.g. info,arp=trace] [-S stats file] \n");
+    printf("           [-W worker threads] [-C cpu list for workers] \n");
+    printf("           [-P control-plane queue depth, 0 inline] \n");
+    printf("           [-R ICMP limits, default %s] \n", SR_ICMP_LIMIT_DEFAULT);
+    printf("           [-H gateway hello interval ms, 0 off, default %d] \n",
+           SR_NBR_HELLO_MS);
+    printf("           [-Q egress queues, on or %s] \n", SR_EGRESS_DEFAULT);
+    printf("           [-A ingress ACL file] [-B prefix policer file] \n");
+    printf("           [-E flow export, file=PATH|udp=A.B.C.D:PORT[,%s]] \n",
+           SR_FLOW_DEFAULT);
+    printf("           [-M MTU, N or iface=N,..., default %d] \n", SR_IF_MTU);
+    printf("           [-V tenant file, one router per line: vhost topo rtable] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -220,10 +438,35 @@ static void sr_destroy_instance(struct sr_instance* sr)
     /* REQUIRES */
     assert(sr);
 
+    /* -- the ARP thread sends, punts and reports lost gateways through
+          everything below: stop it before any of that goes -- */
+    sr_arpcache_stop(&(sr->cache));
+
+    sr_workers_stop(sr->workers);
+    sr_punt_stop(sr->punt);
+    sr->punt = NULL;
+    sr_nbrs_destroy(sr->nbrs);
+    sr->nbrs = NULL;
+
+    /* -- the egress queues print their own figures, dump before they go -- */
+#ifdef _DEBUG_
+    sr_stats_dump(stderr);
+#endif
+    sr_egress_destroy(sr->egress);
+    sr->egress = NULL;
+
     if(sr->logfile)
     {
-        sr_dump_close(sr->logfile);
+        sr_pcaplog_close(sr->logfile);
+        sr->logfile = NULL;
     }
+    sr_capfilter_destroy(sr->capfilter);
+    sr_acl_destroy(sr->acl);
+    sr_police_destroy(sr->police);
+    sr_flows_destroy(sr->flows);
+    sr_reasm_destroy(sr->reasm);
+    sr_fib_destroy(sr->fib);
+    sr_log_shutdown();
 
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
@@ -248,7 +491,21 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->topo_id = 0;
     sr->if_list = 0;
     sr->routing_table = 0;
+    sr->fib = 0;
+    sr->nbrs = 0;
+    sr->egress = 0;
     sr->logfile = 0;
+    sr->capfilter = 0;
+    sr->workers = 0;
+    sr->punt = 0;
+    sr->icmp_limit = 0;
+    sr->acl = 0;
+    sr->police = 0;
+    sr->flows = 0;
+    sr->reasm = 0;
+    sr->mtu_spec = 0;
+    sr->hosted = 0;
+    pthread_mutex_init(&sr->send_lock, NULL);
 } /* -- sr_init_instance -- */
 
 /*-----------------------------------------------------------------------------
@@ -1,17 +1,122 @@
-
 #include <signal.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
 #include <unistd.h>
 
+#define SR_NAT_PER_SHARD (SR_NAT_MAX_MAPPINGS / SR_NAT_SHARDS)
+
+/* Internal index bucket; its low bits are the shard */
+static uint32_t sr_nat_int_hash(uint32_t ip_int, uint16_t aux_int,
+  sr_nat_mapping_type type) {
+  /* murmur3 finalizer over the folded key */
+  uint32_t h = ip_int ^ ((uint32_t)aux_int << 16 | type) * 0x9e3779b1;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h & ((1 << SR_NAT_HASH_BITS) - 1);
+}
+
+/* Shard of an internal index bucket or an external port */
+static struct sr_nat_shard *sr_nat_shard_of(struct sr_nat *nat, uint32_t key) {
+  return &nat->shards[key & (SR_NAT_SHARDS - 1)];
+}
+
+/* Seconds on CLOCK_MONOTONIC: the wheel must neither stall nor race when
+   the wall clock is stepped */
+static time_t sr_nat_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static time_t sr_nat_now(struct sr_nat *nat) {
+  return __atomic_load_n(&nat->now, __ATOMIC_RELAXED);
+}
+
+static int sr_nat_idle_timeout(struct sr_nat_entry *e) {
+  if (e->m.type == nat_mapping_icmp)
+    return SR_NAT_ICMP_TIMEOUT;
+  return e->conn.state == nat_tcp_established ? SR_NAT_TCP_TIMEOUT :
+                                                SR_NAT_TCP_TRANS_TIMEOUT;
+}
+
+/* Frees the tables; any of them may not have been allocated */
+static void sr_nat_free_tables(struct sr_nat *nat) {
+  int t;
+
+  free(nat->shards);
+  free(nat->slab);
+  free(nat->int_index);
+  for (t = 0; t < SR_NAT_TYPES; t++) {
+    free(nat->ext_index[t]);
+    nat->ext_index[t] = NULL;
+  }
+  nat->shards = NULL;
+  nat->slab = NULL;
+  nat->int_index = NULL;
+}
+
 int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
 
   assert(nat);
 
+  /* The tables, before the timeout thread can look at them */
+  uint32_t i;
+  int s, t;
+  unsigned int port;
+  nat->ip_ext = 0;
+  nat->now = sr_nat_clock();
+  nat->slab = calloc(SR_NAT_MAX_MAPPINGS, sizeof(struct sr_nat_entry));
+  nat->int_index = malloc(sizeof(uint32_t) << SR_NAT_HASH_BITS);
+  nat->shards = calloc(SR_NAT_SHARDS, sizeof(struct sr_nat_shard));
+  for (t = 0; t < SR_NAT_TYPES; t++)
+    nat->ext_index[t] = malloc(sizeof(uint32_t) * 65536);
+  if (!nat->slab || !nat->int_index || !nat->shards) {
+    sr_nat_free_tables(nat);
+    return -1;
+  }
+  for (t = 0; t < SR_NAT_TYPES; t++) {
+    if (!nat->ext_index[t]) {
+      sr_nat_free_tables(nat);
+      return -1;
+    }
+  }
+  memset(nat->int_index, 0xff, sizeof(uint32_t) << SR_NAT_HASH_BITS);
+  for (t = 0; t < SR_NAT_TYPES; t++)
+    memset(nat->ext_index[t], 0xff, sizeof(uint32_t) * 65536);
+
   /* Acquire mutex lock */
   pthread_mutexattr_init(&(nat->attr));
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+  int success = 0;
+
+  for (s = 0; s < SR_NAT_SHARDS; s++) {
+    struct sr_nat_shard *sh = &nat->shards[s];
+    success |= pthread_mutex_init(&sh->lock, &(nat->attr));
+    for (i = 0; i < SR_NAT_PER_SHARD; i++) {
+      uint32_t slot = s * SR_NAT_PER_SHARD + i;
+      nat->slab[slot].int_next = i + 1 < SR_NAT_PER_SHARD ? slot + 1 : SR_NAT_NONE;
+    }
+    sh->free = s * SR_NAT_PER_SHARD;
+    /* the shard hands out only the ports of its class */
+    for (t = 0; t < SR_NAT_TYPES; t++) {
+      sr_nat_ports_init(&sh->ports[t], SR_NAT_PORT_MIN,
+                        time(NULL) ^ getpid() << 8 ^ (s << 1 | t));
+      for (port = SR_NAT_PORT_MIN; port < 65536; port++)
+        if ((port & (SR_NAT_SHARDS - 1)) != (unsigned int)s)
+          sr_nat_ports_reserve(&sh->ports[t], port);
+    }
+    memset(sh->wheel, 0xff, sizeof(sh->wheel));
+    sh->wheel_time = nat->now;
+  }
 
   /* Initialize timeout thread */
 
@@ -23,51 +128,199 @@ int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
 
   /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
-  nat->mappings = NULL;
-  /* Initialize any variables here */
-
   return success;
 }
 
 
 int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
-  pthread_mutex_lock(&(nat->lock));
+  /* sleep() is where the timeout thread can be cancelled, never with
+     a lock held */
+  pthread_cancel(nat->thread);
+  pthread_join(nat->thread, NULL);
 
   /* free nat memory here */
+  int s, err = 0;
+  for (s = 0; s < SR_NAT_SHARDS; s++)
+    err |= pthread_mutex_destroy(&nat->shards[s].lock);
+  sr_nat_free_tables(nat);
+
+  err |= pthread_mutexattr_destroy(&(nat->attr));
+  err |= pthread_attr_destroy(&(nat->thread_attr));
+  return err;
+
+}
 
-  pthread_kill(nat->thread, SIGKILL);
-  return pthread_mutex_destroy(&(nat->lock)) &&
-    pthread_mutexattr_destroy(&(nat->attr));
+/* Puts slot i in the wheel slot of second due.  Shard lock held. */
+static void sr_nat_wheel_add(struct sr_nat *nat, struct sr_nat_shard *sh,
+  uint32_t i, time_t due) {
+  struct sr_nat_entry *e = &nat->slab[i];
+  uint16_t slot = due & (SR_NAT_WHEEL_SLOTS - 1);
 
+  e->wheel_slot = slot;
+  e->wheel_prev = SR_NAT_NONE;
+  e->wheel_next = sh->wheel[slot];
+  if (e->wheel_next != SR_NAT_NONE)
+    nat->slab[e->wheel_next].wheel_prev = i;
+  sh->wheel[slot] = i;
+}
+
+static void sr_nat_wheel_del(struct sr_nat *nat, struct sr_nat_shard *sh,
+  uint32_t i) {
+  struct sr_nat_entry *e = &nat->slab[i];
+
+  if (e->wheel_prev != SR_NAT_NONE)
+    nat->slab[e->wheel_prev].wheel_next = e->wheel_next;
+  else
+    sh->wheel[e->wheel_slot] = e->wheel_next;
+  if (e->wheel_next != SR_NAT_NONE)
+    nat->slab[e->wheel_next].wheel_prev = e->wheel_prev;
+}
+
+/* Unlinks slot i, already off the wheel, from the indexes and frees it.
+   Shard lock held. */
+static void sr_nat_remove(struct sr_nat *nat, struct sr_nat_shard *sh,
+  uint32_t i) {
+  struct sr_nat_entry *e = &nat->slab[i];
+  uint32_t *p = &nat->int_index[sr_nat_int_hash(e->m.ip_int, e->m.aux_int,
+                                                e->m.type)];
+
+  while (*p != i)
+    p = &nat->slab[*p].int_next;
+  *p = e->int_next;
+  nat->ext_index[e->m.type][e->m.aux_ext] = SR_NAT_NONE;
+  sr_nat_ports_release(&sh->ports[e->m.type], e->m.aux_ext);
+
+  e->used = 0;
+  e->int_next = sh->free;
+  sh->free = i;
+  sh->count--;
+}
+
+/* Runs the wheel of one shard up to now.  Packets only refresh
+   last_updated, so a mapping found in a slot may have been used since:
+   it goes back in at its real deadline, and only idle ones expire.  The
+   work is what fell due, not the size of the table. */
+static void sr_nat_expire(struct sr_nat *nat, struct sr_nat_shard *sh,
+  time_t now) {
+  while (sh->wheel_time < now) {
+    uint16_t slot = ++sh->wheel_time & (SR_NAT_WHEEL_SLOTS - 1);
+    uint32_t i;
+
+    while ((i = sh->wheel[slot]) != SR_NAT_NONE) {
+      struct sr_nat_entry *e = &nat->slab[i];
+      time_t due = e->m.last_updated + sr_nat_idle_timeout(e);
+
+      sr_nat_wheel_del(nat, sh, i);
+      if (due <= sh->wheel_time)
+        sr_nat_remove(nat, sh, i);
+      else
+        sr_nat_wheel_add(nat, sh, i, due);
+    }
+  }
 }
 
 void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
   struct sr_nat *nat = (struct sr_nat *)nat_ptr;
   while (1) {
     sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
 
-    time_t curtime = time(NULL);
+    time_t curtime = sr_nat_clock();
 
-    /* handle periodic tasks here */
-
-    pthread_mutex_unlock(&(nat->lock));
+    /* handle periodic tasks here; one shard locked at a time, for as
+       long as its due mappings take */
+    int s;
+    __atomic_store_n(&nat->now, curtime, __ATOMIC_RELAXED);
+    for (s = 0; s < SR_NAT_SHARDS; s++) {
+      struct sr_nat_shard *sh = &nat->shards[s];
+      pthread_mutex_lock(&sh->lock);
+      sr_nat_expire(nat, sh, curtime);
+      pthread_mutex_unlock(&sh->lock);
+    }
   }
   return NULL;
 }
 
+/* Slot of the mapping for an external port, or SR_NAT_NONE.  Shard lock
+   held. */
+static uint32_t sr_nat_find_external(struct sr_nat *nat, uint16_t aux_ext,
+  sr_nat_mapping_type type) {
+  return nat->ext_index[type][aux_ext];
+}
+
+/* Slot of the mapping for an internal (ip, port), or SR_NAT_NONE.  Shard
+   lock held. */
+static uint32_t sr_nat_find_internal(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type) {
+  uint32_t i = nat->int_index[sr_nat_int_hash(ip_int, aux_int, type)];
+
+  while (i != SR_NAT_NONE) {
+    struct sr_nat_mapping *m = &nat->slab[i].m;
+    if (m->ip_int == ip_int && m->aux_int == aux_int && m->type == type)
+      break;
+    i = nat->slab[i].int_next;
+  }
+  return i;
+}
+
+/* Makes a mapping with a random free external port of shard sh, or
+   returns SR_NAT_NONE if its slots or ports ran out.  Shard lock held. */
+static uint32_t sr_nat_add(struct sr_nat *nat, struct sr_nat_shard *sh,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type) {
+  uint32_t i = sh->free, h;
+  struct sr_nat_entry *e;
+  int port;
+
+  if (i == SR_NAT_NONE)
+    return SR_NAT_NONE;
+  if ((port = sr_nat_ports_alloc(&sh->ports[type])) < 0)
+    return SR_NAT_NONE;
+
+  e = &nat->slab[i];
+  sh->free = e->int_next;
+  memset(&e->m, 0, sizeof(e->m));
+  memset(&e->conn, 0, sizeof(e->conn));
+  e->m.type = type;
+  e->m.ip_int = ip_int;
+  e->m.ip_ext = nat->ip_ext;
+  e->m.aux_int = aux_int;
+  e->m.aux_ext = port;
+  e->m.last_updated = sr_nat_now(nat);
+  e->conn.state = nat_tcp_syn;
+  e->used = 1;
+
+  h = sr_nat_int_hash(ip_int, aux_int, type);
+  e->int_next = nat->int_index[h];
+  nat->int_index[h] = i;
+  nat->ext_index[type][port] = i;
+  sr_nat_wheel_add(nat, sh, i, e->m.last_updated + sr_nat_idle_timeout(e));
+  sh->count++;
+  return i;
+}
+
+/* Copy of slot i for the caller to free, NULL for SR_NAT_NONE */
+static struct sr_nat_mapping *sr_nat_copy(struct sr_nat *nat, uint32_t i) {
+  struct sr_nat_mapping *copy;
+
+  if (i == SR_NAT_NONE || !(copy = malloc(sizeof(struct sr_nat_mapping))))
+    return NULL;
+  memcpy(copy, &nat->slab[i].m, sizeof(struct sr_nat_mapping));
+  copy->next = NULL;
+  return copy;
+}
+
 /* Get the mapping associated with given external port.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
     uint16_t aux_ext, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_shard *sh = sr_nat_shard_of(nat, aux_ext);
+  pthread_mutex_lock(&sh->lock);
 
-  /* handle lookup here, malloc and assign to copy */
-  struct sr_nat_mapping *copy = NULL;
+  struct sr_nat_mapping *copy = sr_nat_copy(nat,
+    sr_nat_find_external(nat, aux_ext, type));
 
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&sh->lock);
   return copy;
 }
 
@@ -76,12 +329,14 @@ struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_shard *sh =
+    sr_nat_shard_of(nat, sr_nat_int_hash(ip_int, aux_int, type));
+  pthread_mutex_lock(&sh->lock);
 
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *copy = NULL;
+  struct sr_nat_mapping *copy = sr_nat_copy(nat,
+    sr_nat_find_internal(nat, ip_int, aux_int, type));
 
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&sh->lock);
   return copy;
 }
 
@@ -91,11 +346,173 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_shard *sh =
+    sr_nat_shard_of(nat, sr_nat_int_hash(ip_int, aux_int, type));
+  pthread_mutex_lock(&sh->lock);
 
-  /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping *mapping = NULL;
+  /* an existing mapping is kept: it must stay endpoint independent */
+  uint32_t i = sr_nat_find_internal(nat, ip_int, aux_int, type);
+  if (i == SR_NAT_NONE)
+    i = sr_nat_add(nat, sh, ip_int, aux_int, type);
+  struct sr_nat_mapping *mapping = sr_nat_copy(nat, i);
 
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&sh->lock);
   return mapping;
 }
+
+/* Where the port or ICMP id of a packet is, and its checksum: the port
+   field is the source one outbound, the destination one inbound.  TCP
+   flags come back in flags, 0 for ICMP.  Returns 0 and fills in, or -1
+   for what is not translated.  The pointers come from offsets, as the
+   headers are packed. */
+static int sr_nat_parse(uint8_t *ip_packet, unsigned int len, int outbound,
+  sr_nat_mapping_type *type, uint16_t **aux, uint16_t **l4_sum,
+  uint8_t *flags) {
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)ip_packet;
+  unsigned int hl;
+
+  if (len < sizeof(sr_ip_hdr_t))
+    return -1;
+  hl = ip_hdr->ip_hl * 4;
+  /* later fragments carry no ports: they wait for reassembly */
+  if (hl < sizeof(sr_ip_hdr_t) || ntohs(ip_hdr->ip_off) & IP_OFFMASK)
+    return -1;
+
+  if (ip_hdr->ip_p == ip_protocol_tcp) {
+    sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t *)(ip_packet + hl);
+    if (len < hl + sizeof(sr_tcp_hdr_t))
+      return -1;
+    *type = nat_mapping_tcp;
+    *aux = (uint16_t *)((uint8_t *)tcp_hdr + (outbound ?
+      offsetof(sr_tcp_hdr_t, tcp_sport) : offsetof(sr_tcp_hdr_t, tcp_dport)));
+    *l4_sum = (uint16_t *)((uint8_t *)tcp_hdr + offsetof(sr_tcp_hdr_t, tcp_sum));
+    *flags = tcp_hdr->tcp_flags;
+    return 0;
+  }
+  if (ip_hdr->ip_p == ip_protocol_icmp) {
+    sr_icmp_echo_hdr_t *icmp_hdr = (sr_icmp_echo_hdr_t *)(ip_packet + hl);
+    if (len < hl + sizeof(sr_icmp_echo_hdr_t))
+      return -1;
+    /* queries out, replies back */
+    if (icmp_hdr->icmp_type != (outbound ? 8 : 0))
+      return -1;
+    *type = nat_mapping_icmp;
+    *aux = (uint16_t *)((uint8_t *)icmp_hdr +
+                        offsetof(sr_icmp_echo_hdr_t, icmp_id));
+    *l4_sum = (uint16_t *)((uint8_t *)icmp_hdr +
+                           offsetof(sr_icmp_echo_hdr_t, icmp_sum));
+    *flags = 0;
+    return 0;
+  }
+  return -1;
+}
+
+/* Refreshes a mapping and moves a TCP one along by the flags of a
+   segment.  Only a shorter timeout needs the wheel: a longer one is
+   found when the old slot comes round.  Shard lock held. */
+static void sr_nat_track(struct sr_nat *nat, struct sr_nat_shard *sh,
+  uint32_t i, uint8_t flags, int outbound) {
+  struct sr_nat_entry *e = &nat->slab[i];
+  struct sr_nat_connection *c = &e->conn;
+  int before = sr_nat_idle_timeout(e);
+
+  e->m.last_updated = sr_nat_now(nat);
+  if (e->m.type != nat_mapping_tcp)
+    return;
+
+  if (flags & TCP_RST) {
+    c->state = nat_tcp_transitory;
+  } else if (flags & TCP_SYN) {
+    /* a SYN out (re)opens, the SYN+ACK back establishes */
+    if (outbound) {
+      c->state = nat_tcp_syn;
+      c->fin = 0;
+    } else if (c->state == nat_tcp_syn) {
+      c->state = nat_tcp_established;
+    }
+  } else if (flags & TCP_FIN) {
+    c->fin |= outbound ? SR_NAT_FIN_OUT : SR_NAT_FIN_IN;
+    c->state = c->fin == (SR_NAT_FIN_OUT | SR_NAT_FIN_IN) ?
+               nat_tcp_transitory : nat_tcp_fin;
+  } else if (c->state == nat_tcp_syn && !outbound) {
+    /* picked up mid-connection, e.g. after a restart */
+    c->state = nat_tcp_established;
+  }
+
+  if (sr_nat_idle_timeout(e) < before) {
+    sr_nat_wheel_del(nat, sh, i);
+    sr_nat_wheel_add(nat, sh, i, e->m.last_updated + sr_nat_idle_timeout(e));
+  }
+}
+
+/* Rewrites one address and port/id, adjusting the IP checksum and the
+   TCP one, whose pseudo-header covers the address; the ICMP checksum
+   covers only the id. */
+static void sr_nat_rewrite(sr_ip_hdr_t *ip_hdr, uint32_t *addr,
+  uint32_t new_addr, uint16_t *aux, uint16_t new_aux, uint16_t *l4_sum,
+  sr_nat_mapping_type type) {
+  ip_hdr->ip_sum = cksum_adjust32(ip_hdr->ip_sum, *addr, new_addr);
+  if (type == nat_mapping_tcp)
+    *l4_sum = cksum_adjust32(*l4_sum, *addr, new_addr);
+  *l4_sum = cksum_adjust(*l4_sum, *aux, htons(new_aux));
+  *addr = new_addr;
+  *aux = htons(new_aux);
+}
+
+int sr_nat_translate_outbound(struct sr_nat *nat, uint8_t *ip_packet,
+  unsigned int len) {
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)ip_packet;
+  sr_nat_mapping_type type;
+  struct sr_nat_shard *sh;
+  uint16_t *aux, *l4_sum;
+  uint8_t flags;
+  uint32_t i;
+
+  if (sr_nat_parse(ip_packet, len, 1, &type, &aux, &l4_sum, &flags) != 0)
+    return -1;
+
+  sh = sr_nat_shard_of(nat, sr_nat_int_hash(ip_hdr->ip_src, ntohs(*aux), type));
+  pthread_mutex_lock(&sh->lock);
+  i = sr_nat_find_internal(nat, ip_hdr->ip_src, ntohs(*aux), type);
+  if (i == SR_NAT_NONE)
+    i = sr_nat_add(nat, sh, ip_hdr->ip_src, ntohs(*aux), type);
+  if (i == SR_NAT_NONE) {
+    pthread_mutex_unlock(&sh->lock);
+    return -1;
+  }
+  struct sr_nat_mapping *m = &nat->slab[i].m;
+  sr_nat_track(nat, sh, i, flags, 1);
+  sr_nat_rewrite(ip_hdr,
+                 (uint32_t *)(ip_packet + offsetof(sr_ip_hdr_t, ip_src)), m->ip_ext,
+                 aux, m->aux_ext, l4_sum, type);
+  pthread_mutex_unlock(&sh->lock);
+  return 0;
+}
+
+int sr_nat_translate_inbound(struct sr_nat *nat, uint8_t *ip_packet,
+  unsigned int len) {
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)ip_packet;
+  sr_nat_mapping_type type;
+  struct sr_nat_shard *sh;
+  uint16_t *aux, *l4_sum;
+  uint8_t flags;
+  uint32_t i;
+
+  if (sr_nat_parse(ip_packet, len, 0, &type, &aux, &l4_sum, &flags) != 0)
+    return -1;
+
+  sh = sr_nat_shard_of(nat, ntohs(*aux));
+  pthread_mutex_lock(&sh->lock);
+  i = sr_nat_find_external(nat, ntohs(*aux), type);
+  if (i == SR_NAT_NONE || nat->slab[i].m.ip_ext != ip_hdr->ip_dst) {
+    pthread_mutex_unlock(&sh->lock);
+    return -1;
+  }
+  struct sr_nat_mapping *m = &nat->slab[i].m;
+  sr_nat_track(nat, sh, i, flags, 0);
+  sr_nat_rewrite(ip_hdr,
+                 (uint32_t *)(ip_packet + offsetof(sr_ip_hdr_t, ip_dst)), m->ip_int,
+                 aux, m->aux_int, l4_sum, type);
+  pthread_mutex_unlock(&sh->lock);
+  return 0;
+}
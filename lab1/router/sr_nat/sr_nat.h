@@ -1,10 +1,39 @@
-
 #ifndef SR_NAT_TABLE_H
 #define SR_NAT_TABLE_H
 
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
+#include "sr_nat_ports.h"
+
+/* Mappings live in a slab of SR_NAT_MAX_MAPPINGS entries allocated by
+   sr_nat_init(), found through two indexes that hold slab positions:
+   a chained hash on (type, internal ip, internal port) and, per type, a
+   table indexed directly by external port, which is a perfect hash since
+   there are only 64k of them.  Nothing is allocated per packet and every
+   operation is O(1) whatever the number of mappings.
+
+   The table is split in SR_NAT_SHARDS shards, each with its own lock,
+   part of the slab, port allocators and timer wheel.  A mapping belongs
+   to the shard its internal key hashes to, and is given an external port
+   in the same residue class, so either direction finds the shard without
+   a shared lock.
+
+   IP addresses are in network byte order, ports and ICMP ids in host
+   byte order. */
+#define SR_NAT_MAX_MAPPINGS  (1 << 17)
+#define SR_NAT_HASH_BITS     18            /* internal index buckets */
+#define SR_NAT_SHARDS        16            /* power of two */
+#define SR_NAT_NONE          0xffffffff    /* end of chain, no mapping */
+#define SR_NAT_PORT_MIN      1024          /* external ports handed out from */
+
+/* Idle timeouts in seconds (RFC 5508, RFC 5382) */
+#define SR_NAT_ICMP_TIMEOUT  60
+#define SR_NAT_TCP_TIMEOUT   7440          /* established */
+#define SR_NAT_TCP_TRANS_TIMEOUT 240       /* opening, closing, reset */
+
+/* One slot a second; longer than the longest timeout */
+#define SR_NAT_WHEEL_SLOTS   8192
 
 typedef enum {
   nat_mapping_icmp,
@@ -12,29 +41,71 @@ typedef enum {
   /* nat_mapping_udp, */
 } sr_nat_mapping_type;
 
+#define SR_NAT_TYPES 2
+
+typedef enum {
+  nat_tcp_syn,          /* SYN out, no SYN back yet */
+  nat_tcp_established,
+  nat_tcp_fin,          /* FIN one way */
+  nat_tcp_transitory    /* FIN both ways, or RST */
+} sr_nat_tcp_state;
+
+/* TCP state of a mapping, tracked from the flags of the segments it
+   translates.  A mapping is endpoint independent, so this follows
+   whatever connections use it together: any SYN reopens it. */
 struct sr_nat_connection {
-  /* add TCP connection state data members here */
+  sr_nat_tcp_state state;
+  uint8_t fin; /* FIN seen, SR_NAT_FIN_OUT | SR_NAT_FIN_IN */
 
   struct sr_nat_connection *next;
 };
 
+#define SR_NAT_FIN_OUT 1
+#define SR_NAT_FIN_IN  2
+
 struct sr_nat_mapping {
   sr_nat_mapping_type type;
   uint32_t ip_int; /* internal ip addr */
   uint32_t ip_ext; /* external ip addr */
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
-  time_t last_updated; /* use to timeout mappings */
+  time_t last_updated; /* use to timeout mappings, sr_nat.now seconds */
   struct sr_nat_connection *conns; /* list of connections. null for ICMP */
   struct sr_nat_mapping *next;
 };
 
+/* A slab slot: the mapping, its TCP state, its link in the internal
+   index or, when the slot is unused, the free list, and its place in the
+   timer wheel */
+struct sr_nat_entry {
+  struct sr_nat_mapping m;
+  struct sr_nat_connection conn;
+  uint32_t int_next;
+  uint32_t wheel_prev, wheel_next;
+  uint16_t wheel_slot;
+  int used;
+};
+
+struct sr_nat_shard {
+  pthread_mutex_t lock;
+  uint32_t free; /* first unused slot of this shard's part of the slab */
+  uint32_t count;
+  struct sr_nat_ports ports[SR_NAT_TYPES]; /* ports in this shard's class */
+  uint32_t wheel[SR_NAT_WHEEL_SLOTS]; /* mappings due in each second */
+  time_t wheel_time; /* slots up to this second have been run */
+};
+
 struct sr_nat {
-  /* add any fields here */
-  struct sr_nat_mapping *mappings;
+  uint32_t ip_ext; /* address mappings are made on, set before use */
+
+  struct sr_nat_entry *slab;
+  uint32_t *int_index; /* 1 << SR_NAT_HASH_BITS chain heads */
+  uint32_t *ext_index[SR_NAT_TYPES]; /* 65536 slots each */
+  struct sr_nat_shard *shards;
+  time_t now; /* CLOCK_MONOTONIC seconds, ticked by the timeout thread,
+                 stamps mappings */
 
   /* threading */
-  pthread_mutex_t lock;
   pthread_mutexattr_t attr;
   pthread_attr_t thread_attr;
   pthread_t thread;
@@ -60,5 +131,17 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
+/* Fast path.  Rewrite an IP packet in place, fixing the checksums up
+   incrementally: outbound packets (internal to external) get the source
+   replaced by nat->ip_ext and a mapped port, making the mapping if there
+   is none; inbound packets to nat->ip_ext get their destination put back.
+   TCP and ICMP echo only; TCP segments move the mapping's state along.
+   Returns 0, or -1 if the packet cannot be translated and should be
+   dropped.  Does not allocate. */
+int sr_nat_translate_outbound(struct sr_nat *nat, uint8_t *ip_packet,
+  unsigned int len);
+int sr_nat_translate_inbound(struct sr_nat *nat, uint8_t *ip_packet,
+  unsigned int len);
+
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,110 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_nat_ports.c
+ *
+ * Description:
+ *
+ * Hierarchical bitmap port allocator, see sr_nat_ports.h.  Not locked:
+ * the NAT table that owns it serializes calls.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <string.h>
+#include <assert.h>
+
+#include "sr_stats.h"
+#include "sr_nat_ports.h"
+
+/* Bits at and above bit b of a word, none for b == 64 */
+#define SR_NAT_PORTS_FROM(b) ((b) < 64 ? ~0ULL << (b) : 0ULL)
+
+static void sr_nat_ports_set(struct sr_nat_ports* p, unsigned int port)
+{
+    unsigned int w = port >> 6;
+
+    p->free[w] |= 1ULL << (port & 63);
+    p->l1[w >> 6] |= 1ULL << (w & 63);
+    p->l2 |= 1ULL << (w >> 6);
+}
+
+static void sr_nat_ports_clear(struct sr_nat_ports* p, unsigned int port)
+{
+    unsigned int w = port >> 6;
+
+    p->free[w] &= ~(1ULL << (port & 63));
+    if (p->free[w])
+        return;
+    p->l1[w >> 6] &= ~(1ULL << (w & 63));
+    if (p->l1[w >> 6])
+        return;
+    p->l2 &= ~(1ULL << (w >> 6));
+}
+
+void sr_nat_ports_init(struct sr_nat_ports* p, uint16_t min, uint32_t seed)
+{
+    unsigned int port;
+
+    memset(p, 0, sizeof(*p));
+    for (port = min; port < 65536; port++)
+        sr_nat_ports_set(p, port);
+    p->nfree = 65536 - min;
+    p->rng = seed ? seed : 0x9e3779b9;
+}
+
+void sr_nat_ports_reserve(struct sr_nat_ports* p, uint16_t port)
+{
+    if (!(p->free[port >> 6] & 1ULL << (port & 63)))
+        return;
+    sr_nat_ports_clear(p, port);
+    p->nfree--;
+}
+
+/* First free port at or after from, or -1 */
+static int sr_nat_ports_find(struct sr_nat_ports* p, unsigned int from)
+{
+    unsigned int w = from >> 6, w1 = w >> 6;
+    uint64_t m;
+
+    if ((m = p->free[w] & SR_NAT_PORTS_FROM(from & 63)))
+        return w << 6 | __builtin_ctzll(m);
+    if ((m = p->l1[w1] & SR_NAT_PORTS_FROM((w & 63) + 1)))
+        w = w1 << 6 | __builtin_ctzll(m);
+    else if ((m = p->l2 & SR_NAT_PORTS_FROM(w1 + 1))) {
+        w1 = __builtin_ctzll(m);
+        w = w1 << 6 | __builtin_ctzll(p->l1[w1]);
+    } else
+        return -1;
+    return w << 6 | __builtin_ctzll(p->free[w]);
+}
+
+int sr_nat_ports_alloc(struct sr_nat_ports* p)
+{
+    uint32_t r = p->rng;
+    int port;
+
+    if (!p->nfree) {
+        p->exhausted++;
+        sr_stat_inc(SR_STAT_NAT_PORT_EXHAUSTED);
+        return -1;
+    }
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    p->rng = r;
+
+    /* nfree says there is one, so at worst it is before the start */
+    if ((port = sr_nat_ports_find(p, r & 0xffff)) < 0)
+        port = sr_nat_ports_find(p, 0);
+    assert(port >= 0);
+    sr_nat_ports_clear(p, port);
+    p->nfree--;
+    p->allocated++;
+    return port;
+}
+
+void sr_nat_ports_release(struct sr_nat_ports* p, uint16_t port)
+{
+    assert(!(p->free[port >> 6] & 1ULL << (port & 63)));
+    sr_nat_ports_set(p, port);
+    p->nfree++;
+    p->released++;
+}
@@ -0,0 +1,51 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_nat_ports.h
+ *
+ * Description:
+ *
+ * External port allocator, one per protocol and external address.  A
+ * bit per port says whether it is free; a bit per 64-port word says
+ * whether that word has a free port, and a bit per 64 words whether any
+ * of those do.  Finding the first free port from any position looks at
+ * one word on each of the three levels, so allocation and release cost
+ * the same at 90% occupancy as when empty.
+ *
+ * Each allocation starts from a random port, so mappings are not handed
+ * out in a predictable sequence.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_NAT_PORTS_H
+#define SR_NAT_PORTS_H
+
+#include <inttypes.h>
+
+#define SR_NAT_PORTS_WORDS  (65536 / 64)
+#define SR_NAT_PORTS_L1     (SR_NAT_PORTS_WORDS / 64)
+
+struct sr_nat_ports
+{
+    uint64_t free[SR_NAT_PORTS_WORDS];  /* bit per port */
+    uint64_t l1[SR_NAT_PORTS_L1];       /* bit per word of free with one set */
+    uint64_t l2;                        /* bit per word of l1 with one set */
+    uint32_t nfree;
+    uint32_t rng;                       /* xorshift state */
+
+    uint64_t allocated, released, exhausted;
+};
+
+/* Marks ports min..65535 free. */
+void sr_nat_ports_init(struct sr_nat_ports* p, uint16_t min, uint32_t seed);
+
+/* Takes port out of the pool for good, e.g. to leave it to another
+   allocator sharing the address. */
+void sr_nat_ports_reserve(struct sr_nat_ports* p, uint16_t port);
+
+/* Takes a free port at random.  Returns it, or -1 if there is none,
+   counted in exhausted and in the nat_port_exhausted stat. */
+int sr_nat_ports_alloc(struct sr_nat_ports* p);
+
+/* Gives back a port sr_nat_ports_alloc() returned. */
+void sr_nat_ports_release(struct sr_nat_ports* p, uint16_t port);
+
+#endif /* -- SR_NAT_PORTS_H -- */
@@ -0,0 +1,213 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_nbr.c
+ *
+ * Description:
+ *
+ * Neighbor table and hello thread.  The table is filled while the FIB is
+ * built, which may be after the hello thread started, and only ever
+ * grows: a record is complete before the count that publishes it is
+ * stored, so readers walk the table without a lock.  After that only the
+ * up flag and the time last heard change, atomically.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_log.h"
+#include "sr_stats.h"
+#include "sr_nbr.h"
+
+struct sr_nbrs
+{
+    struct sr_nbr nbr[SR_NBR_MAX];
+    unsigned int n;
+    uint64_t interval_ns;
+    int running;
+    int stop;
+    pthread_t thread;
+};
+
+static uint64_t sr_nbr_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct sr_nbrs* sr_nbrs_create(void)
+{
+    return calloc(1, sizeof(struct sr_nbrs));
+}
+
+struct sr_nbr* sr_nbr_get(struct sr_nbrs* t, uint32_t ip, struct sr_if* iface)
+{
+    struct sr_nbr* n;
+    unsigned int i;
+
+    for (i = 0; i < t->n; i++)
+        if (t->nbr[i].ip == ip && t->nbr[i].iface == iface)
+            return &t->nbr[i];
+    if (t->n == SR_NBR_MAX)
+        return NULL;
+    /* a full dead interval to answer the first hello */
+    n = &t->nbr[t->n];
+    n->ip = ip;
+    n->iface = iface;
+    n->up = 1;
+    n->heard_ns = sr_nbr_now();
+    __atomic_store_n(&t->n, t->n + 1, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* Takes the frames waiting on an ARP request for ip off the queue and
+   forwards them again, now that the FIB steers around ip */
+static void sr_nbr_reroute(struct sr_instance* sr, uint32_t ip)
+{
+    struct sr_arpreq* req;
+    struct sr_packet *pkts = NULL, *pkt, *next;
+
+    pthread_mutex_lock(&sr->cache.lock);
+    for (req = sr->cache.requests; req; req = req->next)
+        if (req->ip == ip)
+            break;
+    if (req) {
+        pkts = req->packets;
+        req->packets = NULL;
+        sr_arpreq_destroy(&sr->cache, req);
+    }
+    pthread_mutex_unlock(&sr->cache.lock);
+
+    for (pkt = pkts; pkt; pkt = next) {
+        sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(pkt->buf + sizeof(sr_ethernet_hdr_t));
+        next = pkt->next;
+        send_or_queue_packet(sr, pkt->buf, pkt->len, ntohl(ip_hdr->ip_dst));
+        free(pkt->buf);
+        free(pkt->iface);
+        free(pkt);
+    }
+}
+
+/* Returns 1 if n was up */
+static int sr_nbr_set_down(struct sr_instance* sr, struct sr_nbr* n)
+{
+    struct in_addr a;
+
+    if (!__atomic_exchange_n(&n->up, 0, __ATOMIC_RELAXED))
+        return 0;
+    a.s_addr = n->ip;
+    sr_stat_inc(SR_STAT_NBR_DOWN);
+    sr_log_warn(SR_LOG_RT, "neighbor %s on %s down\n", inet_ntoa(a), n->iface->name);
+    sr_nbr_reroute(sr, n->ip);
+    return 1;
+}
+
+void sr_nbr_heard(struct sr_instance* sr, uint32_t ip)
+{
+    struct sr_nbrs* t = sr->nbrs;
+    uint64_t now;
+    unsigned int i, count;
+
+    if (!t)
+        return;
+    now = sr_nbr_now();
+    count = __atomic_load_n(&t->n, __ATOMIC_ACQUIRE);
+    for (i = 0; i < count; i++) {
+        struct sr_nbr* n = &t->nbr[i];
+        struct in_addr a;
+
+        if (n->ip != ip)
+            continue;
+        __atomic_store_n(&n->heard_ns, now, __ATOMIC_RELAXED);
+        if (__atomic_exchange_n(&n->up, 1, __ATOMIC_RELAXED))
+            continue;
+        a.s_addr = ip;
+        sr_stat_inc(SR_STAT_NBR_UP);
+        sr_log_warn(SR_LOG_RT, "neighbor %s on %s up\n", inet_ntoa(a), n->iface->name);
+    }
+}
+
+void sr_nbr_lost(struct sr_instance* sr, uint32_t ip)
+{
+    struct sr_nbrs* t = sr->nbrs;
+    unsigned int i, count;
+
+    /* without hellos nothing would ever bring it back */
+    if (!t || !t->running)
+        return;
+    count = __atomic_load_n(&t->n, __ATOMIC_ACQUIRE);
+    for (i = 0; i < count; i++)
+        if (t->nbr[i].ip == ip)
+            sr_nbr_set_down(sr, &t->nbr[i]);
+}
+
+void sr_nbr_tick(struct sr_instance* sr, unsigned int interval_ms)
+{
+    struct sr_nbrs* t = sr->nbrs;
+    uint64_t dead = SR_NBR_DEAD_MULT * (interval_ms * 1000000ULL);
+    uint64_t now = sr_nbr_now();
+    unsigned int i, count;
+
+    count = __atomic_load_n(&t->n, __ATOMIC_ACQUIRE);
+    for (i = 0; i < count; i++) {
+        struct sr_nbr* n = &t->nbr[i];
+        struct sr_arpreq hello;
+
+        if (now - __atomic_load_n(&n->heard_ns, __ATOMIC_RELAXED) > dead)
+            sr_nbr_set_down(sr, n);
+
+        memset(&hello, 0, sizeof(hello));
+        hello.ip = n->ip;
+        generate_arp_request(sr, &hello, n->iface);
+    }
+}
+
+static void* sr_nbr_main(void* arg)
+{
+    struct sr_instance* sr = arg;
+    struct sr_nbrs* t = sr->nbrs;
+    struct timespec tick;
+
+    tick.tv_sec = t->interval_ns / 1000000000ULL;
+    tick.tv_nsec = t->interval_ns % 1000000000ULL;
+
+    while (!__atomic_load_n(&t->stop, __ATOMIC_RELAXED)) {
+        sr_nbr_tick(sr, t->interval_ns / 1000000ULL);
+        nanosleep(&tick, NULL);
+    }
+    return NULL;
+}
+
+int sr_nbr_start(struct sr_instance* sr, unsigned int interval_ms)
+{
+    struct sr_nbrs* t = sr->nbrs;
+
+    if (!t || interval_ms == 0)
+        return -1;
+    t->interval_ns = interval_ms * 1000000ULL;
+    t->running = 1;
+    if (pthread_create(&t->thread, NULL, sr_nbr_main, sr) != 0) {
+        fprintf(stderr, "sr_nbr: cannot start hello thread\n");
+        t->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void sr_nbrs_destroy(struct sr_nbrs* t)
+{
+    if (!t)
+        return;
+    if (t->running) {
+        __atomic_store_n(&t->stop, 1, __ATOMIC_RELAXED);
+        pthread_join(t->thread, NULL);
+    }
+    free(t);
+}
@@ -0,0 +1,84 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_nbr.h
+ *
+ * Description:
+ *
+ * Neighbor liveness.  Every gateway named in the routing table gets a
+ * neighbor record when the FIB is built, and the FIB consults its up flag
+ * on every lookup to steer traffic off a dead next hop onto a backup.
+ *
+ * Liveness is tracked with ARP used as a hello: a thread sends each
+ * neighbor an ARP request every interval (-H, milliseconds) and declares
+ * it down when nothing has been heard from it for SR_NBR_DEAD_MULT
+ * intervals.  Any ARP frame from the neighbor -- the reply to a hello, a
+ * reply to an ordinary request, its own requests -- counts as hearing
+ * from it and brings it straight back up.  An ARP request for the
+ * neighbor that times out on the data path takes it down as well.
+ *
+ * When a neighbor goes down, frames already queued waiting for its MAC
+ * are forwarded again, which now sends them to the backup.
+ *
+ * Without the thread (-H 0, and sr_replay) every neighbor stays up and
+ * forwarding behaves as it did without backups.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_NBR_H
+#define SR_NBR_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_NBR_MAX        64
+#define SR_NBR_HELLO_MS   100   /* default hello interval, -H */
+#define SR_NBR_DEAD_MULT  3     /* intervals without a word before down */
+
+struct sr_instance;
+struct sr_if;
+struct sr_nbrs;
+
+struct sr_nbr
+{
+    uint32_t ip;                /* network order */
+    struct sr_if* iface;
+    int up;                     /* read without a lock by forwarding threads */
+    uint64_t heard_ns;          /* CLOCK_MONOTONIC */
+};
+
+/* Is the next hop n usable?  NULL (an on-link route) always is. */
+static __inline__ int sr_nbr_up(const struct sr_nbr* n)
+{
+    return !n || __atomic_load_n(&n->up, __ATOMIC_RELAXED);
+}
+
+struct sr_nbrs* sr_nbrs_create(void);
+
+/* The neighbor ip (network order) on iface, added up if new.  Returns
+   NULL if the table is full. */
+struct sr_nbr* sr_nbr_get(struct sr_nbrs* t, uint32_t ip, struct sr_if* iface);
+
+/* An ARP frame from ip (network order) arrived. */
+void sr_nbr_heard(struct sr_instance* sr, uint32_t ip);
+
+/* An ARP request for ip (network order) went unanswered. */
+void sr_nbr_lost(struct sr_instance* sr, uint32_t ip);
+
+/* Starts sending hellos every interval_ms.  Returns 0 or -1. */
+int sr_nbr_start(struct sr_instance* sr, unsigned int interval_ms);
+
+/* One round of the hello thread: downs the neighbors not heard from in
+   SR_NBR_DEAD_MULT intervals and sends each a hello.  For a caller
+   driving several routers' hellos from one thread (sr_tenant.h). */
+void sr_nbr_tick(struct sr_instance* sr, unsigned int interval_ms);
+
+/* Joins the hello thread, if any, and frees the table.  The ARP sweep
+   also reads the table (sr_nbr_lost): stop it first, and clear sr->nbrs
+   after. */
+void sr_nbrs_destroy(struct sr_nbrs* t);
+
+#endif /* -- SR_NBR_H -- */
@@ -0,0 +1,219 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pcaplog.c
+ *
+ * Description:
+ *
+ * Ring buffered pcap logger.  Producers format the on-disk record
+ * (pcap_sf_pkthdr followed by the captured bytes) straight into their
+ * ring, so the writer only has to fwrite() records back to back into a
+ * large stdio buffer.  The file is flushed when the writer goes idle
+ * rather than after every frame.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "sr_dumper.h"
+#include "sr_ring.h"
+#include "sr_pcaplog.h"
+
+#define SR_PCAPLOG_STDIO_BUF (1 << 20)
+
+struct sr_pcaplog_producer
+{
+    struct sr_ring* ring;       /* published with release once created */
+    uint64_t logged;            /* written by the owning thread only */
+    uint64_t drops;
+} __attribute__ ((aligned (SR_CACHE_LINE)));
+
+struct sr_pcaplog
+{
+    FILE*     fp;
+    char*     stdio_buf;
+    int       snaplen;
+    size_t    ring_bytes;
+    pthread_t writer;
+    int       stop;
+    unsigned int nproducers;    /* slots claimed so far */
+    uint64_t  overflow_drops;   /* frames from threads without a slot */
+    struct sr_pcaplog_producer producers[SR_PCAPLOG_PRODUCERS];
+};
+
+/* Each thread remembers the slot it claimed in the last log it used */
+static __thread struct sr_pcaplog* tls_log;
+static __thread struct sr_pcaplog_producer* tls_producer;
+
+static struct sr_pcaplog_producer* sr_pcaplog_claim(struct sr_pcaplog* log)
+{
+    struct sr_pcaplog_producer* p;
+    struct sr_ring* ring;
+    unsigned int slot;
+
+    slot = __atomic_fetch_add(&log->nproducers, 1, __ATOMIC_RELAXED);
+    if (slot >= SR_PCAPLOG_PRODUCERS) {
+        fprintf(stderr, "sr_pcaplog: more than %d logging threads\n",
+                SR_PCAPLOG_PRODUCERS);
+        return NULL;
+    }
+    if ((ring = sr_ring_create(log->ring_bytes)) == NULL) {
+        fprintf(stderr, "sr_pcaplog: out of memory for ring\n");
+        return NULL;
+    }
+    p = &log->producers[slot];
+    __atomic_store_n(&p->ring, ring, __ATOMIC_RELEASE);
+    return p;
+}
+
+/* Moves everything queued to stdio; returns the number of records. */
+static unsigned int sr_pcaplog_drain(struct sr_pcaplog* log)
+{
+    unsigned int i, n = 0, len;
+    void* rec;
+
+    for (i = 0; i < SR_PCAPLOG_PRODUCERS; i++) {
+        struct sr_ring* ring = __atomic_load_n(&log->producers[i].ring,
+                                               __ATOMIC_ACQUIRE);
+        if (!ring)
+            continue;
+        while ((rec = sr_ring_peek(ring, &len)) != NULL) {
+            if (fwrite(rec, len, 1, log->fp) != 1)
+                fprintf(stderr, "sr_pcaplog: write error\n");
+            sr_ring_release(ring, len);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void* sr_pcaplog_writer(void* arg)
+{
+    struct sr_pcaplog* log = arg;
+    int dirty = 0;
+
+    while (1) {
+        int stop = __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE);
+
+        if (sr_pcaplog_drain(log)) {
+            dirty = 1;
+            continue;
+        }
+        if (dirty) {
+            fflush(log->fp);
+            dirty = 0;
+        }
+        if (stop)
+            break;
+        usleep(SR_PCAPLOG_FLUSH_US);
+    }
+    return NULL;
+}
+
+struct sr_pcaplog* sr_pcaplog_open(const char* fname, int snaplen,
+                                   size_t ring_bytes)
+{
+    struct sr_pcaplog* log;
+
+    if (posix_memalign((void**)&log, SR_CACHE_LINE, sizeof(struct sr_pcaplog)) != 0)
+        return NULL;
+    memset(log, 0, sizeof(struct sr_pcaplog));
+    log->snaplen = snaplen;
+    log->ring_bytes = ring_bytes ? ring_bytes : SR_PCAPLOG_RING_SZ;
+
+    if ((log->fp = sr_dump_open(fname, 0, snaplen)) == NULL) {
+        free(log);
+        return NULL;
+    }
+    log->stdio_buf = malloc(SR_PCAPLOG_STDIO_BUF);
+    if (log->stdio_buf)
+        setvbuf(log->fp, log->stdio_buf, _IOFBF, SR_PCAPLOG_STDIO_BUF);
+
+    if (pthread_create(&log->writer, NULL, sr_pcaplog_writer, log) != 0) {
+        perror("sr_pcaplog: pthread_create");
+        sr_dump_close(log->fp);
+        free(log->stdio_buf);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+int sr_pcaplog_write(struct sr_pcaplog* log, const uint8_t* buf,
+                     unsigned int len)
+{
+    struct sr_pcaplog_producer* p = tls_producer;
+    struct pcap_sf_pkthdr* hdr;
+    struct timeval tv;
+    unsigned int caplen = min(len, (unsigned int)log->snaplen);
+
+    if (tls_log != log) {
+        p = tls_producer = sr_pcaplog_claim(log);
+        tls_log = log;
+    }
+    if (!p) {
+        __atomic_fetch_add(&log->overflow_drops, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    hdr = sr_ring_reserve(p->ring, sizeof(struct pcap_sf_pkthdr) + caplen);
+    if (!hdr) {
+        __atomic_store_n(&p->drops, p->drops + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    gettimeofday(&tv, 0);
+    hdr->ts.tv_sec = tv.tv_sec;
+    hdr->ts.tv_usec = tv.tv_usec;
+    hdr->caplen = caplen;
+    hdr->len = len;
+    memcpy(hdr + 1, buf, caplen);
+    sr_ring_commit(p->ring, sizeof(struct pcap_sf_pkthdr) + caplen);
+
+    __atomic_store_n(&p->logged, p->logged + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+uint64_t sr_pcaplog_logged(struct sr_pcaplog* log)
+{
+    uint64_t n = 0;
+    unsigned int i;
+    for (i = 0; i < SR_PCAPLOG_PRODUCERS; i++)
+        n += __atomic_load_n(&log->producers[i].logged, __ATOMIC_RELAXED);
+    return n;
+}
+
+uint64_t sr_pcaplog_drops(struct sr_pcaplog* log)
+{
+    uint64_t n = __atomic_load_n(&log->overflow_drops, __ATOMIC_RELAXED);
+    unsigned int i;
+    for (i = 0; i < SR_PCAPLOG_PRODUCERS; i++)
+        n += __atomic_load_n(&log->producers[i].drops, __ATOMIC_RELAXED);
+    return n;
+}
+
+void sr_pcaplog_close(struct sr_pcaplog* log)
+{
+    unsigned int i;
+
+    if (!log)
+        return;
+
+    __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(log->writer, NULL);
+
+    if (sr_pcaplog_drops(log))
+        fprintf(stderr, "sr_pcaplog: %llu frames logged, %llu dropped on full ring\n",
+                (unsigned long long)sr_pcaplog_logged(log),
+                (unsigned long long)sr_pcaplog_drops(log));
+
+    sr_dump_close(log->fp);
+    free(log->stdio_buf);
+    for (i = 0; i < SR_PCAPLOG_PRODUCERS; i++)
+        sr_ring_destroy(log->producers[i].ring);
+    free(log);
+}
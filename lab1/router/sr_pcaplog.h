@@ -0,0 +1,50 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pcaplog.h
+ *
+ * Description:
+ *
+ * Asynchronous pcap logger used by sr_log_packet().  Every thread that
+ * logs gets its own lock-free SPSC ring; a background writer thread drains
+ * the rings into the dump file with large sequential writes.  When a ring
+ * is full the frame is dropped and counted instead of stalling the caller.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PCAPLOG_H
+#define SR_PCAPLOG_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <stddef.h>
+
+#include "sr_workers.h"
+
+#define SR_PCAPLOG_RING_SZ    (4 << 20) /* bytes per producing thread */
+#define SR_PCAPLOG_PRODUCERS  SR_THREADS_MAX /* max threads that can log */
+#define SR_PCAPLOG_FLUSH_US   1000      /* writer idle poll interval */
+
+struct sr_pcaplog;
+
+/* Opens fname ("-" is stdout), writes the pcap header and starts the
+   writer thread.  snaplen bounds the bytes kept from each frame. */
+struct sr_pcaplog* sr_pcaplog_open(const char* fname, int snaplen,
+                                   size_t ring_bytes);
+
+/* Queues a copy of the frame.  Never blocks; returns -1 if it was dropped. */
+int sr_pcaplog_write(struct sr_pcaplog* log, const uint8_t* buf,
+                     unsigned int len);
+
+/* Frames accepted / dropped so far, summed over all producers. */
+uint64_t sr_pcaplog_logged(struct sr_pcaplog* log);
+uint64_t sr_pcaplog_drops(struct sr_pcaplog* log);
+
+/* Stops the writer after draining everything queued, closes the file. */
+void sr_pcaplog_close(struct sr_pcaplog* log);
+
+#endif /* -- SR_PCAPLOG_H -- */
@@ -0,0 +1,299 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_police.c
+ *
+ * Description:
+ *
+ * Token bucket policers found by longest prefix match, see sr_police.h.
+ * A bucket is kept as GCRA, like the ICMP limits: tat is when the bucket
+ * will be full again, in sr_tsc() ticks, and a packet conforms if tat is
+ * no more than burst ahead of now, moving tat on by the packet's cost.
+ * Threads race on tat with compare and swap; the loser recomputes from
+ * the tat that won.  Each policer has a cache line to itself.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_lpm.h"
+#include "sr_police.h"
+
+#define SR_POLICE_LINE_MAX 256
+
+enum { SR_POLICE_SRC, SR_POLICE_DST };
+
+struct sr_policer
+{
+    uint64_t tat;
+    double ticks_per_byte;
+    uint64_t tolerance;         /* burst, in ticks */
+    uint64_t conform_pkts, conform_bytes;
+    uint64_t exceed_pkts, exceed_bytes;
+    uint8_t dir, mark, dscp, len;
+    uint32_t prefix;            /* host order */
+    uint32_t rate_kbps, burst;
+} __attribute__((aligned(64)));
+
+struct sr_police
+{
+    struct sr_lpm* lpm[2];      /* SR_POLICE_SRC, SR_POLICE_DST */
+    struct sr_policer* policers;
+    unsigned int n;
+};
+
+static void sr_police_dump(FILE* fp, void* arg)
+{
+    struct sr_police* p = arg;
+    unsigned int i;
+
+    for (i = 0; i < p->n; i++) {
+        struct sr_policer* pl = &p->policers[i];
+        struct in_addr a;
+        a.s_addr = htonl(pl->prefix);
+        fprintf(fp, "police %s %s/%u %u kbit/s burst %u: conform %llu pkts "
+                "%llu bytes, exceed %llu pkts %llu bytes (%s)\n",
+                pl->dir == SR_POLICE_SRC ? "src" : "dst", inet_ntoa(a), pl->len,
+                pl->rate_kbps, pl->burst,
+                (unsigned long long)__atomic_load_n(&pl->conform_pkts, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&pl->conform_bytes, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&pl->exceed_pkts, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&pl->exceed_bytes, __ATOMIC_RELAXED),
+                pl->mark ? "mark" : "drop");
+    }
+}
+
+/* Fills pl from one line; returns an error or NULL */
+static const char* sr_police_parse(struct sr_policer* pl, char* line,
+                                   double ticks_per_ns)
+{
+    char *tok, *save = NULL, *slash, *end;
+    unsigned long v;
+    unsigned int len = 32;
+    struct in_addr a;
+
+    if ((tok = strtok_r(line, " \t", &save)) == NULL)
+        return "empty line";
+    if (strcmp(tok, "src") == 0)
+        pl->dir = SR_POLICE_SRC;
+    else if (strcmp(tok, "dst") == 0)
+        pl->dir = SR_POLICE_DST;
+    else
+        return "expected src or dst";
+
+    if ((tok = strtok_r(NULL, " \t", &save)) == NULL)
+        return "missing prefix";
+    if ((slash = strchr(tok, '/')) != NULL) {
+        *slash = '\0';
+        len = strtoul(slash + 1, &end, 10);
+        if (slash[1] == '\0' || *end != '\0' || len > 32)
+            return "bad prefix length";
+    }
+    if (inet_pton(AF_INET, tok, &a) != 1)
+        return "bad address";
+    pl->len = len;
+    pl->prefix = ntohl(a.s_addr) & (len ? ~0U << (32 - len) : 0);
+    pl->dscp = SR_POLICE_DSCP;
+
+    while ((tok = strtok_r(NULL, " \t", &save)) != NULL) {
+        char* eq = strchr(tok, '=');
+        if (!eq)
+            return "expected key=value";
+        *eq++ = '\0';
+        if (strcmp(tok, "exceed") == 0) {
+            if (strcmp(eq, "drop") == 0)
+                pl->mark = 0;
+            else if (strcmp(eq, "mark") == 0)
+                pl->mark = 1;
+            else
+                return "exceed is drop or mark";
+            continue;
+        }
+        v = strtoul(eq, &end, 10);
+        if (*eq == '\0' || *end != '\0')
+            return "bad number";
+        if (strcmp(tok, "rate") == 0 && v > 0 && v <= 0xffffffffUL)
+            pl->rate_kbps = v;
+        else if (strcmp(tok, "burst") == 0 && v > 0 && v <= 0xffffffffUL)
+            pl->burst = v;
+        else if (strcmp(tok, "dscp") == 0 && v < 64)
+            pl->dscp = v;
+        else
+            return "unknown key or value out of range";
+    }
+    if (!pl->rate_kbps)
+        return "missing rate";
+
+    /* kbit/s is bits per ms */
+    if (!pl->burst)
+        pl->burst = pl->rate_kbps / 8 * SR_POLICE_BURST_MS;
+    if (pl->burst < 1514)
+        pl->burst = 1514;
+    pl->ticks_per_byte = 8e6 / pl->rate_kbps * ticks_per_ns;
+    pl->tolerance = pl->burst * pl->ticks_per_byte;
+    return NULL;
+}
+
+struct sr_police* sr_police_load(const char* path)
+{
+    struct sr_police* p;
+    char line[SR_POLICE_LINE_MAX], *s;
+    const char* err = NULL;
+    unsigned int lineno = 0, i;
+    double ticks_per_ns = sr_stats_ticks_per_ns();
+    FILE* fp;
+    void* mem;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return NULL;
+    }
+    if ((p = calloc(1, sizeof(*p))) == NULL ||
+        posix_memalign(&mem, 64, SR_POLICE_MAX * sizeof(struct sr_policer)) != 0) {
+        fprintf(stderr, "sr_police: out of memory\n");
+        fclose(fp);
+        free(p);
+        return NULL;
+    }
+    p->policers = mem;
+    memset(p->policers, 0, SR_POLICE_MAX * sizeof(struct sr_policer));
+
+    while (!err && fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if ((s = strchr(line, '#')) != NULL)
+            *s = '\0';
+        s = line + strspn(line, " \t\r\n");
+        s[strcspn(s, "\r\n")] = '\0';
+        if (*s == '\0')
+            continue;
+        if (p->n == SR_POLICE_MAX)
+            err = "too many policers";
+        else if ((err = sr_police_parse(&p->policers[p->n], s, ticks_per_ns)) == NULL) {
+            struct sr_policer* pl = &p->policers[p->n];
+            for (i = 0; i < p->n; i++)
+                if (p->policers[i].dir == pl->dir && p->policers[i].len == pl->len &&
+                    p->policers[i].prefix == pl->prefix)
+                    err = "prefix already policed";
+            p->n++;
+        }
+    }
+    fclose(fp);
+
+    for (i = 0; !err && i < 2; i++)
+        if ((p->lpm[i] = sr_lpm_create()) == NULL)
+            err = "out of memory";
+    for (i = 0; !err && i < p->n; i++) {
+        struct sr_policer* pl = &p->policers[i];
+        if (sr_lpm_insert(p->lpm[pl->dir], pl->prefix, pl->len, pl) != 0)
+            err = "out of memory";
+    }
+    if (err) {
+        fprintf(stderr, "sr_police: %s:%u: %s\n", path, lineno, err);
+        sr_police_destroy(p);
+        return NULL;
+    }
+    sr_stats_add_dumper(sr_police_dump, p);
+    return p;
+}
+
+/* Takes len bytes from pl's bucket at now, or returns 0 if it has not
+   got them */
+static int sr_police_take(struct sr_policer* pl, uint64_t now, unsigned int len)
+{
+    uint64_t tat = __atomic_load_n(&pl->tat, __ATOMIC_RELAXED), next;
+
+    do {
+        uint64_t base = tat > now ? tat : now;
+        if (base - now > pl->tolerance)
+            return 0;
+        next = base + (uint64_t)(len * pl->ticks_per_byte);
+    } while (!__atomic_compare_exchange_n(&pl->tat, &tat, next, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/* Gives back what sr_police_take() took for a packet that was dropped */
+static void sr_police_give(struct sr_policer* pl, unsigned int len)
+{
+    __atomic_fetch_sub(&pl->tat, (uint64_t)(len * pl->ticks_per_byte), __ATOMIC_RELAXED);
+}
+
+/* Rewrites the DSCP, keeping the ECN bits, and patches the checksum */
+static void sr_police_mark(sr_ip_hdr_t* ip_hdr, uint8_t dscp)
+{
+    uint8_t* b = (uint8_t*)ip_hdr;
+    uint8_t tos = dscp << 2 | (b[1] & 3);
+
+    if (tos == b[1])
+        return;
+    ip_hdr->ip_sum = cksum_adjust(ip_hdr->ip_sum, htons(b[0] << 8 | b[1]),
+                                  htons(b[0] << 8 | tos));
+    b[1] = tos;
+}
+
+int sr_police_check(struct sr_police* p, uint8_t* ip_packet, unsigned int len)
+{
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)ip_packet;
+    struct sr_policer* pl[2];
+    int took[2], drop = 0;
+    uint64_t now;
+    int d;
+
+    if (!p)
+        return 0;
+    pl[SR_POLICE_SRC] = sr_lpm_lookup(p->lpm[SR_POLICE_SRC], ntohl(ip_hdr->ip_src));
+    pl[SR_POLICE_DST] = sr_lpm_lookup(p->lpm[SR_POLICE_DST], ntohl(ip_hdr->ip_dst));
+    if (!pl[SR_POLICE_SRC] && !pl[SR_POLICE_DST])
+        return 0;
+
+    /* charge both buckets before deciding, and give back what was taken
+       if either drops the packet: a bucket pays only for what leaves */
+    now = sr_tsc();
+    for (d = SR_POLICE_SRC; d <= SR_POLICE_DST; d++) {
+        took[d] = pl[d] && sr_police_take(pl[d], now, len);
+        if (pl[d] && !took[d] && !pl[d]->mark)
+            drop = 1;
+    }
+
+    for (d = SR_POLICE_SRC; d <= SR_POLICE_DST; d++) {
+        if (!pl[d])
+            continue;
+        if (took[d]) {
+            if (drop) {
+                sr_police_give(pl[d], len);
+                continue;
+            }
+            __atomic_fetch_add(&pl[d]->conform_pkts, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&pl[d]->conform_bytes, len, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_fetch_add(&pl[d]->exceed_pkts, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&pl[d]->exceed_bytes, len, __ATOMIC_RELAXED);
+        if (!drop) {
+            sr_stat_inc(SR_STAT_POLICE_MARK);
+            sr_police_mark(ip_hdr, pl[d]->dscp);
+        }
+    }
+    if (drop) {
+        sr_stat_inc(SR_STAT_DROP_POLICE);
+        return -1;
+    }
+    return 0;
+}
+
+void sr_police_destroy(struct sr_police* p)
+{
+    if (!p)
+        return;
+    sr_stats_del_dumper(sr_police_dump, p);
+    if (p->lpm[SR_POLICE_SRC])
+        sr_lpm_destroy(p->lpm[SR_POLICE_SRC], NULL);
+    if (p->lpm[SR_POLICE_DST])
+        sr_lpm_destroy(p->lpm[SR_POLICE_DST], NULL);
+    free(p->policers);
+    free(p);
+}
@@ -0,0 +1,58 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_police.h
+ *
+ * Description:
+ *
+ * Per prefix ingress policers (-B).  Each policer is a token bucket of
+ * rate kbit/s and burst bytes on the traffic from (src) or to (dst) one
+ * prefix.  A packet is policed once the router knows it will forward it
+ * -- past the ACL, the TTL check and the route lookup -- and charged to
+ * the longest matching source prefix and the longest matching destination
+ * prefix, each found with an sr_lpm table like the FIB's.  A packet within both buckets conforms;
+ * one that exceeds a bucket is dropped, or marked with a lower DSCP and
+ * forwarded, as that policer says.
+ *
+ * One policer per line, '#' starts a comment:
+ *
+ *   (src|dst) A.B.C.D/LEN rate=KBITS [burst=BYTES] [exceed=drop|mark]
+ *                         [dscp=N]
+ *
+ * burst defaults to 10 ms at rate and at least one full frame, exceed to
+ * drop and dscp, for mark, to SR_POLICE_DSCP.
+ *
+ * A bucket is one 64-bit GCRA timestamp moved with compare and swap, so
+ * policing takes no lock on any number of threads.  Conforming and
+ * exceeding packets and bytes are counted per policer and printed with
+ * the stats.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_POLICE_H
+#define SR_POLICE_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_POLICE_MAX        4096
+#define SR_POLICE_DSCP       8          /* CS1, lower effort */
+#define SR_POLICE_BURST_MS   10
+
+struct sr_police;
+
+/* Loads the policers in path.  Returns NULL and names the offending line
+   on an error. */
+struct sr_police* sr_police_load(const char* path);
+
+/* Charges an IP packet of len bytes to its policers, remarking its DSCP
+   if one that marks is exceeded.  Returns 0 to forward it, -1 if it is
+   to be dropped.  A NULL policer set passes everything.  Thread safe. */
+int sr_police_check(struct sr_police* p, uint8_t* ip_packet, unsigned int len);
+
+void sr_police_destroy(struct sr_police* p);
+
+#endif /* -- SR_POLICE_H -- */
@@ -102,6 +102,40 @@ struct sr_icmp_t3_hdr {
 typedef struct sr_icmp_t3_hdr sr_icmp_t3_hdr_t;
 
 
+/* Structure of an ICMP echo request or reply header
+ */
+struct sr_icmp_echo_hdr {
+  uint8_t icmp_type;
+  uint8_t icmp_code;
+  uint16_t icmp_sum;
+  uint16_t icmp_id;
+  uint16_t icmp_seq;
+
+} __attribute__ ((packed)) ;
+typedef struct sr_icmp_echo_hdr sr_icmp_echo_hdr_t;
+
+
+/* Structure of a TCP header, naked of options
+ */
+struct sr_tcp_hdr {
+  uint16_t tcp_sport;
+  uint16_t tcp_dport;
+  uint32_t tcp_seq;
+  uint32_t tcp_ack;
+  uint8_t  tcp_off;			/* data offset in the high nibble */
+  uint8_t  tcp_flags;
+#define	TCP_FIN 0x01
+#define	TCP_SYN 0x02
+#define	TCP_RST 0x04
+#define	TCP_ACK 0x10
+  uint16_t tcp_win;
+  uint16_t tcp_sum;
+  uint16_t tcp_urp;
+
+} __attribute__ ((packed)) ;
+typedef struct sr_tcp_hdr sr_tcp_hdr_t;
+
+
 
 
 /*
@@ -119,6 +153,9 @@ struct sr_ip_hdr
 #error "Byte ordering ot specified " 
 #endif 
     uint8_t ip_tos;			/* type of service */
+#define	IPTOS_ECN_MASK 0x03		/* ECN field, RFC 3168 */
+#define	IPTOS_ECN_NOT_ECT 0x00		/* not ECN capable */
+#define	IPTOS_ECN_CE 0x03		/* congestion experienced */
     uint16_t ip_len;			/* total length */
     uint16_t ip_id;			/* identification */
     uint16_t ip_off;			/* fragment offset field */
@@ -152,6 +189,7 @@ typedef struct sr_ethernet_hdr sr_ethernet_hdr_t;
 
 enum sr_ip_protocol {
   ip_protocol_icmp = 0x0001,
+  ip_protocol_tcp = 0x0006,
 };
 
 enum sr_ethertype {
@@ -0,0 +1,204 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_punt.c
+ *
+ * Description:
+ *
+ * Control-plane queue and thread.  Each class is a fixed array of slots
+ * used as a circular queue; producers copy the frame into the tail slot
+ * under the lock, the single consumer handles the head slot in place with
+ * the lock dropped and only then gives it back.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_stats.h"
+#include "sr_log.h"
+#include "sr_punt.h"
+
+struct sr_punt_rec
+{
+    uint64_t t_enq;             /* sr_tsc() when queued */
+    char iface[sr_IFACE_NAMELEN];
+    uint32_t len;
+    uint8_t type;
+    uint8_t code;
+    uint8_t frame[SR_PUNT_FRAME_MAX];
+};
+
+struct sr_punt_q
+{
+    struct sr_punt_rec* slots;
+    unsigned int head;
+    unsigned int count;
+};
+
+struct sr_punt
+{
+    struct sr_instance* sr;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    unsigned int depth;
+    int stop;
+    struct sr_punt_q q[SR_PUNT_NCLASS];
+};
+
+static void* sr_punt_main(void* arg)
+{
+    struct sr_punt* p = arg;
+    struct sr_punt_q* q;
+    struct sr_punt_rec* rec;
+    int c;
+
+#ifdef _LINUX_
+    /* niceness is per thread on Linux */
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), SR_PUNT_NICE) != 0)
+        sr_log_warn(SR_LOG_ROUTER, "punt: cannot lower thread priority\n");
+#endif
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        for (c = 0; c < SR_PUNT_NCLASS && p->q[c].count == 0; c++)
+            ;
+        if (c == SR_PUNT_NCLASS) {
+            if (p->stop)
+                break;
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+
+        /* the head slot is ours until count drops, producers only write
+           past the tail */
+        q = &p->q[c];
+        rec = &q->slots[q->head];
+        pthread_mutex_unlock(&p->lock);
+
+        sr_hist_end(SR_HIST_PUNT, rec->t_enq);
+        sr_punt_handle(p->sr, c, rec->frame, rec->len,
+                       rec->iface[0] ? rec->iface : NULL, rec->type, rec->code);
+
+        pthread_mutex_lock(&p->lock);
+        q->head = (q->head + 1) % p->depth;
+        q->count--;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+struct sr_punt* sr_punt_start(struct sr_instance* sr, unsigned int depth)
+{
+    struct sr_punt* p;
+    int c;
+
+    if (depth == 0) {
+        fprintf(stderr, "sr_punt: queue depth must be at least 1\n");
+        return NULL;
+    }
+    if ((p = calloc(1, sizeof(struct sr_punt))) == NULL)
+        return NULL;
+    p->sr = sr;
+    p->depth = depth;
+    for (c = 0; c < SR_PUNT_NCLASS; c++)
+        if ((p->q[c].slots = calloc(depth, sizeof(struct sr_punt_rec))) == NULL)
+            goto fail;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, sr_punt_main, p) != 0) {
+        fprintf(stderr, "sr_punt: cannot start control-plane thread\n");
+        goto fail;
+    }
+    return p;
+
+fail:
+    for (c = 0; c < SR_PUNT_NCLASS; c++)
+        free(p->q[c].slots);
+    free(p);
+    return NULL;
+}
+
+int sr_punt(struct sr_instance* sr, enum sr_punt_class c, const uint8_t* frame,
+            unsigned int len, const char* iface, uint8_t type, uint8_t code)
+{
+    struct sr_punt* p = sr->punt;
+    struct sr_punt_q* q;
+    struct sr_punt_rec* rec;
+
+    if (len > SR_PUNT_FRAME_MAX) {
+        /* an ICMP error only quotes the headers */
+        if (c != SR_PUNT_ICMP_ERR) {
+            sr_stat_inc(SR_STAT_DROP_PUNT_ARP + c);
+            return -1;
+        }
+        len = SR_PUNT_FRAME_MAX;
+    }
+
+    if (!p) {
+        uint8_t copy[SR_PUNT_FRAME_MAX];
+        char name[sr_IFACE_NAMELEN];
+
+        /* the handlers may rewrite the frame and expect their own copy */
+        memcpy(copy, frame, len);
+        if (iface) {
+            strncpy(name, iface, sr_IFACE_NAMELEN);
+            name[sr_IFACE_NAMELEN - 1] = '\0';
+        }
+        sr_stat_inc(SR_STAT_PUNT_ARP + c);
+        sr_punt_handle(sr, c, copy, len, iface ? name : NULL, type, code);
+        return 0;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    q = &p->q[c];
+    if (q->count == p->depth) {
+        pthread_mutex_unlock(&p->lock);
+        sr_stat_inc(SR_STAT_DROP_PUNT_ARP + c);
+        return -1;
+    }
+    rec = &q->slots[(q->head + q->count) % p->depth];
+    rec->t_enq = sr_tsc();
+    if (iface) {
+        strncpy(rec->iface, iface, sr_IFACE_NAMELEN);
+        rec->iface[sr_IFACE_NAMELEN - 1] = '\0';
+    } else {
+        rec->iface[0] = '\0';
+    }
+    rec->len = len;
+    rec->type = type;
+    rec->code = code;
+    memcpy(rec->frame, frame, len);
+    q->count++;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    sr_stat_inc(SR_STAT_PUNT_ARP + c);
+    return 0;
+}
+
+void sr_punt_stop(struct sr_punt* p)
+{
+    int c;
+
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    for (c = 0; c < SR_PUNT_NCLASS; c++)
+        free(p->q[c].slots);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
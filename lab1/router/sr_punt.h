@@ -0,0 +1,64 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_punt.h
+ *
+ * Description:
+ *
+ * Punt path.  Work that only matters to the router itself -- answering
+ * ARP requests, handling IP addressed to one of our interfaces and
+ * generating ICMP errors -- is copied into a bounded queue and handled by
+ * a control-plane thread, so a ping flood or a traceroute storm cannot
+ * hold up transit forwarding.
+ *
+ * There is one queue per class, served in strict priority order (ARP
+ * before ICMP errors before local delivery).  A full queue drops the
+ * frame and counts it; the forwarding thread never waits on the control
+ * plane.  The control-plane thread runs at a lower scheduling priority.
+ *
+ * ARP replies are not punted: they release frames queued on the data
+ * path and are handled inline.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PUNT_H
+#define SR_PUNT_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_PUNT_DEPTH      128   /* default frames queued per class, -P */
+#define SR_PUNT_FRAME_MAX  1600  /* longer frames are dropped, or cut for ICMP errors */
+#define SR_PUNT_NICE       10    /* control-plane thread niceness */
+
+/* In priority order; the counters SR_STAT_PUNT_* follow the same order */
+enum sr_punt_class
+{
+    SR_PUNT_ARP = 0,            /* ARP request */
+    SR_PUNT_ICMP_ERR,           /* ICMP error about the frame, type/code given */
+    SR_PUNT_LOCAL,              /* IP datagram addressed to the router */
+    SR_PUNT_NCLASS
+};
+
+struct sr_instance;
+struct sr_punt;
+
+/* Starts the control-plane thread for sr with depth frames per class. */
+struct sr_punt* sr_punt_start(struct sr_instance* sr, unsigned int depth);
+
+/* Hands frame to the control plane.  Without a punt thread (sr->punt is
+   NULL, e.g. sr_replay) the frame is handled before returning.  iface is
+   the ingress interface and may be NULL.  Returns 0, or -1 if the queue
+   was full and the frame dropped. */
+int sr_punt(struct sr_instance* sr, enum sr_punt_class c, const uint8_t* frame,
+            unsigned int len, const char* iface, uint8_t type, uint8_t code);
+
+/* Handles what is already queued, joins the thread and frees the queue.
+   Whatever punts -- the workers, the ARP thread -- must be stopped first,
+   and sr->punt cleared after. */
+void sr_punt_stop(struct sr_punt* p);
+
+#endif /* -- SR_PUNT_H -- */
@@ -0,0 +1,475 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_replay.c
+ *
+ * Description:
+ *
+ * Offline driver for the forwarding engine.  Links the router core without
+ * sr_vns_comm.c, loads a pcap file into memory and feeds every frame
+ * straight into sr_handlepacket() as fast as possible.  sr_send_packet()
+ * is provided here: transmitted frames are counted, folded into a digest
+ * for regression checks and optionally written to an output pcap.
+ *
+ * ARP requests the router emits are answered by a synthetic neighbour
+ * (MAC derived from the IP) after the current frame has been handled, so
+ * a replay is deterministic and needs no real peers.
+ *
+ *   ./sr_replay -r rtable -w out.pcap -n 10 in.pcap > /dev/null
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_dumper.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_acl.h"
+#include "sr_police.h"
+#include "sr_flow.h"
+
+#define DEFAULT_RTABLE  "rtable"
+#define DEFAULT_INGRESS "eth3"
+#define REPLAY_SNAPLEN  65535
+#define MAX_PENDING_ARP 64
+
+/* One captured frame, held in memory for the whole run */
+struct replay_frame
+{
+    struct pcap_pkthdr h;
+    uint8_t* buf;
+};
+
+/* Deferred ARP reply to inject once the router returns */
+struct replay_arp
+{
+    char     iface[sr_IFACE_NAMELEN];
+    uint8_t  router_mac[ETHER_ADDR_LEN];
+    uint32_t router_ip;
+    uint32_t host_ip;
+};
+
+static struct
+{
+    pthread_mutex_t lock;   /* the ARP sweep thread transmits too */
+    FILE*    out;
+    struct pcap_pkthdr cur; /* header of the frame being replayed */
+    uint64_t tx_frames;
+    uint64_t tx_bytes;
+    uint64_t digest;
+    int      auto_arp;
+    struct replay_arp arp[MAX_PENDING_ARP];
+    unsigned int narp;
+} replay;
+
+/* Lab1 topology, same addresses as sr_bench */
+static const char* default_ifs[][3] = {
+    { "eth1", "192.168.2.1", "02:00:00:00:00:01" },
+    { "eth2", "172.64.3.1",  "02:00:00:00:00:02" },
+    { "eth3", "10.0.1.1",    "02:00:00:00:00:03" }
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a, order dependent so reordering shows up as a digest change */
+static uint64_t fnv1a(uint64_t h, const uint8_t* p, unsigned int len)
+{
+    unsigned int i;
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_send_packet(..)
+ * Scope:  Global
+ *
+ * Replaces the VNS transmit path: capture the frame instead of writing
+ * it to a socket.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_send_packet(struct sr_instance* sr /* borrowed */,
+                   uint8_t* buf /* borrowed */,
+                   unsigned int len,
+                   const char* iface /* borrowed */)
+{
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)buf;
+
+    assert(sr);
+    assert(buf);
+
+    if (len < sizeof(sr_ethernet_hdr_t))
+        return -1;
+
+    pthread_mutex_lock(&replay.lock);
+    replay.tx_frames++;
+    replay.tx_bytes += len;
+    replay.digest = fnv1a(replay.digest, (const uint8_t*)iface, strlen(iface));
+    replay.digest = fnv1a(replay.digest, buf, len);
+
+    if (replay.out) {
+        struct pcap_pkthdr h = replay.cur;
+        h.caplen = h.len = len;
+        sr_dump(replay.out, &h, buf);
+    }
+
+    if (replay.auto_arp && ntohs(eth->ether_type) == ethertype_arp &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t) &&
+        replay.narp < MAX_PENDING_ARP) {
+        sr_arp_hdr_t* arp = (sr_arp_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t));
+        if (ntohs(arp->ar_op) == arp_op_request) {
+            struct replay_arp* a = &replay.arp[replay.narp++];
+            strncpy(a->iface, iface, sr_IFACE_NAMELEN);
+            memcpy(a->router_mac, arp->ar_sha, ETHER_ADDR_LEN);
+            a->router_ip = arp->ar_sip;
+            a->host_ip = arp->ar_tip;
+        }
+    }
+    pthread_mutex_unlock(&replay.lock);
+    return 0;
+} /* -- sr_send_packet -- */
+
+/* Fragments come in pieces; the capture wants them whole */
+int sr_send_packetv(struct sr_instance* sr, const struct iovec* iov, int iovcnt,
+                    const char* iface)
+{
+    uint8_t buf[REPLAY_SNAPLEN];
+    unsigned int len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (len + iov[i].iov_len > sizeof(buf))
+            return -1;
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return sr_send_packet(sr, buf, len, iface);
+}
+
+/* The egress queues write through this; replay runs without them, so it
+   only has to link. */
+int sr_vns_send(struct sr_instance* sr, const uint8_t* buf, unsigned int len,
+                const char* iface)
+{
+    return sr_send_packet(sr, (uint8_t*)buf, len, iface);
+}
+
+/* Answer the ARP requests queued by sr_send_packet(). */
+static void replay_flush_arp(struct sr_instance* sr)
+{
+    struct replay_arp pending[MAX_PENDING_ARP];
+    unsigned int i, n;
+
+    pthread_mutex_lock(&replay.lock);
+    n = replay.narp;
+    memcpy(pending, replay.arp, n * sizeof(struct replay_arp));
+    replay.narp = 0;
+    pthread_mutex_unlock(&replay.lock);
+
+    for (i = 0; i < n; i++) {
+        uint8_t frame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+        sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+        sr_arp_hdr_t* arp = (sr_arp_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+        uint8_t mac[ETHER_ADDR_LEN] = { 0x02, 0x00 };
+
+        memcpy(mac + 2, &pending[i].host_ip, 4);
+        memcpy(eth->ether_dhost, pending[i].router_mac, ETHER_ADDR_LEN);
+        memcpy(eth->ether_shost, mac, ETHER_ADDR_LEN);
+        eth->ether_type = htons(ethertype_arp);
+        arp->ar_hrd = htons(arp_hrd_ethernet);
+        arp->ar_pro = htons(ethertype_ip);
+        arp->ar_hln = ETHER_ADDR_LEN;
+        arp->ar_pln = 4;
+        arp->ar_op = htons(arp_op_reply);
+        memcpy(arp->ar_sha, mac, ETHER_ADDR_LEN);
+        arp->ar_sip = pending[i].host_ip;
+        memcpy(arp->ar_tha, pending[i].router_mac, ETHER_ADDR_LEN);
+        arp->ar_tip = pending[i].router_ip;
+
+        sr_handlepacket(sr, frame, sizeof(frame), pending[i].iface);
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Setup
+ *---------------------------------------------------------------------*/
+
+static int replay_add_if(struct sr_instance* sr, const char* name,
+                         const char* ip, const char* mac)
+{
+    struct in_addr addr;
+    unsigned int m[ETHER_ADDR_LEN];
+    unsigned char hw[ETHER_ADDR_LEN];
+    int i;
+
+    if (!inet_aton(ip, &addr) ||
+        sscanf(mac, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4],
+               &m[5]) != ETHER_ADDR_LEN) {
+        fprintf(stderr, "sr_replay: bad interface %s %s %s\n", name, ip, mac);
+        return -1;
+    }
+    for (i = 0; i < ETHER_ADDR_LEN; i++)
+        hw[i] = m[i];
+
+    sr_add_interface(sr, name);
+    sr_set_ether_addr(sr, hw);
+    sr_set_ether_ip(sr, addr.s_addr);
+    return 0;
+}
+
+/* Interface file: one "name ip mac" per line, '#' starts a comment */
+static int replay_load_ifs(struct sr_instance* sr, const char* fname)
+{
+    char line[BUFSIZ], name[sr_IFACE_NAMELEN], ip[32], mac[32];
+    FILE* fp;
+    unsigned int i;
+
+    if (!fname) {
+        for (i = 0; i < sizeof(default_ifs) / sizeof(default_ifs[0]); i++)
+            if (replay_add_if(sr, default_ifs[i][0], default_ifs[i][1],
+                              default_ifs[i][2]) < 0)
+                return -1;
+        return 0;
+    }
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        perror("sr_replay: interface file");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || sscanf(line, "%31s %31s %31s", name, ip, mac) != 3)
+            continue;
+        if (replay_add_if(sr, name, ip, mac) < 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static struct replay_frame* replay_load_pcap(const char* fname, unsigned int* count)
+{
+    static uint8_t buf[REPLAY_SNAPLEN];
+    struct replay_frame* frames = NULL;
+    unsigned int n = 0, cap = 0;
+    struct pcap_pkthdr h;
+    int swapped, len;
+    FILE* fp;
+
+    if ((fp = sr_dump_read_open(fname, &swapped, NULL)) == NULL)
+        return NULL;
+
+    while ((len = sr_dump_read(fp, swapped, &h, buf, sizeof(buf))) > 0) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            frames = realloc(frames, cap * sizeof(struct replay_frame));
+            assert(frames);
+        }
+        frames[n].h = h;
+        frames[n].buf = malloc(len);
+        assert(frames[n].buf);
+        memcpy(frames[n].buf, buf, len);
+        n++;
+    }
+    if (len < 0)
+        fprintf(stderr, "sr_replay: %s: corrupt record after %u frames\n",
+                fname, n);
+    if (fp != stdin)
+        fclose(fp);
+
+    *count = n;
+    return frames;
+}
+
+/* Pick the receiving interface from the destination MAC */
+static const char* replay_ingress(struct sr_instance* sr, const uint8_t* frame,
+                                  unsigned int len, const char* fallback)
+{
+    struct sr_if* iface;
+
+    if (len >= sizeof(sr_ethernet_hdr_t)) {
+        for (iface = sr->if_list; iface; iface = iface->next)
+            if (memcmp(frame, iface->addr, ETHER_ADDR_LEN) == 0)
+                return iface->name;
+    }
+    return fallback;
+}
+
+static void usage(char* argv0)
+{
+    printf("Offline pcap replay driver for the sr forwarding engine\n");
+    printf("Format: %s [-h] [-r routing table] [-i interface file] \n", argv0);
+    printf("           [-I default ingress] [-w out.pcap] [-n loops] [-A] [-c] \n");
+    printf("           [-a acl] [-b policers] [-e flow export] [-m MTU] in.pcap\n");
+    printf("   -a filters forwarded frames through the ingress ACL in file acl\n");
+    printf("   -b polices forwarded frames with the policers in file policers\n");
+    printf("   -e accounts forwarded frames per flow and exports them, see -E of sr\n");
+    printf("   -m sets the interface MTUs, see -M of sr\n");
+    printf("   -A disables the synthetic ARP responder\n");
+    printf("   -c prints the forwarding counters and stage latencies at the end\n");
+    printf("   defaults rtable=%s ingress=%s loops=1\n", DEFAULT_RTABLE,
+           DEFAULT_INGRESS);
+}
+
+int main(int argc, char** argv)
+{
+    char* rtable = DEFAULT_RTABLE;
+    char* iffile = 0;
+    char* ingress = DEFAULT_INGRESS;
+    char* outfile = 0;
+    char* acl = 0;
+    char* police = 0;
+    char* flows = 0;
+    char* mtu = 0;
+    unsigned int loops = 1, nframes = 0, i, l, counters = 0;
+    struct replay_frame* frames;
+    struct sr_instance sr;
+    struct sr_rt* rt;
+    uint8_t* work;
+    uint64_t start, end;
+    int c;
+
+    replay.auto_arp = 1;
+    while ((c = getopt(argc, argv, "hr:i:I:w:n:a:b:e:m:Ac")) != EOF) {
+        switch (c) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'r':
+                rtable = optarg;
+                break;
+            case 'i':
+                iffile = optarg;
+                break;
+            case 'I':
+                ingress = optarg;
+                break;
+            case 'w':
+                outfile = optarg;
+                break;
+            case 'n':
+                loops = atoi(optarg);
+                break;
+            case 'a':
+                acl = optarg;
+                break;
+            case 'b':
+                police = optarg;
+                break;
+            case 'e':
+                flows = optarg;
+                break;
+            case 'm':
+                mtu = optarg;
+                break;
+            case 'A':
+                replay.auto_arp = 0;
+                break;
+            case 'c':
+                counters = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    memset(&sr, 0, sizeof(sr));
+    sr.sockfd = -1;
+    pthread_mutex_init(&replay.lock, NULL);
+    replay.digest = 0xcbf29ce484222325ULL;
+
+    if (replay_load_ifs(&sr, iffile) < 0 || sr_load_rt(&sr, rtable) != 0) {
+        fprintf(stderr, "sr_replay: failed to set up interfaces/routing table\n");
+        exit(1);
+    }
+    for (rt = sr.routing_table; rt; rt = rt->next) {
+        if (!sr_get_interface(&sr, rt->interface)) {
+            fprintf(stderr, "sr_replay: route via unknown interface %s\n",
+                    rt->interface);
+            exit(1);
+        }
+    }
+    if (acl && (sr.acl = sr_acl_load(acl)) == NULL) {
+        exit(1);
+    }
+    if (police && (sr.police = sr_police_load(police)) == NULL) {
+        exit(1);
+    }
+    if (flows && (sr.flows = sr_flows_create(flows)) == NULL) {
+        exit(1);
+    }
+    if ((frames = replay_load_pcap(argv[optind], &nframes)) == NULL) {
+        exit(1);
+    }
+    if (outfile && (replay.out = sr_dump_open(outfile, 0, REPLAY_SNAPLEN)) == NULL) {
+        exit(1);
+    }
+
+    sr.mtu_spec = mtu;
+    sr_init(&sr);
+    sr_init_interfaces(&sr);
+
+    /* the router rewrites frames in place, so replay from a scratch copy */
+    work = malloc(REPLAY_SNAPLEN);
+    assert(work);
+
+    start = now_ns();
+    for (l = 0; l < loops; l++) {
+        for (i = 0; i < nframes; i++) {
+            unsigned int len = frames[i].h.caplen;
+            char name[sr_IFACE_NAMELEN];
+
+            strncpy(name, replay_ingress(&sr, frames[i].buf, len, ingress),
+                    sr_IFACE_NAMELEN);
+            memcpy(work, frames[i].buf, len);
+            replay.cur = frames[i].h;
+            sr_handlepacket(&sr, work, len, name);
+            if (replay.narp)
+                replay_flush_arp(&sr);
+        }
+    }
+    end = now_ns();
+
+    if (replay.out)
+        sr_dump_close(replay.out);
+
+    fprintf(stderr, "\nsr_replay: %u frames x %u loops in %.3f s: %.0f pps\n",
+            nframes, loops, (end - start) / 1e9,
+            end > start ? (double)nframes * loops * 1e9 / (end - start) : 0.0);
+    fprintf(stderr, "sr_replay: tx %llu frames %llu bytes digest %016llx\n",
+            (unsigned long long)replay.tx_frames,
+            (unsigned long long)replay.tx_bytes,
+            (unsigned long long)replay.digest);
+    if (counters) {
+        sr_stats_dump(stderr);
+        sr_stats_hist_dump(stderr);
+    }
+    /* exports the flows still in the table */
+    sr_flows_destroy(sr.flows);
+    return 0;
+}
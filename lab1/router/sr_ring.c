@@ -0,0 +1,122 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ring.c
+ *
+ * Description:
+ *
+ * Lock-free SPSC record ring.  head and tail are free running byte
+ * counters; each record is an 8 byte aligned {length, payload} pair.  A
+ * record never wraps: when it does not fit before the end of the buffer
+ * the producer writes a SR_RING_SKIP marker and starts again at offset 0.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_ring.h"
+
+#define SR_RING_ALIGN 8
+#define SR_RING_HDR   SR_RING_ALIGN
+#define SR_RING_SKIP  0xffffffffU
+
+#define ring_align(x) (((x) + SR_RING_ALIGN - 1) & ~(uint64_t)(SR_RING_ALIGN - 1))
+
+struct sr_ring* sr_ring_create(size_t bytes)
+{
+    struct sr_ring* ring;
+    uint64_t size = 4096;
+
+    while (size < bytes)
+        size <<= 1;
+
+    if (posix_memalign((void**)&ring, SR_CACHE_LINE, sizeof(struct sr_ring)) != 0)
+        return NULL;
+    memset(ring, 0, sizeof(struct sr_ring));
+    ring->size = size;
+    ring->mask = size - 1;
+    if (posix_memalign((void**)&ring->data, SR_CACHE_LINE, size) != 0) {
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void sr_ring_destroy(struct sr_ring* ring)
+{
+    if (ring) {
+        free(ring->data);
+        free(ring);
+    }
+}
+
+void* sr_ring_reserve(struct sr_ring* ring, unsigned int len)
+{
+    uint64_t need = SR_RING_HDR + ring_align(len);
+    uint64_t head = ring->head;
+    uint64_t off = head & ring->mask;
+    uint64_t pad = 0;
+
+    /* records do not wrap, burn the tail end of the buffer instead */
+    if (off + need > ring->size)
+        pad = ring->size - off;
+    if (need + pad > ring->size)
+        return NULL;
+
+    if (head + pad + need - ring->tail_cache > ring->size) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head + pad + need - ring->tail_cache > ring->size)
+            return NULL;
+    }
+
+    if (pad) {
+        *(uint32_t*)(ring->data + off) = SR_RING_SKIP;
+        head += pad;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        off = 0;
+    }
+    *(uint32_t*)(ring->data + off) = len;
+    return ring->data + off + SR_RING_HDR;
+}
+
+void sr_ring_commit(struct sr_ring* ring, unsigned int len)
+{
+    __atomic_store_n(&ring->head, ring->head + SR_RING_HDR + ring_align(len),
+                     __ATOMIC_RELEASE);
+}
+
+void* sr_ring_peek(struct sr_ring* ring, unsigned int* len)
+{
+    uint64_t tail = ring->tail;
+    uint32_t rlen;
+
+    if (tail == ring->head_cache) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail == ring->head_cache)
+            return NULL;
+    }
+
+    rlen = *(uint32_t*)(ring->data + (tail & ring->mask));
+    if (rlen == SR_RING_SKIP) {
+        tail += ring->size - (tail & ring->mask);
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        if (tail == ring->head_cache)
+            return NULL;
+        rlen = *(uint32_t*)(ring->data + (tail & ring->mask));
+    }
+
+    *len = rlen;
+    return ring->data + (tail & ring->mask) + SR_RING_HDR;
+}
+
+void sr_ring_release(struct sr_ring* ring, unsigned int len)
+{
+    __atomic_store_n(&ring->tail, ring->tail + SR_RING_HDR + ring_align(len),
+                     __ATOMIC_RELEASE);
+}
+
+uint64_t sr_ring_used(struct sr_ring* ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
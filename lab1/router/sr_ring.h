@@ -0,0 +1,70 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ring.h
+ *
+ * Description:
+ *
+ * Lock-free single producer / single consumer ring of variable length
+ * records.  Exactly one thread may call the producer side
+ * (sr_ring_reserve/sr_ring_commit) and exactly one other thread the
+ * consumer side (sr_ring_peek/sr_ring_release) of a given ring.
+ *
+ * Records are stored contiguously, so a reserved or peeked record can be
+ * filled or consumed in place with a single memcpy/fwrite.
+ *
+ *   producer:                          consumer:
+ *     p = sr_ring_reserve(r, len);       p = sr_ring_peek(r, &len);
+ *     if (p) {                           if (p) {
+ *         memcpy(p, data, len);              use(p, len);
+ *         sr_ring_commit(r, len);            sr_ring_release(r, len);
+ *     }                                  }
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_RING_H
+#define SR_RING_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <stddef.h>
+
+#define SR_CACHE_LINE 64
+
+struct sr_ring
+{
+    /* consumer owned */
+    uint64_t tail __attribute__ ((aligned (SR_CACHE_LINE)));
+    uint64_t head_cache;        /* consumer's last view of head */
+
+    /* producer owned */
+    uint64_t head __attribute__ ((aligned (SR_CACHE_LINE)));
+    uint64_t tail_cache;        /* producer's last view of tail */
+
+    uint64_t size __attribute__ ((aligned (SR_CACHE_LINE)));   /* power of two */
+    uint64_t mask;
+    uint8_t* data;
+};
+
+/* Creates a ring holding at least 'bytes' bytes of records. */
+struct sr_ring* sr_ring_create(size_t bytes);
+void sr_ring_destroy(struct sr_ring* ring);
+
+/* Producer: returns space for a record of 'len' bytes or NULL if the ring
+   is full.  The record becomes visible to the consumer on commit. */
+void* sr_ring_reserve(struct sr_ring* ring, unsigned int len);
+void  sr_ring_commit(struct sr_ring* ring, unsigned int len);
+
+/* Consumer: returns the oldest record and its length or NULL if the ring
+   is empty.  The space is handed back to the producer on release. */
+void* sr_ring_peek(struct sr_ring* ring, unsigned int* len);
+void  sr_ring_release(struct sr_ring* ring, unsigned int len);
+
+/* Number of bytes (records plus framing) currently queued. */
+uint64_t sr_ring_used(struct sr_ring* ring);
+
+#endif /* -- SR_RING_H -- */
@@ -16,13 +16,50 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "sr_acl.h"
 #include "sr_arpcache.h"
+#include "sr_egress.h"
+#include "sr_fib.h"
+#include "sr_flow.h"
+#include "sr_frag.h"
+#include "sr_icmp_limit.h"
 #include "sr_if.h"
+#include "sr_log.h"
+#include "sr_nbr.h"
+#include "sr_police.h"
+#include "sr_stats.h"
 #include "sr_protocol.h"
+#include "sr_punt.h"
 #include "sr_router.h"
 #include "sr_rt.h"
 #include "sr_utils.h"
 
+/* sr_tsc() when the frame being handled by this thread arrived */
+static __thread uint64_t pkt_t0;
+
+static void icmp_tmpl_init(struct sr_if* iface);
+
+/* Is ip (network order) one of our interface addresses? */
+static int ip_is_mine(struct sr_instance* sr, uint32_t ip) {
+  struct sr_if* if_itr;
+  for (if_itr = sr->if_list; if_itr != NULL; if_itr = if_itr->next) {
+    if (if_itr->ip == ip) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Is the datagram an ICMP error message itself? */
+static int ip_is_icmp_error(sr_ip_hdr_t* ip_hdr, unsigned int ip_packet_len) {
+  unsigned int hl = ip_hdr->ip_hl * 4;
+  if (ip_hdr->ip_p != ip_protocol_icmp || ip_packet_len < hl + 1) {
+    return 0;
+  }
+  uint8_t type = ((uint8_t*)ip_hdr)[hl];
+  return type == 3 || type == 4 || type == 5 || type == 11 || type == 12;
+}
+
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
  * Scope:  Global
@@ -35,23 +72,72 @@ void sr_init(struct sr_instance* sr) {
   /* REQUIRES */
   assert(sr);
 
-  /* Initialize cache and cache cleanup thread */
+  /* Initialize cache and cache cleanup thread; a router hosted with
+     others (-V) is swept by the host's timer thread instead */
   sr_arpcache_init(&(sr->cache));
 
-  pthread_attr_init(&(sr->attr));
-  pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
-  pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_t thread;
+  if (!sr->hosted) {
+    pthread_attr_init(&(sr->attr));
+    pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
+    pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
+    pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
+
+    /* joined by sr_arpcache_stop() before the router is torn down */
+    if (pthread_create(&(sr->cache.thread), &(sr->attr), sr_arpcache_timeout, sr) == 0)
+      sr->cache.running = 1;
+  }
 
-  pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+  /* Gateways are added as the forwarding table is built */
+  sr->nbrs = sr_nbrs_create();
+  assert(sr->nbrs);
 
-  /* Add initialization code here! */
+  sr->reasm = sr_reasm_create();
+  assert(sr->reasm);
 
 } /* -- sr_init -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_init_interfaces(struct sr_instance*)
+ * Scope:  Global
+ *
+ * Called once the interfaces are known (VNSHWINFO, or sr_replay's
+ * interface file) and before the first packet: compiles the routing
+ * table, which names interfaces, starts the egress queues and prebuilds
+ * each interface's ICMP errors.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_init_interfaces(struct sr_instance* sr) {
+  /* REQUIRES */
+  assert(sr);
+  assert(sr->fib == NULL);
+
+  /* One egress queue per interface, -Q; up before the FIB gives the
+     hello thread neighbors to send to */
+  if (sr->egress && sr_egress_start(sr->egress, sr) != 0)
+    exit(1);
+
+  /* Interface MTUs, -M */
+  if (sr->mtu_spec && sr_frag_set_mtu(sr, sr->mtu_spec) != 0)
+    exit(1);
+
+  /* Compile the routing table into the forwarding table, with a
+     neighbor record for every gateway */
+  sr->fib = sr_fib_build(sr);
+  assert(sr->fib);
+
+  /* Prebuild the ICMP errors each interface sends */
+  struct sr_if* iface;
+  for (iface = sr->if_list; iface != NULL; iface = iface->next) {
+    icmp_tmpl_init(iface);
+  }
+
+} /* -- sr_init_interfaces -- */
+
 void handle_arp_request(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
                         sr_arp_hdr_t* arp_hdr) {
+  sr_nbr_heard(sr, arp_hdr->ar_sip);
+
   /* iterate through all the interfaces  */
   struct sr_if* iface;
   for (iface = sr->if_list; iface != NULL; iface = iface->next) {
@@ -83,12 +169,14 @@ void handle_arp_request(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
 
       /* Send through the chosen iface */
       sr_send_packet(sr, buf, arp_len, iface->name);
+      sr_stat_inc(SR_STAT_ARP_REPLY_TX);
 
       /* Free the buffer of arp_request */
       free(buf);
-      break;
+      return;
     }
   }
+  sr_stat_inc(SR_STAT_DROP_ARP_NOT_US);
 }
 
 void handle_arp_reply(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
@@ -98,6 +186,8 @@ void handle_arp_reply(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
   uint32_t ip = arp_hdr->ar_sip;
   unsigned char* mac = arp_hdr->ar_sha;
 
+  sr_nbr_heard(sr, ip);
+
   /* interface is the hardware interface that receive the arp reply */
   /* insert the ip -> mac mapping to the cache */
   struct sr_arpreq* req = sr_arpcache_insert(&(sr->cache), mac, ip);
@@ -111,65 +201,14 @@ void handle_arp_reply(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
   for (curr_pkt = req->packets; curr_pkt != NULL; curr_pkt = curr_pkt->next) {
     sr_ethernet_hdr_t* pkt_eth_hdr = (sr_ethernet_hdr_t*)(curr_pkt->buf);
     memcpy(pkt_eth_hdr->ether_dhost, mac, 6);
-    sr_send_packet(sr, curr_pkt->buf, curr_pkt->len, curr_pkt->iface);
+    sr_frag_send(sr, curr_pkt->buf, curr_pkt->len,
+                 sr_get_interface(sr, curr_pkt->iface));
+    sr_stat_inc(SR_STAT_ARP_RELEASED);
   }
 
   sr_arpreq_destroy(&(sr->cache), req);
 }
 
-int bit_count(uint32_t prefix) {
-  int count = 0;
-
-  /* I saw one previously, if I see zero again, prefix is formattedly wrong */
-  unsigned prev_one = 0;
-
-  while (prefix > 0) {
-    if (prefix & 1) {
-      count++;
-      prev_one = 1;
-    } else {
-      if (prev_one) {
-        return -1;
-      }
-    }
-    prefix = prefix >> 1;
-  }
-  return count;
-}
-
-uint32_t routing_table_lookup(struct sr_instance* sr, uint32_t dest_ip,
-                              char* iface_name, uint8_t* found) {
-  struct sr_rt* rt_itr;
-
-  uint32_t result = 0;
-  int longest_matched_length = -1;
-
-  for (rt_itr = sr->routing_table; rt_itr != NULL;
-       rt_itr = rt_itr->next) {
-    uint32_t rt_dest = ntohl((uint32_t)rt_itr->dest.s_addr);
-    uint32_t rt_mask = ntohl((uint32_t)rt_itr->mask.s_addr);
-    uint32_t prefix = rt_dest & rt_mask;
-    int prefix_length = bit_count(rt_mask);
-
-    if (prefix_length < 0) {
-      printf("Negative prefix len = %d\n", prefix_length);
-    }
-
-    uint32_t masked_dest_ip = dest_ip & rt_mask;
-
-    uint32_t matched = masked_dest_ip ^ prefix;
-
-    if ((matched == 0) && prefix_length > longest_matched_length) {
-      *found = 1;
-      strncpy(iface_name, rt_itr->interface, sr_IFACE_NAMELEN);
-      longest_matched_length = prefix_length;
-      result = rt_itr->gw.s_addr;
-    }
-  }
-
-  return result;
-}
-
 void generate_arp_request(struct sr_instance* sr, struct sr_arpreq* req,
                           struct sr_if* iface) {
   uint32_t ip = req->ip;
@@ -196,147 +235,205 @@ void generate_arp_request(struct sr_instance* sr, struct sr_arpreq* req,
   memcpy(request_arp->ar_sha, iface->addr, ETHER_ADDR_LEN);
   request_arp->ar_sip = iface->ip;
 
+  memset(request_arp->ar_tha, 0, ETHER_ADDR_LEN);
   request_arp->ar_tip = ip;
 
   req->sent = time(NULL);
   
   sr_send_packet(sr, buf, arp_len, iface->name);
   req->times_sent += 1;
+  sr_stat_inc(SR_STAT_ARP_REQ_TX);
 
   /* Free the buffer of arp_request */
   free(buf);
 }
 
-void send_or_queue_packet(struct sr_instance* sr, uint8_t* packet,
-                          unsigned int packet_len, uint32_t dest_ip) {
-  char next_hop_iface[sr_IFACE_NAMELEN];
-  uint8_t found = 0;
-  uint32_t next_hop_ip = routing_table_lookup(sr, dest_ip, next_hop_iface, &found);
-  /* if there is no route, sent destination net unreachable to sender*/
-  if (!found) {
-    handle_icmp_t3(sr, (sr_ethernet_hdr_t*)(packet),
-                   (sr_ip_hdr_t*)(packet + sizeof(sr_ethernet_hdr_t)),
-                   packet_len - sizeof(sr_ethernet_hdr_t), 3, 0);
-    return;
-  }
-
-  struct sr_if* iface = sr_get_interface(sr, next_hop_iface);
+/* Sends packet out iface to next_hop_ip (network order), or queues it
+   behind an ARP request if the next hop's MAC is not known yet */
+static void send_on_iface(struct sr_instance* sr, uint8_t* packet,
+                          unsigned int packet_len, uint32_t next_hop_ip,
+                          struct sr_if* iface) {
   sr_ethernet_hdr_t* pkt_eth_hdr = (sr_ethernet_hdr_t*)(packet);
   memcpy(pkt_eth_hdr->ether_shost, iface->addr, 6);
 
+  uint64_t t0 = sr_tsc();
   struct sr_arpentry* entry = sr_arpcache_lookup(&(sr->cache), next_hop_ip);
+  sr_hist_end(SR_HIST_ARP, t0);
 
   if (entry) {
+    sr_stat_inc(SR_STAT_ARP_CACHE_HIT);
     memcpy(pkt_eth_hdr->ether_dhost, entry->mac, 6);
-    sr_send_packet(sr, packet, packet_len, iface->name);
+    t0 = sr_tsc();
+    sr_frag_send(sr, packet, packet_len, iface);
+    sr_hist_end(SR_HIST_TX, t0);
   }
   else {
+    sr_stat_inc(SR_STAT_ARP_QUEUED);
+    /* Hold the cache lock until the request is sent: with -W another
+       worker may otherwise resolve and free req in between */
+    pthread_mutex_lock(&(sr->cache.lock));
     /* Queue the request if not found */
     struct sr_arpreq* req = sr_arpcache_queuereq(&(sr->cache), next_hop_ip,
                                                  packet, packet_len, iface->name);
     /* Generate and send arp request */
     generate_arp_request(sr, req, iface);
+    pthread_mutex_unlock(&(sr->cache.lock));
   }
 }
 
-void handle_icmp_echo(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
-                      sr_ip_hdr_t* ip_hdr) {
-  size_t icmp_echo_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_hdr_t);
-  uint8_t* buf = malloc(icmp_echo_len);
+/* Next hop for dest_ip (host order), choosing among equal-cost paths by
+   the flow the frame belongs to.  Fills in the next hop's IP (network
+   order) and returns its interface, or NULL if there is no route. */
+static struct sr_if* fib_lookup(struct sr_instance* sr, uint32_t dest_ip,
+                                const uint8_t* frame, unsigned int len,
+                                uint32_t* next_hop_ip) {
+  uint64_t t0 = sr_tsc();
+  const struct sr_nexthop* nh = sr_fib_lookup(sr->fib, dest_ip,
+                                              sr_flow_hash(frame, len));
+  sr_hist_end(SR_HIST_FIB, t0);
+  if (nh == NULL) {
+    return NULL;
+  }
+  /* an on-link route has the destination itself as next hop */
+  *next_hop_ip = nh->gw ? nh->gw : htonl(dest_ip);
+  return nh->iface;
+}
 
-  /* Construct Ethernet header */
-  sr_ethernet_hdr_t* reply_eth_hdr = (sr_ethernet_hdr_t*)buf;
-  memcpy(reply_eth_hdr->ether_shost, eth_hdr->ether_dhost, ETHER_ADDR_LEN);
-  reply_eth_hdr->ether_type = htons(ethertype_ip);
+void send_or_queue_packet(struct sr_instance* sr, uint8_t* packet,
+                          unsigned int packet_len, uint32_t dest_ip) {
+  uint32_t next_hop_ip;
+  struct sr_if* iface = fib_lookup(sr, dest_ip, packet, packet_len, &next_hop_ip);
+  /* if there is no route, sent destination net unreachable to sender*/
+  if (iface == NULL) {
+    sr_stat_inc(SR_STAT_DROP_NO_ROUTE);
+    sr_punt(sr, SR_PUNT_ICMP_ERR, packet, packet_len, NULL, 3, 0);
+    return;
+  }
 
-  /* Construct IP header */
-  sr_ip_hdr_t* reply_ip_hdr = (sr_ip_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t));
-  reply_ip_hdr->ip_v = 4;
-  reply_ip_hdr->ip_hl = 5;
-  reply_ip_hdr->ip_tos = 0;
-  reply_ip_hdr->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_hdr_t));
-  reply_ip_hdr->ip_id = htons(0);
-
-  reply_ip_hdr->ip_off = htons(0);
-  reply_ip_hdr->ip_ttl = 0xff;
-  reply_ip_hdr->ip_p = ip_protocol_icmp;
-
-  /* Flip the dst/src IP address */
-  reply_ip_hdr->ip_src = ip_hdr->ip_dst;
-  reply_ip_hdr->ip_dst = ip_hdr->ip_src;
+  send_on_iface(sr, packet, packet_len, next_hop_ip, iface);
+}
 
-  reply_ip_hdr->ip_sum = 0;
-  reply_ip_hdr->ip_sum = cksum(reply_ip_hdr, sizeof(sr_ip_hdr_t));
+/* Turns the echo request into its reply in place: addresses swap, the
+   type flips and both checksums are adjusted rather than recomputed, so
+   identifier, sequence and payload come back untouched.  The reply goes
+   straight back out the ingress interface to the sender's MAC, without a
+   route or ARP lookup. */
+void handle_icmp_echo(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
+                      sr_ip_hdr_t* ip_hdr, sr_icmp_hdr_t* icmp_hdr,
+                      unsigned int ip_len, char* interface) {
+  struct sr_if* iface = sr_get_interface(sr, interface);
+  if (iface == NULL) {
+    return;
+  }
 
-  /* Construct ICMP header */
-  sr_icmp_hdr_t* reply_icmp_hdr = (sr_icmp_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-  reply_icmp_hdr->icmp_type = 0;
-  reply_icmp_hdr->icmp_code = 0;
+  memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, ETHER_ADDR_LEN);
+  memcpy(eth_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
 
-  reply_icmp_hdr->icmp_sum = 0;
-  reply_icmp_hdr->icmp_sum = cksum(reply_icmp_hdr, sizeof(sr_icmp_hdr_t));
+  /* Swapping the addresses leaves the IP checksum as it is */
+  uint32_t addr = ip_hdr->ip_src;
+  ip_hdr->ip_src = ip_hdr->ip_dst;
+  ip_hdr->ip_dst = addr;
 
-  send_or_queue_packet(sr, buf, icmp_echo_len, ntohl(reply_ip_hdr->ip_dst));
+  /* ttl shares its checksum word with the protocol */
+  ip_hdr->ip_sum = cksum_adjust(ip_hdr->ip_sum,
+                                htons(ip_hdr->ip_ttl << 8 | ip_hdr->ip_p),
+                                htons(INIT_TTL << 8 | ip_hdr->ip_p));
+  ip_hdr->ip_ttl = INIT_TTL;
 
-  free(buf);
+  icmp_hdr->icmp_sum = cksum_adjust(icmp_hdr->icmp_sum,
+                                    htons(icmp_hdr->icmp_type << 8 | icmp_hdr->icmp_code),
+                                    htons(0 << 8 | icmp_hdr->icmp_code));
+  icmp_hdr->icmp_type = 0;
+
+  sr_stat_inc(SR_STAT_ICMP_ECHO_TX);
+  sr_frag_send(sr, (uint8_t*)eth_hdr, sizeof(sr_ethernet_hdr_t) + ip_len, iface);
 }
 
-/* Even though it is called type3 header, it also support type 1 */
-/* This function will send icmp message to the ip_hdr->ip_src*/
-void handle_icmp_t3(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
-                    sr_ip_hdr_t* ip_hdr, unsigned int ip_packet_len,
-                    uint8_t type, uint8_t code) {
-  size_t icmp_t3_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) +
-                       sizeof(sr_icmp_t3_hdr_t);
-  uint8_t* buf = malloc(icmp_t3_len);
+/* Builds iface's ICMP error template: the Ethernet source, the fixed IP
+   header fields and their share of the header checksum */
+static void icmp_tmpl_init(struct sr_if* iface) {
+  struct sr_icmp_tmpl* tmpl = &(iface->icmp_tmpl);
+  memset(tmpl, 0, sizeof(*tmpl));
+
+  sr_ethernet_hdr_t* eth_hdr = (sr_ethernet_hdr_t*)tmpl->frame;
+  memcpy(eth_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
+  eth_hdr->ether_type = htons(ethertype_ip);
+
+  sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(tmpl->frame + sizeof(sr_ethernet_hdr_t));
+  ip_hdr->ip_v = 4;
+  ip_hdr->ip_hl = 5;
+  ip_hdr->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t));
+  ip_hdr->ip_ttl = INIT_TTL;
+  ip_hdr->ip_p = ip_protocol_icmp;
+  ip_hdr->ip_src = iface->ip;
+
+  /* addresses are summed in per error */
+  tmpl->ip_sum = cksum_partial(ip_hdr, sizeof(sr_ip_hdr_t) - 8, 0);
+}
 
-  /* Construct Ethernet header */
-  sr_ethernet_hdr_t* reply_eth_hdr = (sr_ethernet_hdr_t*)buf;
-  /* Leave the destination mac address blank...use arp to find out */
-  memcpy(reply_eth_hdr->ether_shost, eth_hdr->ether_dhost, ETHER_ADDR_LEN);
-  reply_eth_hdr->ether_type = htons(ethertype_ip);
+/* Sends an ICMP error of type/code about the datagram at ip_hdr back to
+   its source.  The frame is a copy of the template of the interface the
+   route back leaves by; the only bytes summed per error are the
+   addresses and the quoted header. */
+void handle_icmp_error(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
+                       sr_ip_hdr_t* ip_hdr, unsigned int ip_packet_len,
+                       uint8_t type, uint8_t code) {
+  if (!sr_icmp_limit_allow(sr->icmp_limit, type, ip_hdr->ip_src)) {
+    sr_log_debug(SR_LOG_ICMP, "ICMP %d/%d rate limited\n", type, code);
+    return;
+  }
+
+  /* The offending frame's symmetric hash sends the error back the way
+     the flow's own return traffic goes */
+  uint32_t next_hop_ip;
+  struct sr_if* iface = fib_lookup(sr, ntohl(ip_hdr->ip_src), (uint8_t*)eth_hdr,
+                                   sizeof(sr_ethernet_hdr_t) + ip_packet_len,
+                                   &next_hop_ip);
+  if (iface == NULL) {
+    sr_stat_inc(SR_STAT_DROP_NO_ROUTE);
+    return;
+  }
 
-  /* Construct IP header */
+  uint8_t buf[sizeof(iface->icmp_tmpl.frame)];
+  memcpy(buf, iface->icmp_tmpl.frame, sizeof(buf));
+
+  /* An error about a datagram addressed to us comes from that address,
+     any other from the interface it is sent out of */
   sr_ip_hdr_t* reply_ip_hdr = (sr_ip_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t));
-  reply_ip_hdr->ip_v = 4;
-  reply_ip_hdr->ip_hl = 5;
-  reply_ip_hdr->ip_tos = 0;
-  reply_ip_hdr->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t));
-  reply_ip_hdr->ip_id = htons(0);
-
-  reply_ip_hdr->ip_off = htons(0);
-  reply_ip_hdr->ip_ttl = 0xff;
-  reply_ip_hdr->ip_p = ip_protocol_icmp;
-
-  /* Flip the IP address */
-  reply_ip_hdr->ip_src = ip_hdr->ip_dst;
+  if (ip_is_mine(sr, ip_hdr->ip_dst)) {
+    reply_ip_hdr->ip_src = ip_hdr->ip_dst;
+  }
   reply_ip_hdr->ip_dst = ip_hdr->ip_src;
+  reply_ip_hdr->ip_sum = cksum_fold(cksum_partial(&(reply_ip_hdr->ip_src), 8,
+                                                  iface->icmp_tmpl.ip_sum));
 
-  reply_ip_hdr->ip_sum = 0;
-  reply_ip_hdr->ip_sum = cksum(reply_ip_hdr, sizeof(sr_ip_hdr_t));
-
-  /* Construct ICMP header */
   sr_icmp_t3_hdr_t* reply_icmp_hdr =
-      (sr_icmp_t3_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t) +
-                          sizeof(sr_ip_hdr_t));
+      (sr_icmp_t3_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
   reply_icmp_hdr->icmp_type = type;
   reply_icmp_hdr->icmp_code = code;
 
-  /* Copy the original ip header and datagram */
-  memset(reply_icmp_hdr->data, 0, ICMP_DATA_SIZE);
-  if (ip_packet_len < ICMP_DATA_SIZE) {
-    memcpy(reply_icmp_hdr->data, ip_hdr, ip_packet_len);
-  } else {
-    /* Assume there is no ip options in the ip header */
-    memcpy(reply_icmp_hdr->data, ip_hdr, ICMP_DATA_SIZE);
+  /* Fragmentation needed says what does fit: the MTU of the interface
+     the datagram was routed out of (RFC 1191) */
+  uint16_t next_mtu = 0;
+  if (type == 3 && code == 4) {
+    uint32_t out_hop_ip;
+    struct sr_if* out = fib_lookup(sr, ntohl(ip_hdr->ip_dst), (uint8_t*)eth_hdr,
+                                   sizeof(sr_ethernet_hdr_t) + ip_packet_len,
+                                   &out_hop_ip);
+    next_mtu = out ? out->mtu : 0;
+    reply_icmp_hdr->next_mtu = htons(next_mtu);
   }
 
-  reply_icmp_hdr->icmp_sum = 0;
-  reply_icmp_hdr->icmp_sum = cksum(reply_icmp_hdr, sizeof(sr_icmp_t3_hdr_t));
-
-  send_or_queue_packet(sr, buf, icmp_t3_len, ntohl(reply_ip_hdr->ip_dst));
+  /* Quote the original ip header and the start of its datagram; the
+     template is zero past it */
+  unsigned int quote = ip_packet_len < ICMP_DATA_SIZE ? ip_packet_len
+                                                      : ICMP_DATA_SIZE;
+  memcpy(reply_icmp_hdr->data, ip_hdr, quote);
+  reply_icmp_hdr->icmp_sum = cksum_fold(cksum_partial(reply_icmp_hdr->data, quote,
+                                                      (type << 8 | code) + next_mtu));
 
-  free(buf);
+  sr_stat_inc(type == 11 ? SR_STAT_ICMP_TIMEX_TX : SR_STAT_ICMP_UNREACH_TX);
+  send_on_iface(sr, buf, sizeof(buf), next_hop_ip, iface);
 }
 
 void handle_ip_packet_to_me(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
@@ -344,96 +441,73 @@ void handle_ip_packet_to_me(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
                             char* interface) {
   uint8_t ip_proto = ip_protocol((uint8_t*)ip_hdr);
   if (ip_proto == ip_protocol_icmp) {
-    sr_icmp_hdr_t* icmp_hdr = (sr_icmp_hdr_t*)(ip_hdr + sizeof(sr_ip_hdr_t));
-    uint16_t check_sum = cksum(icmp_hdr, sizeof(sr_icmp_hdr_t)) ^ 0xffff;
+    unsigned int ip_hl = ip_hdr->ip_hl * 4;
+    unsigned int ip_len = ntohs(ip_hdr->ip_len);
+    if (ip_hl < sizeof(sr_ip_hdr_t) || ip_len > ip_packet_len ||
+        ip_len < ip_hl + sizeof(sr_icmp_hdr_t)) {
+      sr_stat_inc(SR_STAT_DROP_IP_MALFORMED);
+      return;
+    }
+
+    /* The checksum covers the whole ICMP message, payload included */
+    sr_icmp_hdr_t* icmp_hdr = (sr_icmp_hdr_t*)((uint8_t*)ip_hdr + ip_hl);
+    uint16_t check_sum = cksum(icmp_hdr, ip_len - ip_hl) ^ 0xffff;
     if (check_sum != 0) {
-      fprintf(stderr, "ICMP packet check sum error\n");
-      print_hdr_icmp((uint8_t*)icmp_hdr);
+      sr_log_warn(SR_LOG_ICMP, "ICMP packet check sum error, type %d code %d\n",
+                  icmp_hdr->icmp_type, icmp_hdr->icmp_code);
+      sr_stat_inc(SR_STAT_DROP_ICMP_CKSUM);
       return;
     }
 
     if (icmp_hdr->icmp_type == 8 && icmp_hdr->icmp_code == 0) {
-      handle_icmp_echo(sr, eth_hdr, ip_hdr);
+      sr_stat_inc(SR_STAT_ICMP_ECHO_RX);
+      handle_icmp_echo(sr, eth_hdr, ip_hdr, icmp_hdr, ip_len, interface);
     }
   } else if (ip_proto == 0x06 || ip_proto == 0x11) {
-    handle_icmp_t3(sr, eth_hdr, ip_hdr, ip_packet_len, 3, 3);
+    handle_icmp_error(sr, eth_hdr, ip_hdr, ip_packet_len, 3, 3);
   }
   else {
-    fprintf(stderr, "Received an IP packet that was not ICMP\n");
-  }
-}
-
-void handle_icmp_time_exceed(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
-                             sr_ip_hdr_t* ip_hdr, unsigned int ip_packet_len,
-                             char* interface) {
-  size_t icmp_t3_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) +
-                       sizeof(sr_icmp_t3_hdr_t);
-  uint8_t* buf = malloc(icmp_t3_len);
-
-  /* Construct Ethernet header */
-  sr_ethernet_hdr_t* reply_eth_hdr = (sr_ethernet_hdr_t*)buf;
-  /* Leave the destination mac address blank...use arp to find out */
-  memcpy(reply_eth_hdr->ether_shost, eth_hdr->ether_dhost, ETHER_ADDR_LEN);
-  reply_eth_hdr->ether_type = htons(ethertype_ip);
-
-  /* Construct IP header */
-  sr_ip_hdr_t* reply_ip_hdr = (sr_ip_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t));
-  reply_ip_hdr->ip_v = 4;
-  reply_ip_hdr->ip_hl = 5;
-  reply_ip_hdr->ip_tos = 0;
-  reply_ip_hdr->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t));
-  reply_ip_hdr->ip_id = htons(0);
-  reply_ip_hdr->ip_off = htons(0);
-  reply_ip_hdr->ip_ttl = 0xff;
-  reply_ip_hdr->ip_p = ip_protocol_icmp;
-
-  struct sr_if* iface = sr_get_interface(sr, interface);
-
-  /* When sending time exceed, use this router's ip as src */
-  reply_ip_hdr->ip_src = iface->ip;
-  reply_ip_hdr->ip_dst = ip_hdr->ip_src;
-  reply_ip_hdr->ip_sum = 0;
-  reply_ip_hdr->ip_sum = cksum(reply_ip_hdr, sizeof(sr_ip_hdr_t));
-
-  /* Construct ICMP header */
-  sr_icmp_t3_hdr_t* reply_icmp_hdr =
-      (sr_icmp_t3_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t) +
-                          sizeof(sr_ip_hdr_t));
-  reply_icmp_hdr->icmp_type = 11;
-  reply_icmp_hdr->icmp_code = 0;
-
-  /* Copy the original ip header and datagram */
-  memset(reply_icmp_hdr->data, 0, ICMP_DATA_SIZE);
-  if (ip_packet_len < ICMP_DATA_SIZE) {
-    memcpy(reply_icmp_hdr->data, ip_hdr, ip_packet_len);
-  } else {
-    /* Assume there is no ip options in the ip header */
-    memcpy(reply_icmp_hdr->data, ip_hdr, ICMP_DATA_SIZE);
+    sr_log_debug(SR_LOG_ROUTER, "received an IP packet that was not ICMP\n");
+    sr_stat_inc(SR_STAT_DROP_IP_PROTO);
   }
-
-  reply_icmp_hdr->icmp_sum = 0;
-  reply_icmp_hdr->icmp_sum = cksum(reply_icmp_hdr, sizeof(sr_icmp_t3_hdr_t));
-
-  send_or_queue_packet(sr, buf, icmp_t3_len, ntohl(reply_ip_hdr->ip_dst));
-
-  free(buf);
 }
 
 void handle_ip_packet_forward(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
                               sr_ip_hdr_t* ip_hdr, unsigned int len,
                               char* interface) {
   if (ip_hdr->ip_ttl == 1) {
-    printf("Time to live is over!!\n");
-    handle_icmp_time_exceed(sr, eth_hdr, ip_hdr, len, interface);
+    sr_log_debug(SR_LOG_ROUTER, "time to live is over\n");
+    sr_stat_inc(SR_STAT_DROP_TTL);
+    sr_punt(sr, SR_PUNT_ICMP_ERR, (uint8_t*)eth_hdr, len, interface, 11, 0);
     return; 
   }
 
-  /* decrement ttl and re-checksum the ip packet */
+  uint32_t next_hop_ip;
+  struct sr_if* out = fib_lookup(sr, ntohl(ip_hdr->ip_dst), (uint8_t*)eth_hdr,
+                                 len, &next_hop_ip);
+  if (out == NULL) {
+    sr_stat_inc(SR_STAT_DROP_NO_ROUTE);
+    sr_punt(sr, SR_PUNT_ICMP_ERR, (uint8_t*)eth_hdr, len, NULL, 3, 0);
+    return;
+  }
+
+  /* policed last, so only packets that would be forwarded are charged */
+  if (sr_police_check(sr->police, (uint8_t*)ip_hdr,
+                      len - sizeof(sr_ethernet_hdr_t)) != 0) {
+    sr_log_debug(SR_LOG_ROUTER, "ip packet over its policer\n");
+    return;
+  }
+
+  sr_stat_inc(SR_STAT_IP_FORWARD);
+  sr_flow_account(sr->flows, (uint8_t*)ip_hdr, len - sizeof(sr_ethernet_hdr_t),
+                  interface);
+
+  /* decrement ttl and re-checksum the ip header, options included */
   ip_hdr->ip_ttl -= 1;
   ip_hdr->ip_sum = 0;
-  ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
+  ip_hdr->ip_sum = cksum(ip_hdr, ip_hdr->ip_hl * 4);
 
-  send_or_queue_packet(sr, (uint8_t*) eth_hdr, len, ntohl(ip_hdr->ip_dst));
+  send_on_iface(sr, (uint8_t*)eth_hdr, len, next_hop_ip, out);
 }
 
 void handle_ip_packet(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
@@ -441,33 +515,102 @@ void handle_ip_packet(struct sr_instance* sr, sr_ethernet_hdr_t* eth_hdr,
                       char* interface) {
   /* Read the ip header out */
   sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)ip_packet_buf;
+  unsigned int ip_hl = ip_hdr->ip_hl * 4;
+
+  if (ip_hl < sizeof(sr_ip_hdr_t) || ip_hl > len - sizeof(sr_ethernet_hdr_t)) {
+    sr_log_warn(SR_LOG_ROUTER, "IP header length %u invalid\n", ip_hl);
+    sr_stat_inc(SR_STAT_DROP_IP_MALFORMED);
+    return;
+  }
 
-  uint16_t check_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t)) ^ 0xffff;
+  /* the checksum covers the options too */
+  uint16_t check_sum = cksum(ip_hdr, ip_hl) ^ 0xffff;
 
   if (check_sum != 0) {
-    fprintf(stderr, "IP packet check sum error %d\n", check_sum);
-    print_hdr_ip((uint8_t*)ip_hdr);
+    sr_log_warn(SR_LOG_ROUTER, "IP packet check sum error %d\n", check_sum);
+    sr_log_frame(SR_LOG_ROUTER, SR_LOG_WARN, interface, (uint8_t*)eth_hdr, len);
+    sr_stat_inc(SR_STAT_DROP_IP_CKSUM);
     return;
   }
 
   /* determine whether the packet is for me */
-  struct sr_if* if_itr;
-  for (if_itr = sr->if_list; if_itr != NULL;
-       if_itr = if_itr->next) {
+  if (ip_is_mine(sr, ip_hdr->ip_dst)) {
+    sr_log_debug(SR_LOG_ROUTER, "ip packet for me\n");
+    sr_stat_inc(SR_STAT_IP_LOCAL);
+    sr_hist_end(SR_HIST_PARSE, pkt_t0);
+    /* handled by the control plane, off the forwarding path */
+    sr_punt(sr, SR_PUNT_LOCAL, (uint8_t*)eth_hdr, len, interface, 0, 0);
+    return;
+  }
 
-    if (if_itr->ip == ip_hdr->ip_dst) {
-      printf("ip packet for me\n");
-      handle_ip_packet_to_me(sr, eth_hdr, ip_hdr, len - sizeof(sr_ethernet_hdr_t),
-                             interface);
-      return;
-    }
+  sr_log_debug(SR_LOG_ROUTER, "ip packet for others\n");
+  sr_hist_end(SR_HIST_PARSE, pkt_t0);
+
+  enum sr_acl_action action = sr_acl_check(sr->acl, ip_packet_buf,
+                                           len - sizeof(sr_ethernet_hdr_t),
+                                           interface);
+  if (action != SR_ACL_PERMIT) {
+    sr_log_debug(SR_LOG_ROUTER, "ip packet filtered\n");
+    sr_stat_inc(SR_STAT_DROP_ACL);
+    if (action == SR_ACL_REJECT)
+      sr_punt(sr, SR_PUNT_ICMP_ERR, (uint8_t*)eth_hdr, len, interface, 3, 13);
+    return;
   }
 
-  printf("ip packet for others\n");
   /* Reach here means the ip packet is not for me. Need to forward */
   handle_ip_packet_forward(sr, eth_hdr, ip_hdr, len, interface);
 }
 
+/*---------------------------------------------------------------------
+ * Method: sr_punt_handle(..)
+ * Scope:  Global
+ *
+ * Control-plane half of the router: does the work sr_handlepacket()
+ * handed to sr_punt().  Runs on the punt thread, or inline when there is
+ * none.  The frame is a private copy and may be modified.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_punt_handle(struct sr_instance* sr, int punt_class, uint8_t* frame,
+                    unsigned int len, char* interface, uint8_t type,
+                    uint8_t code) {
+  sr_ethernet_hdr_t* eth_hdr = (sr_ethernet_hdr_t*)frame;
+  sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+  unsigned int ip_packet_len = len - sizeof(sr_ethernet_hdr_t);
+
+  switch (punt_class) {
+    case SR_PUNT_ARP:
+      handle_arp_request(sr, eth_hdr, (sr_arp_hdr_t*)ip_hdr);
+      break;
+    case SR_PUNT_LOCAL:
+      /* A fragment is held until its datagram is whole */
+      if (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK)) {
+        unsigned int dgram_len;
+        uint8_t* dgram = sr_reasm_add(sr->reasm, frame, len, &dgram_len);
+        if (dgram == NULL) {
+          break;
+        }
+        handle_ip_packet_to_me(sr, (sr_ethernet_hdr_t*)dgram,
+                               (sr_ip_hdr_t*)(dgram + sizeof(sr_ethernet_hdr_t)),
+                               dgram_len - sizeof(sr_ethernet_hdr_t), interface);
+        free(dgram);
+        break;
+      }
+      handle_ip_packet_to_me(sr, eth_hdr, ip_hdr, ip_packet_len, interface);
+      break;
+    case SR_PUNT_ICMP_ERR:
+      /* No error about an error, nor about a datagram we generated: an
+         echo reply of ours with no route would otherwise loop */
+      if (ip_is_mine(sr, ip_hdr->ip_src) ||
+          ip_is_icmp_error(ip_hdr, ip_packet_len)) {
+        sr_log_debug(SR_LOG_ICMP, "not sending ICMP %d/%d\n", type, code);
+        break;
+      }
+      handle_icmp_error(sr, eth_hdr, ip_hdr, ip_packet_len, type, code);
+      break;
+  }
+}
+
 /*---------------------------------------------------------------------
  * Method: sr_handlepacket(uint8_t* p,char* interface)
  * Scope:  Global
@@ -491,11 +634,17 @@ void sr_handlepacket(struct sr_instance* sr, uint8_t* packet /* lent */,
   assert(packet);
   assert(interface);
 
-  printf("*** -> Received packet of length %d \n", len);
+  pkt_t0 = sr_tsc();
+  sr_log_debug(SR_LOG_ROUTER, "received packet of length %d on %s\n", len,
+               interface);
+  sr_log_frame(SR_LOG_ROUTER, SR_LOG_TRACE, interface, packet, len);
+  sr_stat_inc(SR_STAT_RX_PKTS);
+  sr_stat_add(SR_STAT_RX_BYTES, len);
 
   unsigned int ether_len = sizeof(sr_ethernet_hdr_t);
   if (len < ether_len) {
-    fprintf(stderr, "packet too short\n");
+    sr_log_warn(SR_LOG_ROUTER, "packet too short\n");
+    sr_stat_inc(SR_STAT_DROP_RUNT);
     return;
   }
   uint8_t* buf = packet;
@@ -509,32 +658,40 @@ void sr_handlepacket(struct sr_instance* sr, uint8_t* packet /* lent */,
   switch (ether_type) {
     case ethertype_arp:
       if (len - offset < sizeof(sr_arp_hdr_t)) {
-        fprintf(stderr, "Failed to parse ARP header, insufficient length\n");
+        sr_log_warn(SR_LOG_ARP, "failed to parse ARP header, insufficient length\n");
+        sr_stat_inc(SR_STAT_DROP_ARP_MALFORMED);
         return;
       }
 
       sr_arp_hdr_t* arp_hdr = (sr_arp_hdr_t*)(buf);
 
       if (ntohs(arp_hdr->ar_op) == arp_op_request) {
-        printf("Received an ARP request\n");
-        handle_arp_request(sr, eth_hdr, arp_hdr);
+        sr_log_debug(SR_LOG_ARP, "received an ARP request\n");
+        sr_stat_inc(SR_STAT_ARP_REQ_RX);
+        sr_punt(sr, SR_PUNT_ARP, packet, len, interface, 0, 0);
       } else if (ntohs(arp_hdr->ar_op) == arp_op_reply) {
+        sr_stat_inc(SR_STAT_ARP_REPLY_RX);
         handle_arp_reply(sr, eth_hdr, arp_hdr, interface);
       } else {
-        printf("ARP op-code invalid: arp opcode %d", ntohs(arp_hdr->ar_op));
-        print_hdrs(packet, len);
+        sr_log_warn(SR_LOG_ARP, "ARP op-code invalid: arp opcode %d\n",
+                    ntohs(arp_hdr->ar_op));
+        sr_log_frame(SR_LOG_ARP, SR_LOG_WARN, interface, packet, len);
+        sr_stat_inc(SR_STAT_DROP_ARP_MALFORMED);
       }
       break;
     case ethertype_ip:
       if (len - offset < sizeof(sr_ip_hdr_t)) {
-        fprintf(stderr, "Failed to parse IP header, insufficient length\n");
+        sr_log_warn(SR_LOG_ROUTER, "failed to parse IP header, insufficient length\n");
+        sr_stat_inc(SR_STAT_DROP_IP_MALFORMED);
         return;
       }
-      printf("Received IP packet\n");
+      sr_log_debug(SR_LOG_ROUTER, "received IP packet\n");
       /* Pass the original length */
       handle_ip_packet(sr, eth_hdr, buf, len, interface);
       break;
     default:
-      printf("not implemented: ethertype %d", ether_type);
+      sr_log_debug(SR_LOG_ROUTER, "not implemented: ethertype %d\n", ether_type);
+      sr_stat_inc(SR_STAT_DROP_ETHERTYPE);
   }
+  sr_hist_end(SR_HIST_TOTAL, pkt_t0);
 } 
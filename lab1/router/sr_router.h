@@ -11,6 +11,7 @@
 
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,10 +34,24 @@
 
 #define INIT_TTL 255
 #define PACKET_DUMP_SIZE 1024
+#define SR_SEND_IOV_MAX 4 /* pieces of one frame for sr_send_packetv() */
+#define SR_VNS_MSG_MAX 10000 /* longest command the server sends */
 
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_pcaplog;
+struct sr_capfilter;
+struct sr_workers;
+struct sr_punt;
+struct sr_icmp_limit;
+struct sr_fib;
+struct sr_nbrs;
+struct sr_egress;
+struct sr_acl;
+struct sr_police;
+struct sr_flows;
+struct sr_reasm;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -55,9 +70,23 @@ struct sr_instance
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
     struct sr_rt* routing_table; /* routing table = list of routes*/
+    struct sr_fib* fib; /* routing table compiled by sr_init_interfaces() */
+    struct sr_nbrs* nbrs; /* gateway liveness, -H */
+    struct sr_egress* egress; /* egress queues, -Q; NULL sends at once */
     struct sr_arpcache cache;   /* ARP cache */
     pthread_attr_t attr;
-    FILE* logfile;
+    struct sr_pcaplog* logfile; /* async pcap logger, -l */
+    struct sr_capfilter* capfilter; /* what gets logged, -F/-N */
+    struct sr_workers* workers; /* forwarding threads, -W; NULL inline */
+    pthread_mutex_t send_lock; /* one frame at a time onto sockfd */
+    struct sr_punt* punt; /* control-plane queue, -P; NULL inline */
+    struct sr_icmp_limit* icmp_limit; /* ICMP error rate limits, -R */
+    struct sr_acl* acl; /* ingress filter on forwarded traffic, -A */
+    struct sr_police* police; /* per prefix policers, -B */
+    struct sr_flows* flows; /* flow accounting and export, -E */
+    struct sr_reasm* reasm; /* fragments addressed to us */
+    const char* mtu_spec; /* interface MTUs, -M; applied with the interfaces */
+    int hosted; /* one of many routers in the process, -V: no threads of its own */
 };
 
 /* -- sr_main.c -- */
@@ -65,12 +94,21 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_send_packetv(struct sr_instance* , const struct iovec* , int , const char*);
+int sr_vns_send(struct sr_instance* , const uint8_t* , unsigned int , const char*);
+int sr_vns_sendv(struct sr_instance* , const struct iovec* , int , const char*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+int sr_handle_command(struct sr_instance* , unsigned char* , int , int );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
+void sr_init_interfaces(struct sr_instance* );
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
+void send_or_queue_packet(struct sr_instance* , uint8_t* , unsigned int , uint32_t );
+void generate_arp_request(struct sr_instance* , struct sr_arpreq* , struct sr_if* );
+void sr_punt_handle(struct sr_instance* , int , uint8_t* , unsigned int ,
+                    char* , uint8_t , uint8_t );
 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
@@ -35,6 +35,7 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
     char  gw[32];
     char  mask[32];
     char  iface[32];
+    unsigned int weight;
     struct in_addr dest_addr;
     struct in_addr gw_addr;
     struct in_addr mask_addr;
@@ -52,7 +53,11 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
 
     while( fgets(line,BUFSIZ,fp) != 0)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
+        /* -- optional fifth column: weight among equal-cost routes,
+              0 for a backup used only while the others are down -- */
+        weight = 1;
+        if(sscanf(line,"%31s %31s %31s %31s %u",dest,gw,mask,iface,&weight) < 4)
+        { continue; }
         if(inet_aton(dest,&dest_addr) == 0)
         { 
             fprintf(stderr,
@@ -79,7 +84,7 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
             sr->routing_table = 0;
             clear_routing_table = 1;
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
+        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface,weight);
     } /* -- while -- */
 
     return 0; /* -- success -- */
@@ -91,7 +96,7 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
  *---------------------------------------------------------------------*/
 
 void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
-struct in_addr gw, struct in_addr mask,char* if_name)
+struct in_addr gw, struct in_addr mask,char* if_name, unsigned int weight)
 {
     struct sr_rt* rt_walker = 0;
 
@@ -109,6 +114,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
         strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        sr->routing_table->weight = weight;
 
         return;
     }
@@ -128,6 +134,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
     strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    rt_walker->weight = weight;
 
 } /* -- sr_add_entry -- */
 
@@ -173,6 +180,11 @@ void sr_print_routing_entry(struct sr_rt* entry)
     printf("%s\t\t",inet_ntoa(entry->dest));
     printf("%s\t",inet_ntoa(entry->gw));
     printf("%s\t",inet_ntoa(entry->mask));
-    printf("%s\n",entry->interface);
+    if(entry->weight > 1)
+    { printf("%s\tweight %u\n",entry->interface,entry->weight); }
+    else if(entry->weight == 0)
+    { printf("%s\tbackup\n",entry->interface); }
+    else
+    { printf("%s\n",entry->interface); }
 
 } /* -- sr_print_routing_entry -- */
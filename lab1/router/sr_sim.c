@@ -0,0 +1,969 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_sim.c
+ *
+ * Description:
+ *
+ * In-process topology simulator.  Reads the lab2 netinfo tables
+ * (links.csv and hosts.csv) and builds the whole network in one process:
+ * every link endpoint not named in hosts.csv is a router, a full
+ * struct sr_instance running the router core unchanged, and every host is
+ * a small traffic endpoint that answers ARP and pings and counts what
+ * reaches it.  Links are point to point with a delay, a bandwidth and a
+ * drop-tail queue in each direction.
+ *
+ * Time is simulated: a frame a router or host sends becomes an event at
+ * the time its last bit reaches the far end, and one loop delivers the
+ * events in time order, into sr_handlepacket() for a router.  A second
+ * of traffic takes as long as the routers need to forward it, so the
+ * wall clock figures are the forwarding cost of the whole topology.
+ *
+ * Each router's routing table is read from DIR/NAME with -r where that
+ * file exists, and otherwise computed: shortest paths by the links' Cost
+ * column (1 where empty), with every equal-cost first hop, on a /24 per
+ * link.
+ *
+ * Every host sends UDP to every other host at -p datagrams per second
+ * for -t ms.  At the end the simulator prints delivery and loss, one
+ * way latency, when every host pair had first got through (the time the
+ * cold network takes to resolve ARP along every path) and per link
+ * load.
+ *
+ *   ./sr_sim -n ../../lab2/netinfo -p 1000 -t 2000
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_stats.h"
+
+#define DEFAULT_NETINFO  "../../lab2/netinfo"
+#define SIM_LINE_MAX     512
+#define SIM_NAME_MAX     32
+#define SIM_MAX_IFS      16
+#define SIM_PREFIX_LEN   24         /* every link is a /24 */
+#define SIM_HOST_HOLD    256        /* datagrams a host holds for ARP */
+#define SIM_FRAME_MAX    1514
+#define SIM_MAGIC        0x5253494dU
+#define SIM_UDP_PORT     9          /* discard */
+#define SIM_INF          0xffffffffU
+
+struct sim_node;
+struct sim_link;
+
+/* One side of a link: an interface of a router or a host */
+struct sim_end
+{
+    struct sim_node* node;
+    struct sim_link* link;
+    int side;                       /* this end is link->end[side] */
+    char name[sr_IFACE_NAMELEN];
+    uint32_t ip;                    /* network order */
+    unsigned char mac[ETHER_ADDR_LEN];
+};
+
+/* One direction of a link */
+struct sim_dir
+{
+    uint64_t busy_until;            /* ns the last queued bit is out */
+    uint64_t frames, bytes, drops;
+};
+
+struct sim_link
+{
+    struct sim_end* end[2];
+    unsigned int cost;
+    uint32_t subnet;                /* host order */
+    struct sim_dir dir[2];          /* dir[s]: sent by end[s] */
+};
+
+/* A frame held by a host until its gateway's MAC is known */
+struct sim_held
+{
+    struct sim_held* next;
+    unsigned int len;
+    uint8_t frame[SIM_FRAME_MAX];
+};
+
+struct sim_node
+{
+    struct sr_instance sr;          /* first: sr_send_packet() is handed &sr */
+    char name[SIM_NAME_MAX];
+    int is_host;
+    unsigned int id;
+    struct sim_end* ends[SIM_MAX_IFS];
+    unsigned int nends;
+
+    /* hosts */
+    int gw_known;
+    unsigned char gw_mac[ETHER_ADDR_LEN];
+    struct sim_held *held, *held_tail;
+    unsigned int nheld;
+    uint64_t icmp_rx[256];          /* by type */
+};
+
+/* Traffic from one host to another */
+struct sim_flow
+{
+    struct sim_node *src, *dst;
+    uint32_t seq;
+    uint64_t sent, delivered, first_rx;
+};
+
+enum sim_event_type { SIM_EV_FRAME, SIM_EV_SEND };
+
+struct sim_event
+{
+    uint64_t t, seq;
+    enum sim_event_type type;
+    struct sim_end* to;             /* SIM_EV_FRAME: arrives here */
+    uint8_t* frame;
+    unsigned int len;
+    struct sim_flow* flow;          /* SIM_EV_SEND */
+};
+
+/* UDP payload of simulated traffic */
+struct sim_payload
+{
+    uint32_t magic;
+    uint32_t flow;
+    uint32_t seq;
+    uint64_t t_sent;
+} __attribute__ ((packed));
+
+static struct
+{
+    pthread_mutex_t lock;           /* ARP sweep threads transmit too */
+    uint64_t now;                   /* ns */
+    uint64_t seq;
+    struct sim_event** heap;
+    unsigned int nheap, capheap;
+
+    struct sim_node** nodes;
+    unsigned int nnodes;
+    struct sim_link** links;
+    unsigned int nlinks;
+    struct sim_flow* flows;
+    unsigned int nflows;
+
+    uint64_t delay_ns;
+    double ns_per_byte;
+    uint64_t queue_ns;              /* drop tail past this much backlog */
+    unsigned int payload;
+    uint64_t events, held_drops;
+    uint64_t latency[SR_HIST_BUCKETS];
+} sim;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*---------------------------------------------------------------------
+ * Events
+ *---------------------------------------------------------------------*/
+
+static int sim_before(const struct sim_event* a, const struct sim_event* b)
+{
+    return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+/* Called with sim.lock held */
+static void sim_push(struct sim_event* ev)
+{
+    unsigned int i;
+
+    if (sim.nheap == sim.capheap) {
+        sim.capheap = sim.capheap ? sim.capheap * 2 : 1024;
+        sim.heap = realloc(sim.heap, sim.capheap * sizeof(*sim.heap));
+        assert(sim.heap);
+    }
+    ev->seq = sim.seq++;
+    for (i = sim.nheap++; i > 0 && sim_before(ev, sim.heap[(i - 1) / 2]); i = (i - 1) / 2)
+        sim.heap[i] = sim.heap[(i - 1) / 2];
+    sim.heap[i] = ev;
+}
+
+/* Called with sim.lock held */
+static struct sim_event* sim_pop(void)
+{
+    struct sim_event *top, *last;
+    unsigned int i = 0, c;
+
+    if (!sim.nheap)
+        return NULL;
+    top = sim.heap[0];
+    last = sim.heap[--sim.nheap];
+    while ((c = 2 * i + 1) < sim.nheap) {
+        if (c + 1 < sim.nheap && sim_before(sim.heap[c + 1], sim.heap[c]))
+            c++;
+        if (!sim_before(sim.heap[c], last))
+            break;
+        sim.heap[i] = sim.heap[c];
+        i = c;
+    }
+    sim.heap[i] = last;
+    return top;
+}
+
+/* Puts a frame on the wire at end from: it arrives at the far end once
+   the frames ahead of it and its own bits are out, plus the delay */
+static int sim_transmit(struct sim_end* from, const uint8_t* frame, unsigned int len)
+{
+    struct sim_dir* d = &from->link->dir[from->side];
+    struct sim_event* ev;
+    uint64_t start;
+
+    pthread_mutex_lock(&sim.lock);
+    start = d->busy_until > sim.now ? d->busy_until : sim.now;
+    if (start - sim.now > sim.queue_ns) {
+        d->drops++;
+        pthread_mutex_unlock(&sim.lock);
+        return -1;
+    }
+    ev = malloc(sizeof(*ev));
+    assert(ev);
+    ev->type = SIM_EV_FRAME;
+    ev->to = from->link->end[!from->side];
+    ev->len = len;
+    ev->frame = malloc(len);
+    assert(ev->frame);
+    memcpy(ev->frame, frame, len);
+
+    d->busy_until = start + (uint64_t)(len * sim.ns_per_byte);
+    d->frames++;
+    d->bytes += len;
+    ev->t = d->busy_until + sim.delay_ns;
+    sim_push(ev);
+    pthread_mutex_unlock(&sim.lock);
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Router side: the core transmits through these
+ *---------------------------------------------------------------------*/
+
+int sr_send_packet(struct sr_instance* sr /* borrowed */,
+                   uint8_t* buf /* borrowed */,
+                   unsigned int len,
+                   const char* iface /* borrowed */)
+{
+    struct sim_node* node = (struct sim_node*)sr;
+    unsigned int i;
+
+    if (len < sizeof(sr_ethernet_hdr_t) || len > SIM_FRAME_MAX)
+        return -1;
+    for (i = 0; i < node->nends; i++)
+        if (strncmp(node->ends[i]->name, iface, sr_IFACE_NAMELEN) == 0)
+            return sim_transmit(node->ends[i], buf, len);
+    return -1;
+}
+
+int sr_send_packetv(struct sr_instance* sr, const struct iovec* iov, int iovcnt,
+                    const char* iface)
+{
+    uint8_t buf[SIM_FRAME_MAX];
+    unsigned int len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (len + iov[i].iov_len > sizeof(buf))
+            return -1;
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return sr_send_packet(sr, buf, len, iface);
+}
+
+/* The egress queues write through this; the simulator runs without
+   them, so it only has to link. */
+int sr_vns_send(struct sr_instance* sr, const uint8_t* buf, unsigned int len,
+                const char* iface)
+{
+    return sr_send_packet(sr, (uint8_t*)buf, len, iface);
+}
+
+/*---------------------------------------------------------------------
+ * Hosts
+ *---------------------------------------------------------------------*/
+
+static void host_arp(struct sim_node* h, uint16_t op, const unsigned char* tha,
+                     uint32_t tip)
+{
+    struct sim_end* e = h->ends[0];
+    uint8_t frame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+    sr_arp_hdr_t* arp = (sr_arp_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+
+    if (op == arp_op_request)
+        memset(eth->ether_dhost, 0xff, ETHER_ADDR_LEN);
+    else
+        memcpy(eth->ether_dhost, tha, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, e->mac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_arp);
+    arp->ar_hrd = htons(arp_hrd_ethernet);
+    arp->ar_pro = htons(ethertype_ip);
+    arp->ar_hln = ETHER_ADDR_LEN;
+    arp->ar_pln = 4;
+    arp->ar_op = htons(op);
+    memcpy(arp->ar_sha, e->mac, ETHER_ADDR_LEN);
+    arp->ar_sip = e->ip;
+    if (op == arp_op_request)
+        memset(arp->ar_tha, 0, ETHER_ADDR_LEN);
+    else
+        memcpy(arp->ar_tha, tha, ETHER_ADDR_LEN);
+    arp->ar_tip = tip;
+    sim_transmit(e, frame, sizeof(frame));
+}
+
+/* Sends an IP frame to the gateway, or holds it until the gateway's MAC
+   is known */
+static void host_send_ip(struct sim_node* h, uint8_t* frame, unsigned int len)
+{
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+    struct sim_held* m;
+
+    memcpy(eth->ether_shost, h->ends[0]->mac, ETHER_ADDR_LEN);
+    if (h->gw_known) {
+        memcpy(eth->ether_dhost, h->gw_mac, ETHER_ADDR_LEN);
+        sim_transmit(h->ends[0], frame, len);
+        return;
+    }
+    if (h->nheld == SIM_HOST_HOLD || (m = malloc(sizeof(*m))) == NULL) {
+        sim.held_drops++;
+        return;
+    }
+    m->len = len;
+    memcpy(m->frame, frame, len);
+    m->next = NULL;
+    if (h->held_tail)
+        h->held_tail->next = m;
+    else
+        h->held = m;
+    h->held_tail = m;
+    if (h->nheld++ == 0)
+        host_arp(h, arp_op_request, NULL, h->ends[0]->link->end[!h->ends[0]->side]->ip);
+}
+
+static void host_send_udp(struct sim_flow* fl, uint64_t now)
+{
+    struct sim_node* h = fl->src;
+    uint8_t frame[SIM_FRAME_MAX];
+    unsigned int ip_len = sizeof(sr_ip_hdr_t) + 8 + sim.payload;
+    sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    uint8_t* udp = (uint8_t*)(ip_hdr + 1);
+    struct sim_payload* p = (struct sim_payload*)(udp + 8);
+    uint16_t sport = htons(10000 + (fl - sim.flows) % 50000);
+
+    memset(frame, 0, sizeof(sr_ethernet_hdr_t) + ip_len);
+    ((sr_ethernet_hdr_t*)frame)->ether_type = htons(ethertype_ip);
+    ip_hdr->ip_v = 4;
+    ip_hdr->ip_hl = 5;
+    ip_hdr->ip_len = htons(ip_len);
+    ip_hdr->ip_id = htons(fl->seq);
+    ip_hdr->ip_ttl = 64;
+    ip_hdr->ip_p = IPPROTO_UDP;
+    ip_hdr->ip_src = h->ends[0]->ip;
+    ip_hdr->ip_dst = fl->dst->ends[0]->ip;
+    ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
+
+    memcpy(udp, &sport, 2);
+    udp[2] = SIM_UDP_PORT >> 8;
+    udp[3] = SIM_UDP_PORT & 0xff;
+    udp[4] = (8 + sim.payload) >> 8;
+    udp[5] = (8 + sim.payload) & 0xff;
+    p->magic = htonl(SIM_MAGIC);
+    p->flow = fl - sim.flows;
+    p->seq = fl->seq++;
+    p->t_sent = now;
+
+    fl->sent++;
+    host_send_ip(h, frame, sizeof(sr_ethernet_hdr_t) + ip_len);
+}
+
+static void host_rx(struct sim_node* h, uint8_t* frame, unsigned int len, uint64_t now)
+{
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+    struct sim_end* e = h->ends[0];
+
+    if (ntohs(eth->ether_type) == ethertype_arp &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
+        sr_arp_hdr_t* arp = (sr_arp_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+        if (arp->ar_tip != e->ip)
+            return;
+        if (ntohs(arp->ar_op) == arp_op_request) {
+            host_arp(h, arp_op_reply, arp->ar_sha, arp->ar_sip);
+        } else if (ntohs(arp->ar_op) == arp_op_reply && !h->gw_known) {
+            struct sim_held* m;
+            memcpy(h->gw_mac, arp->ar_sha, ETHER_ADDR_LEN);
+            h->gw_known = 1;
+            while ((m = h->held) != NULL) {
+                h->held = m->next;
+                host_send_ip(h, m->frame, m->len);
+                free(m);
+            }
+            h->held_tail = NULL;
+            h->nheld = 0;
+        }
+        return;
+    }
+
+    if (ntohs(eth->ether_type) == ethertype_ip &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+        sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+        unsigned int hl = ip_hdr->ip_hl * 4;
+        uint8_t* l4 = (uint8_t*)ip_hdr + hl;
+
+        if (ip_hdr->ip_dst != e->ip)
+            return;
+        if (ip_hdr->ip_p == IPPROTO_UDP &&
+            len >= sizeof(sr_ethernet_hdr_t) + hl + 8 + sizeof(struct sim_payload)) {
+            struct sim_payload* p = (struct sim_payload*)(l4 + 8);
+            struct sim_flow* fl;
+            if (ntohl(p->magic) != SIM_MAGIC || p->flow >= sim.nflows)
+                return;
+            fl = &sim.flows[p->flow];
+            if (!fl->delivered++)
+                fl->first_rx = now;
+            sim.latency[sr_hist_bucket(now - p->t_sent)]++;
+        } else if (ip_hdr->ip_p == ip_protocol_icmp &&
+                   len >= sizeof(sr_ethernet_hdr_t) + hl + sizeof(sr_icmp_hdr_t)) {
+            sr_icmp_hdr_t* icmp = (sr_icmp_hdr_t*)l4;
+            h->icmp_rx[icmp->icmp_type]++;
+            if (icmp->icmp_type == 8) {
+                icmp->icmp_sum = cksum_adjust(icmp->icmp_sum, htons(8 << 8),
+                                              htons(0 << 8));
+                icmp->icmp_type = 0;
+                ip_hdr->ip_dst = ip_hdr->ip_src;
+                ip_hdr->ip_src = e->ip;
+                ip_hdr->ip_ttl = 64;
+                ip_hdr->ip_sum = 0;
+                ip_hdr->ip_sum = cksum(ip_hdr, hl);
+                host_send_ip(h, frame, len);
+            }
+        }
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Topology
+ *---------------------------------------------------------------------*/
+
+/* Splits a CSV line in place into at most max fields; returns how many */
+static int sim_csv(char* line, char** f, int max)
+{
+    int n = 0;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    f[n++] = line;
+    while (n < max && (line = strchr(line, ',')) != NULL) {
+        *line++ = '\0';
+        f[n++] = line;
+    }
+    return n;
+}
+
+/* Is net listed in the comma separated nets?  NULL lists every net. */
+static int sim_net_wanted(const char* nets, const char* net)
+{
+    size_t len = strlen(net);
+    const char* p;
+
+    if (!nets)
+        return 1;
+    for (p = nets; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL)
+        if (strncmp(p, net, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+            return 1;
+    return 0;
+}
+
+static struct sim_node* sim_node(const char* name, int create)
+{
+    struct sim_node* n;
+    unsigned int i;
+
+    for (i = 0; i < sim.nnodes; i++)
+        if (strcmp(sim.nodes[i]->name, name) == 0)
+            return sim.nodes[i];
+    if (!create)
+        return NULL;
+    if (strlen(name) >= SIM_NAME_MAX || sim.nnodes == 0xffff) {
+        fprintf(stderr, "sr_sim: bad node %s\n", name);
+        return NULL;
+    }
+    n = calloc(1, sizeof(*n));
+    assert(n);
+    strcpy(n->name, name);
+    n->id = sim.nnodes;
+    n->sr.sockfd = -1;
+    sim.nodes = realloc(sim.nodes, (sim.nnodes + 1) * sizeof(*sim.nodes));
+    assert(sim.nodes);
+    sim.nodes[sim.nnodes++] = n;
+    return n;
+}
+
+static struct sim_end* sim_add_end(struct sim_node* n, const char* ifname,
+                                   const char* addr)
+{
+    struct sim_end* e;
+    struct in_addr a;
+
+    if (n->nends == SIM_MAX_IFS || strlen(ifname) >= sr_IFACE_NAMELEN ||
+        inet_pton(AF_INET, addr, &a) != 1) {
+        fprintf(stderr, "sr_sim: bad interface %s %s on %s\n", ifname, addr, n->name);
+        return NULL;
+    }
+    e = calloc(1, sizeof(*e));
+    assert(e);
+    e->node = n;
+    strcpy(e->name, ifname);
+    e->ip = a.s_addr;
+    e->mac[0] = 0x02;
+    e->mac[2] = n->id >> 8;
+    e->mac[3] = n->id;
+    e->mac[4] = n->nends;
+    e->mac[5] = 1;
+    n->ends[n->nends++] = e;
+    return e;
+}
+
+static int sim_load(const char* dir, const char* nets)
+{
+    char path[BUFSIZ], line[SIM_LINE_MAX], *f[8];
+    unsigned int lineno = 0, i, j;
+    FILE* fp;
+
+    snprintf(path, sizeof(path), "%s/hosts.csv", dir);
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        struct sim_node* n;
+        if (lineno++ == 0 || sim_csv(line, f, 2) != 2 || !sim_net_wanted(nets, f[0]))
+            continue;
+        if ((n = sim_node(f[1], 1)) == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        n->is_host = 1;
+    }
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "%s/links.csv", dir);
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        struct sim_link* l;
+        struct sim_node *a, *b;
+        if (lineno++ == 0 || sim_csv(line, f, 8) < 7 || !sim_net_wanted(nets, f[0]))
+            continue;
+        if ((a = sim_node(f[1], 1)) == NULL || (b = sim_node(f[4], 1)) == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        l = calloc(1, sizeof(*l));
+        assert(l);
+        if ((l->end[0] = sim_add_end(a, f[2], f[3])) == NULL ||
+            (l->end[1] = sim_add_end(b, f[5], f[6])) == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        for (i = 0; i < 2; i++) {
+            l->end[i]->link = l;
+            l->end[i]->side = i;
+        }
+        l->cost = f[7] && atoi(f[7]) > 0 ? atoi(f[7]) : 1;
+        l->subnet = ntohl(l->end[0]->ip) & ~0U << (32 - SIM_PREFIX_LEN);
+        if ((ntohl(l->end[1]->ip) & ~0U << (32 - SIM_PREFIX_LEN)) != l->subnet) {
+            fprintf(stderr, "sr_sim: %s:%u: ends not on one /%d\n", path, lineno,
+                    SIM_PREFIX_LEN);
+            fclose(fp);
+            return -1;
+        }
+        for (j = 0; j < sim.nlinks; j++)
+            if (sim.links[j]->subnet == l->subnet) {
+                fprintf(stderr, "sr_sim: %s:%u: /%d shared with another link\n",
+                        path, lineno, SIM_PREFIX_LEN);
+                fclose(fp);
+                return -1;
+            }
+        sim.links = realloc(sim.links, (sim.nlinks + 1) * sizeof(*sim.links));
+        assert(sim.links);
+        sim.links[sim.nlinks++] = l;
+    }
+    fclose(fp);
+
+    for (i = 0; i < sim.nnodes; i++) {
+        if (sim.nodes[i]->is_host && sim.nodes[i]->nends != 1) {
+            fprintf(stderr, "sr_sim: host %s has %u links, expected 1\n",
+                    sim.nodes[i]->name, sim.nodes[i]->nends);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Shortest path costs from router src to every node, through routers
+   only */
+static void sim_dijkstra(struct sim_node* src, unsigned int* dist)
+{
+    unsigned char* done = calloc(sim.nnodes, 1);
+    unsigned int i, k;
+
+    assert(done);
+    for (i = 0; i < sim.nnodes; i++)
+        dist[i] = SIM_INF;
+    dist[src->id] = 0;
+    while (1) {
+        struct sim_node* u = NULL;
+        for (i = 0; i < sim.nnodes; i++)
+            if (!done[i] && dist[i] != SIM_INF && (!u || dist[i] < dist[u->id]))
+                u = sim.nodes[i];
+        if (!u)
+            break;
+        done[u->id] = 1;
+        if (u->is_host)
+            continue;
+        for (k = 0; k < u->nends; k++) {
+            struct sim_link* l = u->ends[k]->link;
+            struct sim_node* v = l->end[!u->ends[k]->side]->node;
+            if (dist[u->id] + l->cost < dist[v->id])
+                dist[v->id] = dist[u->id] + l->cost;
+        }
+    }
+    free(done);
+}
+
+/* Routes from r to every link's /24: connected, or through every
+   neighbor on a shortest path to the nearer of the link's ends */
+static void sim_compute_rt(struct sim_node* r)
+{
+    unsigned int* dist = malloc(sim.nnodes * sizeof(unsigned int));
+    unsigned int** ndist = calloc(r->nends, sizeof(unsigned int*));
+    struct in_addr dest, gw, mask;
+    unsigned int i, k;
+
+    assert(dist && ndist);
+    mask.s_addr = htonl(~0U << (32 - SIM_PREFIX_LEN));
+    sim_dijkstra(r, dist);
+    for (k = 0; k < r->nends; k++) {
+        struct sim_node* v = r->ends[k]->link->end[!r->ends[k]->side]->node;
+        ndist[k] = malloc(sim.nnodes * sizeof(unsigned int));
+        assert(ndist[k]);
+        if (v->is_host)
+            memset(ndist[k], 0xff, sim.nnodes * sizeof(unsigned int));
+        else
+            sim_dijkstra(v, ndist[k]);
+    }
+
+    for (i = 0; i < sim.nlinks; i++) {
+        struct sim_link* l = sim.links[i];
+        unsigned int best = SIM_INF, e;
+
+        dest.s_addr = htonl(l->subnet);
+        if (l->end[0]->node == r || l->end[1]->node == r) {
+            gw.s_addr = 0;
+            for (k = 0; k < r->nends; k++)
+                if (r->ends[k]->link == l)
+                    sr_add_rt_entry(&r->sr, dest, gw, mask, r->ends[k]->name, 1);
+            continue;
+        }
+        /* a link is reached at whichever end routes to it, never through
+           a host */
+        for (e = 0; e < 2; e++)
+            if (!l->end[e]->node->is_host && dist[l->end[e]->node->id] < best)
+                best = dist[l->end[e]->node->id];
+        if (best == SIM_INF)
+            continue;
+        for (k = 0; k < r->nends; k++) {
+            struct sim_link* via = r->ends[k]->link;
+            struct sim_end* peer = via->end[!r->ends[k]->side];
+            unsigned int d = SIM_INF;
+            for (e = 0; e < 2; e++)
+                if (!l->end[e]->node->is_host && ndist[k][l->end[e]->node->id] < d)
+                    d = ndist[k][l->end[e]->node->id];
+            if (peer->node->is_host || d == SIM_INF || via->cost + d != best)
+                continue;
+            gw.s_addr = peer->ip;
+            sr_add_rt_entry(&r->sr, dest, gw, mask, r->ends[k]->name, 1);
+        }
+    }
+    for (k = 0; k < r->nends; k++)
+        free(ndist[k]);
+    free(ndist);
+    free(dist);
+}
+
+static int sim_routers_init(const char* rtdir)
+{
+    char path[BUFSIZ];
+    unsigned int i, k;
+
+    for (i = 0; i < sim.nnodes; i++) {
+        struct sim_node* r = sim.nodes[i];
+        if (r->is_host)
+            continue;
+        for (k = 0; k < r->nends; k++) {
+            sr_add_interface(&r->sr, r->ends[k]->name);
+            sr_set_ether_addr(&r->sr, r->ends[k]->mac);
+            sr_set_ether_ip(&r->sr, r->ends[k]->ip);
+        }
+        snprintf(path, sizeof(path), "%s/%s", rtdir ? rtdir : "", r->name);
+        if (rtdir && access(path, R_OK) == 0) {
+            if (sr_load_rt(&r->sr, path) != 0)
+                return -1;
+        } else {
+            sim_compute_rt(r);
+        }
+        sr_init(&r->sr);
+        sr_init_interfaces(&r->sr);
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Run
+ *---------------------------------------------------------------------*/
+
+/* One flow per ordered pair of hosts, sending from t=0, spread over the
+   first interval so the hosts do not all send at once */
+static void sim_flows_init(uint64_t interval)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < sim.nnodes; i++)
+        for (j = 0; j < sim.nnodes; j++) {
+            struct sim_flow* fl;
+            if (i == j || !sim.nodes[i]->is_host || !sim.nodes[j]->is_host)
+                continue;
+            sim.flows = realloc(sim.flows, (sim.nflows + 1) * sizeof(*sim.flows));
+            assert(sim.flows);
+            fl = &sim.flows[sim.nflows++];
+            memset(fl, 0, sizeof(*fl));
+            fl->src = sim.nodes[i];
+            fl->dst = sim.nodes[j];
+        }
+    for (i = 0; i < sim.nflows; i++) {
+        struct sim_event* ev = calloc(1, sizeof(*ev));
+        assert(ev);
+        ev->type = SIM_EV_SEND;
+        ev->flow = &sim.flows[i];
+        ev->t = interval * i / sim.nflows;
+        sim_push(ev);
+    }
+}
+
+static void sim_run(uint64_t interval, uint64_t duration)
+{
+    struct sim_event* ev;
+
+    while (1) {
+        pthread_mutex_lock(&sim.lock);
+        ev = sim_pop();
+        if (ev)
+            sim.now = ev->t;
+        pthread_mutex_unlock(&sim.lock);
+        if (!ev)
+            break;
+        sim.events++;
+
+        if (ev->type == SIM_EV_SEND) {
+            host_send_udp(ev->flow, ev->t);
+            if (ev->t + interval < duration) {
+                ev->t += interval;
+                pthread_mutex_lock(&sim.lock);
+                sim_push(ev);
+                pthread_mutex_unlock(&sim.lock);
+                continue;
+            }
+        } else if (ev->to->node->is_host) {
+            host_rx(ev->to->node, ev->frame, ev->len, ev->t);
+        } else {
+            sr_handlepacket(&ev->to->node->sr, ev->frame, ev->len, ev->to->name);
+        }
+        free(ev->frame);
+        free(ev);
+    }
+}
+
+static void sim_report(uint64_t duration, double bw_kbps, uint64_t wall_ns,
+                       int counters)
+{
+    uint64_t sent = 0, delivered = 0, link_frames = 0, drops = 0, icmp[256];
+    uint64_t converged = 0;
+    unsigned int i, never = 0, t;
+
+    memset(icmp, 0, sizeof(icmp));
+    for (i = 0; i < sim.nflows; i++) {
+        struct sim_flow* fl = &sim.flows[i];
+        sent += fl->sent;
+        delivered += fl->delivered;
+        if (!fl->delivered)
+            never++;
+        else if (fl->first_rx > converged)
+            converged = fl->first_rx;
+    }
+    for (i = 0; i < sim.nnodes; i++)
+        for (t = 0; t < 256; t++)
+            icmp[t] += sim.nodes[i]->icmp_rx[t];
+
+    printf("%-18s %-10s %10s %12s %8s %6s\n", "link", "to", "frames", "bytes",
+           "drops", "util%");
+    for (i = 0; i < sim.nlinks; i++) {
+        struct sim_link* l = sim.links[i];
+        unsigned int s;
+        for (s = 0; s < 2; s++) {
+            char from[2 * SIM_NAME_MAX], to[2 * SIM_NAME_MAX];
+            struct sim_dir* d = &l->dir[s];
+            link_frames += d->frames;
+            drops += d->drops;
+            if (!d->frames && !d->drops)
+                continue;
+            snprintf(from, sizeof(from), "%s:%s", l->end[s]->node->name, l->end[s]->name);
+            snprintf(to, sizeof(to), "%s", l->end[!s]->node->name);
+            printf("%-18s %-10s %10llu %12llu %8llu %6.1f\n", from, to,
+                   (unsigned long long)d->frames, (unsigned long long)d->bytes,
+                   (unsigned long long)d->drops,
+                   duration ? d->bytes * 8 / (bw_kbps * 1e3) / (duration / 1e9) * 100 : 0.0);
+        }
+    }
+
+    printf("\nsr_sim: %u nodes, %u links, %u host pairs, %.3f s simulated\n",
+           sim.nnodes, sim.nlinks, sim.nflows, duration / 1e9);
+    printf("sr_sim: sent %llu delivered %llu (%.2f%% lost), %llu link drops, "
+           "%llu held for ARP dropped\n", (unsigned long long)sent,
+           (unsigned long long)delivered,
+           sent ? 100.0 * (sent - delivered) / sent : 0.0,
+           (unsigned long long)drops, (unsigned long long)sim.held_drops);
+    printf("sr_sim: ICMP at hosts: %llu unreachable, %llu time exceeded, "
+           "%llu echo replies\n", (unsigned long long)icmp[3],
+           (unsigned long long)icmp[11], (unsigned long long)icmp[0]);
+    if (never)
+        printf("sr_sim: %u host pairs never got through\n", never);
+    else
+        printf("sr_sim: every host pair through by %.3f ms\n", converged / 1e6);
+    printf("%-8s %10s %9s %9s %9s %9s %9s %9s\n", "latency", "count",
+           "mean", "p50", "p90", "p99", "p99.9", "max");
+    sr_hist_print(stdout, "latency", sim.latency, 1.0);
+    printf("sr_sim: %llu events, %llu link frames in %.3f s: %.0f frames/s\n",
+           (unsigned long long)sim.events, (unsigned long long)link_frames,
+           wall_ns / 1e9, wall_ns ? link_frames * 1e9 / wall_ns : 0.0);
+    if (counters) {
+        sr_stats_dump(stdout);
+        sr_stats_hist_dump(stdout);
+    }
+}
+
+static void usage(char* argv0)
+{
+    printf("In-process topology simulator for the sr forwarding engine\n");
+    printf("Format: %s [-h] [-n netinfo dir] [-N nets] [-r rtable dir] \n", argv0);
+    printf("           [-d delay us] [-b kbit/s] [-q queue frames] \n");
+    printf("           [-p datagrams/s per host pair] [-s payload bytes] \n");
+    printf("           [-t ms of traffic] [-c] \n");
+    printf("   -N only builds the nets listed, e.g. i2,west\n");
+    printf("   -r reads router NAME's routing table from dir/NAME where it exists\n");
+    printf("   -c prints the forwarding counters and stage latencies at the end\n");
+    printf("   defaults netinfo=%s delay=1000 kbit/s=100000 queue=100 \n",
+           DEFAULT_NETINFO);
+    printf("            datagrams/s=100 payload=64 ms=1000\n");
+}
+
+int main(int argc, char** argv)
+{
+    char* netinfo = DEFAULT_NETINFO;
+    char* nets = 0;
+    char* rtdir = 0;
+    unsigned long delay_us = 1000, bw_kbps = 100000, qframes = 100, pps = 100;
+    unsigned long payload = 64, ms = 1000;
+    uint64_t interval, duration, start;
+    int c, counters = 0;
+
+    while ((c = getopt(argc, argv, "hn:N:r:d:b:q:p:s:t:c")) != EOF) {
+        switch (c) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'n':
+                netinfo = optarg;
+                break;
+            case 'N':
+                nets = optarg;
+                break;
+            case 'r':
+                rtdir = optarg;
+                break;
+            case 'd':
+                delay_us = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                bw_kbps = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                qframes = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                pps = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                payload = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                counters = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc || !bw_kbps || !pps || payload < sizeof(struct sim_payload) ||
+        payload > SIM_FRAME_MAX - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t) - 8) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    pthread_mutex_init(&sim.lock, NULL);
+    sim.delay_ns = delay_us * 1000ULL;
+    sim.ns_per_byte = 8e6 / bw_kbps;
+    sim.queue_ns = qframes * SIM_FRAME_MAX * sim.ns_per_byte;
+    sim.payload = payload;
+    interval = 1000000000ULL / pps;
+    duration = ms * 1000000ULL;
+
+    if (sim_load(netinfo, nets) != 0 || sim_routers_init(rtdir) != 0) {
+        fprintf(stderr, "sr_sim: failed to build the topology\n");
+        exit(1);
+    }
+    sim_flows_init(interval);
+
+    start = now_ns();
+    sim_run(interval, duration);
+    /* utilization is over the whole run, queues drained */
+    sim_report(sim.now > duration ? sim.now : duration, bw_kbps, now_ns() - start,
+               counters);
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_stat.c
+ *
+ * Description:
+ *
+ * Reader for the stats segment a running sr exports with -S.  The segment
+ * is mapped read-only and every thread block is summed here, so reading
+ * never takes a lock or writes a cache line the router uses.  -H prints
+ * the per-stage latency histograms instead of the counters.
+ *
+ *   ./sr -S /dev/shm/sr.stats ...
+ *   ./sr_stat -i 1 /dev/shm/sr.stats
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_stats.h"
+
+static const struct sr_stats_shm* shm;
+
+static const uint64_t* stat_block(unsigned int i)
+{
+    return (const uint64_t*)((const char*)shm + shm->blocks_off +
+                             (size_t)i * shm->block_size);
+}
+
+static const char* stat_name(unsigned int c)
+{
+    return (const char*)shm + shm->names_off + c * SR_STATS_NAME_LEN;
+}
+
+static unsigned int stat_nthreads(void)
+{
+    unsigned int n = __atomic_load_n(&shm->nthreads, __ATOMIC_RELAXED);
+    return n > shm->max_threads ? shm->max_threads : n;
+}
+
+static void stat_sum(uint64_t* out)
+{
+    unsigned int i, c, n = stat_nthreads();
+
+    memset(out, 0, shm->ncounters * sizeof(uint64_t));
+    for (i = 0; i < n; i++) {
+        const uint64_t* b = stat_block(i);
+        for (c = 0; c < shm->ncounters; c++)
+            out[c] += __atomic_load_n(&b[c], __ATOMIC_RELAXED);
+    }
+}
+
+static void stat_hists(void)
+{
+    uint64_t b[SR_HIST_BUCKETS];
+    unsigned int h, i, k, n = stat_nthreads();
+
+    printf("%-8s %10s %9s %9s %9s %9s %9s %9s\n", "stage ns", "count",
+           "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (h = 0; h < shm->nhists; h++) {
+        memset(b, 0, sizeof(b));
+        for (i = 0; i < n; i++) {
+            const uint64_t* hb = (const uint64_t*)((const char*)stat_block(i) +
+                                 shm->hist_off) + h * SR_HIST_BUCKETS;
+            for (k = 0; k < SR_HIST_BUCKETS; k++)
+                b[k] += __atomic_load_n(&hb[k], __ATOMIC_RELAXED);
+        }
+        sr_hist_print(stdout, (const char*)shm + shm->hist_names_off +
+                      h * SR_STATS_NAME_LEN, b, shm->ticks_per_ns);
+    }
+}
+
+static void usage(char* argv0)
+{
+    printf("Read sr forwarding counters\n");
+    printf("Format: %s [-h] [-a] [-t] [-H] [-i interval [-c count]] stats_file\n", argv0);
+    printf("   -a  also print counters that are zero\n");
+    printf("   -t  break totals down per thread\n");
+    printf("   -H  print stage latency histograms\n");
+    printf("   -i  print per-second rates every interval seconds\n");
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int interval = 0, count = 0, all = 0, per_thread = 0, hists = 0;
+    unsigned int c, i, n;
+    struct stat st;
+    uint64_t *cur, *prev;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "hatHi:c:")) != EOF) {
+        switch (opt) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'a':
+                all = 1;
+                break;
+            case 't':
+                per_thread = 1;
+                break;
+            case 'H':
+                hists = 1;
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'c':
+                count = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    if (st.st_size < (off_t)sizeof(struct sr_stats_shm)) {
+        fprintf(stderr, "%s: not a stats segment\n", argv[optind]);
+        exit(1);
+    }
+    shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SR_STATS_MAGIC ||
+        shm->version != SR_STATS_VERSION ||
+        shm->hist_buckets != SR_HIST_BUCKETS ||
+        shm->blocks_off + (uint64_t)shm->max_threads * shm->block_size >
+            (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: not a stats segment or wrong version\n", argv[optind]);
+        exit(1);
+    }
+
+    cur = calloc(shm->ncounters, sizeof(uint64_t));
+    prev = calloc(shm->ncounters, sizeof(uint64_t));
+
+    printf("sr pid %llu, %u threads counting\n",
+           (unsigned long long)shm->pid, stat_nthreads());
+
+    if (hists) {
+        stat_hists();
+        return 0;
+    }
+
+    if (per_thread) {
+        n = stat_nthreads();
+        printf("%-24s", "counter");
+        for (i = 0; i < n; i++)
+            printf(" %12s%u", "thread", i);
+        printf("\n");
+        for (c = 0; c < shm->ncounters; c++) {
+            int nonzero = 0;
+            for (i = 0; i < n; i++)
+                nonzero |= stat_block(i)[c] != 0;
+            if (!nonzero && !all)
+                continue;
+            printf("%-24s", stat_name(c));
+            for (i = 0; i < n; i++)
+                printf(" %13llu", (unsigned long long)stat_block(i)[c]);
+            printf("\n");
+        }
+        return 0;
+    }
+
+    stat_sum(cur);
+    for (c = 0; c < shm->ncounters; c++)
+        if (cur[c] || all)
+            printf("%-24s %llu\n", stat_name(c), (unsigned long long)cur[c]);
+
+    for (i = 0; interval && (!count || i < count); i++) {
+        memcpy(prev, cur, shm->ncounters * sizeof(uint64_t));
+        sleep(interval);
+        stat_sum(cur);
+        printf("--- per second over %us\n", interval);
+        for (c = 0; c < shm->ncounters; c++)
+            if (cur[c] != prev[c] || all)
+                printf("%-24s %llu\n", stat_name(c),
+                       (unsigned long long)((cur[c] - prev[c]) / interval));
+        fflush(stdout);
+    }
+    return 0;
+}
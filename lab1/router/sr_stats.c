@@ -0,0 +1,359 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_stats.c
+ *
+ * Description:
+ *
+ * Stats segment setup and per-thread block allocation.  A thread claims
+ * the next free block the first time it counts anything and keeps the
+ * pointer in thread local storage.  Also the histogram summary used by
+ * the SIGUSR1 dump and by sr_stat.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "sr_stats.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+__thread uint64_t* sr_stats_tls;
+
+static const char* sr_stats_names[SR_STAT_NUM + 1] = {
+#define SR_STAT_NAME(c, name) name,
+    SR_STATS_COUNTERS(SR_STAT_NAME)
+#undef SR_STAT_NAME
+    NULL
+};
+
+static const char* sr_hist_names[SR_HIST_NUM + 1] = {
+#define SR_HIST_NAME(h, name) name,
+    SR_STATS_HISTS(SR_HIST_NAME)
+#undef SR_HIST_NAME
+    NULL
+};
+
+static struct sr_stats_shm* seg;
+static pthread_once_t seg_once = PTHREAD_ONCE_INIT;
+
+static struct sr_stats_dumper
+{
+    void (*fn)(FILE*, void*);
+    void* arg;
+} dumpers[SR_STATS_MAX_DUMPERS];
+static pthread_mutex_t dumpers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t sr_stats_seg_size(void)
+{
+    return sr_stats_round(sizeof(struct sr_stats_shm)) +
+           sr_stats_round(SR_STAT_NUM * SR_STATS_NAME_LEN) +
+           sr_stats_round(SR_HIST_NUM * SR_STATS_NAME_LEN) +
+           (size_t)SR_STATS_MAX_THREADS * SR_STATS_BLOCK_SZ;
+}
+
+/* Ticks of sr_tsc() per nanosecond, measured against the monotonic clock */
+static double sr_stats_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec a, b, d = { 0, 20 * 1000 * 1000 };
+    uint64_t t0, t1;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    t0 = sr_tsc();
+    nanosleep(&d, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    t1 = sr_tsc();
+    ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+    return ns > 0 ? (t1 - t0) / ns : 1.0;
+#else
+    return 1.0;
+#endif
+}
+
+static uint64_t* sr_stats_block(unsigned int i)
+{
+    return (uint64_t*)((char*)seg + seg->blocks_off + i * seg->block_size);
+}
+
+int sr_stats_init(const char* path)
+{
+    struct sr_stats_shm* s;
+    size_t len = sr_stats_seg_size();
+    char* names;
+    int fd = -1, i;
+
+    if (seg) {
+        fprintf(stderr, "sr_stats: segment already set up\n");
+        return -1;
+    }
+
+    if (path) {
+        if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+            ftruncate(fd, len) != 0) {
+            perror(path);
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        s = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        s = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (s == MAP_FAILED) {
+        perror("sr_stats: mmap");
+        return -1;
+    }
+
+    s->version = SR_STATS_VERSION;
+    s->ncounters = SR_STAT_NUM;
+    s->max_threads = SR_STATS_MAX_THREADS;
+    s->block_size = SR_STATS_BLOCK_SZ;
+    s->names_off = sr_stats_round(sizeof(struct sr_stats_shm));
+    s->blocks_off = len - (size_t)SR_STATS_MAX_THREADS * SR_STATS_BLOCK_SZ;
+    s->nthreads = 0;
+    s->nhists = SR_HIST_NUM;
+    s->hist_buckets = SR_HIST_BUCKETS;
+    s->hist_sub_bits = SR_HIST_SUB_BITS;
+    s->hist_off = SR_STATS_HIST_OFF;
+    s->hist_names_off = s->names_off + sr_stats_round(SR_STAT_NUM * SR_STATS_NAME_LEN);
+    s->pid = getpid();
+    s->start_time = time(NULL);
+    s->ticks_per_ns = sr_stats_calibrate();
+
+    names = (char*)s + s->names_off;
+    for (i = 0; i < SR_STAT_NUM; i++)
+        strncpy(names + i * SR_STATS_NAME_LEN, sr_stats_names[i],
+                SR_STATS_NAME_LEN - 1);
+    names = (char*)s + s->hist_names_off;
+    for (i = 0; i < SR_HIST_NUM; i++)
+        strncpy(names + i * SR_STATS_NAME_LEN, sr_hist_names[i],
+                SR_STATS_NAME_LEN - 1);
+
+    /* readers check the magic last */
+    __atomic_store_n(&s->magic, SR_STATS_MAGIC, __ATOMIC_RELEASE);
+    __atomic_store_n(&seg, s, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void sr_stats_default_init(void)
+{
+    if (!__atomic_load_n(&seg, __ATOMIC_ACQUIRE) && sr_stats_init(NULL) != 0)
+        abort();
+}
+
+uint64_t* sr_stats_claim(void)
+{
+    unsigned int i;
+
+    if (!__atomic_load_n(&seg, __ATOMIC_ACQUIRE))
+        pthread_once(&seg_once, sr_stats_default_init);
+
+    i = __atomic_fetch_add(&seg->nthreads, 1, __ATOMIC_RELAXED);
+    if (i >= SR_STATS_MAX_THREADS) {
+        /* shared by every extra thread, increments may be lost */
+        if (i == SR_STATS_MAX_THREADS)
+            fprintf(stderr, "sr_stats: more than %d counting threads\n",
+                    SR_STATS_MAX_THREADS);
+        i = SR_STATS_MAX_THREADS - 1;
+    }
+    sr_stats_tls = sr_stats_block(i);
+    return sr_stats_tls;
+}
+
+void sr_stats_snapshot(uint64_t* out)
+{
+    unsigned int i, n, c;
+
+    memset(out, 0, SR_STAT_NUM * sizeof(uint64_t));
+    if (!__atomic_load_n(&seg, __ATOMIC_ACQUIRE))
+        return;
+
+    n = __atomic_load_n(&seg->nthreads, __ATOMIC_RELAXED);
+    if (n > SR_STATS_MAX_THREADS)
+        n = SR_STATS_MAX_THREADS;
+    for (i = 0; i < n; i++) {
+        uint64_t* b = sr_stats_block(i);
+        for (c = 0; c < SR_STAT_NUM; c++)
+            out[c] += __atomic_load_n(&b[c], __ATOMIC_RELAXED);
+    }
+}
+
+const char* sr_stats_name(int c)
+{
+    return c >= 0 && c < SR_STAT_NUM ? sr_stats_names[c] : "?";
+}
+
+void sr_stats_dump(FILE* fp)
+{
+    uint64_t v[SR_STAT_NUM];
+    int c;
+
+    sr_stats_snapshot(v);
+    for (c = 0; c < SR_STAT_NUM; c++)
+        if (v[c])
+            fprintf(fp, "%-24s %llu\n", sr_stats_names[c], (unsigned long long)v[c]);
+
+    pthread_mutex_lock(&dumpers_lock);
+    for (c = 0; c < SR_STATS_MAX_DUMPERS; c++)
+        if (dumpers[c].fn)
+            dumpers[c].fn(fp, dumpers[c].arg);
+    pthread_mutex_unlock(&dumpers_lock);
+}
+
+int sr_stats_add_dumper(void (*fn)(FILE*, void*), void* arg)
+{
+    int i;
+
+    pthread_mutex_lock(&dumpers_lock);
+    for (i = 0; i < SR_STATS_MAX_DUMPERS && dumpers[i].fn; i++)
+        ;
+    if (i < SR_STATS_MAX_DUMPERS) {
+        dumpers[i].fn = fn;
+        dumpers[i].arg = arg;
+    }
+    pthread_mutex_unlock(&dumpers_lock);
+    return i < SR_STATS_MAX_DUMPERS ? 0 : -1;
+}
+
+void sr_stats_del_dumper(void (*fn)(FILE*, void*), void* arg)
+{
+    int i;
+
+    pthread_mutex_lock(&dumpers_lock);
+    for (i = 0; i < SR_STATS_MAX_DUMPERS; i++)
+        if (dumpers[i].fn == fn && dumpers[i].arg == arg)
+            dumpers[i].fn = NULL;
+    pthread_mutex_unlock(&dumpers_lock);
+}
+
+double sr_stats_ticks_per_ns(void)
+{
+    if (!__atomic_load_n(&seg, __ATOMIC_ACQUIRE))
+        pthread_once(&seg_once, sr_stats_default_init);
+    return seg->ticks_per_ns;
+}
+
+void sr_stats_hist_snapshot(int h, uint64_t* out)
+{
+    unsigned int i, n, k;
+
+    memset(out, 0, SR_HIST_BUCKETS * sizeof(uint64_t));
+    if (!__atomic_load_n(&seg, __ATOMIC_ACQUIRE))
+        return;
+
+    n = __atomic_load_n(&seg->nthreads, __ATOMIC_RELAXED);
+    if (n > SR_STATS_MAX_THREADS)
+        n = SR_STATS_MAX_THREADS;
+    for (i = 0; i < n; i++) {
+        uint64_t* b = sr_stats_block(i) + SR_STATS_HIST_OFF / 8 +
+                      h * SR_HIST_BUCKETS;
+        for (k = 0; k < SR_HIST_BUCKETS; k++)
+            out[k] += __atomic_load_n(&b[k], __ATOMIC_RELAXED);
+    }
+}
+
+/* Smallest value that falls in bucket k */
+static uint64_t sr_hist_lowest(unsigned int k)
+{
+    unsigned int shift;
+
+    if (k < (1 << SR_HIST_SUB_BITS))
+        return k;
+    shift = (k >> SR_HIST_SUB_BITS) - 1;
+    return (uint64_t)((1 << SR_HIST_SUB_BITS) |
+                      (k & ((1 << SR_HIST_SUB_BITS) - 1))) << shift;
+}
+
+static uint64_t sr_hist_highest(unsigned int k)
+{
+    return k + 1 < SR_HIST_BUCKETS ? sr_hist_lowest(k + 1) - 1 : sr_hist_lowest(k);
+}
+
+void sr_hist_print(FILE* fp, const char* name, const uint64_t* buckets,
+                   double ticks_per_ns)
+{
+    static const double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+    double v[4], sum = 0, max = 0;
+    uint64_t count = 0, seen = 0;
+    unsigned int k, p = 0;
+
+    for (k = 0; k < SR_HIST_BUCKETS; k++) {
+        count += buckets[k];
+        sum += buckets[k] * (sr_hist_lowest(k) + sr_hist_highest(k)) / 2.0;
+    }
+    if (!count) {
+        fprintf(fp, "%-8s %10s\n", name, "-");
+        return;
+    }
+    if (ticks_per_ns <= 0)
+        ticks_per_ns = 1.0;
+
+    /* percentiles report the top of the bucket they land in */
+    for (k = 0; k < SR_HIST_BUCKETS && p < 4; k++) {
+        seen += buckets[k];
+        while (p < 4 && seen >= count * pct[p] / 100.0)
+            v[p++] = sr_hist_highest(k) / ticks_per_ns;
+    }
+    for (k = SR_HIST_BUCKETS; k-- > 0; )
+        if (buckets[k]) {
+            max = sr_hist_highest(k) / ticks_per_ns;
+            break;
+        }
+
+    fprintf(fp, "%-8s %10llu %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f\n", name,
+            (unsigned long long)count, sum / count / ticks_per_ns,
+            v[0], v[1], v[2], v[3], max);
+}
+
+void sr_stats_hist_dump(FILE* fp)
+{
+    uint64_t b[SR_HIST_BUCKETS];
+    int h;
+
+    fprintf(fp, "%-8s %10s %9s %9s %9s %9s %9s %9s\n", "stage ns", "count",
+            "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (h = 0; h < SR_HIST_NUM; h++) {
+        sr_stats_hist_snapshot(h, b);
+        sr_hist_print(fp, sr_hist_names[h], b, seg ? seg->ticks_per_ns : 1.0);
+    }
+}
+
+static void* sr_stats_signal_thread(void* arg)
+{
+    sigset_t* set = arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0) {
+        sr_stats_dump(stderr);
+        sr_stats_hist_dump(stderr);
+    }
+    return NULL;
+}
+
+int sr_stats_dump_on_signal(int signo)
+{
+    static sigset_t set;
+    pthread_t thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+        pthread_create(&thread, NULL, sr_stats_signal_thread, &set) != 0) {
+        perror("sr_stats: signal thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
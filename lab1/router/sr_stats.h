@@ -0,0 +1,257 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_stats.h
+ *
+ * Description:
+ *
+ * Forwarding counters.  Every thread that counts gets its own block of
+ * 64-bit counters, padded to whole cache lines, and is the only writer of
+ * that block, so an increment is a plain load and store with no locked
+ * instruction and no cache line sharing.  Totals are summed over the blocks
+ * on demand.
+ *
+ * The blocks live in a stats segment which, when sr_stats_init() is given
+ * a path (-S), is a shared file mapping laid out as:
+ *
+ *   struct sr_stats_shm | counter names | block 0 | block 1 | ...
+ *
+ * so an external reader (sr_stat) can mmap it read-only and add up the
+ * blocks without any cooperation from the router.
+ *
+ * After the counters each block holds one latency histogram per packet
+ * processing stage, and one for the time frames wait in the egress
+ * queues.  Stages are timed with the TSC (clock_gettime where there is
+ * none) and binned log-linearly: 2^SR_HIST_SUB_BITS buckets per
+ * power of two, so every bucket is within 1/16 of its value, HDR style.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_STATS_H
+#define SR_STATS_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <stdio.h>
+#include <time.h>
+
+/* X(counter, name) */
+#define SR_STATS_COUNTERS(X)                                            \
+    X(RX_PKTS,            "rx_pkts")                                    \
+    X(RX_BYTES,           "rx_bytes")                                   \
+    X(TX_PKTS,            "tx_pkts")                                    \
+    X(TX_BYTES,           "tx_bytes")                                   \
+    X(TX_ERRORS,          "tx_errors")                                  \
+    X(IP_FORWARD,         "ip_forward")                                 \
+    X(IP_LOCAL,           "ip_local")                                   \
+    X(ARP_REQ_RX,         "arp_request_rx")                             \
+    X(ARP_REPLY_RX,       "arp_reply_rx")                               \
+    X(ARP_REQ_TX,         "arp_request_tx")                             \
+    X(ARP_REPLY_TX,       "arp_reply_tx")                               \
+    X(ARP_CACHE_HIT,      "arp_cache_hit")                              \
+    X(ARP_QUEUED,         "arp_queued")                                 \
+    X(ARP_RELEASED,       "arp_released")                               \
+    X(ARP_REQ_TIMEOUT,    "arp_request_timeout")                        \
+    X(ARP_CACHE_EXPIRED,  "arp_cache_expired")                          \
+    X(ARP_CACHE_FULL,     "arp_cache_full")                             \
+    X(ICMP_ECHO_RX,       "icmp_echo_rx")                               \
+    X(ICMP_ECHO_TX,       "icmp_echo_reply_tx")                         \
+    X(ICMP_UNREACH_TX,    "icmp_unreach_tx")                            \
+    X(ICMP_TIMEX_TX,      "icmp_time_exceeded_tx")                      \
+    X(ICMP_UNREACH_RL,    "icmp_unreach_ratelimited")                   \
+    X(ICMP_TIMEX_RL,      "icmp_time_exceeded_ratelimited")             \
+    X(ICMP_SOURCE_RL,     "icmp_source_ratelimited")                    \
+    X(DROP_RUNT,          "drop_runt")                                  \
+    X(DROP_ETHERTYPE,     "drop_ethertype")                             \
+    X(DROP_ARP_MALFORMED, "drop_arp_malformed")                         \
+    X(DROP_ARP_NOT_US,    "drop_arp_not_for_us")                        \
+    X(DROP_IP_MALFORMED,  "drop_ip_malformed")                          \
+    X(DROP_IP_CKSUM,      "drop_ip_checksum")                           \
+    X(DROP_ICMP_CKSUM,    "drop_icmp_checksum")                         \
+    X(DROP_IP_PROTO,      "drop_ip_proto")                              \
+    X(DROP_TTL,           "drop_ttl_expired")                           \
+    X(DROP_NO_ROUTE,      "drop_no_route")                              \
+    X(DROP_ARP_TIMEOUT,   "drop_arp_timeout")                           \
+    X(WORKER_STALL,       "worker_ring_full")                           \
+    X(PUNT_ARP,           "punt_arp")                                   \
+    X(PUNT_ICMP_ERR,      "punt_icmp_error")                            \
+    X(PUNT_LOCAL,         "punt_local")                                 \
+    X(DROP_PUNT_ARP,      "drop_punt_arp_full")                         \
+    X(DROP_PUNT_ICMP_ERR, "drop_punt_icmp_error_full")                  \
+    X(DROP_PUNT_LOCAL,    "drop_punt_local_full")                       \
+    X(NBR_DOWN,           "neighbor_down")                              \
+    X(NBR_UP,             "neighbor_up")                                \
+    X(FIB_ALTERNATE,      "fib_alternate")                              \
+    X(EGRESS_CODEL_DROP,  "egress_codel_drop")                          \
+    X(EGRESS_OVERLIMIT,   "egress_overlimit_drop")                      \
+    X(EGRESS_ECN_MARK,    "egress_ecn_mark")                            \
+    X(NAT_PORT_EXHAUSTED, "nat_port_exhausted")                         \
+    X(DROP_ACL,           "drop_acl")                                   \
+    X(DROP_POLICE,        "drop_police")                                \
+    X(POLICE_MARK,        "police_mark")                                \
+    X(FLOW_EXPORTED,      "flow_exported")                              \
+    X(FLOW_EVICTED,       "flow_evicted")                               \
+    X(DROP_FLOW_EXPORT,   "drop_flow_export")                           \
+    X(FRAG_OK,            "frag_ok")                                    \
+    X(FRAG_TX,            "frag_tx")                                    \
+    X(DROP_FRAG_DF,       "drop_frag_df")                               \
+    X(REASM_OK,           "reasm_ok")                                   \
+    X(DROP_REASM_TIMEOUT, "drop_reasm_timeout")                         \
+    X(DROP_REASM_MEM,     "drop_reasm_mem")                             \
+    X(DROP_REASM_BAD,     "drop_reasm_bad")
+
+#define SR_STAT_ENUM(c, name) SR_STAT_##c,
+enum sr_stat { SR_STATS_COUNTERS(SR_STAT_ENUM) SR_STAT_NUM };
+#undef SR_STAT_ENUM
+
+/* X(stage, name) */
+#define SR_STATS_HISTS(X)                                               \
+    X(PARSE,              "parse")                                      \
+    X(FIB,                "fib")                                        \
+    X(ARP,                "arp")                                        \
+    X(TX,                 "tx")                                         \
+    X(TOTAL,              "total")                                      \
+    X(PUNT,               "punt")                                       \
+    X(SOJOURN,            "sojourn")
+
+#define SR_HIST_ENUM(h, name) SR_HIST_##h,
+enum sr_hist { SR_STATS_HISTS(SR_HIST_ENUM) SR_HIST_NUM };
+#undef SR_HIST_ENUM
+
+#define SR_HIST_SUB_BITS     4
+#define SR_HIST_MAX_EXP      39  /* values of 2^40 ticks and up clamp */
+#define SR_HIST_BUCKETS      ((SR_HIST_MAX_EXP - SR_HIST_SUB_BITS + 2) << SR_HIST_SUB_BITS)
+
+#define SR_STATS_MAGIC       0x53525354 /* "SRST" */
+#define SR_STATS_VERSION     2
+#define SR_STATS_MAX_THREADS 64
+#define SR_STATS_NAME_LEN    32
+#define SR_STATS_ALIGN       64
+
+#define sr_stats_round(x) (((x) + SR_STATS_ALIGN - 1) & ~(SR_STATS_ALIGN - 1))
+
+/* Per thread block: counters, then histograms, in whole cache lines */
+#define SR_STATS_HIST_OFF  sr_stats_round(SR_STAT_NUM * 8)
+#define SR_STATS_BLOCK_SZ \
+    sr_stats_round(SR_STATS_HIST_OFF + SR_HIST_NUM * SR_HIST_BUCKETS * 8)
+
+/* Segment header; all offsets are from the start of the segment */
+struct sr_stats_shm
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ncounters;
+    uint32_t max_threads;
+    uint32_t block_size;        /* bytes per thread block */
+    uint32_t names_off;         /* ncounters names of SR_STATS_NAME_LEN */
+    uint32_t blocks_off;        /* max_threads blocks */
+    uint32_t nthreads;          /* blocks claimed so far */
+    uint32_t nhists;
+    uint32_t hist_buckets;
+    uint32_t hist_sub_bits;
+    uint32_t hist_off;          /* histograms, from the start of a block */
+    uint32_t hist_names_off;    /* nhists names of SR_STATS_NAME_LEN */
+    uint64_t pid;
+    uint64_t start_time;
+    double   ticks_per_ns;      /* histogram unit */
+};
+
+extern __thread uint64_t* sr_stats_tls;
+uint64_t* sr_stats_claim(void);
+
+/* Single writer per block: a relaxed load/store is enough, and keeps the
+   compiler from tearing or caching the counter. */
+#define sr_stat_add(c, n)                                               \
+    do {                                                                \
+        uint64_t* b_ = sr_stats_tls ? sr_stats_tls : sr_stats_claim();  \
+        __atomic_store_n(&b_[c], __atomic_load_n(&b_[c], __ATOMIC_RELAXED) + (n), \
+                         __ATOMIC_RELAXED);                             \
+    } while (0)
+#define sr_stat_inc(c) sr_stat_add(c, 1)
+
+/* Cycle counter used to time stages */
+static __inline__ uint64_t sr_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static __inline__ unsigned int sr_hist_bucket(uint64_t v)
+{
+    unsigned int e, shift;
+
+    if (v < (1 << SR_HIST_SUB_BITS))
+        return v;
+    e = 63 - __builtin_clzll(v);
+    if (e > SR_HIST_MAX_EXP)
+        return SR_HIST_BUCKETS - 1;
+    shift = e - SR_HIST_SUB_BITS;
+    return ((shift + 1) << SR_HIST_SUB_BITS) |
+           ((v >> shift) & ((1 << SR_HIST_SUB_BITS) - 1));
+}
+
+/* Records v ticks in stage h's histogram */
+#define sr_hist_add(h, v)                                               \
+    do {                                                                \
+        uint64_t* b_ = sr_stats_tls ? sr_stats_tls : sr_stats_claim();  \
+        uint64_t* c_ = b_ + SR_STATS_HIST_OFF / 8 +                     \
+                       (h) * SR_HIST_BUCKETS + sr_hist_bucket(v);       \
+        __atomic_store_n(c_, __atomic_load_n(c_, __ATOMIC_RELAXED) + 1, \
+                         __ATOMIC_RELAXED);                             \
+    } while (0)
+
+/* t0 = sr_tsc(); ...stage...; sr_hist_end(SR_HIST_FIB, t0); */
+#define sr_hist_end(h, t0) sr_hist_add(h, sr_tsc() - (t0))
+
+/* Creates the stats segment.  With a path the segment is a shared file
+   mapping readable by sr_stat, otherwise private memory.  Called once at
+   startup; counting before that uses a private segment. */
+int sr_stats_init(const char* path);
+
+/* Sums every thread's block into out[SR_STAT_NUM]. */
+void sr_stats_snapshot(uint64_t* out);
+
+/* Name of counter c. */
+const char* sr_stats_name(int c);
+
+/* Prints the non-zero totals, then whatever the dumpers print. */
+void sr_stats_dump(FILE* fp);
+
+#define SR_STATS_MAX_DUMPERS 8
+
+/* Adds fn(fp, arg) to sr_stats_dump(), for figures kept outside the
+   segment such as per interface tables.  Returns 0, or -1 if there are
+   SR_STATS_MAX_DUMPERS already.  Remove it before arg goes away. */
+int sr_stats_add_dumper(void (*fn)(FILE*, void*), void* arg);
+void sr_stats_del_dumper(void (*fn)(FILE*, void*), void* arg);
+
+/* Ticks of sr_tsc() per nanosecond. */
+double sr_stats_ticks_per_ns(void);
+
+/* Sums every thread's histogram h into out[SR_HIST_BUCKETS]. */
+void sr_stats_hist_snapshot(int h, uint64_t* out);
+
+/* Prints count, mean and percentiles in ns of one summed histogram. */
+void sr_hist_print(FILE* fp, const char* name, const uint64_t* buckets,
+                   double ticks_per_ns);
+
+/* Prints every stage histogram. */
+void sr_stats_hist_dump(FILE* fp);
+
+/* Blocks signo in the calling thread, which must not have started any
+   other thread yet, and starts a thread that prints counters and
+   histograms to stderr whenever the process receives it. */
+int sr_stats_dump_on_signal(int signo);
+
+#endif /* -- SR_STATS_H -- */
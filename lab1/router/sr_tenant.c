@@ -0,0 +1,415 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_tenant.c
+ *
+ * Description:
+ *
+ * Tenant host.  The tenants are read from the file up front, so the
+ * array the timer thread walks never changes; a tenant is only swept once
+ * its live flag says it is up, and stops being swept when its session
+ * closes.  Each tenant is allocated on its own, and brought up alone, so
+ * the heap growth across its bring-up is its own.
+ *
+ * Once up, a tenant's socket is read without blocking, a recv() per
+ * wakeup, into a buffer of its own; whole commands are handled from the
+ * buffer and the rest waits for the next wakeup.  A session that stalls
+ * halfway through a command holds up no other, and one the server drops
+ * without a VNSCLOSE ends at the first empty read.  Writes stay blocking:
+ * the send path shares the socket.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_nbr.h"
+#include "sr_frag.h"
+#include "sr_icmp_limit.h"
+#include "sr_workers.h"
+#include "sr_tenant.h"
+#include "vnscommand.h"
+
+struct sr_tenant
+{
+    struct sr_instance sr;
+    uint32_t rx[SR_VNS_MSG_MAX / 4]; /* commands read but not yet handled */
+    unsigned int rx_len;
+    char rtable[256];
+    size_t mem;                 /* heap taken to come up */
+    int live;                   /* session up; read by the timer */
+};
+
+struct sr_tenants
+{
+    struct sr_tenant** t;
+    unsigned int n;
+    unsigned int hello_ms;
+    unsigned int nworkers;
+    struct sr_workers* workers;
+    pthread_t timer;
+    int timer_running;
+    int stop;
+};
+
+/* Bytes of heap in use, both arenas and mmapped chunks; 0 where the C
+   library cannot say */
+static size_t sr_tenant_heap(void)
+{
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#endif
+#endif
+    return 0;
+}
+
+static uint64_t sr_tenant_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void* sr_tenant_timer(void* arg)
+{
+    struct sr_tenants* h = arg;
+    unsigned int tick_ms = SR_TENANT_ARP_MS;
+    uint64_t last_arp = sr_tenant_now_ms(), now;
+    struct timespec tick;
+    unsigned int i;
+    int arp;
+
+    if (h->hello_ms && h->hello_ms < tick_ms)
+        tick_ms = h->hello_ms;
+    tick.tv_sec = tick_ms / 1000;
+    tick.tv_nsec = (tick_ms % 1000) * 1000000L;
+
+    while (!__atomic_load_n(&h->stop, __ATOMIC_RELAXED)) {
+        nanosleep(&tick, NULL);
+        now = sr_tenant_now_ms();
+        arp = now - last_arp >= SR_TENANT_ARP_MS;
+        if (arp)
+            last_arp = now;
+        for (i = 0; i < h->n; i++) {
+            struct sr_tenant* tn = h->t[i];
+
+            if (!__atomic_load_n(&tn->live, __ATOMIC_ACQUIRE))
+                continue;
+            if (h->hello_ms)
+                sr_nbr_tick(&tn->sr, h->hello_ms);
+            if (arp)
+                sr_arpcache_sweep(&tn->sr);
+        }
+    }
+    return NULL;
+}
+
+static void sr_tenant_free(struct sr_tenant* tn)
+{
+    struct sr_instance* sr = &tn->sr;
+
+    while (sr->if_list) {
+        struct sr_if* next = sr->if_list->next;
+        free(sr->if_list);
+        sr->if_list = next;
+    }
+    while (sr->routing_table) {
+        struct sr_rt* next = sr->routing_table->next;
+        free(sr->routing_table);
+        sr->routing_table = next;
+    }
+    sr_fib_destroy(sr->fib);
+    if (sr->nbrs) {
+        sr_nbrs_destroy(sr->nbrs);
+        sr_arpcache_destroy(&sr->cache);
+    }
+    sr_reasm_destroy(sr->reasm);
+    sr_icmp_limit_destroy(sr->icmp_limit);
+    if (sr->sockfd >= 0)
+        close(sr->sockfd);
+    pthread_mutex_destroy(&sr->send_lock);
+    free(tn);
+}
+
+static int sr_tenants_load(struct sr_tenants* h, const char* file,
+                           const struct sr_tenant_conf* conf)
+{
+    char line[512], vhost[32];
+    unsigned int topo, lineno = 0, cap = 0;
+    FILE* fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        perror("sr_tenant: fopen");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        struct sr_tenant* tn;
+        char* hash = strchr(line, '#');
+        char rest[8];
+        int fields;
+
+        lineno++;
+        if (hash)
+            *hash = '\0';
+        tn = calloc(1, sizeof(struct sr_tenant));
+        if (!tn)
+            break;
+        fields = sscanf(line, "%31s %u %255s %7s", vhost, &topo, tn->rtable, rest);
+        if (fields <= 0) {
+            free(tn);
+            continue;
+        }
+        if (fields != 3 || topo > 0xffff) {
+            fprintf(stderr, "sr_tenant: %s:%u: want vhost topo rtable\n",
+                    file, lineno);
+            free(tn);
+            fclose(fp);
+            return -1;
+        }
+        if (h->n == cap) {
+            struct sr_tenant** t;
+            cap = cap ? 2 * cap : 16;
+            if ((t = realloc(h->t, cap * sizeof(struct sr_tenant*))) == NULL) {
+                free(tn);
+                break;
+            }
+            h->t = t;
+        }
+
+        tn->sr.sockfd = -1;
+        tn->sr.hosted = 1;
+        tn->sr.topo_id = topo;
+        strncpy(tn->sr.host, vhost, sizeof(tn->sr.host) - 1);
+        strncpy(tn->sr.user, conf->user, sizeof(tn->sr.user) - 1);
+        tn->sr.mtu_spec = conf->mtu;
+        tn->sr.workers = h->workers;
+        pthread_mutex_init(&tn->sr.send_lock, NULL);
+        h->t[h->n++] = tn;
+    }
+    if (!feof(fp)) {
+        fprintf(stderr, "sr_tenant: out of memory reading %s\n", file);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    if (h->n == 0) {
+        fprintf(stderr, "sr_tenant: no routers in %s\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+/* Connects tn and reads until VNSHWINFO has built its FIB */
+static int sr_tenant_up(struct sr_tenant* tn, const struct sr_tenant_conf* conf)
+{
+    struct sr_instance* sr = &tn->sr;
+    size_t before = sr_tenant_heap();
+
+    if ((sr->icmp_limit = sr_icmp_limit_create(conf->icmp_limit)) == NULL)
+        return -1;
+    if (sr_connect_to_server(sr, conf->port, (char*)conf->server) == -1)
+        return -1;
+    if (sr_load_rt(sr, tn->rtable) != 0) {
+        fprintf(stderr, "sr_tenant: %s: error loading routing table %s\n",
+                sr->host, tn->rtable);
+        return -1;
+    }
+    sr_init(sr);
+    while (sr->fib == NULL)
+        if (sr_read_from_server(sr) != 1)
+            return -1;
+
+    tn->mem = sizeof(struct sr_tenant) + (sr_tenant_heap() - before);
+    __atomic_store_n(&tn->live, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Reads what tn's socket holds and handles every whole command in it.
+   Returns 1 while the session lasts, 0 or -1 once it is over. */
+static int sr_tenant_read(struct sr_tenant* tn)
+{
+    uint8_t* rx = (uint8_t*)tn->rx;
+    uint32_t len;
+    ssize_t n;
+    int ret;
+
+    /* a partial command is shorter than SR_VNS_MSG_MAX, so there is room */
+    n = recv(tn->sr.sockfd, rx + tn->rx_len, sizeof(tn->rx) - tn->rx_len,
+             MSG_DONTWAIT);
+    if (n == 0) {
+        fprintf(stderr, "sr_tenant: %s: server closed the connection\n",
+                tn->sr.host);
+        return 0;
+    }
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+        perror("sr_tenant: recv");
+        return -1;
+    }
+    tn->rx_len += n;
+
+    /* commands are handled from the start of the buffer, which keeps
+       their fields aligned */
+    while (tn->rx_len >= sizeof(uint32_t)) {
+        len = ntohl(tn->rx[0]);
+        if (len < sizeof(c_base) || len > SR_VNS_MSG_MAX) {
+            fprintf(stderr, "sr_tenant: %s: bad command length %u\n",
+                    tn->sr.host, len);
+            return -1;
+        }
+        if (tn->rx_len < len)
+            break;
+        ret = sr_handle_command(&tn->sr, rx, len, 0);
+        memmove(rx, rx + len, tn->rx_len - len);
+        tn->rx_len -= len;
+        if (ret != 1)
+            return ret;
+    }
+    return 1;
+}
+
+struct sr_tenants* sr_tenants_start(const char* file,
+                                    const struct sr_tenant_conf* conf)
+{
+    struct sr_tenants* h;
+    unsigned int i;
+
+    if ((h = calloc(1, sizeof(struct sr_tenants))) == NULL)
+        return NULL;
+    h->hello_ms = conf->hello_ms;
+    h->nworkers = conf->nworkers;
+
+    /* a session the server drops may still be written to -- by the timer,
+       a worker, or the loop before it sees the close -- and that must
+       fail the one write, not every router */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (conf->nworkers &&
+        (h->workers = sr_workers_start(conf->nworkers, conf->cpus)) == NULL)
+        goto fail;
+    if (sr_tenants_load(h, file, conf) != 0)
+        goto fail;
+    if (pthread_create(&h->timer, NULL, sr_tenant_timer, h) != 0) {
+        fprintf(stderr, "sr_tenant: cannot start timer thread\n");
+        goto fail;
+    }
+    h->timer_running = 1;
+
+    for (i = 0; i < h->n; i++) {
+        if (sr_tenant_up(h->t[i], conf) != 0) {
+            fprintf(stderr, "sr_tenant: router %s (topology %u) did not come up\n",
+                    h->t[i]->sr.host, h->t[i]->sr.topo_id);
+            goto fail;
+        }
+    }
+    return h;
+
+fail:
+    sr_tenants_destroy(h);
+    return NULL;
+}
+
+void sr_tenants_report(const struct sr_tenants* h, FILE* out)
+{
+    size_t total = 0;
+    unsigned int i;
+
+    fprintf(out, "%6s %-16s %6s %6s %6s %10s\n",
+            "router", "vhost", "topo", "ifaces", "routes", "bytes");
+    for (i = 0; i < h->n; i++) {
+        const struct sr_instance* sr = &h->t[i]->sr;
+        const struct sr_if* iface;
+        const struct sr_rt* rt;
+        unsigned int nif = 0, nrt = 0;
+
+        for (iface = sr->if_list; iface; iface = iface->next)
+            nif++;
+        for (rt = sr->routing_table; rt; rt = rt->next)
+            nrt++;
+        fprintf(out, "%6u %-16s %6u %6u %6u %10lu\n", i, sr->host,
+                sr->topo_id, nif, nrt, (unsigned long)h->t[i]->mem);
+        total += h->t[i]->mem;
+    }
+    fprintf(out, "%u routers in %lu bytes, %lu per router; "
+            "threads: 1 loop, 1 timer, %u workers\n", h->n,
+            (unsigned long)total, (unsigned long)(total / h->n), h->nworkers);
+}
+
+void sr_tenants_run(struct sr_tenants* h)
+{
+    struct epoll_event ev, evs[SR_TENANT_EVENTS];
+    unsigned int i, live = 0;
+    int epfd, nev;
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("sr_tenant: epoll_create1");
+        return;
+    }
+    for (i = 0; i < h->n; i++) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = h->t[i];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, h->t[i]->sr.sockfd, &ev) != 0) {
+            perror("sr_tenant: epoll_ctl");
+            close(epfd);
+            return;
+        }
+        live++;
+    }
+
+    while (live > 0) {
+        if ((nev = epoll_wait(epfd, evs, SR_TENANT_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("sr_tenant: epoll_wait");
+            break;
+        }
+        for (i = 0; i < (unsigned int)nev; i++) {
+            struct sr_tenant* tn = evs[i].data.ptr;
+
+            if (sr_tenant_read(tn) == 1)
+                continue;
+            /* the socket is closed with the tenant */
+            __atomic_store_n(&tn->live, 0, __ATOMIC_RELEASE);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, tn->sr.sockfd, &ev);
+            fprintf(stderr, "sr_tenant: router %s (topology %u) closed\n",
+                    tn->sr.host, tn->sr.topo_id);
+            live--;
+        }
+    }
+    close(epfd);
+}
+
+void sr_tenants_destroy(struct sr_tenants* h)
+{
+    unsigned int i;
+
+    if (!h)
+        return;
+    if (h->timer_running) {
+        __atomic_store_n(&h->stop, 1, __ATOMIC_RELAXED);
+        pthread_join(h->timer, NULL);
+    }
+    sr_workers_stop(h->workers);
+    for (i = 0; i < h->n; i++)
+        sr_tenant_free(h->t[i]);
+    free(h->t);
+    free(h);
+}
@@ -0,0 +1,74 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_tenant.h
+ *
+ * Description:
+ *
+ * Many virtual routers in one process (-V).  Each router listed in the
+ * tenant file gets its own struct sr_instance, VNS session, interfaces,
+ * routing table, FIB, ARP cache, neighbor table and reassembly state,
+ * exactly as a router of its own process would.  What they share is the
+ * machinery around them:
+ *
+ *   one event loop     the main thread waits on every session's socket
+ *                      (epoll) and makes one non-blocking read per ready
+ *                      socket per round, so a busy tenant cannot starve
+ *                      the rest and a half-sent message stalls no one
+ *   one timer thread   sweeps every ARP cache once a second and sends
+ *                      every router's gateway hellos (-H)
+ *   one worker pool    (-W) frames are queued with the router they
+ *                      arrived on; without -W the loop forwards inline
+ *
+ * A hosted router therefore starts no thread of its own: its control
+ * plane (-P) runs inline too.  Counters and log levels stay per process.
+ *
+ * The file has one router per line, '#' starts a comment:
+ *
+ *   # vhost     topo   rtable
+ *   vrhost      310    rtable.310
+ *   vrhost      311    rtable.311
+ *
+ * Routers are brought up one after the other, and the heap each takes to
+ * come up -- its instance, interfaces, routes, FIB and tables -- is
+ * measured as it does (glibc only) and reported by sr_tenants_report().
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_TENANT_H
+#define SR_TENANT_H
+
+#include <stdio.h>
+
+#define SR_TENANT_EVENTS   64         /* sockets handled per loop round */
+#define SR_TENANT_ARP_MS   1000       /* ARP cache sweep interval */
+
+struct sr_tenants;
+
+/* What every hosted router shares, from sr's command line */
+struct sr_tenant_conf
+{
+    const char* user;
+    const char* server;
+    unsigned short port;
+    const char* icmp_limit;     /* -R, NULL for SR_ICMP_LIMIT_DEFAULT */
+    const char* mtu;            /* -M, NULL for SR_IF_MTU */
+    unsigned int hello_ms;      /* -H, 0 off */
+    unsigned int nworkers;      /* -W, 0 forwards on the loop thread */
+    const char* cpus;           /* -C */
+};
+
+/* Reads the tenant file, connects every router to the server and waits
+   for each to learn its interfaces.  Returns NULL and complains if the
+   file is bad or any router fails to come up. */
+struct sr_tenants* sr_tenants_start(const char* file,
+                                    const struct sr_tenant_conf* conf);
+
+/* Prints each router and the memory it took, then the totals. */
+void sr_tenants_report(const struct sr_tenants* h, FILE* out);
+
+/* The event loop.  Returns once every session has closed. */
+void sr_tenants_run(struct sr_tenants* h);
+
+/* Stops the timer and workers, then frees every router. */
+void sr_tenants_destroy(struct sr_tenants* h);
+
+#endif /* -- SR_TENANT_H -- */
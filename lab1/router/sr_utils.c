@@ -19,6 +19,38 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+uint32_t cksum_partial(const void *_data, int len, uint32_t sum) {
+  const uint8_t *data = _data;
+
+  for (;len >= 2; data += 2, len -= 2)
+    sum += data[0] << 8 | data[1];
+  if (len > 0)
+    sum += data[0] << 8;
+  return sum;
+}
+
+uint16_t cksum_fold(uint32_t sum) {
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  sum = htons (~sum);
+  return sum ? sum : 0xffff;
+}
+
+uint16_t cksum_adjust(uint16_t sum, uint16_t old_word, uint16_t new_word) {
+  /* HC' = ~(~HC + ~m + m') */
+  uint32_t s = (uint16_t)~ntohs(sum) + (uint16_t)~ntohs(old_word) +
+               ntohs(new_word);
+
+  s = (s >> 16) + (s & 0xffff);
+  s = (s >> 16) + (s & 0xffff);
+  return htons(~s & 0xffff);
+}
+
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old_val, uint32_t new_val) {
+  sum = cksum_adjust(sum, old_val >> 16, new_val >> 16);
+  return cksum_adjust(sum, old_val & 0xffff, new_val & 0xffff);
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
@@ -30,6 +62,56 @@ uint8_t ip_protocol(uint8_t *buf) {
   return iphdr->ip_p;
 }
 
+/* murmur3 finalizer */
+static uint32_t hash_mix(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+uint32_t sr_flow_hash(const uint8_t *frame, unsigned int len) {
+  const sr_ethernet_hdr_t *ehdr = (const sr_ethernet_hdr_t *)frame;
+  uint32_t a, b, ports = 0, proto;
+
+  if (len < sizeof(sr_ethernet_hdr_t))
+    return 0;
+
+  if (ehdr->ether_type == htons(ethertype_arp) &&
+      len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
+    const sr_arp_hdr_t *arp = (const sr_arp_hdr_t *)(ehdr + 1);
+    a = ntohl(arp->ar_sip);
+    b = ntohl(arp->ar_tip);
+    proto = 0x10000;
+  } else if (ehdr->ether_type == htons(ethertype_ip) &&
+             len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+    const sr_ip_hdr_t *iphdr = (const sr_ip_hdr_t *)(ehdr + 1);
+    const uint8_t *l4 = (const uint8_t *)iphdr + iphdr->ip_hl * 4;
+    a = ntohl(iphdr->ip_src);
+    b = ntohl(iphdr->ip_dst);
+    proto = iphdr->ip_p;
+    /* fragments of one datagram must stay together, so only unfragmented
+       packets contribute their ports */
+    if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+        (ntohs(iphdr->ip_off) & (IP_MF | IP_OFFMASK)) == 0 &&
+        l4 + 4 <= frame + len) {
+      uint32_t sport = l4[0] << 8 | l4[1], dport = l4[2] << 8 | l4[3];
+      ports = sport < dport ? sport << 16 | dport : dport << 16 | sport;
+    }
+  } else {
+    return 0;
+  }
+
+  if (a > b) {
+    uint32_t t = a;
+    a = b;
+    b = t;
+  }
+  return hash_mix(hash_mix(hash_mix(a ^ proto) ^ b) ^ ports);
+}
+
 
 /* Prints out formatted Ethernet address, e.g. 00:11:22:33:44:55 */
 void print_addr_eth(uint8_t *addr) {
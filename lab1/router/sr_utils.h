@@ -30,6 +30,19 @@
 
 uint16_t cksum(const void *_data, int len);
 
+/* checksum sum after one 16-bit word of the data changes from old_word to
+   new_word (RFC 1624); all three in network order */
+uint16_t cksum_adjust(uint16_t sum, uint16_t old_word, uint16_t new_word);
+
+/* the same for a 32-bit field such as an address, as stored in the data:
+   either halves of it are words of the data whatever the byte order */
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old_val, uint32_t new_val);
+
+/* checksum in pieces: cksum_fold(cksum_partial(b, lb, cksum_partial(a, la,
+   0))) == cksum of a then b, as long as la is even */
+uint32_t cksum_partial(const void *_data, int len, uint32_t sum);
+uint16_t cksum_fold(uint32_t sum);
+
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
 
@@ -45,4 +58,9 @@ void print_hdr_arp(uint8_t *buf);
 /* prints all headers, starting from eth */
 void print_hdrs(uint8_t *buf, uint32_t length);
 
+/* symmetric hash of the flow a frame belongs to: IPv4 addresses, protocol
+   and TCP/UDP ports, sorted so both directions hash alike; ARP frames hash
+   on their protocol addresses */
+uint32_t sr_flow_hash(const uint8_t *frame, unsigned int len);
+
 #endif /* -- SR_UTILS_H -- */
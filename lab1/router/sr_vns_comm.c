@@ -33,10 +33,18 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "sr_dumper.h"
+#include "sr_pcaplog.h"
+#include "sr_capfilter.h"
+#include "sr_log.h"
+#include "sr_stats.h"
+#include "sr_workers.h"
+#include "sr_egress.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
@@ -44,7 +52,7 @@
 #include "sha1.h"
 #include "vnscommand.h"
 
-static void sr_log_packet(struct sr_instance* , uint8_t* , int );
+static void sr_log_packet(struct sr_instance* , uint8_t* , int , const char* );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   uint8_t * packet /* lent */,
                                   unsigned int len,
@@ -121,6 +129,13 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
         return -1;
     }
 
+    /* every frame is its own small write: don't let Nagle hold one back
+       waiting for the server's delayed ACK */
+    {
+        int one = 1;
+        setsockopt(sr->sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
     /* wait for authentication to be completed (server sends the first message) */
     if(sr_read_from_server_expect(sr, VNS_AUTH_REQUEST)!= 1 ||
        sr_read_from_server_expect(sr, VNS_AUTH_STATUS) != 1)
@@ -333,9 +348,8 @@ int sr_read_from_server(struct sr_instance* sr /* borrowed */)
 
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
 {
-    int command, len;
+    int len;
     unsigned char *buf = 0;
-    c_packet_ethernet_header* sr_pkt = 0;
     int ret = 0, bytes_read = 0;
 
     /* REQUIRES */
@@ -362,6 +376,11 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 perror("recv(..):sr_client.c::sr_read_from_server");
                 return -1;
             }
+            if ( ret == 0 )
+            {
+                fprintf(stderr,"Error: server closed the connection\n");
+                return -1;
+            }
             bytes_read += ret;
         } while ( errno == EINTR); /* be mindful of signals */
 
@@ -369,7 +388,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     len = ntohl(len);
 
-    if ( len > 10000 || len < 0 )
+    if ( len > SR_VNS_MSG_MAX || len < (int)sizeof(c_base) )
     {
         fprintf(stderr,"Error: command length to large %d\n",len);
         close(sr->sockfd);
@@ -400,12 +419,42 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 { continue; }
                 fprintf(stderr,"Error: failed reading command body %d\n",ret);
                 close(sr->sockfd);
+                free(buf);
+                return -1;
+            }
+            if ( ret == 0 )
+            {
+                fprintf(stderr,"Error: server closed the connection\n");
+                free(buf);
                 return -1;
             }
             bytes_read += ret;
         } while (errno == EINTR); /* be mindful of signals */
     }
 
+    ret = sr_handle_command(sr, buf, len, expected_cmd);
+    free(buf);
+    return ret;
+}/* -- sr_read_from_server -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_command(..)
+ * Scope: global
+ *
+ * Handles one whole command of len bytes from the server.  buf is
+ * borrowed, and its command field is converted to host order in place.
+ * Returns 1 to go on reading, 0 if the server closed the session and -1
+ * on error.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_handle_command(struct sr_instance* sr /* borrowed */,
+                      unsigned char* buf /* borrowed */, int len,
+                      int expected_cmd)
+{
+    int command, ret;
+    c_packet_ethernet_header* sr_pkt = 0;
+
     /* My entry for most unreadable line of code - guido */
     /* ... you win - mc                                  */
     command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
@@ -436,9 +485,20 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
             /* -- log packet -- */
             sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
+                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header),
+                    (char*)(buf + sizeof(c_base)));
 
             /* -- pass to router, student's code should take over here -- */
+            if(sr->workers)
+            {
+                /* -- copied to the flow's worker, buf is the caller's -- */
+                sr_workers_dispatch(sr->workers, sr,
+                        (buf+sizeof(c_packet_header)),
+                        len - sizeof(c_packet_ethernet_header) +
+                        sizeof(struct sr_ethernet_hdr),
+                        (char*)(buf + sizeof(c_base)));
+                break;
+            }
             sr_handlepacket(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
@@ -453,11 +513,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             fprintf(stderr,"VNS server closed session.\n");
             fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
             sr_session_closed_help();
-
-            if(buf)
-            { free(buf); }
             return 0;
-            break;
 
             /* -------------        VNSBANNER      -------------------- */
 
@@ -474,6 +530,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 fprintf(stderr,"Routing table not consistent with hardware\n");
                 return -1;
             }
+            sr_init_interfaces(sr);
             printf(" <-- Ready to process packets --> \n");
             break;
 
@@ -501,10 +558,8 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     }/* -- switch -- */
 
-    if(buf)
-    { free(buf); }
     return ret;
-}/* -- sr_read_from_server -- */
+}/* -- sr_handle_command -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_ether_addrs_match_interface(..)
@@ -555,7 +610,8 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
  * Scope: Global
  *
  * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * to be injected onto the wire, through the egress queue of iface when
+ * there is one (-Q).
  *
  *---------------------------------------------------------------------------*/
 
@@ -564,78 +620,169 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          unsigned int len,
                          const char* iface /* borrowed */)
 {
-    c_packet_header *sr_pkt;
-    unsigned int total_len =  len + (sizeof(c_packet_header));
+    struct iovec iov;
 
     /* REQUIRES */
-    assert(sr);
     assert(buf);
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return sr_send_packetv(sr, &iov, 1, iface);
+} /* -- sr_send_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packetv(..)
+ * Scope: Global
+ *
+ * sr_send_packet() of a frame in iovcnt pieces, at most SR_SEND_IOV_MAX,
+ * the first holding the whole ethernet header.  Fragments go out this
+ * way without being copied together.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packetv(struct sr_instance* sr /* borrowed */,
+                    const struct iovec* iov /* borrowed */,
+                    int iovcnt,
+                    const char* iface /* borrowed */)
+{
+    unsigned int len = 0;
+    int i;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(iov);
+    assert(iovcnt > 0 && iovcnt <= SR_SEND_IOV_MAX);
    /* assert(iface);*/
 
+    for (i = 0; i < iovcnt; i++)
+    { len += iov[i].iov_len; }
+
     /* don't waste my time ... */
-    if ( len < sizeof(struct sr_ethernet_hdr) ){
-        fprintf(stderr , "** Error: packet is wayy to short \n");
-        fprintf(stderr, "Size of ethernet header: %li\n", sizeof(struct sr_ethernet_hdr)); 
-        fprintf(stderr, "Size of packet to send: %i\n", len); 
+    if ( iov[0].iov_len < sizeof(struct sr_ethernet_hdr) ){
+        sr_log_err(SR_LOG_VNS, "packet to send is too short: %u bytes\n", len);
+        sr_stat_inc(SR_STAT_TX_ERRORS);
+        return -1;
+    }
+
+    if ( ! sr_ether_addrs_match_interface( sr, iov[0].iov_base, iface) ){
+        sr_log_err(SR_LOG_VNS, "problem with ethernet header on %s\n", iface);
+        sr_log_frame(SR_LOG_VNS, SR_LOG_ERR, iface, iov[0].iov_base,
+                     iov[0].iov_len);
+        sr_stat_inc(SR_STAT_TX_ERRORS);
         return -1;
     }
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
+    if ( sr->egress )
+    { return sr_egress_sendv(sr->egress, iov, iovcnt, iface); }
 
-    /* -- log packet -- */
-    sr_log_packet(sr,buf,len);
-    print_hdrs((uint8_t* ) buf, len); 
+    return sr_vns_sendv(sr, iov, iovcnt, iface);
+} /* -- sr_send_packetv -- */
 
-    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
-        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
-        return -1;
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_send(..)
+ * Scope: Global
+ *
+ * Write a checked frame to the server now.  sr_send_packet() without
+ * egress queues, and the egress thread with them.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_vns_send(struct sr_instance* sr, const uint8_t* buf, unsigned int len,
+                const char* iface)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+    return sr_vns_sendv(sr, &iov, 1, iface);
+} /* -- sr_vns_send -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_sendv(..)
+ * Scope: Global
+ *
+ * sr_vns_send() of a frame in pieces: the VNS header and the pieces go
+ * out in one writev(), so the frame is only gathered if it is logged.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_vns_sendv(struct sr_instance* sr, const struct iovec* iov, int iovcnt,
+                 const char* iface)
+{
+    c_packet_header sr_pkt;
+    struct iovec v[SR_SEND_IOV_MAX + 1];
+    unsigned int len = 0, total_len;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+    {
+        v[i + 1] = iov[i];
+        len += iov[i].iov_len;
     }
+    total_len = len + sizeof(c_packet_header);
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
-        fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
-        return -1;
+    sr_pkt.mLen  = htonl(total_len);
+    sr_pkt.mType = htonl(VNSPACKET);
+    strncpy(sr_pkt.mInterfaceName,iface,16);
+    v[0].iov_base = &sr_pkt;
+    v[0].iov_len = sizeof(c_packet_header);
+
+    /* -- log packet -- */
+    if ( iovcnt == 1 )
+    {
+        sr_log_packet(sr,iov[0].iov_base,len,iface);
+        sr_log_frame(SR_LOG_VNS, SR_LOG_TRACE, iface, iov[0].iov_base, len);
+    }
+    else if ( sr->logfile || sr_log_enabled(SR_LOG_VNS, SR_LOG_TRACE) )
+    {
+        uint8_t* buf = malloc(len);
+        assert(buf);
+        for (len = 0, i = 0; i < iovcnt; len += iov[i].iov_len, i++)
+        { memcpy(buf + len, iov[i].iov_base, iov[i].iov_len); }
+        sr_log_packet(sr,buf,len,iface);
+        sr_log_frame(SR_LOG_VNS, SR_LOG_TRACE, iface, buf, len);
+        free(buf);
     }
 
-    free(sr_pkt);
+    /* -- workers and the ARP thread all send, keep messages whole -- */
+    pthread_mutex_lock(&sr->send_lock);
+    if( writev(sr->sockfd, v, iovcnt + 1) < (ssize_t)total_len ){
+        pthread_mutex_unlock(&sr->send_lock);
+        sr_log_err(SR_LOG_VNS, "error writing packet\n");
+        sr_stat_inc(SR_STAT_TX_ERRORS);
+        return -1;
+    }
+    pthread_mutex_unlock(&sr->send_lock);
 
+    sr_stat_inc(SR_STAT_TX_PKTS);
+    sr_stat_add(SR_STAT_TX_BYTES, len);
     return 0;
-} /* -- sr_send_packet -- */
+} /* -- sr_vns_sendv -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
  * Scope: Local
  *
+ * Hand the frame to the asynchronous pcap logger if it passes the capture
+ * filter.  The forwarding thread only runs the filter and copies the frame
+ * into its ring; the file I/O happens on the logger's writer thread.
+ *
  *---------------------------------------------------------------------------*/
 
-void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
+void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len,
+                   const char* iface)
 {
-    struct pcap_pkthdr h;
-    int size;
-
     /* REQUIRES */
     assert(sr);
 
     if(!sr->logfile)
     {return; }
 
-    size = min(PACKET_DUMP_SIZE, len);
-
-    gettimeofday(&h.ts, 0);
-    h.caplen = size;
-    h.len = (size < PACKET_DUMP_SIZE) ? size : PACKET_DUMP_SIZE;
+    if(!sr_capfilter_match(sr->capfilter, buf, len, iface))
+    {return; }
 
-    sr_dump(sr->logfile, &h, buf);
-    fflush(sr->logfile);
+    /* -- queued for the writer thread, dropped (and counted) if full -- */
+    sr_pcaplog_write(sr->logfile, buf, len);
 } /* -- sr_log_packet -- */
 
 /*-----------------------------------------------------------------------------
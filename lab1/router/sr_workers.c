@@ -0,0 +1,172 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_workers.c
+ *
+ * Description:
+ *
+ * Flow-hashed forwarding workers.  Each ring record is a small header
+ * naming the router and ingress interface followed by the frame; the
+ * worker hands the record to sr_handlepacket() in place and only releases
+ * it afterwards.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_utils.h"
+#include "sr_ring.h"
+#include "sr_stats.h"
+#include "sr_log.h"
+#include "sr_workers.h"
+
+struct sr_worker_rec
+{
+    struct sr_instance* sr;
+    char iface[sr_IFACE_NAMELEN];
+    uint32_t len;
+    uint32_t pad;
+};
+
+struct sr_worker
+{
+    struct sr_ring* ring;
+    struct sr_workers* pool;
+    pthread_t thread;
+    unsigned int id;
+    int cpu;                    /* -1 if not pinned */
+} __attribute__ ((aligned (SR_CACHE_LINE)));
+
+struct sr_workers
+{
+    unsigned int n;
+    int stop;
+    struct sr_worker* w;
+};
+
+static void* sr_worker_main(void* arg)
+{
+    struct sr_worker* me = arg;
+    struct sr_worker_rec* rec;
+    unsigned int len, idle = 0;
+
+    if (me->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(me->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            sr_log_warn(SR_LOG_ROUTER, "worker %u: cannot pin to cpu %d\n",
+                        me->id, me->cpu);
+    }
+
+    while (1) {
+        if ((rec = sr_ring_peek(me->ring, &len)) != NULL) {
+            sr_handlepacket(rec->sr, (uint8_t*)(rec + 1), rec->len, rec->iface);
+            sr_ring_release(me->ring, len);
+            idle = 0;
+            continue;
+        }
+        if (__atomic_load_n(&me->pool->stop, __ATOMIC_ACQUIRE) &&
+            sr_ring_used(me->ring) == 0)
+            break;
+        if (++idle < SR_WORKER_SPIN)
+            sched_yield();
+        else
+            usleep(SR_WORKER_IDLE_US);
+    }
+    return NULL;
+}
+
+struct sr_workers* sr_workers_start(unsigned int n, const char* cpus)
+{
+    struct sr_workers* pool;
+    int cpu_list[SR_WORKERS_MAX];
+    unsigned int ncpus = 0, i;
+
+    if (n == 0 || n > SR_WORKERS_MAX) {
+        fprintf(stderr, "sr_workers: between 1 and %d workers\n", SR_WORKERS_MAX);
+        return NULL;
+    }
+    while (cpus && *cpus && ncpus < SR_WORKERS_MAX) {
+        char* end;
+        cpu_list[ncpus++] = strtol(cpus, &end, 10);
+        if (end == cpus || (*end && *end != ',')) {
+            fprintf(stderr, "sr_workers: bad cpu list\n");
+            return NULL;
+        }
+        cpus = *end ? end + 1 : end;
+    }
+
+    pool = calloc(1, sizeof(struct sr_workers));
+    if (!pool || posix_memalign((void**)&pool->w, SR_CACHE_LINE,
+                                n * sizeof(struct sr_worker)) != 0) {
+        free(pool);
+        return NULL;
+    }
+    memset(pool->w, 0, n * sizeof(struct sr_worker));
+    pool->n = n;
+
+    for (i = 0; i < n; i++) {
+        struct sr_worker* w = &pool->w[i];
+        w->pool = pool;
+        w->id = i;
+        w->cpu = ncpus ? cpu_list[i % ncpus] : -1;
+        if ((w->ring = sr_ring_create(SR_WORKER_RING_SZ)) == NULL ||
+            pthread_create(&w->thread, NULL, sr_worker_main, w) != 0) {
+            fprintf(stderr, "sr_workers: cannot start worker %u\n", i);
+            pool->n = i;
+            sr_ring_destroy(w->ring);
+            sr_workers_stop(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void sr_workers_dispatch(struct sr_workers* pool, struct sr_instance* sr,
+                         const uint8_t* frame, unsigned int len, const char* iface)
+{
+    struct sr_worker* w;
+    struct sr_worker_rec* rec;
+
+    /* tenants tend to reuse the same addresses: salt the flow hash with
+       the router so their flows spread rather than land on one worker */
+    if (pool->n > 1)
+        w = &pool->w[(sr_flow_hash(frame, len) +
+                      (uint32_t)((uintptr_t)sr >> 6) * 0x9e3779b1u) % pool->n];
+    else
+        w = &pool->w[0];
+
+    /* a full ring means the worker is behind: wait rather than reorder or
+       drop, the server socket buffers meanwhile */
+    while ((rec = sr_ring_reserve(w->ring, sizeof(struct sr_worker_rec) + len)) == NULL) {
+        sr_stat_inc(SR_STAT_WORKER_STALL);
+        sched_yield();
+    }
+    rec->sr = sr;
+    strncpy(rec->iface, iface, sr_IFACE_NAMELEN);
+    rec->iface[sr_IFACE_NAMELEN - 1] = '\0';
+    rec->len = len;
+    memcpy(rec + 1, frame, len);
+    sr_ring_commit(w->ring, sizeof(struct sr_worker_rec) + len);
+}
+
+void sr_workers_stop(struct sr_workers* pool)
+{
+    unsigned int i;
+
+    if (!pool)
+        return;
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < pool->n; i++) {
+        pthread_join(pool->w[i].thread, NULL);
+        sr_ring_destroy(pool->w[i].ring);
+    }
+    free(pool->w);
+    free(pool);
+}
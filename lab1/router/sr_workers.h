@@ -0,0 +1,58 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_workers.h
+ *
+ * Description:
+ *
+ * Multi-worker forwarding (-W).  The thread reading the VNS socket no
+ * longer runs sr_handlepacket() itself: it hashes each frame's flow
+ * (sr_flow_hash) and copies it into the SPSC ring of the worker that owns
+ * the flow.  Every frame of a flow goes through the same ring and the
+ * same worker, so per-flow order is preserved; different flows proceed in
+ * parallel.  A full ring stalls the reader rather than dropping.
+ *
+ * Workers share the routing table read-only.  The ARP cache keeps its own
+ * lock and sr_send_packet() serialises writes to the server socket.
+ *
+ * A pool is not tied to one router: each frame is queued with the
+ * instance it arrived on, so routers hosted in one process (-V) share a
+ * single pool.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_WORKERS_H
+#define SR_WORKERS_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_WORKERS_MAX     32
+/* every thread that may log or capture: the workers, plus the reader or
+   tenant loop, ARP sweep or tenant timer, hello, punt, egress and flow
+   export threads, with room to spare */
+#define SR_THREADS_MAX     (SR_WORKERS_MAX + 8)
+#define SR_WORKER_RING_SZ  (1 << 20)  /* bytes of queued frames per worker */
+#define SR_WORKER_SPIN     256        /* idle polls before sleeping */
+#define SR_WORKER_IDLE_US  50
+
+struct sr_instance;
+struct sr_workers;
+
+/* Starts n workers.  cpus is a comma separated list of CPUs to pin the
+   workers to, round robin, or NULL to leave them unpinned. */
+struct sr_workers* sr_workers_start(unsigned int n, const char* cpus);
+
+/* Queues a frame received by sr to the worker owning its flow.  Called
+   only from the thread reading the server sockets. */
+void sr_workers_dispatch(struct sr_workers* w, struct sr_instance* sr,
+                         const uint8_t* frame, unsigned int len,
+                         const char* iface);
+
+/* Lets the workers finish what is queued, then joins them. */
+void sr_workers_stop(struct sr_workers* w);
+
+#endif /* -- SR_WORKERS_H -- */